@@ -0,0 +1,319 @@
+#include "numap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/**
+ * Measures the throughput of numap's analysis code on synthetic
+ * samples, independently of the hardware. Each stage prints one line:
+ *
+ *   numap-bench stage=<name> samples=<n> seconds=<best time> samples_per_sec=<rate>
+ *
+ * Samples are generated deterministically, so results of two builds can
+ * be compared directly.
+ */
+
+#define PAGE_SHIFT 12
+#define NB_HOT_PAGES 64
+#define NB_COLD_PAGES 65536
+
+/**
+ * Memory level of the synthetic samples, with the share of samples
+ * (in per ten thousand) and the latency range in cycles of each level.
+ */
+struct level {
+  uint64_t mem_lvl;
+  int share;
+  uint64_t min_latency;
+  uint64_t max_latency;
+};
+
+static const struct level levels[] = {
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_L1, 6000, 4, 8 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_LFB, 500, 8, 120 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_L2, 1000, 12, 20 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3, 1200, 35, 70 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_LOC_RAM, 800, 180, 300 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_REM_RAM1, 300, 280, 450 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_REM_RAM2, 50, 400, 700 },
+  { PERF_MEM_LVL_HIT | PERF_MEM_LVL_REM_CCE1, 100, 200, 400 },
+  { PERF_MEM_LVL_NA, 50, 0, 0 },
+};
+
+/**
+ * Record laid out as NUMAP_ANALYSIS_SAMPLE_TYPE.
+ */
+struct __attribute__ ((__packed__)) bench_record {
+  struct perf_event_header header;
+  uint64_t ip;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time;
+  uint64_t addr;
+  uint32_t cpu;
+  uint32_t reserved;
+  uint64_t weight;
+  uint64_t data_src;
+};
+
+static uint64_t xorshift(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+static const struct level *pick_level(uint64_t *rng) {
+  int r = xorshift(rng) % 10000;
+  size_t nb_levels = sizeof(levels) / sizeof(levels[0]);
+  for (size_t i = 0; i < nb_levels - 1; i++) {
+    if (r < levels[i].share) {
+      return &levels[i];
+    }
+    r -= levels[i].share;
+  }
+  return &levels[nb_levels - 1];
+}
+
+/**
+ * Addresses mix a few hot pages, a large set of cold pages and a
+ * sequential stream per thread, which is roughly what page aggregation
+ * sees on real applications.
+ */
+static uint64_t pick_addr(uint64_t *rng, int thread, uint64_t *stream) {
+  uint64_t heap = 0x7f0000000000ULL;
+  uint64_t r = xorshift(rng) % 100;
+  if (r < 50) {
+    // Skewed choice of hot pages: low numbered pages are hotter
+    uint64_t page = xorshift(rng) % NB_HOT_PAGES;
+    page = page * page / NB_HOT_PAGES;
+    return heap + (page << PAGE_SHIFT) + (xorshift(rng) & 0xfc0);
+  }
+  if (r < 80) {
+    uint64_t page = NB_HOT_PAGES + xorshift(rng) % NB_COLD_PAGES;
+    return heap + (page << PAGE_SHIFT) + (xorshift(rng) & 0xfc0);
+  }
+  *stream += 64;
+  return 0x7e0000000000ULL + ((uint64_t)thread << 32) + *stream;
+}
+
+static void *generate(int thread, size_t nb_samples, size_t *size) {
+  struct bench_record *records = malloc(nb_samples * sizeof(struct bench_record));
+  if (records == NULL) {
+    return NULL;
+  }
+  uint64_t rng = 0x9e3779b97f4a7c15ULL * (thread + 1);
+  uint64_t stream = 0;
+  for (size_t i = 0; i < nb_samples; i++) {
+    struct bench_record *r = &records[i];
+    const struct level *level = pick_level(&rng);
+    union perf_mem_data_src data_src;
+    data_src.val = 0;
+    data_src.mem_op = PERF_MEM_OP_LOAD;
+    data_src.mem_lvl = level->mem_lvl;
+    data_src.mem_snoop = PERF_MEM_SNOOP_NONE;
+    data_src.mem_dtlb = PERF_MEM_TLB_HIT | PERF_MEM_TLB_L1;
+    r->header.type = PERF_RECORD_SAMPLE;
+    r->header.misc = PERF_RECORD_MISC_USER;
+    r->header.size = sizeof(struct bench_record);
+    r->ip = 0x400000 + (xorshift(&rng) % 4096) * 4;
+    r->pid = 1000;
+    r->tid = 1000 + thread;
+    r->time = i * 1000;
+    r->addr = pick_addr(&rng, thread, &stream);
+    r->cpu = thread;
+    r->reserved = 0;
+    r->weight = level->min_latency;
+    if (level->max_latency > level->min_latency) {
+      r->weight += xorshift(&rng) % (level->max_latency - level->min_latency);
+    }
+    r->data_src = data_src.val;
+  }
+  *size = nb_samples * sizeof(struct bench_record);
+  return records;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int decode_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  (*(uint64_t *)arg) += sample->addr;
+  return 0;
+}
+
+static int classify_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  uint64_t *counts = arg;
+  counts[0] += is_served_by_local_NA_miss(sample->data_src);
+  counts[1] += is_served_by_local_cache1(sample->data_src);
+  counts[2] += is_served_by_local_cache2(sample->data_src);
+  counts[3] += is_served_by_local_cache3(sample->data_src);
+  counts[4] += is_served_by_local_lfb(sample->data_src);
+  counts[5] += is_served_by_local_memory(sample->data_src);
+  counts[6] += is_served_by_remote_memory(sample->data_src);
+  counts[7] += is_served_by_remote_cache_or_local_memory(sample->data_src);
+  return 0;
+}
+
+// Keeps the compiler from dropping the decoded values
+static volatile uint64_t sink;
+
+static int stage_decode(struct numap_sampling_measure *measure) {
+  uint64_t sum = 0;
+  int res = numap_sampling_foreach_sample(measure, decode_sample, &sum);
+  sink = sum;
+  return res;
+}
+
+static int stage_classification(struct numap_sampling_measure *measure) {
+  uint64_t counts[8];
+  memset(counts, 0, sizeof(counts));
+  int res = numap_sampling_foreach_sample(measure, classify_sample, counts);
+  sink = counts[5] + counts[6];
+  return res;
+}
+
+static int stage_page_aggregation(struct numap_sampling_measure *measure) {
+  struct numap_remote_cost cost;
+  int res = numap_sampling_remote_cost(measure, &cost);
+  if (res == 0) {
+    numap_remote_cost_free(&cost);
+  }
+  return res;
+}
+
+static int stage_latency_histogram(struct numap_sampling_measure *measure) {
+  struct numap_latency_histogram histogram;
+  return numap_sampling_latency_histogram(measure, &histogram);
+}
+
+static int stage_output(struct numap_sampling_measure *measure) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  if (saved == -1 || devnull == -1) {
+    return -1;
+  }
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+  int res = numap_sampling_print(measure, 1);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  return res;
+}
+
+struct stage {
+  const char *name;
+  int (*run)(struct numap_sampling_measure *measure);
+};
+
+static const struct stage stages[] = {
+  { "decode", stage_decode },
+  { "classification", stage_classification },
+  { "page_aggregation", stage_page_aggregation },
+  { "latency_histogram", stage_latency_histogram },
+  { "output", stage_output },
+};
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n samples_per_thread] [-t threads] [-r repeats] [-s stage]\n", name);
+  fprintf(stderr, "  -n  samples generated for each thread (default 1000000)\n");
+  fprintf(stderr, "  -t  number of threads (default 4)\n");
+  fprintf(stderr, "  -r  repetitions of each stage, the best time is reported (default 5)\n");
+  fprintf(stderr, "  -s  only run the given stage\n");
+}
+
+int main(int argc, char **argv) {
+  size_t nb_samples = 1000000;
+  int nb_threads = 4;
+  int repeats = 5;
+  const char *only = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:t:r:s:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      nb_samples = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      nb_threads = atoi(optarg);
+      break;
+    case 'r':
+      repeats = atoi(optarg);
+      break;
+    case 's':
+      only = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (nb_threads < 1 || nb_threads > MAX_NB_THREADS || repeats < 1) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  pid_t tids[MAX_NB_THREADS];
+  void *records[MAX_NB_THREADS];
+  size_t sizes[MAX_NB_THREADS];
+  for (int thread = 0; thread < nb_threads; thread++) {
+    tids[thread] = 1000 + thread;
+    records[thread] = generate(thread, nb_samples, &sizes[thread]);
+    if (records[thread] == NULL) {
+      fprintf(stderr, "generate : %s\n", numap_error_message(ERROR_NUMAP_MALLOC));
+      return -1;
+    }
+  }
+
+  struct numap_sampling_measure measure;
+  res = numap_sampling_replay_init_buffers(&measure, NUMAP_ANALYSIS_SAMPLE_TYPE, 1000, nb_threads,
+                                           tids, records, sizes);
+  for (int thread = 0; thread < nb_threads; thread++) {
+    free(records[thread]);
+  }
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_replay_init_buffers : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  size_t total = nb_samples * nb_threads;
+  for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+    if (only != NULL && strcmp(only, stages[i].name) != 0) {
+      continue;
+    }
+    double best = -1;
+    for (int r = 0; r < repeats; r++) {
+      double start = now();
+      res = stages[i].run(&measure);
+      double elapsed = now() - start;
+      if(res < 0) {
+        fprintf(stderr, "%s : %s\n", stages[i].name, numap_error_message(res));
+        return -1;
+      }
+      if (best < 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    printf("numap-bench stage=%s samples=%zu seconds=%.6f samples_per_sec=%.0f\n",
+           stages[i].name, total, best, best > 0 ? total / best : 0);
+    fflush(stdout);
+  }
+
+  numap_sampling_end(&measure);
+  return 0;
+}
@@ -0,0 +1,442 @@
+#include "numap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+/**
+ * Measures the slowdown caused by numap sampling on memory bound
+ * kernels. Each kernel is run without sampling, then with read (or
+ * write) sampling for every combination of sampling_rate,
+ * mmap_pages_count and nb_refresh. The handler drains the ring buffers
+ * as a real user would, and each combination prints one line:
+ *
+ *   numap-overhead kernel=<name> threads=<n> sampling_rate=<r> mmap_pages=<p> nb_refresh=<f>
+ *     baseline_s=<s> sampled_s=<s> slowdown=<x> signals=<n> signals_per_sec=<n>
+ *     samples=<n> samples_lost=<n>
+ */
+
+#define CACHE_LINE 64
+
+enum kernel {
+  KERNEL_STREAM,
+  KERNEL_CHASE,
+  KERNEL_SHARED,
+};
+
+static const char *kernel_names[] = { "stream", "chase", "shared" };
+#define NB_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+struct line {
+  uint64_t next;
+  uint64_t pad[CACHE_LINE / sizeof(uint64_t) - 1];
+};
+
+struct config {
+  enum kernel kernel;
+  int nb_threads;
+  size_t buffer_size; // per thread, except for the shared kernel
+  int iterations;
+};
+
+struct worker {
+  struct config *config;
+  int index;
+  pid_t tid;
+  void *buffer;
+  uint64_t result;
+};
+
+static pthread_barrier_t barrier;
+static uint64_t *shared_buffer;
+static volatile uint64_t sink;
+
+/**
+ * Counters updated by the sampling handler, which runs in signal
+ * context on any sampled thread.
+ */
+static uint64_t signals;
+static uint64_t samples;
+static uint64_t samples_lost;
+
+static uint64_t xorshift(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int kernel_prepare(struct worker *w) {
+  struct config *config = w->config;
+  switch (config->kernel) {
+  case KERNEL_STREAM: {
+    uint64_t *a = malloc(config->buffer_size);
+    if (a == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < config->buffer_size / sizeof(uint64_t); i++) {
+      a[i] = i;
+    }
+    w->buffer = a;
+    break;
+  }
+  case KERNEL_CHASE: {
+    // Sattolo's shuffle builds a single cycle through every line
+    size_t nb_lines = config->buffer_size / sizeof(struct line);
+    struct line *lines = malloc(nb_lines * sizeof(struct line));
+    if (lines == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < nb_lines; i++) {
+      lines[i].next = i;
+    }
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (w->index + 1);
+    for (size_t i = nb_lines - 1; i > 0; i--) {
+      size_t j = xorshift(&rng) % i;
+      uint64_t tmp = lines[i].next;
+      lines[i].next = lines[j].next;
+      lines[j].next = tmp;
+    }
+    w->buffer = lines;
+    break;
+  }
+  case KERNEL_SHARED:
+    w->buffer = shared_buffer;
+    break;
+  }
+  return 0;
+}
+
+static void kernel_run(struct worker *w) {
+  struct config *config = w->config;
+  uint64_t result = 0;
+  switch (config->kernel) {
+  case KERNEL_STREAM: {
+    uint64_t *a = w->buffer;
+    size_t n = config->buffer_size / sizeof(uint64_t);
+    for (int it = 0; it < config->iterations; it++) {
+      for (size_t i = 0; i < n; i++) {
+        a[i] = a[i] * 3 + 1;
+      }
+    }
+    result = a[n / 2];
+    break;
+  }
+  case KERNEL_CHASE: {
+    struct line *lines = w->buffer;
+    size_t steps = config->buffer_size / sizeof(struct line) * config->iterations;
+    uint64_t i = 0;
+    while (steps--) {
+      i = lines[i].next;
+    }
+    result = i;
+    break;
+  }
+  case KERNEL_SHARED: {
+    // Every thread writes its own word of the same cache lines
+    volatile uint64_t *a = w->buffer;
+    size_t nb_lines = config->buffer_size / CACHE_LINE;
+    size_t words = CACHE_LINE / sizeof(uint64_t);
+    size_t slot = w->index % words;
+    for (int it = 0; it < config->iterations; it++) {
+      for (size_t l = 0; l < nb_lines; l++) {
+        a[l * words + slot] += 1;
+      }
+    }
+    result = a[slot];
+    break;
+  }
+  }
+  w->result = result;
+}
+
+static void *worker_f(void *p) {
+  struct worker *w = p;
+  w->tid = syscall(SYS_gettid);
+  if (kernel_prepare(w) != 0) {
+    fprintf(stderr, "malloc failed\n");
+    exit(-1);
+  }
+  pthread_barrier_wait(&barrier); // tids are known
+  pthread_barrier_wait(&barrier); // sampling started
+  kernel_run(w);
+  pthread_barrier_wait(&barrier); // kernel done
+  pthread_barrier_wait(&barrier); // sampling stopped
+  if (w->buffer != shared_buffer) {
+    free(w->buffer);
+  }
+  return NULL;
+}
+
+/**
+ * Walks the records between data_tail and data_head of a ring buffer,
+ * counting samples and lost records, then releases them to the kernel.
+ */
+static void drain(struct numap_sampling_measure *measure, struct perf_event_mmap_page *metadata_page) {
+  uint8_t *data = (uint8_t *)metadata_page + measure->page_size;
+  uint64_t data_size = measure->mmap_len - measure->page_size;
+  uint64_t head = metadata_page->data_head;
+  rmb();
+  uint64_t tail = metadata_page->data_tail;
+  uint64_t nb_samples = 0;
+  uint64_t nb_lost = 0;
+  while (tail < head) {
+    // Records are 8 bytes aligned: a header never wraps
+    struct perf_event_header *header = (struct perf_event_header *)(data + tail % data_size);
+    if (header->size == 0) {
+      break;
+    }
+    if (header->type == PERF_RECORD_SAMPLE) {
+      nb_samples++;
+    } else if (header->type == PERF_RECORD_LOST) {
+      // struct { header; u64 id; u64 lost; }
+      nb_lost += *(uint64_t *)(data + (tail + 16) % data_size);
+    }
+    tail += header->size;
+  }
+  __sync_synchronize();
+  metadata_page->data_tail = head;
+  __atomic_fetch_add(&samples, nb_samples, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&samples_lost, nb_lost, __ATOMIC_RELAXED);
+}
+
+static void handler(struct numap_sampling_measure *measure, int fd) {
+  __atomic_fetch_add(&signals, 1, __ATOMIC_RELAXED);
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    if (measure->fd_per_tid[thread] == fd) {
+      drain(measure, measure->metadata_pages_per_tid[thread]);
+      return;
+    }
+    // E-core events of hybrid processors
+    for (int stream = 1; stream < measure->nb_streams; stream++) {
+      if (measure->stream_fd_per_tid[stream - 1][thread] == fd) {
+        drain(measure, measure->stream_metadata_pages_per_tid[stream - 1][thread]);
+        return;
+      }
+    }
+  }
+}
+
+/**
+ * Runs the kernel once, with sampling when measure is not NULL.
+ * Returns the elapsed time of the kernel, or -1 on error.
+ */
+static double run(struct config *config, struct numap_sampling_measure *measure, int write) {
+  pthread_t threads[MAX_NB_THREADS];
+  struct worker workers[MAX_NB_THREADS];
+
+  pthread_barrier_init(&barrier, NULL, config->nb_threads + 1);
+  for (int t = 0; t < config->nb_threads; t++) {
+    workers[t].config = config;
+    workers[t].index = t;
+    workers[t].buffer = NULL;
+    pthread_create(&threads[t], NULL, worker_f, &workers[t]);
+  }
+  pthread_barrier_wait(&barrier);
+
+  int res = 0;
+  if (measure != NULL) {
+    for (int t = 0; t < config->nb_threads; t++) {
+      measure->tids[t] = workers[t].tid;
+    }
+    res = write ? numap_sampling_write_start(measure) : numap_sampling_read_start(measure);
+    if (res < 0) {
+      fprintf(stderr, "numap_sampling_%s_start : %s\n", write ? "write" : "read", numap_error_message(res));
+    }
+  }
+  double start = now();
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  double elapsed = now() - start;
+  if (measure != NULL && res == 0) {
+    if (write) {
+      numap_sampling_write_stop(measure);
+    } else {
+      numap_sampling_read_stop(measure);
+    }
+    for (int t = 0; t < config->nb_threads; t++) {
+      drain(measure, measure->metadata_pages_per_tid[t]);
+      for (int stream = 1; stream < measure->nb_streams; stream++) {
+        drain(measure, measure->stream_metadata_pages_per_tid[stream - 1][t]);
+      }
+    }
+  }
+  pthread_barrier_wait(&barrier);
+
+  for (int t = 0; t < config->nb_threads; t++) {
+    pthread_join(threads[t], NULL);
+    sink += workers[t].result;
+  }
+  pthread_barrier_destroy(&barrier);
+  return res < 0 ? -1 : elapsed;
+}
+
+static int parse_list(char *s, int *values, int max) {
+  int n = 0;
+  for (char *v = strtok(s, ","); v != NULL && n < max; v = strtok(NULL, ",")) {
+    values[n++] = atoi(v);
+  }
+  return n;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-k kernels] [-t threads] [-s size_mb] [-i iterations] [-r repeats]\n"
+                  "          [-R sampling_rates] [-P mmap_pages_counts] [-F nb_refreshes] [-w]\n", name);
+  fprintf(stderr, "  -k  comma separated kernels among stream, chase, shared (default all)\n");
+  fprintf(stderr, "  -t  number of threads (default 2)\n");
+  fprintf(stderr, "  -s  buffer size of each thread in MB (default 64)\n");
+  fprintf(stderr, "  -i  passes over the buffer (default 4)\n");
+  fprintf(stderr, "  -r  repetitions of each run, the best time is kept (default 3)\n");
+  fprintf(stderr, "  -R  comma separated sampling rates (default 1000,10000,100000)\n");
+  fprintf(stderr, "  -P  comma separated mmap_pages_count, powers of two (default 8,64)\n");
+  fprintf(stderr, "  -F  comma separated nb_refresh (default 1,100,1000)\n");
+  fprintf(stderr, "  -w  sample writes instead of reads\n");
+}
+
+int main(int argc, char **argv) {
+  struct config config;
+  config.nb_threads = 2;
+  config.buffer_size = 64 * 1024 * 1024;
+  config.iterations = 4;
+  int repeats = 3;
+  int write = 0;
+  int kernels[NB_KERNELS] = { 1, 1, 1 };
+  int rates[16] = { 1000, 10000, 100000 };
+  int nb_rates = 3;
+  int pages[16] = { 8, 64 };
+  int nb_pages = 2;
+  int refreshes[16] = { 1, 100, 1000 };
+  int nb_refreshes = 3;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:t:s:i:r:R:P:F:wh")) != -1) {
+    switch (opt) {
+    case 'k':
+      memset(kernels, 0, sizeof(kernels));
+      for (char *k = strtok(optarg, ","); k != NULL; k = strtok(NULL, ",")) {
+        size_t i;
+        for (i = 0; i < NB_KERNELS && strcmp(k, kernel_names[i]) != 0; i++);
+        if (i == NB_KERNELS) {
+          usage(argv[0]);
+          return -1;
+        }
+        kernels[i] = 1;
+      }
+      break;
+    case 't':
+      config.nb_threads = atoi(optarg);
+      break;
+    case 's':
+      config.buffer_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'i':
+      config.iterations = atoi(optarg);
+      break;
+    case 'r':
+      repeats = atoi(optarg);
+      break;
+    case 'R':
+      nb_rates = parse_list(optarg, rates, 16);
+      break;
+    case 'P':
+      nb_pages = parse_list(optarg, pages, 16);
+      break;
+    case 'F':
+      nb_refreshes = parse_list(optarg, refreshes, 16);
+      break;
+    case 'w':
+      write = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (config.nb_threads < 1 || config.nb_threads > MAX_NB_THREADS || repeats < 1 || config.buffer_size == 0) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  for (size_t k = 0; k < NB_KERNELS; k++) {
+    if (!kernels[k]) {
+      continue;
+    }
+    config.kernel = k;
+    if (config.kernel == KERNEL_SHARED) {
+      shared_buffer = calloc(1, config.buffer_size);
+      if (shared_buffer == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+      }
+    }
+
+    double baseline = -1;
+    for (int r = 0; r < repeats; r++) {
+      double elapsed = run(&config, NULL, write);
+      if (baseline < 0 || elapsed < baseline) {
+        baseline = elapsed;
+      }
+    }
+
+    for (int ri = 0; ri < nb_rates; ri++) {
+      for (int pi = 0; pi < nb_pages; pi++) {
+        for (int fi = 0; fi < nb_refreshes; fi++) {
+          double best = -1;
+          uint64_t best_signals = 0, best_samples = 0, best_lost = 0;
+          for (int r = 0; r < repeats; r++) {
+            struct numap_sampling_measure measure;
+            numap_sampling_init_measure(&measure, config.nb_threads, rates[ri], pages[pi]);
+            res = numap_sampling_set_measure_handler(&measure, handler, refreshes[fi]);
+            if(res < 0) {
+              fprintf(stderr, "numap_sampling_set_measure_handler : %s\n", numap_error_message(res));
+              return -1;
+            }
+            signals = samples = samples_lost = 0;
+            double elapsed = run(&config, &measure, write);
+            numap_sampling_end(&measure);
+            if (elapsed < 0) {
+              return -1;
+            }
+            if (best < 0 || elapsed < best) {
+              best = elapsed;
+              best_signals = signals;
+              best_samples = samples;
+              best_lost = samples_lost;
+            }
+          }
+          printf("numap-overhead kernel=%s threads=%d sampling_rate=%d mmap_pages=%d nb_refresh=%d "
+                 "baseline_s=%.6f sampled_s=%.6f slowdown=%.4f signals=%" PRIu64 " signals_per_sec=%.0f "
+                 "samples=%" PRIu64 " samples_lost=%" PRIu64 "\n",
+                 kernel_names[k], config.nb_threads, rates[ri], pages[pi], refreshes[fi],
+                 baseline, best, best / baseline, best_signals, best_signals / best,
+                 best_samples, best_lost);
+          fflush(stdout);
+        }
+      }
+    }
+
+    if (config.kernel == KERNEL_SHARED) {
+      free(shared_buffer);
+      shared_buffer = NULL;
+    }
+  }
+  return 0;
+}
@@ -111,8 +111,9 @@ int main() {
   // Start memory read access sampling
   printf("\nStarting memory read sampling");
   fflush(stdout);
-  // has to be called after tids set and before start
-  res = numap_sampling_read_start(&sm);
+  // has to be called after tids set and before start, with the thread
+  // and cpu of each sample for the remote cost
+  res = numap_sampling_read_start_generic(&sm, NUMAP_ANALYSIS_SAMPLE_TYPE);
   if(res < 0) {
     fprintf(stderr, " -> numap_sampling_start error : %s\n", numap_error_message(res));
     return -1;
@@ -131,6 +132,16 @@ int main() {
   printf("\nMemory read sampling results\n");
   numap_sampling_read_print(&sm, 0);
 
+  // Print the estimated cost of remote memory reads
+  struct numap_remote_cost cost;
+  res = numap_sampling_remote_cost(&sm, &cost);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_remote_cost error : %s\n", numap_error_message(res));
+    return -1;
+  }
+  numap_remote_cost_print(&cost, 10);
+  numap_remote_cost_free(&cost);
+
   if ((res = pthread_create(&thread_0, &attr, thread_0_f, (void *)NULL)) < 0) {
     fprintf(stderr, "Error creating thread 0: %d\n", res);
     return -1;
@@ -0,0 +1,134 @@
+#include "numap.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+/**
+ * Samples loads and stores of two threads in a single run: thread 0
+ * writes a shared array that thread 1 reads, and each thread also
+ * works on a private array.
+ */
+
+#define SIZE 20000000
+
+pthread_barrier_t barrier;
+pid_t tids[2];
+int *shared;
+
+void to_be_profiled(int index) {
+  int *data = malloc(sizeof(int) * SIZE);
+  if (data == NULL) {
+    printf("malloc failed\n");
+    exit(-1);
+  }
+  volatile int res = 0;
+  for (long i = 0; i < SIZE; i++) {
+    data[i] = i;
+    if (index == 0) {
+      shared[i] = i;
+    } else {
+      res += shared[i];
+    }
+    res += data[i];
+  }
+  free(data);
+}
+
+void *thread_f(void *p) {
+  int index = (int)(long)p;
+  tids[index] = syscall(SYS_gettid);
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  to_be_profiled(index);
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+int main() {
+
+  // Init numap
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+  shared = calloc(SIZE, sizeof(int));
+  if (shared == NULL) {
+    printf("malloc failed\n");
+    return -1;
+  }
+
+  // Create threads
+  res = pthread_barrier_init(&barrier, NULL, 3);
+  if (res) {
+    fprintf(stderr, "Error creating barrier: %d\n", res);
+    return -1;
+  }
+  pthread_t threads[2];
+  for (long i = 0; i < 2; i++) {
+    if ((res = pthread_create(&threads[i], NULL, thread_f, (void *)i)) != 0) {
+      fprintf(stderr, "Error creating thread %ld: %d\n", i, res);
+      return -1;
+    }
+  }
+
+  // Init sampling
+  struct numap_sampling_measure sm;
+  int sampling_rate = 1000;
+  res = numap_sampling_init_measure(&sm, 2, sampling_rate, 64);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_init error : %s\n", numap_error_message(res));
+    return -1;
+  }
+  pthread_barrier_wait(&barrier);
+  sm.tids[0] = tids[0];
+  sm.tids[1] = tids[1];
+
+  // Start memory read and write sampling, in a single run
+  printf("\nStarting memory read and write sampling");
+  fflush(stdout);
+  res = numap_sampling_read_write_start(&sm);
+  if(res < 0) {
+    fprintf(stderr, " -> numap_sampling_read_write_start error : %s\n", numap_error_message(res));
+    return -1;
+  }
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+
+  res = numap_sampling_read_write_stop(&sm);
+  if(res < 0) {
+    printf("numap_sampling_stop error : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  // Print the read/write profile of each thread and of the busiest pages
+  struct numap_rw_profile profile;
+  res = numap_sampling_rw_profile(&sm, &profile);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_rw_profile error : %s\n", numap_error_message(res));
+    return -1;
+  }
+  numap_rw_profile_print(&profile, 10);
+  numap_rw_profile_free(&profile);
+
+  // Print the cache lines contended between the threads
+  struct numap_sharing sharing;
+  res = numap_sampling_sharing(&sm, &sharing);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_sharing error : %s\n", numap_error_message(res));
+    return -1;
+  }
+  numap_sharing_print(&sharing, 10);
+  numap_sharing_free(&sharing);
+
+  numap_sampling_end(&sm);
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(shared);
+  return 0;
+}
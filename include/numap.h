@@ -1,7 +1,12 @@
+#ifndef NUMAP_H
+#define NUMAP_H
+
 #include <inttypes.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <perfmon/pfmlib_perf_event.h>
 #include <signal.h>
+#include <pthread.h>
 
 #define MAX_NB_NUMA_NODES     16
 #define MAX_NB_THREADS        24
@@ -16,13 +21,42 @@
 #define ERROR_NUMAP_WRITE_SAMPLING_ARCH_NOT_SUPPORTED -10
 #define ERROR_PFM                                     -11
 #define ERROR_READ                                    -12
+#define ERROR_NUMAP_SAMPLE_TYPE                       -13
+#define ERROR_NUMAP_MALLOC                            -14
+#define ERROR_NUMAP_CALIBRATION                       -15
+#define ERROR_NUMAP_CALIBRATION_FILE                  -16
+#define ERROR_NUMAP_TOO_MANY_THREADS                  -17
+#define ERROR_NUMAP_REPLAY_FILE                       -18
+#define ERROR_NUMAP_REPLAY_FORMAT                     -19
+#define ERROR_NUMAP_REPLAY                            -20
+#define ERROR_NUMAP_INVALID_ARGUMENT                  -21
+#define ERROR_NUMAP_PLATFORM                          -22
+#define ERROR_NUMAP_SESSION_BUSY                      -23
+#define ERROR_NUMAP_SIGNAL                            -24
+#define ERROR_NUMAP_MLOCK                             -25
+#define ERROR_NUMAP_MMAP                              -26
+#define ERROR_NUMAP_LDLAT                             -27
+#define ERROR_NUMAP_MOVE_PAGES                        -28
+#define ERROR_NUMAP_SHM                               -29
+#define ERROR_NUMAP_SHM_BUSY                          -30
+#define ERROR_NUMAP_ATTACH                            -31
+#define ERROR_NUMAP_MAPS                              -32
 
 #define rmb()		asm volatile("lfence" ::: "memory")
 
+/**
+ * A session groups measures that share their error reporting and
+ * sample draining state. Measures of different sessions can be started
+ * and ended independently from different threads. Measures initialized
+ * without a session belong to a default session.
+ */
+struct numap_session;
+
 /**
  * Structure representing a measurement of counting the load of controlers.
  */
 struct numap_counting_measure {
+  struct numap_session *session;
   char started;
   int nb_nodes;
   int is_valid[MAX_NB_NUMA_NODES];
@@ -32,6 +66,61 @@ struct numap_counting_measure {
   long long writes_count[MAX_NB_NUMA_NODES];
 };
 
+/**
+ * Core types of hybrid processors, recorded with each sample.
+ */
+#define NUMAP_CORE_ANY 0 // processor with a single core type
+#define NUMAP_CORE_P   1 // performance cores (cpu_core PMU)
+#define NUMAP_CORE_E   2 // efficient cores (cpu_atom PMU)
+
+/**
+ * A sampling measure opens up to NUMAP_MAX_STREAMS events per thread,
+ * e.g. one per PMU on hybrid processors and per load latency threshold
+ * of a sweep, each with its own ring buffer.
+ */
+#define NUMAP_MAX_STREAMS 8
+
+/**
+ * Kind of memory access sampled by a stream.
+ */
+#define NUMAP_ACCESS_READ  0
+#define NUMAP_ACCESS_WRITE 1
+
+struct numap_stream {
+  int core_type; // NUMAP_CORE_*
+  int access; // NUMAP_ACCESS_*
+  int slot; // sweep slot, 0 when not sweeping, -1 for stores that are never swept
+  unsigned int ldlat; // load latency threshold, 0 for the default of the event
+};
+
+/**
+ * Load latency sweeps, see numap_sampling_set_ldlat_sweep.
+ */
+#define NUMAP_MAX_SWEEP 4
+#define NUMAP_SWEEP_TIME    0 // all threads rotate through the thresholds
+#define NUMAP_SWEEP_THREADS 1 // thread i always uses threshold i % nb_ldlats
+
+/**
+ * Sampling of another process, see numap_sampling_init_attach.
+ */
+#define NUMAP_ATTACH_THREADS 0 // a ring per thread of the process
+#define NUMAP_ATTACH_CPUS    1 // a ring per cpu, gathering all the threads of the process
+
+/**
+ * Per-thread overrides of the sampling parameters of a measure, see
+ * numap_sampling_set_thread_config. A zero field inherits the value of
+ * the measure.
+ */
+#define NUMAP_THREAD_READS  (1 << NUMAP_ACCESS_READ)
+#define NUMAP_THREAD_WRITES (1 << NUMAP_ACCESS_WRITE)
+
+struct numap_thread_config {
+  unsigned int sampling_rate;
+  int accesses; // NUMAP_THREAD_READS and/or NUMAP_THREAD_WRITES, 0 for those of the sampling start
+  unsigned int ldlat;
+  unsigned int mmap_pages_count; // rounded down to a power of two, kept out of the locked memory budget sizing
+};
+
 /**
  * Structure representing a measurement of memory read or write sampling.
  */
@@ -42,26 +131,123 @@ struct numap_sampling_measure {
    */
   unsigned int nb_threads;
   unsigned int sampling_rate;
-  unsigned int mmap_pages_count; // Must be power of two as specified in the man page of perf_event_open (mmap size should be 1+2^n pages)
+  unsigned int mmap_pages_count; // Power of two (mmap size is 1+2^n pages), 0 to size rings automatically. Set to the size chosen at start
+  double expected_samples_per_sec; // per thread, 0 if unknown; sizes rings when mmap_pages_count is 0
+  unsigned int ldlat; // load latency threshold of read sampling in cycles, 0 for the default of the architecture
   pid_t tids[MAX_NB_THREADS];
   struct perf_event_mmap_page *metadata_pages_per_tid[MAX_NB_THREADS];
 
   /*
    * Fields to be written and/or read by library code.
    */
+  struct numap_session *session;
+  // stream 0 uses fd_per_tid and metadata_pages_per_tid, the others the stream_* arrays
+  unsigned int nb_streams;
+  struct numap_stream streams[NUMAP_MAX_STREAMS];
+  struct perf_event_attr stream_attrs[NUMAP_MAX_STREAMS]; // events of the streams, opened for added threads too
+  long stream_fd_per_tid[NUMAP_MAX_STREAMS - 1][MAX_NB_THREADS];
+  struct perf_event_mmap_page *stream_metadata_pages_per_tid[NUMAP_MAX_STREAMS - 1][MAX_NB_THREADS];
   size_t page_size;
   size_t mmap_len;
+  unsigned int wanted_pages_count; // ring size before the locked memory budget applied
+  uint64_t sample_type; // sample_type given to the last sampling start
   char started;
+  char replay; // samples read from a file by numap_sampling_replay_init
+  struct numap_topology *topology; // of the machine a replayed trace was recorded on, NULL for the host
   long fd_per_tid[MAX_NB_THREADS];
   // overflow related fields
   void (*handler)(struct numap_sampling_measure*, int); // handler called each nb_refresh samples
   int total_samples; // after record, contains the total number of samples % nb_refresh
   int nb_refresh; // default value : 1000
+  struct numap_sketch *sketch; // fed by the refresh handler, see numap_sampling_set_sketch
+  struct numap_live *live; // published by the refresh handler, see numap_sampling_set_live
+  struct numap_regions *regions; // updated by the refresh handler, see numap_sampling_set_regions
+  uint64_t drained_per_stream[NUMAP_MAX_STREAMS][MAX_NB_THREADS];
+  // adaptive sampling period, see numap_sampling_set_adaptive_period
+  char adaptive;
+  double target_samples_per_sec;
+  double max_overhead;
+  uint64_t min_period;
+  uint64_t max_period;
+  uint64_t period_per_tid[MAX_NB_THREADS]; // active sampling period of each thread
+  uint64_t lost_per_tid[MAX_NB_THREADS]; // samples lost by the kernel, counted when adaptive
+  uint64_t scanned_per_stream[NUMAP_MAX_STREAMS][MAX_NB_THREADS];
+  // streams refresh independently: the controller sums their latest rates
+  double last_refresh_per_stream[NUMAP_MAX_STREAMS][MAX_NB_THREADS];
+  double rate_per_stream[NUMAP_MAX_STREAMS][MAX_NB_THREADS]; // samples per second
+  double overhead_per_stream[NUMAP_MAX_STREAMS][MAX_NB_THREADS]; // fraction of the time spent draining
+  // load latency sweep, see numap_sampling_set_ldlat_sweep
+  int nb_sweep; // 0 when not sweeping
+  int sweep_mode;
+  unsigned int sweep_ldlat[NUMAP_MAX_SWEEP];
+  double sweep_interval;
+  int sweep_slot; // slot sampled by all threads in NUMAP_SWEEP_TIME mode
+  double sweep_slot_start;
+  double sweep_time[NUMAP_MAX_SWEEP]; // seconds each slot was sampled in NUMAP_SWEEP_TIME mode
+  char sweep_timer_armed;
+  timer_t sweep_timer;
+  // per-thread overrides, see numap_sampling_set_thread_config
+  struct numap_thread_config thread_configs[MAX_NB_THREADS];
+  int thread_accesses[MAX_NB_THREADS]; // NUMAP_THREAD_* sampled by each thread, set at start
+  size_t mmap_len_per_tid[MAX_NB_THREADS]; // 0 when the ring of the thread is mmap_len long
+  // attach mode, see numap_sampling_init_attach
+  pid_t attach_pid; // 0 when the threads are given by the caller
+  int attach_mode; // NUMAP_ATTACH_*
+  int attach_cpus[MAX_NB_THREADS]; // cpu of each ring in NUMAP_ATTACH_CPUS mode
+  int attach_missed; // threads of the process left unsampled at the last scan
+  long *attach_fds; // NUMAP_ATTACH_CPUS events output to the ring of their cpu
+  size_t nb_attach_fds;
+  size_t attach_fds_capacity;
+  unsigned int collector_interval_ms;
+  char collector_running;
+  char collector_stop;
+  pthread_t collector;
 };
 
 /**
- * Structure representing a read sample gathered with the library in
- * sampling mode.
+ * Default sample_type used by numap_sampling_read_start and
+ * numap_sampling_write_start, laid out as struct sample. It has no
+ * timestamp, so that handlers reading struct sample in place keep
+ * working: numap_sampling_phases needs NUMAP_ANALYSIS_SAMPLE_TYPE.
+ */
+#define NUMAP_DEFAULT_SAMPLE_TYPE (PERF_SAMPLE_IP | PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC)
+
+/**
+ * sample_type required by the analyses (remote cost, read/write
+ * profile, sharing, placement, phases...), used by
+ * numap_sampling_read_write_start. TID and CPU are required to know
+ * which thread and which NUMA node issued each access, TIME
+ * (CLOCK_MONOTONIC_RAW nanoseconds) when it happened. Samples are read
+ * with numap_sample_decode.
+ */
+#define NUMAP_ANALYSIS_SAMPLE_TYPE (PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR | \
+                                    PERF_SAMPLE_CPU | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC)
+
+/**
+ * sample_type adding the user call stack of each sample, for
+ * numap_sampling_stacks.
+ */
+#define NUMAP_CALLCHAIN_SAMPLE_TYPE (NUMAP_ANALYSIS_SAMPLE_TYPE | PERF_SAMPLE_CALLCHAIN)
+
+/**
+ * User registers sampled with PERF_SAMPLE_REGS_USER: the stack pointer
+ * only, which tells the regions which mapping is the stack of the
+ * sampled thread. 0 on the architectures where it is not known.
+ */
+#if defined(__x86_64__)
+#include <asm/perf_regs.h>
+#define NUMAP_SAMPLE_REGS_USER (1ULL << PERF_REG_X86_SP)
+#elif defined(__aarch64__)
+#include <asm/perf_regs.h>
+#define NUMAP_SAMPLE_REGS_USER (1ULL << PERF_REG_ARM64_SP)
+#else
+#define NUMAP_SAMPLE_REGS_USER 0ULL
+#endif
+
+/**
+ * Structure representing a raw read sample gathered with the library
+ * when sampling with NUMAP_DEFAULT_SAMPLE_TYPE. Use numap_sample_decode
+ * for any other sample_type.
  */
 struct __attribute__ ((__packed__)) sample {
   uint64_t ip;
@@ -83,25 +269,577 @@ struct __attribute__ ((__packed__)) mmap_sample {
   char filename[100];
 };
 
+/**
+ * Structure representing a decoded sample. Only the fields selected by
+ * sample_type are meaningful.
+ */
+struct numap_sample {
+  uint64_t sample_type;
+  uint64_t ip;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time;
+  uint64_t addr;
+  uint32_t cpu;
+  uint64_t period;
+  uint64_t weight;
+  union perf_mem_data_src data_src;
+  uint64_t nb_callchain;
+  const uint64_t *callchain; // innermost frame first, points into the record: valid during the callback only
+  uint64_t sp; // user stack pointer (PERF_SAMPLE_REGS_USER), 0 when unknown
+  // set by numap_sampling_foreach_sample
+  int stream;
+  int core_type;
+  int access; // NUMAP_ACCESS_*
+};
+
+/**
+ * Latency histogram with logarithmic buckets: exact values below 16
+ * cycles, then 8 buckets per power of two.
+ */
+#define NUMAP_LATENCY_BUCKETS 512
+struct numap_latency_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[NUMAP_LATENCY_BUCKETS];
+};
+
+/**
+ * Remote access cost of one memory page.
+ */
+struct numap_page_cost {
+  uint64_t page;
+  int node; // node holding the page, -1 if unknown
+  uint64_t samples;
+  uint64_t remote_samples;
+  double lost_cycles;
+};
+
+/**
+ * Estimated cost of remote memory accesses: samples served by memory
+ * are attributed to a (cpu node, memory node) pair and their latency
+ * is weighted by the numa_distance between both nodes.
+ */
+struct numap_remote_cost {
+  int nb_nodes;
+  int nb_threads;
+  uint64_t pair_samples[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  double pair_lost_cycles[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  double pair_factor[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES]; // latency relative to a local access
+  uint64_t thread_memory_samples[MAX_NB_THREADS];
+  uint64_t thread_remote_1hop[MAX_NB_THREADS];
+  uint64_t thread_remote_2hops[MAX_NB_THREADS];
+  double thread_lost_cycles[MAX_NB_THREADS];
+  uint64_t unresolved_samples; // memory samples whose cpu or page node is unknown
+  // Memory bandwidth from the sampled accesses, a cache line each, when samples have PERF_SAMPLE_TIME
+  double seconds; // between the first and the last sample
+  double pair_bandwidth_mbs[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  double pair_utilization[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES]; // % of the calibrated bandwidth, 0 if unknown
+  size_t nb_pages;
+  struct numap_page_cost *pages; // sorted by decreasing lost_cycles
+};
+
+/**
+ * Reads and writes on one memory page, each sample counting for the
+ * accesses of its period.
+ */
+struct numap_page_rw {
+  uint64_t page;
+  int node; // node holding the page, -1 if unknown
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t read_latency; // sum of the latencies of the reads
+  uint64_t threads; // bit i set when thread i accessed the page
+  uint64_t writer_threads; // bit i set when thread i wrote the page
+};
+
+/**
+ * Reads and writes sampled for one thread.
+ */
+struct numap_thread_rw {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t memory_reads; // reads served by local or remote memory
+  uint64_t remote_reads; // reads served by remote memory or caches
+  uint64_t read_latency;
+};
+
+/**
+ * Read/write profile of a measure sampling both loads and stores.
+ */
+struct numap_rw_profile {
+  int nb_threads;
+  struct numap_thread_rw threads[MAX_NB_THREADS];
+  size_t nb_pages;
+  struct numap_page_rw *pages; // sorted by decreasing number of accesses
+};
+
+/**
+ * Accesses to one 8 bytes word of a cache line.
+ */
+#define NUMAP_CACHE_LINE_SIZE 64
+#define NUMAP_LINE_WORDS 8
+struct numap_line_word {
+  uint64_t loads;
+  uint64_t stores;
+  uint64_t hitm;
+  uint64_t threads; // bit i set when thread i accessed the word
+};
+
+/**
+ * A cache line contended between threads: its loads hit lines modified
+ * in the cache of another core (HITM). Counts are in accesses, each
+ * sample counting for its period.
+ */
+struct numap_line_sharing {
+  uint64_t line;
+  int node; // node holding the line, -1 if unknown
+  uint64_t loads;
+  uint64_t stores;
+  uint64_t local_hitm; // HITM in a cache of the same node
+  uint64_t remote_hitm; // HITM in a cache of another node
+  uint64_t hitm_latency; // sum of the latencies of the HITM loads
+  uint64_t threads; // bit i set when thread i accessed the line
+  uint64_t hitm_threads; // bit i set when a load of thread i was a HITM
+  uint32_t cpu_nodes; // bit n set when the line was accessed from node n
+  int false_sharing; // threads access different words of the line
+  struct numap_line_word words[NUMAP_LINE_WORDS];
+};
+
+struct numap_sharing {
+  uint64_t loads;
+  uint64_t stores;
+  uint64_t local_hitm;
+  uint64_t remote_hitm;
+  size_t nb_lines;
+  struct numap_line_sharing *lines; // sorted by decreasing remote, then total, HITM
+};
+
+/**
+ * Page placement advisor parameters, see numap_placement_params_init
+ * for the defaults.
+ */
+#define NUMAP_PLACEMENT_MIN_SAMPLES 4
+#define NUMAP_PLACEMENT_HYSTERESIS 2.0
+#define NUMAP_PLACEMENT_MIGRATION_CYCLES 20000.0
+struct numap_placement_params {
+  uint64_t min_samples; // pages with fewer memory samples stay where they are
+  double hysteresis; // the target node needs that many times the samples of the current node
+  double migration_cycles; // estimated cost of moving a page
+  double horizon; // how many more times the sampled accesses will happen
+  double max_bytes_per_sec; // bandwidth budget of numap_placement_apply, 0 for none
+};
+
+/**
+ * Memory samples of one page per accessing node, and the node proposed
+ * for it.
+ */
+struct numap_page_placement {
+  uint64_t page;
+  int node; // node holding the page, -1 if unknown
+  int target; // node to move the page to, -1 to leave it
+  int status; // set by numap_placement_apply for pages with a target: new node or -errno
+  uint64_t samples;
+  uint64_t node_samples[MAX_NB_NUMA_NODES]; // samples per accessing cpu node
+  double node_cycles[MAX_NB_NUMA_NODES]; // sum of weight * period per accessing cpu node
+  double gain; // estimated cycles saved by the move, net of its cost
+};
+
+struct numap_placement_plan {
+  int nb_nodes;
+  size_t page_size;
+  double max_bytes_per_sec;
+  size_t nb_moves;
+  double gain;
+  size_t moved; // set by numap_placement_apply
+  size_t failed;
+  size_t nb_pages;
+  struct numap_page_placement *pages; // pages to move first, by decreasing gain
+};
+
+/**
+ * Memory placement policies of the simulator.
+ */
+#define NUMAP_POLICY_FIRST_TOUCH 0
+#define NUMAP_POLICY_INTERLEAVE  1
+#define NUMAP_POLICY_PREFERRED   2
+#define NUMAP_POLICY_BIND        3
+
+/**
+ * Address range bound to a node, e.g. one allocation.
+ */
+struct numap_policy_range {
+  uint64_t start;
+  uint64_t end;
+  int node;
+};
+
+struct numap_policy {
+  int type; // NUMAP_POLICY_*
+  int node; // node of NUMAP_POLICY_PREFERRED
+  uint32_t nodes; // nodes of NUMAP_POLICY_INTERLEAVE, bit n for node n, 0 for all
+  size_t nb_ranges; // ranges of NUMAP_POLICY_BIND
+  const struct numap_policy_range *ranges;
+};
+
+struct numap_simulated_page {
+  uint64_t page;
+  uint64_t first_time;
+  int first_thread; // thread touching the page first
+};
+
+/**
+ * Memory accesses of one thread to one page.
+ */
+struct numap_simulated_access {
+  uint32_t page_index;
+  int thread;
+  uint64_t samples;
+  uint64_t accesses; // samples weighted by their period
+  double local_cycles; // estimated latency of the accesses if they were local
+};
+
+/**
+ * NUMA machine given to numap_simulation_init_machine: the node of each
+ * cpu the samples were taken on, and the distance between nodes (10 for
+ * a node to itself), as reported by numactl --hardware.
+ */
+struct numap_machine {
+  int nb_nodes;
+  int nb_cpus;
+  const int *cpu_to_node;
+  int distances[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+};
+
+struct numap_simulation {
+  int nb_nodes;
+  int nb_threads;
+  size_t page_size;
+  double factors[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES]; // latency of a node pair relative to a local access
+  int thread_nodes[MAX_NB_THREADS]; // node of each thread, -1 if unknown
+  size_t nb_pages;
+  struct numap_simulated_page *pages;
+  size_t nb_entries;
+  struct numap_simulated_access *entries;
+};
+
+struct numap_policy_result {
+  int policy;
+  int nb_nodes;
+  uint64_t samples;
+  uint64_t remote_samples;
+  uint64_t unresolved_samples; // samples of threads with an unknown node
+  double remote_fraction;
+  double node_bytes[MAX_NB_NUMA_NODES]; // bytes served by each memory node
+  double cycles; // estimated latency of the accesses
+  double local_cycles; // the same if all the accesses were local
+};
+
+/**
+ * Data source classes of samples, see numap_sample_class.
+ */
+#define NUMAP_CLASS_L1            0
+#define NUMAP_CLASS_LFB           1
+#define NUMAP_CLASS_L2            2
+#define NUMAP_CLASS_L3            3
+#define NUMAP_CLASS_LOCAL_MEMORY  4
+#define NUMAP_CLASS_REMOTE_CACHE  5
+#define NUMAP_CLASS_REMOTE_MEMORY 6
+#define NUMAP_CLASS_OTHER         7
+#define NUMAP_NB_CLASSES          8
+
+/**
+ * Samples of a fixed time window.
+ */
+#define NUMAP_WINDOW_HOT_PAGES 8
+struct numap_window {
+  uint64_t start; // sample clock, in nanoseconds
+  uint64_t samples;
+  uint64_t accesses; // samples weighted by their period
+  uint64_t classes[NUMAP_NB_CLASSES]; // accesses per NUMAP_CLASS_*
+  uint64_t nb_pages; // distinct pages sampled
+  int nb_hot_pages;
+  uint64_t hot_pages[NUMAP_WINDOW_HOT_PAGES]; // hottest first
+  uint64_t hot_accesses[NUMAP_WINDOW_HOT_PAGES];
+  uint64_t p50; // latency percentiles, in cycles
+  uint64_t p90;
+  uint64_t p99;
+  int phase;
+};
+
+/**
+ * Consecutive windows with similar classes and latencies.
+ */
+struct numap_phase {
+  size_t first_window;
+  size_t nb_windows;
+  uint64_t samples;
+  uint64_t accesses; // samples weighted by their period
+  uint64_t classes[NUMAP_NB_CLASSES]; // accesses per NUMAP_CLASS_*
+  double latency_sum; // sum of the median latency of each window times its accesses
+};
+
+struct numap_phases {
+  uint64_t start; // time of the first sample
+  uint64_t window_ns;
+  size_t nb_windows;
+  struct numap_window *windows;
+  int nb_phases;
+  struct numap_phase *phases;
+};
+
+/**
+ * Streaming sketches of the hottest pages and cache lines, in fixed
+ * memory, see numap_sketch_init.
+ */
+#define NUMAP_SKETCH_PAGES 0
+#define NUMAP_SKETCH_LINES 1
+#define NUMAP_SKETCH_KINDS 2
+
+struct numap_heavy_hitter {
+  uint64_t key; // page or cache line address
+  uint64_t count; // accesses (samples weighted by their period), overestimated by at most error
+  uint64_t error;
+};
+
+/**
+ * Space-saving top-k counters.
+ */
+struct numap_space_saving {
+  int k;
+  int nb;
+  struct numap_heavy_hitter *entries;
+  uint32_t *heap; // entries by increasing count
+  uint32_t *heap_pos; // position of each entry in heap
+  uint32_t *index; // open addressing index of the keys: entry + 1, 0 when empty
+  uint32_t index_mask;
+};
+
+/**
+ * Count-min sketch: depth rows of width counters.
+ */
+struct numap_count_min {
+  uint32_t width;
+  uint32_t depth;
+  uint64_t *counts;
+};
+
+struct numap_sketch {
+  double epsilon;
+  double delta;
+  int page_shift;
+  uint64_t total; // accesses counted
+  uint64_t seq; // odd while an update is in progress
+  char lock;
+  struct numap_space_saving top[NUMAP_SKETCH_KINDS];
+  struct numap_count_min counts[NUMAP_SKETCH_KINDS];
+};
+
+/**
+ * Trie of the call stacks of samples, see numap_sampling_stacks. Node 0
+ * is the root; the other nodes are frames, children of their caller.
+ * The statistics of a node are those of the samples whose innermost
+ * frame it is, so a node identifies a distinct stack.
+ */
+struct numap_stack_node {
+  uint64_t ip;
+  uint32_t parent;
+  uint32_t depth;
+  uint64_t samples;
+  uint64_t classes[NUMAP_NB_CLASSES]; // samples per NUMAP_CLASS_*
+  uint64_t latency; // sum of the weights of the samples
+  uint64_t max_latency;
+};
+
+struct numap_stacks {
+  uint32_t nb_nodes;
+  uint32_t capacity;
+  struct numap_stack_node *nodes;
+  uint32_t *index; // open addressing index of (parent, ip): node, 0 when empty
+  uint32_t index_mask;
+  uint64_t total; // samples added
+};
+
+/**
+ * Address space regions of the sampled processes, see
+ * numap_sampling_set_regions.
+ */
+#define NUMAP_REGION_UNKNOWN  0 // no mapping known at the address
+#define NUMAP_REGION_HEAP     1
+#define NUMAP_REGION_STACK    2
+#define NUMAP_REGION_ANON     3 // private anonymous memory
+#define NUMAP_REGION_FILE     4
+#define NUMAP_REGION_SHM      5 // shared anonymous, POSIX, System V or memfd memory
+#define NUMAP_NB_REGION_TYPES 6
+
+#define NUMAP_REGION_NAME_LEN 128
+
+struct numap_region {
+  uint32_t pid;
+  uint32_t tid; // thread of a stack, 0 when unknown
+  uint64_t start;
+  uint64_t end;
+  uint64_t pgoff;
+  int type; // NUMAP_REGION_*
+  char name[NUMAP_REGION_NAME_LEN]; // path, [heap], [stack:<tid>]..., empty when anonymous
+  uint64_t accesses; // samples weighted by their period
+  uint64_t classes[NUMAP_NB_CLASSES]; // accesses per NUMAP_CLASS_*
+  uint64_t latency; // sum of the weights of the accesses
+};
+
+struct numap_region_summary {
+  uint64_t accesses;
+  uint64_t classes[NUMAP_NB_CLASSES];
+  uint64_t latency;
+};
+
+struct numap_regions {
+  int capacity;
+  int nb_regions;
+  struct numap_region *regions; // sorted by pid, then start address
+  int nb_pids;
+  uint32_t pids[MAX_NB_THREADS]; // processes whose mappings were read from /proc
+  uint64_t dropped; // mappings not indexed, for lack of capacity
+  struct numap_region_summary types[NUMAP_NB_REGION_TYPES];
+  uint64_t foreign_stack; // accesses to the stack of another thread
+  uint64_t total; // accesses added
+  char lock;
+  uint64_t seq; // odd while the regions are updated
+};
+
+/**
+ * Live statistics published by a sampling measure in a named POSIX
+ * shared memory segment, see numap_live_open. Other processes read
+ * them with numap_live_attach and numap_live_snapshot.
+ */
+#define NUMAP_LIVE_MAGIC     0x6e756d61706c6976ULL // "numapliv"
+#define NUMAP_LIVE_VERSION   3
+#define NUMAP_LIVE_TOP_PAGES 32
+#define NUMAP_LIVE_PENDING   4096
+
+/**
+ * A remote memory sample published with its page, whose node the
+ * readers resolve.
+ */
+struct numap_live_pending {
+  uint64_t page;
+  uint64_t weight;
+  uint64_t period;
+  int cpu_node;
+};
+
+struct numap_live_stats {
+  uint64_t magic;
+  uint32_t version;
+  pid_t pid; // sampled process
+  double time; // CLOCK_MONOTONIC seconds of the last publication
+  uint64_t publications;
+  int nb_threads;
+  int nb_nodes;
+  uint64_t page_size;
+  pid_t tids[MAX_NB_THREADS];
+  uint64_t periods[MAX_NB_THREADS]; // sampling period of each thread
+  uint64_t thread_samples[MAX_NB_THREADS];
+  uint64_t thread_classes[MAX_NB_THREADS][NUMAP_NB_CLASSES]; // samples per NUMAP_CLASS_*
+  uint64_t thread_lost[MAX_NB_THREADS]; // samples lost by the kernel
+  // Counts mixing threads are in accesses: each sample counts for its period
+  uint64_t node_accesses[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES]; // memory accesses per cpu node and memory node
+  uint64_t unresolved; // memory accesses whose cpu or memory node is unknown
+  struct numap_latency_histogram node_latency[MAX_NB_NUMA_NODES]; // latency of the memory accesses per memory node
+  int nb_top_pages;
+  struct numap_heavy_hitter top_pages[NUMAP_LIVE_TOP_PAGES]; // hottest first
+  // remote memory samples, counted in the node matrix by numap_live_snapshot
+  uint64_t nb_pending; // published so far, the last NUMAP_LIVE_PENDING are kept
+  uint64_t pending_accesses; // accesses of the published ones
+  struct numap_live_pending pending[NUMAP_LIVE_PENDING]; // indexed by number % NUMAP_LIVE_PENDING
+};
+
+/**
+ * Layout of the segment: a sequence count, odd while the stats are
+ * being written, followed by the stats.
+ */
+struct numap_live_segment {
+  uint64_t seq;
+  struct numap_live_stats stats;
+};
+
+/**
+ * Publishing side, private to the sampled process.
+ */
+struct numap_live {
+  char name[256];
+  struct numap_live_segment *segment;
+  char lock;
+  struct numap_sketch pages;
+};
+
+/**
+ * Reading side, in any process. Resolves the nodes of the pending
+ * remote memory samples and keeps their counts across snapshots.
+ */
+struct numap_live_reader {
+  const struct numap_live_segment *segment;
+  uint64_t nb_resolved; // pending samples counted so far
+  uint64_t resolved_accesses;
+  uint64_t node_accesses[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  uint64_t unresolved;
+  struct numap_latency_histogram node_latency[MAX_NB_NUMA_NODES];
+};
+
+/**
+ * Numap trace the records of a running measure are streamed to (see
+ * numap_trace_writer_open).
+ */
+struct numap_trace_writer {
+  FILE *f;
+  uint64_t bytes; // bytes of records written so far
+  struct u64_map *pages; // pages whose node is already in the trace
+};
+
+/**
+ * Memory latency and bandwidth measured for each (cpu node, memory node)
+ * pair of the machine.
+ */
+struct numap_calibration {
+  int nb_nodes;
+  double latency_ns[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  double bandwidth_mbs[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+};
+
 char* concat(const char *s1, const char *s2);
 
 /**
- * Numap initialization function
+ * Numap initialization function. It has to be called before any other
+ * function; the platform is probed by the first call only.
  */
 int numap_init(void);
 
+/**
+ * Sessions.
+ */
+int numap_session_create(struct numap_session **session);
+int numap_session_destroy(struct numap_session *session);
+// Same as numap_error_message: error details are per thread, session is unused
+const char *numap_session_error_message(struct numap_session *session, int error);
+
 /**
  * Memory counting.
  */
 int numap_counting_init_measure(struct numap_counting_measure *measure);
+int numap_session_counting_init_measure(struct numap_session *session, struct numap_counting_measure *measure);
 int numap_counting_start(struct numap_counting_measure *measure);
 int numap_counting_stop(struct numap_counting_measure *measure);
+int numap_counting_print(struct numap_counting_measure *measure, double seconds);
 
 /**
  * Memory read and write sampling.
  */
 int numap_sampling_set_measure_handler(struct numap_sampling_measure *measure, void(*)(struct numap_sampling_measure*,int), int);
 int numap_sampling_init_measure(struct numap_sampling_measure *measure, int nb_threads, int sampling_rate, int mmap_pages_count);
+int numap_session_sampling_init_measure(struct numap_session *session, struct numap_sampling_measure *measure,
+                                        int nb_threads, int sampling_rate, int mmap_pages_count);
+int numap_sampling_read_supported();
 int numap_sampling_read_start_generic(struct numap_sampling_measure *measure, uint64_t sample_type);
 int numap_sampling_read_start(struct numap_sampling_measure *measure);
 int numap_sampling_read_stop(struct numap_sampling_measure *measure);
@@ -110,10 +848,33 @@ int numap_sampling_write_supported();
 int numap_sampling_write_start_generic(struct numap_sampling_measure *measure, uint64_t sample_type);
 int numap_sampling_write_start(struct numap_sampling_measure *measure);
 int numap_sampling_write_stop(struct numap_sampling_measure *measure);
+int numap_sampling_read_write_start_generic(struct numap_sampling_measure *measure, uint64_t sample_type);
+int numap_sampling_read_write_start(struct numap_sampling_measure *measure);
+int numap_sampling_read_write_stop(struct numap_sampling_measure *measure);
 int numap_sampling_write_print(struct numap_sampling_measure *measure, char print_samples);
 int numap_sampling_print(struct numap_sampling_measure *measure, char print_samples);
 int numap_sampling_end(struct numap_sampling_measure *measure);
 int numap_sampling_resume(struct numap_sampling_measure *measure);
+int numap_sampling_add_thread(struct numap_sampling_measure *measure, pid_t tid);
+int numap_sampling_remove_thread(struct numap_sampling_measure *measure, pid_t tid);
+int numap_sampling_init_attach(struct numap_sampling_measure *measure, pid_t pid, int mode, int sampling_rate,
+                               int mmap_pages_count);
+int numap_sampling_set_collector_interval(struct numap_sampling_measure *measure, unsigned int interval_ms);
+int numap_sampling_attach_missed(struct numap_sampling_measure *measure);
+int numap_sampling_set_adaptive_period(struct numap_sampling_measure *measure, double target_samples_per_sec,
+                                       double max_overhead, uint64_t min_period, uint64_t max_period);
+
+/**
+ * Recording and replay of samples.
+ */
+int numap_sampling_save(struct numap_sampling_measure *measure, const char *path);
+int numap_trace_writer_open(struct numap_trace_writer *writer, const char *path, struct numap_sampling_measure *measure);
+int numap_trace_writer_append(struct numap_trace_writer *writer, struct numap_sampling_measure *measure);
+int numap_trace_writer_close(struct numap_trace_writer *writer);
+int numap_sampling_replay_init(struct numap_sampling_measure *measure, const char *path);
+int numap_sampling_replay_init_buffers(struct numap_sampling_measure *measure, uint64_t sample_type,
+                                       unsigned int sampling_rate, int nb_threads, pid_t *tids,
+                                       void **records, size_t *sizes);
 
 /**
  * Error handling.
@@ -134,3 +895,113 @@ int is_served_by_remote_memory(union perf_mem_data_src data_src);
 int is_served_by_local_NA_miss(union perf_mem_data_src data_src);
 char *get_data_src_opcode(union perf_mem_data_src data_src);
 char *get_data_src_level(union perf_mem_data_src data_src);
+int numap_sample_class(union perf_mem_data_src data_src);
+void numap_latency_histogram_init(struct numap_latency_histogram *histogram);
+void numap_latency_histogram_add(struct numap_latency_histogram *histogram, uint64_t latency);
+void numap_latency_histogram_add_count(struct numap_latency_histogram *histogram, uint64_t latency, uint64_t count);
+void numap_latency_histogram_merge(struct numap_latency_histogram *histogram, struct numap_latency_histogram *other);
+uint64_t numap_latency_histogram_percentile(struct numap_latency_histogram *histogram, double percentile);
+int numap_latency_histogram_print(struct numap_latency_histogram *histogram);
+int numap_sampling_latency_histogram(struct numap_sampling_measure *measure, struct numap_latency_histogram *histogram);
+int numap_sampling_set_ldlat_sweep(struct numap_sampling_measure *measure, const unsigned int *ldlats, int nb_ldlats,
+                                   int mode, double interval);
+int numap_sampling_set_thread_config(struct numap_sampling_measure *measure, int thread,
+                                     const struct numap_thread_config *config);
+int numap_sampling_sweep_histogram(struct numap_sampling_measure *measure, struct numap_latency_histogram *histogram);
+int numap_sample_decode(uint64_t sample_type, struct perf_event_header *header, struct numap_sample *sample);
+int numap_sampling_foreach_record(struct numap_sampling_measure *measure,
+                                  int (*callback)(struct numap_sampling_measure*, int, struct perf_event_header*, void*),
+                                  void *arg);
+int numap_sampling_foreach_sample(struct numap_sampling_measure *measure,
+                                  int (*callback)(struct numap_sampling_measure*, int, struct numap_sample*, void*),
+                                  void *arg);
+
+/**
+ * Remote access cost analysis
+ */
+int numap_sampling_remote_cost(struct numap_sampling_measure *measure, struct numap_remote_cost *cost);
+int numap_remote_cost_print(struct numap_remote_cost *cost, size_t nb_pages);
+void numap_remote_cost_free(struct numap_remote_cost *cost);
+int numap_sampling_rw_profile(struct numap_sampling_measure *measure, struct numap_rw_profile *profile);
+int numap_rw_profile_print(struct numap_rw_profile *profile, size_t nb_pages);
+void numap_rw_profile_free(struct numap_rw_profile *profile);
+int numap_sampling_sharing(struct numap_sampling_measure *measure, struct numap_sharing *sharing);
+// Requires PERF_SAMPLE_TIME, see NUMAP_ANALYSIS_SAMPLE_TYPE
+int numap_sampling_phases(struct numap_sampling_measure *measure, double window_seconds, double threshold,
+                          struct numap_phases *phases);
+int numap_phases_print(struct numap_phases *phases, char print_windows);
+void numap_phases_free(struct numap_phases *phases);
+
+/**
+ * Streaming top-k pages and cache lines
+ */
+int numap_sketch_init(struct numap_sketch *sketch, int k, double epsilon, double delta);
+void numap_sketch_free(struct numap_sketch *sketch);
+void numap_sketch_add(struct numap_sketch *sketch, struct numap_sample *sample, uint64_t count);
+uint64_t numap_sketch_estimate(struct numap_sketch *sketch, int what, uint64_t addr);
+int numap_sketch_top(struct numap_sketch *sketch, int what, struct numap_heavy_hitter *hitters, int k,
+                     uint64_t *total);
+int numap_sketch_print(struct numap_sketch *sketch, int k);
+int numap_sampling_set_sketch(struct numap_sampling_measure *measure, struct numap_sketch *sketch);
+int numap_stacks_init(struct numap_stacks *stacks);
+void numap_stacks_free(struct numap_stacks *stacks);
+int64_t numap_stacks_add(struct numap_stacks *stacks, struct numap_sample *sample);
+int numap_stacks_frames(struct numap_stacks *stacks, uint32_t node, uint64_t *ips, int max);
+int numap_sampling_stacks(struct numap_sampling_measure *measure, struct numap_stacks *stacks);
+int numap_stacks_print(struct numap_stacks *stacks, size_t nb_stacks);
+int numap_regions_init(struct numap_regions *regions, int capacity);
+void numap_regions_free(struct numap_regions *regions);
+int numap_regions_seed(struct numap_regions *regions, pid_t tid);
+void numap_regions_record(struct numap_regions *regions, struct perf_event_header *header);
+int numap_regions_add(struct numap_regions *regions, struct numap_sample *sample, uint64_t count);
+int numap_regions_find(struct numap_regions *regions, pid_t pid, uint64_t addr, struct numap_region *region);
+const char *numap_region_type_name(int type);
+int numap_sampling_set_regions(struct numap_sampling_measure *measure, struct numap_regions *regions);
+int numap_regions_print(struct numap_regions *regions, int nb_regions);
+int numap_live_open(struct numap_live *live, const char *name);
+void numap_live_close(struct numap_live *live);
+int numap_sampling_set_live(struct numap_sampling_measure *measure, struct numap_live *live);
+int numap_live_attach(struct numap_live_reader *reader, const char *name);
+int numap_live_snapshot(struct numap_live_reader *reader, struct numap_live_stats *stats);
+void numap_live_detach(struct numap_live_reader *reader);
+int numap_live_print(struct numap_live_stats *stats, int nb_pages);
+int numap_sharing_print(struct numap_sharing *sharing, size_t nb_lines);
+void numap_sharing_free(struct numap_sharing *sharing);
+
+/**
+ * Page placement advisor
+ */
+void numap_placement_params_init(struct numap_placement_params *params);
+int numap_sampling_placement(struct numap_sampling_measure *measure, struct numap_placement_params *params,
+                             struct numap_placement_plan *plan);
+int numap_placement_apply(struct numap_sampling_measure *measure, struct numap_placement_plan *plan);
+int numap_placement_print(struct numap_placement_plan *plan, size_t nb_pages);
+void numap_placement_free(struct numap_placement_plan *plan);
+
+/**
+ * Memory placement policy simulator
+ */
+int numap_simulation_init(struct numap_simulation *simulation, struct numap_sampling_measure *measure,
+                          const int *thread_nodes);
+int numap_simulation_init_machine(struct numap_simulation *simulation, struct numap_sampling_measure *measure,
+                                  const int *thread_nodes, const struct numap_machine *machine);
+int numap_simulation_run(struct numap_simulation *simulation, struct numap_policy *policy,
+                         struct numap_policy_result *result);
+int numap_policy_result_print(struct numap_policy_result *result, double seconds);
+void numap_simulation_free(struct numap_simulation *simulation);
+
+/**
+ * Per node pair latency and bandwidth calibration. Analyses use the
+ * calibration saved at numap_calibration_default_path() when present.
+ */
+int numap_calibration_run(struct numap_calibration *calibration, size_t buffer_size);
+int numap_calibration_save(struct numap_calibration *calibration, const char *path);
+int numap_calibration_load(struct numap_calibration *calibration, const char *path);
+int numap_calibration_print(struct numap_calibration *calibration);
+const char *numap_calibration_default_path(void);
+double numap_calibration_remote_factor(struct numap_calibration *calibration, int cpu_node, int mem_node);
+double numap_calibration_utilization(struct numap_calibration *calibration, int node, double bytes, double seconds);
+double numap_calibration_pair_utilization(struct numap_calibration *calibration, int cpu_node, int mem_node,
+                                          double bytes, double seconds);
+
+#endif
@@ -19,248 +19,10 @@
 #include <pthread.h>
 
 #include "numap.h"
+#include "numap_internal.h"
 
 #define PERF_EVENT_MLOCK_KB_FILE "/proc/sys/kernel/perf_event_mlock_kb"
 
-#define NOT_SUPPORTED "NOT_SUPPORTED"
-
-struct archi {
-  unsigned int id;
-  char name[256];
-  char sampling_read_event[256];
-  char sampling_write_event[256];
-  char counting_read_event[256];
-  char counting_write_event[256];
-};
-
-/* If your Intel CPU is not supported by Numap, you need to add a new architecture:
- * .id can be found by running lscpu (CPU Familly | Model <<8)
- * .sampling_read_event and .sampling_write_event can be found in the Intel Software Developpers Manuel (Chapter 19)
- */
-
-
-#define CPU_MODEL(family, model) ((family) | (model) <<8)
-
-static void get_archi(unsigned int archi_id, struct archi * arch) {
-  arch->id=archi_id;
-
-  snprintf(arch->name, 256, "Unknown architecture");
-  snprintf(arch->sampling_read_event, 256, NOT_SUPPORTED);
-  snprintf(arch->sampling_write_event, 256, NOT_SUPPORTED);
-  snprintf(arch->counting_read_event, 256, NOT_SUPPORTED);
-  snprintf(arch->counting_write_event, 256, NOT_SUPPORTED);
-
-  switch (archi_id)  {
-  case CPU_MODEL(6, 151):
-  case CPU_MODEL(6, 154):
-    snprintf(arch->name, 256, "Alder Lake micro arch");
-    /* Not tested. Let's assume these events are the same as the previous cpu generation */
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 167):
-    snprintf(arch->name, 256, "Rocket Lake micro arch");
-    /* Not tested. Let's assume these events are the same as the previous cpu generation */
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 143):
-    snprintf(arch->name, 256, "Sapphire Rapids micro arch");
-    /* Not tested. Let's assume these events are the same as the previous cpu generation */
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 141):
-  case CPU_MODEL(6, 140):
-    snprintf(arch->name, 256, "Tiger Lake micro arch");
-    /* Not tested. Let's assume these events are the same as the previous cpu generation */
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 106):
-  case CPU_MODEL(6, 125):
-  case CPU_MODEL(6, 126):
-    snprintf(arch->name, 256, "Ice Lake micro arch");
-    /* Not tested. Let's assume these events are the same as the previous cpu generation */
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 102):
-    snprintf(arch->name, 256, "Cannon Lake micro arch");
-    /* Not tested. Let's assume these events are the same as the previous cpu generation */
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 158):
-  case CPU_MODEL(6, 142):
-    snprintf(arch->name, 256, "Kaby Lake micro arch");
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_INST_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 94):
-  case CPU_MODEL(6, 78):
-  case CPU_MODEL(6, 85):
-    snprintf(arch->name, 256, "Skylake micro arch");
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_UOPS_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 79):
-  case CPU_MODEL(6, 86):
-  case CPU_MODEL(6, 71):
-  case CPU_MODEL(6, 61):
-    snprintf(arch->name, 256, "Broadwell micro arch");
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_UOPS_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 60):
-  case CPU_MODEL(6, 63):
-  case CPU_MODEL(6, 69):
-  case CPU_MODEL(6, 70):
-    snprintf(arch->name, 256, "Haswell micro arch");
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_UOPS_RETIRED:ALL_STORES");
-    break;
-
-  case CPU_MODEL(6, 58):
-  case CPU_MODEL(6, 62):
-    snprintf(arch->name, 256, "Ivy Bridge micro arch");
-    // NOTE: in the Intel SDM, read sampling event is MEM_TRANS_RETIRED:LOAD_LATENCY.
-    // In practice this event does not work. As a consequence we use the event below
-    // which is the one used by perf mem record and reported by the pfm library
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LATENCY_ABOVE_THRESHOLD:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_TRANS_RETIRED:PRECISE_STORE");
-    //snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LOAD_LATENCY:ldlat=3");
-    //snprintf(arch->sampling_write_event, 256, "MEM_TRANS_RETIRED:PRECISE_STORE");
-    break;
-
-  case CPU_MODEL(6, 42):
-  case CPU_MODEL(6, 45):
-    snprintf(arch->name, 256, "Sandy Bridge micro arch");
-  // NOTE: in the Intel SDM, read sampling event is MEM_TRANS_RETIRED:LOAD_LATENCY.
-  // In practice this event does not work. As a consequence we use the event below
-  // which is the one used by perf mem record and reported by the pfm library
-    snprintf(arch->sampling_read_event, 256, "MEM_TRANS_RETIRED:LATENCY_ABOVE_THRESHOLD:ldlat=3");
-    snprintf(arch->sampling_write_event, 256, "MEM_TRANS_RETIRED:PRECISE_STORE");
-    break;
-
-  case CPU_MODEL(6,46):
-  case CPU_MODEL(6,30):
-  case CPU_MODEL(6,26):
-  case CPU_MODEL(6,31):
-    snprintf(arch->name, 256, "Nehalem micro arch");
-    snprintf(arch->sampling_read_event, 256,  "MEM_INST_RETIRED:LATENCY_ABOVE_THRESHOLD:ldlat=3");
-    break;
-
-  case CPU_MODEL(6, 44):
-  case CPU_MODEL(6, 47):
-  case CPU_MODEL(6, 37):
-    snprintf(arch->name, 256, "Westmere micro arch");
-    snprintf(arch->sampling_read_event, 256, "MEM_INST_RETIRED:LATENCY_ABOVE_THRESHOLD:ldlat=3");
-    break;
-
-
-    // Intel Xeon Phi CPUs (currently not supported)
-    // I'm not sure if PEBS is available on these cpus
-  case CPU_MODEL(6, 133):
-    snprintf(arch->name, 256, "Knights Mill micro arch");
-    break;
-
-  case CPU_MODEL(6, 87):
-    snprintf(arch->name, 256, "Knights Landing micro arch");
-    break;
-
-    // Old Intel Xeon Phi CPUs
-  case CPU_MODEL(11, 0):
-    snprintf(arch->name, 256, "Knights Ferry micro arch");
-    break;   
-  case CPU_MODEL(11, 1):
-    snprintf(arch->name, 256, "Knights Corner micro arch");
-    break;
-
-    // Some old Intel arch (will probably never be supported)
-  case CPU_MODEL(15, 6):
-    snprintf(arch->name, 256, "Netburst micro arch");
-    break;
-
-  case CPU_MODEL(15, 4):
-  case CPU_MODEL(15, 3):
-    snprintf(arch->name, 256, "Prescott micro arch");
-    break;
-
-  case CPU_MODEL(15, 2):
-    snprintf(arch->name, 256, "Northwood micro arch");
-    break;
-  case CPU_MODEL(15, 1):
-    snprintf(arch->name, 256, "Willamette micro arch");
-    break;
-
-  case CPU_MODEL(6, 29):
-  case CPU_MODEL(6, 23):
-    snprintf(arch->name, 256, "Penryn micro arch");
-    break;
-    
-  case CPU_MODEL(6, 15):
-  case CPU_MODEL(6, 22):
-    snprintf(arch->name, 256, "Core micro arch");
-    break;
-    
-  case CPU_MODEL(6, 14):
-    snprintf(arch->name, 256, "Modified Pentium M micro arch");
-    break;
-    
-  case CPU_MODEL(6, 21):
-  case CPU_MODEL(6, 13):
-  case CPU_MODEL(6, 9):
-    snprintf(arch->name, 256, "Pentium M micro arch");
-    break;
-
-    // Intel Atom/ Celeron CPUs (will probably never be supported)
-  case CPU_MODEL(6, 134):
-    snprintf(arch->name, 256, "Tremont micro arch");
-    break;
-    
-  case CPU_MODEL(6, 122):
-    snprintf(arch->name, 256, "Goldmont Plus micro arch");
-    break;
-    
-  case CPU_MODEL(6, 95):
-  case CPU_MODEL(6, 92):
-    snprintf(arch->name, 256, "Goldmont micro arch");
-    break;
-    
-  case CPU_MODEL(6, 76):
-    snprintf(arch->name, 256, "Airmont micro arch");
-    break;
-    
-  case CPU_MODEL(6, 55):
-  case CPU_MODEL(6, 74):
-  case CPU_MODEL(6, 77):
-  case CPU_MODEL(6, 93):
-    snprintf(arch->name, 256, "Silvermont micro arch");
-    break;
-
-  case CPU_MODEL(6, 39):
-  case CPU_MODEL(6, 53):
-  case CPU_MODEL(6, 54):
-    snprintf(arch->name, 256, "Saltwell micro arch");
-    break;
-    
-  case CPU_MODEL(6, 28):
-  case CPU_MODEL(6, 38):
-    snprintf(arch->name, 256, "Bonnell micro arch");
-    break;
-  }
-}
-
 unsigned char get_family(unsigned int archi_id) {
   return (archi_id >> (8*0)) & 0xff;
 }
@@ -275,93 +37,131 @@ unsigned char get_model(unsigned int archi_id) {
  */
 unsigned int nb_numa_nodes;
 int numa_node_to_cpu[MAX_NB_NUMA_NODES];
-unsigned int perf_event_mlock_kb;
+int nb_cpus;
+int *cpu_to_node;
+unsigned int perf_event_mlock_kb; // 0 if unknown
 struct archi *current_archi;
 char *model_name = NULL;
-int curr_err;
-
-struct link_fd_measure {
-  struct link_fd_measure *next;
-  int fd;
-  struct numap_sampling_measure* measure;
-};
 
-struct link_fd_measure *link_fd_measure = NULL;
-pthread_mutex_t link_fd_lock;
+pthread_once_t platform_once = PTHREAD_ONCE_INIT;
+int platform_status;
+static int platform_pfm_err;
 
 /**
- * Special function called each time a process using the lib is
- * started.
+ * Reads the cpu family, model and model name from /proc/cpuinfo.
  */
-__attribute__((constructor)) void init(void) {
-
-  int node;
-  int cpu;
-
-  // Supported_archs
-
-  // Check architecture
+static int read_cpuinfo(unsigned char *family, unsigned char *model) {
   FILE *cpuinfo = fopen("/proc/cpuinfo", "rb");
+  if (cpuinfo == NULL) {
+    return ERROR_NUMAP_PLATFORM;
+  }
   char *arg = NULL;
   size_t size = 0;
-  unsigned char family = 0;
-  unsigned char model = 0;
   const char *family_string = "cpu family\t";
   const char *model_string = "model\t";
   const char *model_name_string = "model name\t";
-  while(getline(&arg, &size, cpuinfo) != -1 && (!family || !model || !model_name)) {
+  while(getline(&arg, &size, cpuinfo) != -1 && (!*family || !*model || !model_name)) {
+    char *value = strchr(arg, ':');
+    if (value == NULL) {
+      continue;
+    }
+    value++;
+    value[strcspn(value, "\n")] = '\0';
     if (strncmp(family_string, arg, strlen(family_string)) == 0) {
-      strtok(arg, ":");
-      family = atoi(strtok(NULL, "\n"));
+      *family = atoi(value);
     } else if (strncmp(model_string, arg, strlen(model_string)) == 0) {
-      strtok(arg, ":");
-      model = atoi(strtok(NULL, "\n"));
+      *model = atoi(value);
     } else if (strncmp(model_name_string, arg, strlen(model_name_string)) == 0) {
-      strtok(arg, ":");
-      char * model_name_strtok = strtok(NULL, "\n");
-      int len = strlen(model_name_strtok);
-      model_name = malloc((len + 1) * sizeof(char));
-      strcpy(model_name, model_name_strtok);
+      model_name = strdup(value);
     }
   }
   free(arg);
   fclose(cpuinfo);
+  return 0;
+}
+
+/**
+ * Gathers the platform information once per process, at the first
+ * numap_init. The result is kept in platform_status.
+ */
+static void platform_init(void) {
+
+  int node;
+  int cpu;
+
+  // Check architecture
+  unsigned char family = 0;
+  unsigned char model = 0;
+  platform_status = read_cpuinfo(&family, &model);
+  if (platform_status != 0) {
+    return;
+  }
   current_archi = malloc(sizeof(struct archi));
-  get_archi(CPU_MODEL(family, model), current_archi);
+  if (current_archi == NULL) {
+    platform_status = ERROR_NUMAP_MALLOC;
+    return;
+  }
+  if (archi_load(CPU_MODEL(family, model), current_archi) != 0) {
+    free(current_archi);
+    current_archi = NULL;
+    platform_status = ERROR_NUMAP_MALLOC;
+    return;
+  }
 
   // Get numa configuration
   int available = numa_available();
   if (available == -1) {
     nb_numa_nodes = -1;
-  } else {
-    nb_numa_nodes = numa_num_configured_nodes();
-    int nb_cpus = numa_num_configured_cpus();
-    for (node = 0; node < nb_numa_nodes; node++) {
-      struct bitmask *mask = numa_allocate_cpumask();
-      numa_node_to_cpus(node, mask);
-      numa_node_to_cpu[node] = -1;
-      for (cpu = 0; cpu < nb_cpus; cpu++) {
-        if (*(mask->maskp) & (1 << cpu)) {
-          numa_node_to_cpu[node] = cpu;
-          break;
-        }
+    platform_status = ERROR_NUMAP_NOT_NUMA;
+    return;
+  }
+  nb_numa_nodes = numa_num_configured_nodes();
+  nb_cpus = numa_num_configured_cpus();
+  cpu_to_node = malloc(nb_cpus * sizeof(int));
+  if (cpu_to_node == NULL) {
+    nb_cpus = 0;
+    platform_status = ERROR_NUMAP_MALLOC;
+    return;
+  }
+  for (cpu = 0; cpu < nb_cpus; cpu++) {
+    cpu_to_node[cpu] = numa_node_of_cpu(cpu);
+    if (cpu_to_node[cpu] >= (int)nb_numa_nodes || cpu_to_node[cpu] >= MAX_NB_NUMA_NODES) {
+      cpu_to_node[cpu] = -1;
+    }
+  }
+  struct bitmask *mask = numa_allocate_cpumask();
+  for (node = 0; node < nb_numa_nodes && node < MAX_NB_NUMA_NODES; node++) {
+    numa_node_to_cpu[node] = -1;
+    if (numa_node_to_cpus(node, mask) != 0) {
+      continue;
+    }
+    for (cpu = 0; cpu < nb_cpus; cpu++) {
+      if (numa_bitmask_isbitset(mask, cpu)) {
+        numa_node_to_cpu[node] = cpu;
+        break;
       }
-      numa_bitmask_free(mask);
     }
   }
+  numa_bitmask_free(mask);
 
-  // Get perf config
+  // Get perf config, used to size the ring buffers
   FILE *f = fopen(PERF_EVENT_MLOCK_KB_FILE, "r");
-  if (!f) {
-    fprintf(stderr, "Failed to open file: `%s'\n", PERF_EVENT_MLOCK_KB_FILE);
-    exit(-1);
-  }
-  if (fscanf(f, "%u", &perf_event_mlock_kb) != 1) {
-    fprintf(stderr, "Failed to read perf_event_mlock_kb from file: `%s'\n", PERF_EVENT_MLOCK_KB_FILE);
+  if (f != NULL) {
+    if (fscanf(f, "%u", &perf_event_mlock_kb) != 1) {
+      perf_event_mlock_kb = 0;
+    }
     fclose(f);
-    exit(-1);
   }
-  fclose(f);
+
+  platform_pfm_err = pfm_initialize();
+  if (platform_pfm_err != PFM_SUCCESS) {
+    platform_status = ERROR_PFM;
+    return;
+  }
+
+  // Select the sampling events that actually work on this host
+  archi_probe(current_archi);
+  platform_status = 0;
 }
 
 char* concat(const char *s1, const char *s2) {
@@ -374,15 +174,11 @@ char* concat(const char *s1, const char *s2) {
  return result;
 }
 
-char* build_string(const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  char* result = NULL;
-  vasprintf(&result, fmt, args);
-  return result;
-}
- 
-const char *numap_error_message(int error) {
+/**
+ * Message of error, formatted in buffer when it needs details about the
+ * last failure of the calling thread.
+ */
+const char *error_message(int error, char *buffer, size_t len) {
   switch (error) {
   case ERROR_NUMAP_NOT_NUMA:
     return "libnumap: numa lib not available";
@@ -391,63 +187,105 @@ const char *numap_error_message(int error) {
   case ERROR_NUMAP_ALREADY_STARTED:
     return "libnumap: start called again before stop";
   case ERROR_NUMAP_ARCH_NOT_SUPPORTED:
-    return build_string("libnumap: architecture not supported: %s (family %d, model %d)",
+    snprintf(buffer, len, "libnumap: architecture not supported: %s (family %d, model %d)",
           model_name, get_family(current_archi->id), get_model(current_archi->id));
+    return buffer;
   case ERROR_NUMAP_READ_SAMPLING_ARCH_NOT_SUPPORTED:
-    return build_string("libnumap: read sampling not supported on architecture: %s (family %d, model %d)",
-          model_name, get_family(current_archi->id), get_model(current_archi->id));
+    snprintf(buffer, len, "libnumap: read sampling not supported on architecture: %s (family %d, model %d)%s%s",
+          model_name, get_family(current_archi->id), get_model(current_archi->id),
+          current_archi->read_probe_errors[0] ? ": " : "", current_archi->read_probe_errors);
+    return buffer;
   case ERROR_NUMAP_WRITE_SAMPLING_ARCH_NOT_SUPPORTED:
-    return build_string("libnumap: write sampling not supported on architecture: %s (family %d, model %d)",
-          model_name, get_family(current_archi->id), get_model(current_archi->id));
+    snprintf(buffer, len, "libnumap: write sampling not supported on architecture: %s (family %d, model %d)%s%s",
+          model_name, get_family(current_archi->id), get_model(current_archi->id),
+          current_archi->write_probe_errors[0] ? ": " : "", current_archi->write_probe_errors);
+    return buffer;
   case ERROR_PERF_EVENT_OPEN:
-    return build_string("libnumap: error when calling perf_event_open: %s", strerror(errno));
+    snprintf(buffer, len, "libnumap: error when calling perf_event_open: %s", strerror(last_sys_errno));
+    return buffer;
   case ERROR_PFM:
-    return build_string("libnumap: error when initializing pfm: %s", pfm_strerror(curr_err));
+    snprintf(buffer, len, "libnumap: error when initializing pfm: %s", pfm_strerror(last_pfm_err));
+    return buffer;
   case ERROR_READ:
     return "libnumap: error while trying to read counter";
+  case ERROR_NUMAP_SAMPLE_TYPE:
+    return "libnumap: sample_type not supported by this analysis";
+  case ERROR_NUMAP_MALLOC:
+    return "libnumap: memory allocation failed";
+  case ERROR_NUMAP_CALIBRATION:
+    return "libnumap: calibration failed";
+  case ERROR_NUMAP_TOO_MANY_THREADS:
+    snprintf(buffer, len, "libnumap: more than %d threads", MAX_NB_THREADS);
+    return buffer;
+  case ERROR_NUMAP_REPLAY_FILE:
+    snprintf(buffer, len, "libnumap: cannot read or write trace file: %s", strerror(errno));
+    return buffer;
+  case ERROR_NUMAP_REPLAY_FORMAT:
+    return "libnumap: unsupported or corrupted trace file";
+  case ERROR_NUMAP_REPLAY:
+    return "libnumap: a replayed measure cannot be started nor have its pages moved";
+  case ERROR_NUMAP_PLATFORM:
+    snprintf(buffer, len, "libnumap: cannot read platform information from /proc/cpuinfo: %s", strerror(errno));
+    return buffer;
+  case ERROR_NUMAP_INVALID_ARGUMENT:
+    return "libnumap: invalid argument";
+  case ERROR_NUMAP_SESSION_BUSY:
+    return "libnumap: session still has sampling measures";
+  case ERROR_NUMAP_SIGNAL:
+    snprintf(buffer, len, "libnumap: could not set up the SIGIO handler: %s", strerror(last_sys_errno));
+    return buffer;
+  case ERROR_NUMAP_MLOCK:
+    snprintf(buffer, len, "libnumap: not enough locked memory to map the ring buffers, "
+             "consider increasing %s (%u kB) or RLIMIT_MEMLOCK", PERF_EVENT_MLOCK_KB_FILE, perf_event_mlock_kb);
+    return buffer;
+  case ERROR_NUMAP_MMAP:
+    snprintf(buffer, len, "libnumap: cannot mmap ring buffer: %s", strerror(last_sys_errno));
+    return buffer;
+  case ERROR_NUMAP_MOVE_PAGES:
+    snprintf(buffer, len, "libnumap: error when calling move_pages: %s", strerror(last_sys_errno));
+    return buffer;
+  case ERROR_NUMAP_SHM:
+    snprintf(buffer, len, "libnumap: cannot open or map shared memory segment: %s", strerror(errno));
+    return buffer;
+  case ERROR_NUMAP_SHM_BUSY:
+    return "libnumap: shared memory segment stayed busy, try again later";
+  case ERROR_NUMAP_ATTACH:
+    snprintf(buffer, len, "libnumap: cannot attach to process: %s", strerror(errno));
+    return buffer;
+  case ERROR_NUMAP_MAPS:
+    snprintf(buffer, len, "libnumap: cannot read the mappings of a process: %s", strerror(last_sys_errno));
+    return buffer;
+  case ERROR_NUMAP_LDLAT:
+    return "libnumap: the read sampling event of this architecture has no load latency threshold (ldlat)";
+  case ERROR_NUMAP_CALIBRATION_FILE:
+    snprintf(buffer, len, "libnumap: cannot read or write calibration file %s%s%s", last_calibration_path,
+             last_sys_errno != 0 ? ": " : "", last_sys_errno != 0 ? strerror(last_sys_errno) : "");
+    return buffer;
   default:
     return "libnumap: unknown error";
   }
 }
 
-int set_signal_handler(void(*handler)(int, siginfo_t*,void*)) {
-  struct sigaction sigoverflow;
-  memset(&sigoverflow, 0, sizeof(struct sigaction));
-  sigoverflow.sa_sigaction = handler;
-  sigoverflow.sa_flags = SA_SIGINFO;
-
-  if (sigaction(SIGIO, &sigoverflow, NULL) < 0)
-  {
-    fprintf(stderr, "could not set up signal handler\n");
-    perror("sigaction");
-    exit(EXIT_FAILURE);
-  }
-  return 0;
+const char *numap_error_message(int error) {
+  static __thread char buffer[1024];
+  return error_message(error, buffer, sizeof(buffer));
 }
 
+/**
+ * Initializes the library. Only the first call does the actual work,
+ * the following ones return the same result.
+ */
 int numap_init(void) {
-
-  if (nb_numa_nodes == -1) {
-    return ERROR_NUMAP_NOT_NUMA;
-  }
-
-  if (current_archi == NULL) {
-    return ERROR_NUMAP_ARCH_NOT_SUPPORTED;
+  pthread_once(&platform_once, platform_init);
+  if (platform_status == ERROR_PFM) {
+    last_pfm_err = platform_pfm_err;
   }
-
-  curr_err = pfm_initialize();
-  if (curr_err != PFM_SUCCESS) {
-    return ERROR_PFM;
-  }
-
-  link_fd_measure = NULL;
-  pthread_mutex_init(&link_fd_lock, NULL);
-
-  return 0;
+  return platform_status;
 }
 
-int numap_counting_init_measure(struct numap_counting_measure *measure) {
+int numap_session_counting_init_measure(struct numap_session *session, struct numap_counting_measure *measure) {
 
+  measure->session = session;
   measure->nb_nodes = nb_numa_nodes;
   for (int node = 0; node < nb_numa_nodes; node++) {
     measure->is_valid[node] = (numa_node_to_cpu[node] != -1);
@@ -456,34 +294,62 @@ int numap_counting_init_measure(struct numap_counting_measure *measure) {
   return 0;
 }
 
+int numap_counting_init_measure(struct numap_counting_measure *measure) {
+  return numap_session_counting_init_measure(&default_session, measure);
+}
+
+/**
+ * Called each nb_refresh samples of the thread sampled by fd.
+ */
+static void refresh_measure(struct numap_sampling_measure *measure, int fd) {
+  // Lost records have to be counted before the handler releases them
+  int stream;
+  int thread = measure_find_fd(measure, fd, &stream);
+  uint64_t lost = 0;
+  double drain_start = 0;
+  if (measure->adaptive && thread >= 0) {
+    lost = measure->lost_per_tid[thread];
+    period_controller_scan(measure, stream, thread);
+    lost = measure->lost_per_tid[thread] - lost;
+    drain_start = period_controller_now();
+  }
+
+  if (thread >= 0) {
+    // The measure handler, if any, releases the records
+    stream_drain(measure, stream, thread, measure->handler == NULL);
+  }
+  if (measure->handler) {
+    measure->handler(measure, fd);
+  }
+  measure->total_samples += measure->nb_refresh;
+
+  if (measure->adaptive && thread >= 0) {
+    period_controller_update(measure, stream, thread, lost, period_controller_now() - drain_start);
+  }
+
+  // Events of a sweep slot rotated out stay disabled
+  if (thread < 0 || sweep_stream_active(measure, stream, thread)) {
+    ioctl(fd, PERF_EVENT_IOC_REFRESH, measure->nb_refresh);
+  }
+}
+
 void refresh_wrapper_handler(int signum, siginfo_t *info, void* ucontext) {
   if (info->si_code == POLL_HUP) {
     /* TODO: copy the samples */
 
-    int fd = info->si_fd;
-
-    // search for corresponding measure
-    struct link_fd_measure* current_lfm = link_fd_measure;
-    while (current_lfm != NULL && current_lfm->fd != fd) {
-      current_lfm = current_lfm->next;
-    }
-    if (current_lfm == NULL)
-    {
-      fprintf(stderr, "No measure associated with fd %d\n", fd);
-      abort();
-      exit(EXIT_FAILURE);
-    }
-    struct numap_sampling_measure* measure = current_lfm->measure;
-
-    if (measure->handler) {
-      measure->handler(measure, fd);
+    int saved_errno = errno;
+    session_handler_enter();
+    // search for corresponding measure, none for late signals of ended measures
+    struct numap_sampling_measure* measure = session_find_fd(info->si_fd);
+    if (measure != NULL) {
+      refresh_measure(measure, info->si_fd);
     }
-    measure->total_samples += measure->nb_refresh;
-
-    ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, measure->nb_refresh);
+    session_handler_exit();
+    errno = saved_errno;
   }
 }
 
+
 int numap_sampling_set_measure_handler(struct numap_sampling_measure *measure, void(*handler)(struct numap_sampling_measure*,int), int nb_refresh)
 {
   // Has to be called before the measure starts
@@ -520,10 +386,12 @@ int __numap_counting_start(struct numap_counting_measure *measure, struct perf_e
     if (measure->is_valid[node]) {
       measure->fd_reads[node] = perf_event_open(pe_attr_read, -1, numa_node_to_cpu[node], -1, 0);
       if (measure->fd_reads[node] == -1) {
+        last_sys_errno = errno;
         return ERROR_PERF_EVENT_OPEN;
       }
       measure->fd_writes[node] = perf_event_open(pe_attr_write, -1, numa_node_to_cpu[node], -1, 0);
       if (measure->fd_writes[node] == -1) {
+        last_sys_errno = errno;
         return ERROR_PERF_EVENT_OPEN;
       }
     }
@@ -554,18 +422,28 @@ int numap_counting_start(struct numap_counting_measure *measure) {
   arg.attr = &pe_attr_read;
   char *fstr;
   arg.fstr = &fstr;
-  curr_err = pfm_get_os_event_encoding(current_archi->counting_read_event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
-  if (curr_err != PFM_SUCCESS) {
+  last_pfm_err = pfm_get_os_event_encoding(current_archi->counting_read_event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
+  if (last_pfm_err != PFM_SUCCESS) {
     return ERROR_PFM;
   }
 
   // Set attribute parameter for counting writes using pfmlib
   struct perf_event_attr pe_attr_write;
+  memset(&pe_attr_write, 0, sizeof(pe_attr_write));
+  pe_attr_write.size = sizeof(pe_attr_write);
+  arg.attr = &pe_attr_write;
+  last_pfm_err = pfm_get_os_event_encoding(current_archi->counting_write_event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
+  if (last_pfm_err != PFM_SUCCESS) {
+    return ERROR_PFM;
+  }
 
   // Other parameters
   pe_attr_read.disabled = 1;
   pe_attr_read.exclude_kernel = 1;
   pe_attr_read.exclude_hv = 1;
+  pe_attr_write.disabled = 1;
+  pe_attr_write.exclude_kernel = 1;
+  pe_attr_write.exclude_hv = 1;
 
   return __numap_counting_start(measure, &pe_attr_read, &pe_attr_write);
 }
@@ -599,39 +477,137 @@ int numap_counting_stop(struct numap_counting_measure *measure) {
   return 0;
 }
 
-int numap_sampling_init_measure(struct numap_sampling_measure *measure, int nb_threads, int sampling_rate, int mmap_pages_count) {
+int numap_counting_print(struct numap_counting_measure *measure, double seconds) {
+  struct numap_calibration *calibration = calibration_get();
+  for (int node = 0; node < measure->nb_nodes; node++) {
+    if (!measure->is_valid[node]) {
+      continue;
+    }
+    printf("Node %d: %-12lld reads %-12lld writes", node, measure->reads_count[node], measure->writes_count[node]);
+    if (calibration != NULL && seconds > 0) {
+      // Each memory controller request transfers one cache line
+      double bytes = 64.0 * (measure->reads_count[node] + measure->writes_count[node]);
+      printf(" %0.3f%% of measured bandwidth", numap_calibration_utilization(calibration, node, bytes, seconds));
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+static void init_thread(struct numap_sampling_measure *measure, int thread) {
+  for (int stream = 0; stream < NUMAP_MAX_STREAMS; stream++) {
+    *measure_fd(measure, stream, thread) = 0;
+    *measure_ring(measure, stream, thread) = NULL;
+  }
+  measure->period_per_tid[thread] = measure->sampling_rate;
+  measure->lost_per_tid[thread] = 0;
+  memset(&measure->thread_configs[thread], 0, sizeof(struct numap_thread_config));
+  measure->thread_accesses[thread] = 0;
+  measure->mmap_len_per_tid[thread] = 0;
+}
+
+int numap_session_sampling_init_measure(struct numap_session *session, struct numap_sampling_measure *measure,
+                                        int nb_threads, int sampling_rate, int mmap_pages_count) {
 
   int thread;
+  measure->session = session;
   measure->started = 0;
+  measure->replay = 0;
+  measure->topology = NULL;
   measure->page_size = (size_t)sysconf(_SC_PAGESIZE);
   measure->mmap_pages_count = mmap_pages_count;
   measure->mmap_len = measure->page_size + measure->page_size * measure->mmap_pages_count;
+  measure->wanted_pages_count = mmap_pages_count;
+  measure->expected_samples_per_sec = 0;
   measure->nb_threads = nb_threads;
   measure->sampling_rate = sampling_rate;
+  measure->sample_type = 0;
+  measure->adaptive = 0;
+  measure->nb_streams = 1;
+  measure->streams[0].core_type = NUMAP_CORE_ANY;
+  measure->streams[0].access = NUMAP_ACCESS_READ;
+  measure->streams[0].slot = 0;
+  measure->streams[0].ldlat = 0;
+  measure->ldlat = 0;
+  measure->nb_sweep = 0;
+  measure->sweep_timer_armed = 0;
   for (thread = 0; thread < measure->nb_threads; thread++) {
-    measure->fd_per_tid[thread] = 0;
-    measure->metadata_pages_per_tid[thread] = 0;
+    init_thread(measure, thread);
   }
+  measure->attach_pid = 0;
+  measure->attach_missed = 0;
+  measure->attach_fds = NULL;
+  measure->nb_attach_fds = 0;
+  measure->attach_fds_capacity = 0;
+  measure->collector_running = 0;
   measure->handler = NULL;
+  measure->sketch = NULL;
+  measure->live = NULL;
+  measure->regions = NULL;
   measure->total_samples = 0;
-  set_signal_handler(refresh_wrapper_handler);
   measure->nb_refresh = 1000; // default refresh 
  
-  return 0;
+  return session_install_signal_handler(session, refresh_wrapper_handler);
+}
+
+int numap_sampling_init_measure(struct numap_sampling_measure *measure, int nb_threads, int sampling_rate, int mmap_pages_count) {
+  return numap_session_sampling_init_measure(&default_session, measure, nb_threads, sampling_rate, mmap_pages_count);
 }
 
 
+/**
+ * Whether tid is a thread of this process. The refresh signal of the
+ * threads of other processes is sent to this process instead, as they
+ * cannot run its handler.
+ */
+static int is_own_thread(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d", (int)tid);
+  return access(path, F_OK) == 0;
+}
+
+/**
+ * Enables the event fd of measure. Events are refreshed each nb_refresh
+ * samples by the signal handler, except in attach mode where the
+ * collector thread drains them without stopping them.
+ */
+void event_enable(struct numap_sampling_measure *measure, long fd) {
+  if (measure->attach_pid == 0) {
+    ioctl(fd, PERF_EVENT_IOC_REFRESH, measure->nb_refresh);
+  }
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void resume_thread(struct numap_sampling_measure *measure, int thread) {
+  pid_t owner = is_own_thread(measure->tids[thread]) ? measure->tids[thread] : getpid();
+  for (int stream = 0; stream < measure->nb_streams; stream++) {
+    if (*measure_ring(measure, stream, thread) == NULL) {
+      continue;
+    }
+    long fd = *measure_fd(measure, stream, thread);
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    if (measure->attach_pid == 0) {
+      fcntl(fd, F_SETFL, O_ASYNC|O_NONBLOCK);
+      fcntl(fd, F_SETSIG, SIGIO);
+      fcntl(fd, F_SETOWN, owner);
+    }
+    if (sweep_stream_active(measure, stream, thread)) {
+      event_enable(measure, fd);
+    }
+  }
+}
+
 static int __numap_sampling_resume(struct numap_sampling_measure *measure) {
   int thread;
   for (thread = 0; thread < measure->nb_threads; thread++) {
-    ioctl(measure->fd_per_tid[thread], PERF_EVENT_IOC_RESET, 0);
-    fcntl(measure->fd_per_tid[thread], F_SETFL, O_ASYNC|O_NONBLOCK);
-    fcntl(measure->fd_per_tid[thread], F_SETSIG, SIGIO);
-    fcntl(measure->fd_per_tid[thread], F_SETOWN, measure->tids[thread]);
-    ioctl(measure->fd_per_tid[thread], PERF_EVENT_IOC_REFRESH, measure->nb_refresh);
-    ioctl(measure->fd_per_tid[thread], PERF_EVENT_IOC_ENABLE, 0);
+    resume_thread(measure, thread);
+  }
+  attach_ioctl(measure, PERF_EVENT_IOC_ENABLE);
+  int res = sweep_start(measure);
+  if (res != 0) {
+    return res;
   }
- return 0;
+  return attach_start(measure);
 }
 
 int numap_sampling_resume(struct numap_sampling_measure *measure) {
@@ -647,116 +623,443 @@ int numap_sampling_resume(struct numap_sampling_measure *measure) {
   return __numap_sampling_resume(measure);
 }
 
-int __numap_sampling_start(struct numap_sampling_measure *measure, struct perf_event_attr *pe_attr) {
-
-  /**
-   * Check everything is ok
-   */
-  if (measure->started != 0) {
-    return ERROR_NUMAP_ALREADY_STARTED;
-  } else {
-    measure->started++;
+int measure_find_fd(struct numap_sampling_measure *measure, int fd, int *stream) {
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int s = 0; s < measure->nb_streams; s++) {
+      if (*measure_ring(measure, s, thread) != NULL && *measure_fd(measure, s, thread) == fd) {
+        *stream = s;
+        return thread;
+      }
+    }
   }
+  return -1;
+}
 
-  /**
-   * Open the events for each thread in measure with Linux system call: we do per
-   * thread monitoring by giving the system call the thread id and a
-   * cpu = -1, this way the kernel handles the migration of counters
-   * when threads are migrated. Then we mmap the result.
-   */
+/**
+ * Opens the events of thread in measure with Linux system call: we do per
+ * thread monitoring by giving the system call the thread id and a
+ * cpu = -1, this way the kernel handles the migration of counters
+ * when threads are migrated. Then we mmap the result. On hybrid
+ * processors, each thread has one event per PMU, counting only while
+ * the thread runs on the cores of that PMU.
+ */
+static int open_thread_rings(struct numap_sampling_measure *measure, struct perf_event_attr *pe_attrs, int thread) {
   int cpu = -1;
-  int thread;
-  for (thread = 0; thread < measure->nb_threads; thread++) {
-    if(measure->metadata_pages_per_tid[thread]) {
-      /* Already open, we can skip this one */
+  int per_cpu = measure->attach_pid != 0 && measure->attach_mode == NUMAP_ATTACH_CPUS;
+  if (per_cpu) {
+    cpu = measure->attach_cpus[thread];
+  }
+  if (measure->tids[thread] == THREAD_REMOVED) {
+    return 0;
+  }
+  struct numap_thread_config *config = &measure->thread_configs[thread];
+  for (int stream = 0; stream < measure->nb_streams; stream++) {
+    long *fd = measure_fd(measure, stream, thread);
+    struct perf_event_mmap_page **metadata_page = measure_ring(measure, stream, thread);
+    if(*metadata_page || !thread_stream_opened(measure, stream, thread)) {
+      /* Already open or not sampled by this thread, we can skip this one */
       continue;
     }
 
-    measure->fd_per_tid[thread] = perf_event_open(pe_attr, measure->tids[thread], cpu,
-                          -1, 0);
-    if (measure->fd_per_tid[thread] == -1) {
+    struct perf_event_attr pe_attr = pe_attrs[stream];
+    if (config->sampling_rate != 0) {
+      pe_attr.sample_period = config->sampling_rate;
+    }
+    if (measure->regions != NULL) {
+      // Data mappings, their flags and execs keep the regions up to date
+      pe_attr.mmap_data = 1;
+      pe_attr.mmap2 = 1;
+      pe_attr.comm = 1;
+      pe_attr.comm_exec = 1;
+    }
+    measure->period_per_tid[thread] = pe_attr.sample_period;
+    measure->mmap_len_per_tid[thread] = budget_thread_ring_len(measure, thread);
+    // Per-cpu events can be mapped when inherited, so new threads are sampled too
+    pe_attr.inherit = per_cpu;
+    *fd = perf_event_open(&pe_attr, measure->tids[thread], cpu, -1, 0);
+    if (*fd == -1) {
+      last_sys_errno = errno;
       return ERROR_PERF_EVENT_OPEN;
     }
-    measure->metadata_pages_per_tid[thread] = mmap(NULL, measure->mmap_len, PROT_WRITE, MAP_SHARED, measure->fd_per_tid[thread], 0);
-    if (measure->metadata_pages_per_tid[thread] == MAP_FAILED) {
-      if (errno == EPERM) {
-        fprintf(stderr, "Permission error mapping pages.\n"
-        "Consider increasing /proc/sys/kernel/perf_event_mlock_kb,\n"
-        "(mmap length parameter = %zd > perf_event_mlock_kb = %u)\n", measure->mmap_len, (perf_event_mlock_kb * 1024));
-      } else {
-        fprintf (stderr, "Couldn't mmap file descriptor: %s - errno = %d\n",
-        strerror (errno), errno);
-      }
-      exit (EXIT_FAILURE);
+    struct perf_event_mmap_page *ring = mmap(NULL, measure_ring_len(measure, thread), PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (ring == MAP_FAILED) {
+      last_sys_errno = errno;
+      close(*fd);
+      return errno == EPERM ? ERROR_NUMAP_MLOCK : ERROR_NUMAP_MMAP;
+    }
+    *metadata_page = ring;
+    measure->drained_per_stream[stream][thread] = 0;
+    budget_acquire(measure_ring_len(measure, thread));
+    int res = session_register_fd(measure->session, *fd, measure);
+    if (res == 0 && per_cpu) {
+      res = attach_open_cpu_events(measure, &pe_attr, stream, thread);
+    }
+    if (res != 0) {
+      return res;
     }
-    struct link_fd_measure* new_lfm = malloc(sizeof(struct link_fd_measure));
-    new_lfm->fd = measure->fd_per_tid[thread];
-    new_lfm->measure = measure;
+  }
+  return 0;
+}
 
-    pthread_mutex_lock(&link_fd_lock);
-    new_lfm->next = link_fd_measure;
-    link_fd_measure = new_lfm;
-    pthread_mutex_unlock(&link_fd_lock);
+static int open_rings(struct numap_sampling_measure *measure, struct perf_event_attr *pe_attrs) {
+  int thread;
+  for (thread = 0; thread < measure->nb_threads; thread++) {
+    int res = open_thread_rings(measure, pe_attrs, thread);
+    if (res != 0) {
+      return res;
+    }
   }
-  __numap_sampling_resume(measure);
-  
   return 0;
 }
 
-int numap_sampling_read_supported() {
+/**
+ * Unmaps the rings and closes the events of thread in measure.
+ */
+static void close_thread_rings(struct numap_sampling_measure *measure, int thread) {
+  for (int stream = 0; stream < measure->nb_streams; stream++) {
+    struct perf_event_mmap_page **metadata_page = measure_ring(measure, stream, thread);
+    if (*metadata_page == NULL) {
+      // never opened
+      continue;
+    }
+    munmap(*metadata_page, measure_ring_len(measure, thread));
+    budget_release(measure_ring_len(measure, thread));
+    close(*measure_fd(measure, stream, thread));
+    *metadata_page = NULL;
+  }
+}
 
-  if (strcmp(current_archi->sampling_read_event, NOT_SUPPORTED) == 0) {
-    return 0;
+/**
+ * Unmaps the rings and closes the events of measure.
+ */
+static void close_rings(struct numap_sampling_measure *measure) {
+  // Late signals of this measure are ignored from now on
+  session_unregister_measure(measure->session, measure);
+
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    close_thread_rings(measure, thread);
   }
-  return 1;
+  attach_close(measure);
 }
 
-int numap_sampling_read_start_generic(struct numap_sampling_measure *measure, uint64_t sample_type) {
+int __numap_sampling_start(struct numap_sampling_measure *measure, struct perf_event_attr *pe_attrs,
+                           struct numap_stream *streams, int nb_streams) {
 
-  // Checks that read sampling is supported before calling pfm
-  if (!numap_sampling_read_supported()) {
-    return ERROR_NUMAP_READ_SAMPLING_ARCH_NOT_SUPPORTED;
+  /**
+   * Check everything is ok
+   */
+  if (measure->replay) {
+    return ERROR_NUMAP_REPLAY;
   }
-  
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  } else {
+    measure->started++;
+  }
+  measure->nb_streams = nb_streams;
+  memcpy(measure->streams, streams, nb_streams * sizeof(struct numap_stream));
+  memcpy(measure->stream_attrs, pe_attrs, nb_streams * sizeof(struct perf_event_attr));
+
+  int nb_open = 0;
+  int nb_rings = 0;
+  size_t fixed_bytes = 0;
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    size_t thread_len = budget_thread_ring_len(measure, thread);
+    for (int stream = 0; stream < nb_streams; stream++) {
+      nb_open += *measure_ring(measure, stream, thread) != NULL;
+      if (!thread_stream_opened(measure, stream, thread)) {
+        continue;
+      }
+      if (thread_len != 0) {
+        fixed_bytes += thread_len;
+      } else {
+        nb_rings++;
+      }
+    }
+  }
+  int res;
+  if (nb_open == 0) {
+    // Rings are sized once, when none is mapped yet, as they share mmap_len
+    budget_size_rings(measure, nb_rings, fixed_bytes);
+    while ((res = open_rings(measure, pe_attrs)) == ERROR_NUMAP_MLOCK && measure->mmap_pages_count > 1) {
+      // The kernel charges more than we accounted for (e.g. other processes of the user)
+      close_rings(measure);
+      budget_set_pages(measure, measure->mmap_pages_count / 2);
+    }
+  } else {
+    res = open_rings(measure, pe_attrs);
+  }
+  if (res != 0) {
+    return res;
+  }
+  if (measure->adaptive) {
+    period_controller_start(measure);
+  }
+  // Mappings created from now on are reported by the events
+  for (int thread = 0; thread < measure->nb_threads && measure->regions != NULL; thread++) {
+    if (measure->tids[thread] == THREAD_REMOVED) {
+      continue;
+    }
+    res = numap_regions_seed(measure->regions, measure->tids[thread]);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return __numap_sampling_resume(measure);
+}
+
+/**
+ * Adds thread tid to measure. When the measure is started, the events
+ * of the thread are opened and enabled right away, with the access
+ * kinds of the streams of the measure, so that a thread created by a
+ * traced process while it is stopped loses none of its samples.
+ */
+int numap_sampling_add_thread(struct numap_sampling_measure *measure, pid_t tid) {
+  if (measure->replay) {
+    return ERROR_NUMAP_REPLAY;
+  }
+  int thread = measure->nb_threads;
+  if (thread >= MAX_NB_THREADS) {
+    // The slot of a removed thread, if any
+    for (thread = 0; thread < measure->nb_threads && measure->tids[thread] != THREAD_REMOVED; thread++);
+    if (thread == measure->nb_threads) {
+      return ERROR_NUMAP_TOO_MANY_THREADS;
+    }
+  }
+  int reused = thread < measure->nb_threads;
+  init_thread(measure, thread);
+  measure->tids[thread] = tid;
+  if (!measure->started) {
+    measure->nb_threads += !reused;
+    return 0;
+  }
+  for (int stream = 0; stream < measure->nb_streams; stream++) {
+    measure->thread_accesses[thread] |= 1 << measure->streams[stream].access;
+  }
+  period_controller_start_thread(measure, thread, period_controller_now());
+  measure->nb_threads += !reused;
+  int res = open_thread_rings(measure, measure->stream_attrs, thread);
+  if (res == 0 && measure->regions != NULL) {
+    res = numap_regions_seed(measure->regions, tid);
+  }
+  // The events opened before a failure are sampled all the same
+  resume_thread(measure, thread);
+  return res;
+}
+
+/**
+ * Removes thread tid from measure: its events are closed, its rings
+ * unmapped and its slot is given to the next thread added, so that a
+ * measure following short-lived threads is not limited to the first
+ * MAX_NB_THREADS of them. The records left in its rings are lost: drain
+ * them first (e.g. with numap_trace_writer_append) once it exited.
+ */
+int numap_sampling_remove_thread(struct numap_sampling_measure *measure, pid_t tid) {
+  if (measure->replay) {
+    return ERROR_NUMAP_REPLAY;
+  }
+  if (measure->attach_pid != 0 && measure->attach_mode == NUMAP_ATTACH_CPUS) {
+    // Slots are cpus
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  int thread;
+  for (thread = 0; thread < measure->nb_threads && measure->tids[thread] != tid; thread++);
+  if (thread == measure->nb_threads || tid == THREAD_REMOVED) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  for (int stream = 0; stream < measure->nb_streams; stream++) {
+    if (*measure_ring(measure, stream, thread) != NULL) {
+      // Late signals of the event are ignored from now on
+      session_unregister_fd(measure->session, measure, *measure_fd(measure, stream, thread));
+    }
+  }
+  close_thread_rings(measure, thread);
+  measure->tids[thread] = THREAD_REMOVED;
+  return 0;
+}
+
+/**
+ * Fills pe_attr to sample event on the PMU of type pmu_type (-1 for the
+ * default PMU).
+ */
+static int sampling_attr(struct numap_sampling_measure *measure, const char *event, int precise_ip, int pmu_type,
+                         uint64_t sample_type, struct perf_event_attr *pe_attr) {
+
   // Set attribute parameter for perf_event_open using pfmlib
-  struct perf_event_attr pe_attr;
-  memset(&pe_attr, 0, sizeof(pe_attr));
-  pe_attr.size = sizeof(pe_attr);
+  memset(pe_attr, 0, sizeof(struct perf_event_attr));
+  pe_attr->size = sizeof(struct perf_event_attr);
   pfm_perf_encode_arg_t arg;
   memset(&arg, 0, sizeof(arg));
   arg.size = sizeof(pfm_perf_encode_arg_t);
-  arg.attr = &pe_attr;
+  arg.attr = pe_attr;
   char *fstr;
   arg.fstr = &fstr;
 
-  curr_err = pfm_get_os_event_encoding(current_archi->sampling_read_event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
-  if (curr_err != PFM_SUCCESS) {
+  last_pfm_err = pfm_get_os_event_encoding(event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
+  if (last_pfm_err != PFM_SUCCESS) {
     return ERROR_PFM;
   }
+  if (pmu_type >= 0 && pe_attr->type == PERF_TYPE_RAW) {
+    pe_attr->type = pmu_type;
+  }
 
   // Sampling parameters
-  pe_attr.sample_period = measure->sampling_rate;
-  pe_attr.sample_type = sample_type;
-  pe_attr.mmap = 1;
-  pe_attr.task = 1;
-  pe_attr.precise_ip = 2;
+  pe_attr->sample_period = measure->sampling_rate;
+  pe_attr->sample_type = sample_type;
+  pe_attr->sample_regs_user = (sample_type & PERF_SAMPLE_REGS_USER) ? NUMAP_SAMPLE_REGS_USER : 0;
+  pe_attr->mmap = 1;
+  pe_attr->task = 1;
+  pe_attr->precise_ip = precise_ip;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
-  pe_attr.use_clockid=1;
-  pe_attr.clockid = CLOCK_MONOTONIC_RAW;
+  pe_attr->use_clockid=1;
+  pe_attr->clockid = CLOCK_MONOTONIC_RAW;
 #else
 #warning NUMAP: using clockid is not possible on kernel version < 4.1. This feature will be disabled.
 #endif
   // Other parameters
-  pe_attr.disabled = 1;
-  pe_attr.exclude_kernel = 1;
-  pe_attr.exclude_hv = 1;
+  pe_attr->disabled = 1;
+  pe_attr->exclude_kernel = 1;
+  pe_attr->exclude_hv = 1;
+  return 0;
+}
 
-  return __numap_sampling_start(measure, &pe_attr);
+/**
+ * Writes event to buffer with its load latency threshold set to ldlat
+ * (kept as is when ldlat is 0).
+ */
+static int event_with_ldlat(const char *event, unsigned int ldlat, char *buffer, size_t len) {
+  if (ldlat == 0) {
+    snprintf(buffer, len, "%s", event);
+    return 0;
+  }
+  const char *threshold = strstr(event, "ldlat=");
+  if (threshold == NULL) {
+    return ERROR_NUMAP_LDLAT;
+  }
+  const char *end = threshold + strlen("ldlat=");
+  while (*end >= '0' && *end <= '9') {
+    end++;
+  }
+  snprintf(buffer, len, "%.*sldlat=%u%s", (int)(threshold - event), event, ldlat, end);
+  return 0;
+}
 
+/**
+ * Adds to streams the events sampling access: the event of the
+ * architecture, and its atom event on the E-cores of hybrid processors.
+ * Loads are opened once per load latency threshold of the sweep, or
+ * once per threshold used by the threads (see thread_ldlats).
+ */
+static int add_streams(struct numap_sampling_measure *measure, uint64_t sample_type, int access,
+                       struct perf_event_attr *pe_attrs, struct numap_stream *streams, int *nb_streams) {
+  int hybrid = current_archi->atom_pmu_type >= 0;
+  int loads = access == NUMAP_ACCESS_READ;
+  const char *event = loads ? current_archi->sampling_read_event : current_archi->sampling_write_event;
+  int precise_ip = loads ? current_archi->sampling_read_precise_ip : current_archi->sampling_write_precise_ip;
+  const char *atom_event = loads ? current_archi->sampling_read_atom_event : current_archi->sampling_write_atom_event;
+  int atom_precise_ip = loads ? current_archi->sampling_read_atom_precise_ip : current_archi->sampling_write_atom_precise_ip;
+  unsigned int ldlats[NUMAP_MAX_STREAMS];
+  int nb_slots = 1;
+  char slot_event[256];
+
+  if (loads && measure->nb_sweep > 0) {
+    nb_slots = measure->nb_sweep;
+    memcpy(ldlats, measure->sweep_ldlat, nb_slots * sizeof(unsigned int));
+  } else if (loads) {
+    nb_slots = thread_ldlats(measure, ldlats);
+    if (nb_slots < 0) {
+      return nb_slots;
+    }
+  }
+  for (int slot = 0; slot < nb_slots; slot++) {
+    unsigned int ldlat = loads ? ldlats[slot] : 0;
+    if (*nb_streams + (hybrid ? 2 : 1) > NUMAP_MAX_STREAMS) {
+      return ERROR_NUMAP_INVALID_ARGUMENT;
+    }
+    int res = event_with_ldlat(event, ldlat, slot_event, sizeof(slot_event));
+    if (res != 0) {
+      return res;
+    }
+    res = sampling_attr(measure, slot_event, precise_ip, current_archi->core_pmu_type, sample_type, &pe_attrs[*nb_streams]);
+    if (res != 0) {
+      return res;
+    }
+    struct numap_stream *stream = &streams[(*nb_streams)++];
+    stream->core_type = hybrid ? NUMAP_CORE_P : NUMAP_CORE_ANY;
+    stream->access = access;
+    stream->slot = !loads ? -1 : (measure->nb_sweep > 0 ? slot : 0);
+    stream->ldlat = ldlat;
+    // E-core events without a threshold are left out rather than mixed with the thresholded ones
+    if (hybrid && strcmp(atom_event, NOT_SUPPORTED) != 0 &&
+        event_with_ldlat(atom_event, ldlat, slot_event, sizeof(slot_event)) == 0) {
+      res = sampling_attr(measure, slot_event, atom_precise_ip, current_archi->atom_pmu_type, sample_type,
+                          &pe_attrs[*nb_streams]);
+      if (res != 0) {
+        return res;
+      }
+      streams[*nb_streams] = *stream;
+      streams[(*nb_streams)++].core_type = NUMAP_CORE_E;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Starts sampling loads and/or stores.
+ */
+static int sampling_start(struct numap_sampling_measure *measure, uint64_t sample_type, int reads, int writes) {
+  struct perf_event_attr pe_attrs[NUMAP_MAX_STREAMS];
+  struct numap_stream streams[NUMAP_MAX_STREAMS];
+  int nb_streams = 0;
+  int res = 0;
+
+  if (measure->adaptive) {
+    // Each sample records the period it was taken with
+    sample_type |= PERF_SAMPLE_PERIOD;
+  }
+  if (measure->regions != NULL && NUMAP_SAMPLE_REGS_USER != 0) {
+    // The stack pointer of each sample finds the stacks of the threads
+    sample_type |= PERF_SAMPLE_REGS_USER;
+  }
+  res = thread_configs_start(measure, &sample_type, &reads, &writes);
+  if (res != 0) {
+    return res;
+  }
+  if (reads) {
+    res = add_streams(measure, sample_type, NUMAP_ACCESS_READ, pe_attrs, streams, &nb_streams);
+  }
+  if (res == 0 && writes) {
+    res = add_streams(measure, sample_type, NUMAP_ACCESS_WRITE, pe_attrs, streams, &nb_streams);
+  }
+  if (res != 0) {
+    return res;
+  }
+  measure->sample_type = sample_type;
+  return __numap_sampling_start(measure, pe_attrs, streams, nb_streams);
+}
+
+int numap_sampling_read_supported() {
+
+  if (current_archi == NULL) {
+    return 0;
+  }
+  if (strcmp(current_archi->sampling_read_event, NOT_SUPPORTED) == 0) {
+    return 0;
+  }
+  return 1;
+}
+
+int numap_sampling_read_start_generic(struct numap_sampling_measure *measure, uint64_t sample_type) {
+
+  // Checks that read sampling is supported before calling pfm
+  if (!numap_sampling_read_supported()) {
+    return ERROR_NUMAP_READ_SAMPLING_ARCH_NOT_SUPPORTED;
+  }
+  return sampling_start(measure, sample_type, 1, 0);
 }
   
 int numap_sampling_read_start(struct numap_sampling_measure *measure) {
-  return numap_sampling_read_start_generic(measure, PERF_SAMPLE_IP | PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC);
+  return numap_sampling_read_start_generic(measure, NUMAP_DEFAULT_SAMPLE_TYPE);
 }
 
 int numap_sampling_read_stop(struct numap_sampling_measure *measure) {
@@ -765,17 +1068,41 @@ int numap_sampling_read_stop(struct numap_sampling_measure *measure) {
   if (measure->started == 0) {
     return ERROR_NUMAP_STOP_BEFORE_START;
   } else {
+    // Threads found by the collector from now on would not be opened
+    attach_stop(measure);
     measure->started = 0;
   }
+  sweep_stop(measure);
+  attach_ioctl(measure, PERF_EVENT_IOC_DISABLE);
   int thread;
   for (thread = 0; thread < measure->nb_threads; thread++) {
-    ioctl(measure->fd_per_tid[thread], PERF_EVENT_IOC_DISABLE, 0);
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      if (*measure_ring(measure, stream, thread) != NULL) {
+        ioctl(*measure_fd(measure, stream, thread), PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+  }
+  // Samples since the last refresh, once no stream runs anymore. They
+  // stay in the rings for numap_sampling_print, the analyses and
+  // numap_sampling_save. A refresh signal raised before that may still
+  // be pending: it is delivered after the drains, which hold the locks
+  // of the sketch, live statistics and regions the handler takes.
+  sigset_t mask;
+  sigio_block(&mask);
+  for (thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      stream_drain(measure, stream, thread, 0);
+    }
   }
+  sigio_restore(&mask);
   return 0;
 }
 
 int numap_sampling_write_supported() {
 
+  if (current_archi == NULL) {
+    return 0;
+  }
   if (strcmp(current_archi->sampling_write_event, NOT_SUPPORTED) == 0) {
     return 0;
   }
@@ -787,59 +1114,60 @@ int numap_sampling_write_start_generic(struct numap_sampling_measure *measure, u
   if (!numap_sampling_write_supported()) {
     return ERROR_NUMAP_WRITE_SAMPLING_ARCH_NOT_SUPPORTED;
   }
+  return sampling_start(measure, sample_type, 0, 1);
+}
 
-  // Set attribute parameter for perf_event_open using pfmlib
-  struct perf_event_attr pe_attr;
-  memset(&pe_attr, 0, sizeof(pe_attr));
-  pe_attr.size = sizeof(pe_attr);
-  pfm_perf_encode_arg_t arg;
-  memset(&arg, 0, sizeof(arg));
-  arg.size = sizeof(pfm_perf_encode_arg_t);
-  arg.attr = &pe_attr;
-  char *fstr;
-  arg.fstr = &fstr;  
-  curr_err = pfm_get_os_event_encoding(current_archi->sampling_write_event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
-  if (curr_err != PFM_SUCCESS) {
-    return ERROR_PFM;
-  }
-
-  // Sampling parameters
-  pe_attr.sample_period = measure->sampling_rate;
-  pe_attr.sample_type = sample_type;
-  pe_attr.mmap = 1;
-  pe_attr.task = 1;
-  pe_attr.precise_ip = 2;
 
-  // Other parameters
-  pe_attr.disabled = 1;
-  pe_attr.exclude_kernel = 1;
-  pe_attr.exclude_hv = 1;
+int numap_sampling_write_start(struct numap_sampling_measure *measure) {
+  return numap_sampling_write_start_generic(measure, NUMAP_DEFAULT_SAMPLE_TYPE);
+}
 
-  return __numap_sampling_start(measure, &pe_attr);
+int numap_sampling_write_stop(struct numap_sampling_measure *measure) {
+  return numap_sampling_read_stop(measure);
 }
 
+/**
+ * Samples loads and stores together, each thread having a stream for
+ * each: a single run of the workload gives its whole read/write
+ * profile. Samples tell which one they come from in sample->access.
+ */
+int numap_sampling_read_write_start_generic(struct numap_sampling_measure *measure, uint64_t sample_type) {
+  if (!numap_sampling_read_supported()) {
+    return ERROR_NUMAP_READ_SAMPLING_ARCH_NOT_SUPPORTED;
+  }
+  if (!numap_sampling_write_supported()) {
+    return ERROR_NUMAP_WRITE_SAMPLING_ARCH_NOT_SUPPORTED;
+  }
+  return sampling_start(measure, sample_type, 1, 1);
+}
 
-int numap_sampling_write_start(struct numap_sampling_measure *measure) {
-  return numap_sampling_write_start_generic(measure, PERF_SAMPLE_IP | PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC);
+int numap_sampling_read_write_start(struct numap_sampling_measure *measure) {
+  return numap_sampling_read_write_start_generic(measure, NUMAP_ANALYSIS_SAMPLE_TYPE);
 }
 
-int numap_sampling_write_stop(struct numap_sampling_measure *measure) {
+int numap_sampling_read_write_stop(struct numap_sampling_measure *measure) {
   return numap_sampling_read_stop(measure);
 }
 
 int numap_sampling_end(struct numap_sampling_measure *measure) {
-  int thread;
-
-  struct link_fd_measure* current_lfm;
-  while (link_fd_measure != NULL) {
-    current_lfm = link_fd_measure;
-    link_fd_measure = link_fd_measure->next;
-    free(current_lfm);
+  attach_stop(measure);
+  if (measure->sweep_timer_armed) {
+    // ended without being stopped
+    measure->started = 0;
+    sweep_stop(measure);
   }
-
-  for (thread = 0; thread < measure->nb_threads; thread++) {
-    munmap(measure->metadata_pages_per_tid[thread], measure->mmap_len);
-    close(measure->fd_per_tid[thread]);
+  if (!measure->replay) {
+    close_rings(measure);
+    return 0;
+  }
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      struct perf_event_mmap_page **metadata_page = measure_ring(measure, stream, thread);
+      free(*metadata_page);
+      *metadata_page = NULL;
+    }
   }
+  topology_free(measure->topology);
+  measure->topology = NULL;
   return 0;
 }
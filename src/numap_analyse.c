@@ -1,7 +1,113 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <linux/version.h>
 
 #include "numap.h"
+#include "numap_internal.h"
+
+int u64_map_init(struct u64_map *map, size_t capacity) {
+  size_t real_capacity = 16;
+  while (real_capacity < 2 * capacity) {
+    real_capacity *= 2;
+  }
+  map->keys = malloc(real_capacity * sizeof(uint64_t));
+  map->values = malloc(real_capacity * sizeof(uint32_t));
+  if (map->keys == NULL || map->values == NULL) {
+    free(map->keys);
+    free(map->values);
+    return ERROR_NUMAP_MALLOC;
+  }
+  memset(map->values, 0xff, real_capacity * sizeof(uint32_t));
+  map->capacity = real_capacity;
+  map->count = 0;
+  return 0;
+}
+
+void u64_map_free(struct u64_map *map) {
+  free(map->keys);
+  free(map->values);
+  map->keys = NULL;
+  map->values = NULL;
+  map->capacity = 0;
+  map->count = 0;
+}
+
+static inline size_t u64_map_hash(uint64_t key, size_t capacity) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key & (capacity - 1);
+}
+
+int64_t u64_map_find(struct u64_map *map, uint64_t key) {
+  size_t slot = u64_map_hash(key, map->capacity);
+  while (map->values[slot] != UINT32_MAX) {
+    if (map->keys[slot] == key) {
+      return map->values[slot];
+    }
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  return -1;
+}
+
+static int u64_map_grow(struct u64_map *map) {
+  struct u64_map bigger;
+  if (u64_map_init(&bigger, map->capacity) != 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  for (size_t slot = 0; slot < map->capacity; slot++) {
+    if (map->values[slot] != UINT32_MAX) {
+      size_t new_slot = u64_map_hash(map->keys[slot], bigger.capacity);
+      while (bigger.values[new_slot] != UINT32_MAX) {
+        new_slot = (new_slot + 1) & (bigger.capacity - 1);
+      }
+      bigger.keys[new_slot] = map->keys[slot];
+      bigger.values[new_slot] = map->values[slot];
+    }
+  }
+  bigger.count = map->count;
+  u64_map_free(map);
+  *map = bigger;
+  return 0;
+}
+
+int64_t u64_map_get(struct u64_map *map, uint64_t key, int *inserted) {
+  if (2 * (map->count + 1) > map->capacity) {
+    if (u64_map_grow(map) != 0) {
+      return -1;
+    }
+  }
+  size_t slot = u64_map_hash(key, map->capacity);
+  while (map->values[slot] != UINT32_MAX) {
+    if (map->keys[slot] == key) {
+      *inserted = 0;
+      return map->values[slot];
+    }
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  map->keys[slot] = key;
+  map->values[slot] = map->count;
+  *inserted = 1;
+  return map->count++;
+}
+
+int array_reserve(void **array, size_t *capacity, size_t count, size_t elem_size) {
+  if (count <= *capacity) {
+    return 0;
+  }
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < count) {
+    new_capacity *= 2;
+  }
+  void *new_array = realloc(*array, new_capacity * elem_size);
+  if (new_array == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return 0;
+}
 
 int is_served_by_local_cache1(union perf_mem_data_src data_src) {
   if (data_src.mem_lvl & PERF_MEM_LVL_HIT) {
@@ -191,6 +297,223 @@ char *get_data_src_level(union perf_mem_data_src data_src) {
   return res;
 }
 
+int ring_walk(struct perf_event_mmap_page *metadata_page, size_t page_size, size_t mmap_len,
+              uint64_t from, uint64_t to, ring_record_fn record, void *arg) {
+  uint8_t *data = (uint8_t *)metadata_page;
+  uint64_t data_size;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+  if (metadata_page->data_size != 0) {
+    data += metadata_page->data_offset;
+    data_size = metadata_page->data_size;
+  } else
+#endif
+  {
+    data += page_size;
+    data_size = mmap_len - page_size;
+  }
+  // Records are at most 64KB long (the size field of the header is 16 bits)
+  uint64_t copy[65536 / sizeof(uint64_t)];
+  uint64_t pos = from;
+  while (pos < to) {
+    struct perf_event_header *header = (struct perf_event_header *)(data + (pos % data_size));
+    if (header->size == 0) {
+      fprintf(stderr, "Error: invalid header size = 0\n");
+      return -1;
+    }
+    uint64_t offset = pos % data_size;
+    if (offset + header->size > data_size) {
+      size_t first_part = data_size - offset;
+      memcpy(copy, header, first_part);
+      memcpy((uint8_t *)copy + first_part, data, header->size - first_part);
+      header = (struct perf_event_header *)copy;
+    }
+    int res = record(header, arg);
+    if (res != 0) {
+      return res;
+    }
+    pos += header->size;
+  }
+  return 0;
+}
+
+int numap_sample_decode(uint64_t sample_type, struct perf_event_header *header, struct numap_sample *sample) {
+  uint64_t unsupported = PERF_SAMPLE_READ | PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_STACK_USER;
+  if (NUMAP_SAMPLE_REGS_USER == 0) {
+    unsupported |= PERF_SAMPLE_REGS_USER;
+  }
+  if (header->type != PERF_RECORD_SAMPLE || (sample_type & unsupported)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  uint8_t *p = (uint8_t *)header + sizeof(struct perf_event_header);
+  uint8_t *end = (uint8_t *)header + header->size;
+  memset(sample, 0, sizeof(struct numap_sample));
+  sample->sample_type = sample_type;
+
+#define NEXT_U64(dst) do {                      \
+    if (p + sizeof(uint64_t) > end) {           \
+      return ERROR_NUMAP_SAMPLE_TYPE;           \
+    }                                           \
+    memcpy(&(dst), p, sizeof(uint64_t));        \
+    p += sizeof(uint64_t);                      \
+  } while (0)
+
+  uint64_t value;
+  if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+    NEXT_U64(value);
+  }
+  if (sample_type & PERF_SAMPLE_IP) {
+    NEXT_U64(sample->ip);
+  }
+  if (sample_type & PERF_SAMPLE_TID) {
+    NEXT_U64(value);
+    sample->pid = (uint32_t)value;
+    sample->tid = (uint32_t)(value >> 32);
+  }
+  if (sample_type & PERF_SAMPLE_TIME) {
+    NEXT_U64(sample->time);
+  }
+  if (sample_type & PERF_SAMPLE_ADDR) {
+    NEXT_U64(sample->addr);
+  }
+  if (sample_type & PERF_SAMPLE_ID) {
+    NEXT_U64(value);
+  }
+  if (sample_type & PERF_SAMPLE_STREAM_ID) {
+    NEXT_U64(value);
+  }
+  if (sample_type & PERF_SAMPLE_CPU) {
+    NEXT_U64(value);
+    sample->cpu = (uint32_t)value;
+  }
+  if (sample_type & PERF_SAMPLE_PERIOD) {
+    NEXT_U64(sample->period);
+  }
+  if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+    NEXT_U64(sample->nb_callchain);
+    if (sample->nb_callchain > (uint64_t)(end - p) / sizeof(uint64_t)) {
+      return ERROR_NUMAP_SAMPLE_TYPE;
+    }
+    sample->callchain = (const uint64_t *)p;
+    p += sample->nb_callchain * sizeof(uint64_t);
+  }
+  if (sample_type & PERF_SAMPLE_RAW) {
+    uint32_t raw_size;
+    if (p + sizeof(uint32_t) > end) {
+      return ERROR_NUMAP_SAMPLE_TYPE;
+    }
+    memcpy(&raw_size, p, sizeof(uint32_t));
+    // raw data is padded so that the next field is 8 bytes aligned
+    p += (sizeof(uint32_t) + raw_size + 7) & ~(uint64_t)7;
+  }
+  if (sample_type & PERF_SAMPLE_REGS_USER) {
+    // The ABI, then the registers of NUMAP_SAMPLE_REGS_USER (the stack pointer) unless it is none
+    NEXT_U64(value);
+    if (value != PERF_SAMPLE_REGS_ABI_NONE) {
+      NEXT_U64(sample->sp);
+    }
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+  if (sample_type & (PERF_SAMPLE_WEIGHT | PERF_SAMPLE_WEIGHT_STRUCT)) {
+    NEXT_U64(sample->weight);
+    if (sample_type & PERF_SAMPLE_WEIGHT_STRUCT) {
+      // var1_dw holds the access latency
+      sample->weight &= 0xffffffff;
+    }
+  }
+#else
+  if (sample_type & PERF_SAMPLE_WEIGHT) {
+    NEXT_U64(sample->weight);
+  }
+#endif
+  if (sample_type & PERF_SAMPLE_DATA_SRC) {
+    NEXT_U64(sample->data_src.val);
+  }
+#undef NEXT_U64
+  return 0;
+}
+
+struct foreach_arg {
+  struct numap_sampling_measure *measure;
+  int thread;
+  int stream;
+  int (*callback)(struct numap_sampling_measure*, int, struct numap_sample*, void*);
+  int (*record_callback)(struct numap_sampling_measure*, int, struct perf_event_header*, void*);
+  void *arg;
+};
+
+static int foreach_record(struct perf_event_header *header, void *arg) {
+  struct foreach_arg *fa = arg;
+  if (header->type != PERF_RECORD_SAMPLE) {
+    return 0;
+  }
+  struct numap_sample sample;
+  int res = numap_sample_decode(fa->measure->sample_type, header, &sample);
+  if (res != 0) {
+    return res;
+  }
+  sample.stream = fa->stream;
+  sample.core_type = fa->measure->streams[fa->stream].core_type;
+  sample.access = fa->measure->streams[fa->stream].access;
+  return fa->callback(fa->measure, fa->thread, &sample, fa->arg);
+}
+
+static int foreach_any_record(struct perf_event_header *header, void *arg) {
+  struct foreach_arg *fa = arg;
+  return fa->record_callback(fa->measure, fa->thread, header, fa->arg);
+}
+
+static int foreach_ring(struct numap_sampling_measure *measure, struct foreach_arg *fa, ring_record_fn record) {
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+      if (metadata_page == NULL) {
+        continue;
+      }
+      uint64_t head = metadata_page->data_head;
+      rmb();
+      fa->thread = thread;
+      fa->stream = stream;
+      int res = ring_walk(metadata_page, measure->page_size, measure_ring_len(measure, thread),
+                          metadata_page->data_tail, head, record, fa);
+      if (res != 0) {
+        return res;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Calls callback for each sample available in the ring buffers of the
+ * measure, without consuming them. A non zero value returned by the
+ * callback stops the iteration and is returned. On hybrid processors, the
+ * samples of a thread are given stream after stream, not in time order.
+ */
+int numap_sampling_foreach_sample(struct numap_sampling_measure *measure,
+                                  int (*callback)(struct numap_sampling_measure*, int, struct numap_sample*, void*),
+                                  void *arg) {
+  struct foreach_arg fa;
+  fa.measure = measure;
+  fa.callback = callback;
+  fa.arg = arg;
+  return foreach_ring(measure, &fa, foreach_record);
+}
+
+/**
+ * Calls callback for each record available in the ring buffers of the
+ * measure, samples as well as side-band records (mmaps, forks, exits,
+ * lost samples...), without consuming them.
+ */
+int numap_sampling_foreach_record(struct numap_sampling_measure *measure,
+                                  int (*callback)(struct numap_sampling_measure*, int, struct perf_event_header*, void*),
+                                  void *arg) {
+  struct foreach_arg fa;
+  fa.measure = measure;
+  fa.record_callback = callback;
+  fa.arg = arg;
+  return foreach_ring(measure, &fa, foreach_any_record);
+}
+
 int get_index(uint32_t tid, struct numap_sampling_measure *measure) {
   uint32_t thread;
   int index = 0;
@@ -203,76 +526,173 @@ int get_index(uint32_t tid, struct numap_sampling_measure *measure) {
   return -1;
 }
 
+void numap_latency_histogram_init(struct numap_latency_histogram *histogram) {
+  memset(histogram, 0, sizeof(struct numap_latency_histogram));
+}
+
+void numap_latency_histogram_add(struct numap_latency_histogram *histogram, uint64_t latency) {
+  numap_latency_histogram_add_count(histogram, latency, 1);
+}
+
+/**
+ * Adds count accesses of the given latency, e.g. a sample standing for
+ * the accesses of its period.
+ */
+void numap_latency_histogram_add_count(struct numap_latency_histogram *histogram, uint64_t latency, uint64_t count) {
+  histogram->buckets[latency_bucket(latency)] += count;
+  histogram->count += count;
+  histogram->sum += latency * count;
+  if (latency > histogram->max) {
+    histogram->max = latency;
+  }
+}
+
+void numap_latency_histogram_merge(struct numap_latency_histogram *histogram, struct numap_latency_histogram *other) {
+  for (int bucket = 0; bucket < NUMAP_LATENCY_BUCKETS; bucket++) {
+    histogram->buckets[bucket] += other->buckets[bucket];
+  }
+  histogram->count += other->count;
+  histogram->sum += other->sum;
+  if (other->max > histogram->max) {
+    histogram->max = other->max;
+  }
+}
+
+/**
+ * Returns the lower bound of the bucket holding the given percentile
+ * (between 0 and 100) of the latencies.
+ */
+uint64_t numap_latency_histogram_percentile(struct numap_latency_histogram *histogram, double percentile) {
+  if (histogram->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->count);
+  if (rank >= histogram->count) {
+    rank = histogram->count - 1;
+  }
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < NUMAP_LATENCY_BUCKETS; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen > rank) {
+      return bucket_latency(bucket);
+    }
+  }
+  return histogram->max;
+}
+
+int numap_latency_histogram_print(struct numap_latency_histogram *histogram) {
+  printf("Latency: %-8" PRIu64 " samples mean %0.1f p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 " cycles\n",
+         histogram->count, histogram->count ? (double)histogram->sum / histogram->count : 0.0,
+         numap_latency_histogram_percentile(histogram, 50), numap_latency_histogram_percentile(histogram, 90),
+         numap_latency_histogram_percentile(histogram, 99), histogram->max);
+  return 0;
+}
+
+static int histogram_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  // Stores have no latency
+  if (sample->weight > 0) {
+    numap_latency_histogram_add(arg, sample->weight);
+  }
+  return 0;
+}
+
+/**
+ * Builds the histogram of the latencies of all the samples of measure.
+ */
+int numap_sampling_latency_histogram(struct numap_sampling_measure *measure, struct numap_latency_histogram *histogram) {
+  if (!(measure->sample_type & SAMPLE_WEIGHT_TYPE)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  numap_latency_histogram_init(histogram);
+  return numap_sampling_foreach_sample(measure, histogram_sample, histogram);
+}
+
+struct print_counts {
+  char print_samples;
+  int na_miss_count;
+  int cache1_count;
+  int cache2_count;
+  int cache3_count;
+  int lfb_count;
+  int memory_count;
+  int remote_memory_count;
+  int remote_cache_count;
+  int total_count;
+};
+
+static int print_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct print_counts *counts = (struct print_counts *)arg + thread;
+  if (is_served_by_local_NA_miss(sample->data_src)) {
+    counts->na_miss_count++;
+  }
+  if (is_served_by_local_cache1(sample->data_src)) {
+    counts->cache1_count++;
+  }
+  if (is_served_by_local_cache2(sample->data_src)) {
+    counts->cache2_count++;
+  }
+  if (is_served_by_local_cache3(sample->data_src)) {
+    counts->cache3_count++;
+  }
+  if (is_served_by_local_lfb(sample->data_src)) {
+    counts->lfb_count++;
+  }
+  if (is_served_by_local_memory(sample->data_src)) {
+    counts->memory_count++;
+  }
+  if (is_served_by_remote_memory(sample->data_src)) {
+    counts->remote_memory_count++;
+  }
+  if (is_served_by_remote_cache_or_local_memory(sample->data_src)) {
+    counts->remote_cache_count++;
+  }
+  counts->total_count++;
+  if (counts->print_samples) {
+    char *level = get_data_src_level(sample->data_src);
+    printf("pc=%" PRIx64 ", @=%" PRIx64 ", src level=%s, latency=%" PRIu64 "\n", sample->ip, sample->addr, level, sample->weight);
+    free(level);
+  }
+  return 0;
+}
+
 int numap_sampling_print(struct numap_sampling_measure *measure, char print_samples) {
   int thread;
+  struct print_counts counts[MAX_NB_THREADS];
+  memset(counts, 0, sizeof(counts));
   for (thread = 0; thread < measure->nb_threads; thread++) {
-
-    struct perf_event_mmap_page *metadata_page = measure->metadata_pages_per_tid[thread];
-    uint64_t head = metadata_page -> data_head;
-    rmb();
-    struct perf_event_header *header = (struct perf_event_header *)((char *)metadata_page + measure->page_size);
-    uint64_t consumed = 0;
-    int na_miss_count = 0;
-    int cache1_count = 0;
-    int cache2_count = 0;
-    int cache3_count = 0;
-    int lfb_count = 0;
-    int memory_count = 0;
-    int remote_memory_count = 0;
-    int remote_cache_count = 0;
-    int total_count = 0;
-    while (consumed < head) {
-      if (header->size == 0) {
-  	fprintf(stderr, "Error: invalid header size = 0\n");
-  	return -1;
+    counts[thread].print_samples = print_samples;
+  }
+  if (numap_sampling_foreach_sample(measure, print_sample, counts) != 0) {
+    return -1;
+  }
+  for (thread = 0; thread < measure->nb_threads; thread++) {
+    struct print_counts *c = &counts[thread];
+    // Threads of a thread sweep only have the rings of their slot, and a thread whose events failed to open has none
+    int nb_rings = 0;
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+      if (metadata_page == NULL) {
+        continue;
       }
-      if (header -> type == PERF_RECORD_SAMPLE) {
-  	struct sample *sample = (struct sample *)((char *)(header) + 8);
-	if (is_served_by_local_NA_miss(sample->data_src)) {
-  	  na_miss_count++;
-  	}
-	if (is_served_by_local_cache1(sample->data_src)) {
-  	  cache1_count++;
-	}
-	if (is_served_by_local_cache2(sample->data_src)) {
-  	  cache2_count++;
-	}
-	if (is_served_by_local_cache3(sample->data_src)) {
-  	  cache3_count++;
-	}
-	if (is_served_by_local_lfb(sample->data_src)) {
-  	  lfb_count++;
-	}
-  	if (is_served_by_local_memory(sample->data_src)) {
-  	  memory_count++;
-  	}
-  	if (is_served_by_remote_memory(sample->data_src)) {
-  	  remote_memory_count++;
-  	}
-  	if (is_served_by_remote_cache_or_local_memory(sample->data_src)) {
-  	  remote_cache_count++;
-  	}
-  	total_count++;
-	if (print_samples) {
-	  printf("pc=%" PRIx64 ", @=%" PRIx64 ", src level=%s, latency=%" PRIu64 "\n", sample->ip, sample->addr, get_data_src_level(sample->data_src), sample->weight);
-	}
+      if (nb_rings++ == 0) {
+        printf("\n");
       }
-      consumed += header->size;
-      header = (struct perf_event_header *)((char *)header + header -> size);
+      printf("head = %" PRIu64 " compared to max = %zu\n", (uint64_t)metadata_page->data_head, measure_ring_len(measure, thread));
+    }
+    if (nb_rings == 0) {
+      continue;
     }
-    printf("\n");
-    printf("head = %" PRIu64 " compared to max = %zu\n", head, measure->mmap_len);
-    printf("Thread %d: %-8d samples\n", thread, total_count);
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, cache1_count, "local cache 1", (100.0 * cache1_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, cache2_count, "local cache 2", (100.0 * cache2_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, cache3_count, "local cache 3", (100.0 * cache3_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, lfb_count, "local cache LFB", (100.0 * lfb_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, memory_count, "local memory", (100.0 * memory_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, remote_cache_count, "remote cache or local memory", (100.0 * remote_cache_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, remote_memory_count, "remote memory", (100.0 * remote_memory_count / total_count));
-    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, na_miss_count, "unknown l3 miss", (100.0 * na_miss_count / total_count));
+    printf("Thread %d: %-8d samples\n", thread, c->total_count);
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->cache1_count, "local cache 1", (100.0 * c->cache1_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->cache2_count, "local cache 2", (100.0 * c->cache2_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->cache3_count, "local cache 3", (100.0 * c->cache3_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->lfb_count, "local cache LFB", (100.0 * c->lfb_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->memory_count, "local memory", (100.0 * c->memory_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->remote_cache_count, "remote cache or local memory", (100.0 * c->remote_cache_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->remote_memory_count, "remote memory", (100.0 * c->remote_memory_count / c->total_count));
+    printf("Thread %d: %-8d %-30s %0.3f%%\n", thread, c->na_miss_count, "unknown l3 miss", (100.0 * c->na_miss_count / c->total_count));
     if (measure->nb_refresh > 0) {
-	    measure->total_samples += (total_count % measure->nb_refresh);
+	    measure->total_samples += (c->total_count % measure->nb_refresh);
     }
   }
   printf("\nTotal sample number : %d\n", measure->total_samples);
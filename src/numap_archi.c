@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+#include "numap_config.h"
+#include "numap_archi_default.h"
+
+#define ARCHI_FILE_ENV "NUMAP_ARCHI_FILE"
+#define ARCHI_INSTALLED_FILE NUMAP_DATA_DIR "/archi.conf"
+#define PMU_TYPE_FILE "/sys/bus/event_source/devices/%s/type"
+
+/**
+ * precise_ip values tried in order when probing a sampling event: PEBS
+ * events need at least 1 to provide data_src and weight.
+ */
+static const int precise_ip_fallbacks[] = { 2, 1 };
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return NULL;
+  }
+  size_t len = 0;
+  size_t capacity = 4096;
+  char *content = malloc(capacity);
+  while (content != NULL) {
+    len += fread(content + len, 1, capacity - len - 1, f);
+    if (len < capacity - 1) {
+      break;
+    }
+    capacity *= 2;
+    char *bigger = realloc(content, capacity);
+    if (bigger == NULL) {
+      free(content);
+    }
+    content = bigger;
+  }
+  if (content != NULL) {
+    content[len] = '\0';
+  }
+  fclose(f);
+  return content;
+}
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s)) {
+    s++;
+  }
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1])) {
+    *--end = '\0';
+  }
+  return s;
+}
+
+static int models_match(char *models, unsigned int archi_id) {
+  char *saveptr;
+  for (char *model = strtok_r(models, " \t", &saveptr); model != NULL; model = strtok_r(NULL, " \t", &saveptr)) {
+    unsigned int family, number;
+    if (strcmp(model, "*") == 0) {
+      return 1;
+    }
+    if (sscanf(model, "%u:%u", &family, &number) == 2 && CPU_MODEL(family, number) == archi_id) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void parse_candidates(char *value, struct archi_events *events) {
+  char *saveptr;
+  events->nb_candidates = 0;
+  for (char *event = strtok_r(value, "|", &saveptr); event != NULL; event = strtok_r(NULL, "|", &saveptr)) {
+    event = trim(event);
+    if (*event == '\0' || events->nb_candidates == ARCHI_MAX_CANDIDATES) {
+      continue;
+    }
+    snprintf(events->candidates[events->nb_candidates++], ARCHI_EVENT_LEN, "%s", event);
+  }
+}
+
+/**
+ * Fills arch with the first section of the table matching archi_id.
+ * Returns 1 when a section matched, 0 otherwise.
+ */
+static int parse_table(char *table, unsigned int archi_id, struct archi *arch) {
+  struct archi section;
+  int in_section = 0;
+  int matched = 0;
+  char *saveptr;
+  char *line = strtok_r(table, "\n", &saveptr);
+
+  for (;; line = strtok_r(NULL, "\n", &saveptr)) {
+    char *content = line ? trim(line) : NULL;
+    if (content == NULL || content[0] == '[') {
+      // end of the previous section
+      if (in_section && matched) {
+        *arch = section;
+        return 1;
+      }
+      if (content == NULL) {
+        return 0;
+      }
+      memset(&section, 0, sizeof(section));
+      section.id = archi_id;
+      char *end = strchr(content, ']');
+      if (end) {
+        *end = '\0';
+      }
+      snprintf(section.name, sizeof(section.name), "%s", content + 1);
+      snprintf(section.counting_read_event, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+      snprintf(section.counting_write_event, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+      in_section = 1;
+      matched = 0;
+      continue;
+    }
+    if (!in_section || content[0] == '#' || content[0] == '\0') {
+      continue;
+    }
+    char *value = strchr(content, '=');
+    if (value == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+    char *key = trim(content);
+    value = trim(value);
+    if (strcmp(key, "models") == 0) {
+      matched = models_match(value, archi_id);
+    } else if (strcmp(key, "read") == 0) {
+      parse_candidates(value, &section.read_candidates);
+    } else if (strcmp(key, "write") == 0) {
+      parse_candidates(value, &section.write_candidates);
+    } else if (strcmp(key, "read_atom") == 0) {
+      parse_candidates(value, &section.read_atom_candidates);
+    } else if (strcmp(key, "write_atom") == 0) {
+      parse_candidates(value, &section.write_atom_candidates);
+    } else if (strcmp(key, "counting_read") == 0) {
+      snprintf(section.counting_read_event, ARCHI_EVENT_LEN, "%s", value);
+    } else if (strcmp(key, "counting_write") == 0) {
+      snprintf(section.counting_write_event, ARCHI_EVENT_LEN, "%s", value);
+    }
+  }
+}
+
+static void select_first_candidate(struct archi_events *events, char *selected, int *precise_ip) {
+  if (events->nb_candidates > 0) {
+    snprintf(selected, ARCHI_EVENT_LEN, "%s", events->candidates[0]);
+  } else {
+    snprintf(selected, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+  }
+  *precise_ip = precise_ip_fallbacks[0];
+}
+
+/**
+ * Returns the perf type of the PMU registered as name in sysfs, -1 if
+ * there is none. Hybrid processors register one PMU per core type.
+ */
+static int pmu_type(const char *name) {
+  char path[256];
+  snprintf(path, sizeof(path), PMU_TYPE_FILE, name);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int type;
+  if (fscanf(f, "%d", &type) != 1) {
+    type = -1;
+  }
+  fclose(f);
+  return type;
+}
+
+/**
+ * Finds the description of the cpu: the override file is searched first,
+ * then the table embedded in the library.
+ */
+int archi_load(unsigned int archi_id, struct archi *arch) {
+  int found = 0;
+  const char *path = getenv(ARCHI_FILE_ENV);
+  if (path == NULL && access(ARCHI_INSTALLED_FILE, R_OK) == 0) {
+    path = ARCHI_INSTALLED_FILE;
+  }
+  if (path != NULL) {
+    char *table = read_file(path);
+    if (table == NULL) {
+      fprintf(stderr, "libnumap: cannot read architecture file `%s': %s\n", path, strerror(errno));
+    } else {
+      found = parse_table(table, archi_id, arch);
+      free(table);
+    }
+  }
+  if (!found) {
+    char *table = strdup(numap_archi_default);
+    if (table == NULL) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    found = parse_table(table, archi_id, arch);
+    free(table);
+  }
+  if (!found) {
+    memset(arch, 0, sizeof(struct archi));
+    arch->id = archi_id;
+    snprintf(arch->name, sizeof(arch->name), "Unknown architecture");
+    snprintf(arch->counting_read_event, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+    snprintf(arch->counting_write_event, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+  }
+  select_first_candidate(&arch->read_candidates, arch->sampling_read_event, &arch->sampling_read_precise_ip);
+  select_first_candidate(&arch->write_candidates, arch->sampling_write_event, &arch->sampling_write_precise_ip);
+  select_first_candidate(&arch->read_atom_candidates, arch->sampling_read_atom_event,
+                         &arch->sampling_read_atom_precise_ip);
+  select_first_candidate(&arch->write_atom_candidates, arch->sampling_write_atom_event,
+                         &arch->sampling_write_atom_precise_ip);
+  arch->core_pmu_type = pmu_type("cpu_core");
+  arch->atom_pmu_type = arch->core_pmu_type == -1 ? -1 : pmu_type("cpu_atom");
+  if (arch->atom_pmu_type == -1) {
+    arch->core_pmu_type = -1;
+  }
+  return 0;
+}
+
+/**
+ * Checks that event can be encoded by libpfm and opened for sampling on
+ * the calling thread. On success, precise_ip holds the highest value
+ * accepted by the kernel. On failure, error describes the reason.
+ */
+static int probe_event(const char *event, int pmu_type, int *precise_ip, char *error, size_t error_len) {
+  struct perf_event_attr pe_attr;
+  memset(&pe_attr, 0, sizeof(pe_attr));
+  pe_attr.size = sizeof(pe_attr);
+  pfm_perf_encode_arg_t arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.size = sizeof(pfm_perf_encode_arg_t);
+  arg.attr = &pe_attr;
+  int err = pfm_get_os_event_encoding(event, PFM_PLM0 | PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
+  if (err != PFM_SUCCESS) {
+    snprintf(error, error_len, "%s: %s", event, pfm_strerror(err));
+    return -1;
+  }
+  if (pmu_type >= 0 && pe_attr.type == PERF_TYPE_RAW) {
+    pe_attr.type = pmu_type;
+  }
+  pe_attr.sample_period = 100000;
+  pe_attr.sample_type = NUMAP_DEFAULT_SAMPLE_TYPE;
+  pe_attr.disabled = 1;
+  pe_attr.exclude_kernel = 1;
+  pe_attr.exclude_hv = 1;
+  for (size_t i = 0; i < sizeof(precise_ip_fallbacks) / sizeof(int); i++) {
+    pe_attr.precise_ip = precise_ip_fallbacks[i];
+    int fd = perf_event_open(&pe_attr, 0, -1, -1, 0);
+    if (fd != -1) {
+      close(fd);
+      *precise_ip = precise_ip_fallbacks[i];
+      return 0;
+    }
+  }
+  snprintf(error, error_len, "%s: perf_event_open: %s", event, strerror(errno));
+  return -1;
+}
+
+static void probe_candidates(const char *kind, struct archi_events *events, int pmu_type, char *selected,
+                             int *precise_ip, char *errors, size_t errors_len) {
+  char error[512];
+  errors[0] = '\0';
+  for (int i = 0; i < events->nb_candidates; i++) {
+    if (probe_event(events->candidates[i], pmu_type, precise_ip, error, sizeof(error)) == 0) {
+      snprintf(selected, ARCHI_EVENT_LEN, "%s", events->candidates[i]);
+      if (errors[0] != '\0') {
+        fprintf(stderr, "libnumap: %s sampling events unusable (%s), using %s\n", kind, errors, selected);
+      }
+      return;
+    }
+    size_t len = strlen(errors);
+    snprintf(errors + len, errors_len - len, "%s%s", len ? "; " : "", error);
+  }
+  snprintf(selected, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+}
+
+/**
+ * Selects, for reads and writes, the first candidate event that the
+ * host accepts. On hybrid processors, the atom candidates are probed on
+ * the cpu_atom PMU.
+ */
+void archi_probe(struct archi *arch) {
+  probe_candidates("read", &arch->read_candidates, arch->core_pmu_type, arch->sampling_read_event,
+                   &arch->sampling_read_precise_ip, arch->read_probe_errors, sizeof(arch->read_probe_errors));
+  probe_candidates("write", &arch->write_candidates, arch->core_pmu_type, arch->sampling_write_event,
+                   &arch->sampling_write_precise_ip, arch->write_probe_errors, sizeof(arch->write_probe_errors));
+  if (arch->atom_pmu_type == -1) {
+    snprintf(arch->sampling_read_atom_event, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+    snprintf(arch->sampling_write_atom_event, ARCHI_EVENT_LEN, NOT_SUPPORTED);
+    return;
+  }
+  probe_candidates("E-core read", &arch->read_atom_candidates, arch->atom_pmu_type, arch->sampling_read_atom_event,
+                   &arch->sampling_read_atom_precise_ip, arch->read_atom_probe_errors,
+                   sizeof(arch->read_atom_probe_errors));
+  probe_candidates("E-core write", &arch->write_atom_candidates, arch->atom_pmu_type, arch->sampling_write_atom_event,
+                   &arch->sampling_write_atom_precise_ip, arch->write_atom_probe_errors,
+                   sizeof(arch->write_atom_probe_errors));
+  if (strcmp(arch->sampling_read_atom_event, NOT_SUPPORTED) == 0) {
+    fprintf(stderr, "libnumap: no usable E-core read sampling event (%s), threads on E-cores are not sampled\n",
+            arch->read_atom_probe_errors[0] ? arch->read_atom_probe_errors : "none in the architecture table");
+  }
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <numa.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Attach mode: sampling the threads of another process, found in
+ * /proc/<pid>/task, without its cooperation. Signals cannot be routed
+ * to the threads of another process, so the events are never refreshed
+ * by overflow signals: a collector thread of the profiler drains the
+ * rings every interval instead, doing what the refresh handler does,
+ * and in NUMAP_ATTACH_THREADS mode picks up the threads created since
+ * the last scan. In NUMAP_ATTACH_CPUS mode each ring gathers the samples
+ * of the process on one cpu: every task has an event per cpu, output to
+ * the ring of its cpu and inherited by the threads it creates.
+ */
+
+#define COLLECTOR_DEFAULT_INTERVAL_MS 100
+
+/**
+ * Fills *tids with the tasks of pid. Returns their number, or -1 when
+ * the process does not exist.
+ */
+static int list_tasks(pid_t pid, pid_t **tids, size_t *capacity) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  int nb_tids = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+      continue;
+    }
+    if (array_reserve((void **)tids, capacity, nb_tids + 1, sizeof(pid_t)) != 0) {
+      closedir(dir);
+      errno = ENOMEM;
+      return -1;
+    }
+    (*tids)[nb_tids++] = atoi(entry->d_name);
+  }
+  closedir(dir);
+  return nb_tids;
+}
+
+/**
+ * Initializes measure to sample process pid: one ring per thread of the
+ * process (at most MAX_NB_THREADS, see numap_sampling_attach_missed) in
+ * NUMAP_ATTACH_THREADS mode, one ring per cpu in NUMAP_ATTACH_CPUS mode,
+ * where measure->tids holds pid and the thread index of the analyses is
+ * a cpu. Sampling the process requires the ptrace access mode asked by
+ * perf_event_paranoid. The measure is then started and stopped as usual.
+ */
+int numap_sampling_init_attach(struct numap_sampling_measure *measure, pid_t pid, int mode, int sampling_rate,
+                               int mmap_pages_count) {
+  if (pid <= 0 || (mode != NUMAP_ATTACH_THREADS && mode != NUMAP_ATTACH_CPUS)) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  pid_t *tids = NULL;
+  size_t capacity = 0;
+  int nb_tids = list_tasks(pid, &tids, &capacity);
+  if (nb_tids <= 0) {
+    free(tids);
+    if (nb_tids == 0) {
+      errno = ESRCH;
+    }
+    return ERROR_NUMAP_ATTACH;
+  }
+  int nb_slots = nb_tids;
+  if (mode == NUMAP_ATTACH_CPUS) {
+    nb_slots = numa_num_configured_cpus();
+    if (nb_slots > MAX_NB_THREADS) {
+      free(tids);
+      return ERROR_NUMAP_TOO_MANY_THREADS;
+    }
+  } else if (nb_slots > MAX_NB_THREADS) {
+    nb_slots = MAX_NB_THREADS;
+  }
+  int res = numap_sampling_init_measure(measure, nb_slots, sampling_rate, mmap_pages_count);
+  if (res != 0) {
+    free(tids);
+    return res;
+  }
+  measure->attach_pid = pid;
+  measure->attach_mode = mode;
+  measure->attach_missed = nb_tids - nb_slots;
+  measure->collector_interval_ms = COLLECTOR_DEFAULT_INTERVAL_MS;
+  for (int slot = 0; slot < nb_slots; slot++) {
+    if (mode == NUMAP_ATTACH_CPUS) {
+      measure->tids[slot] = pid;
+      measure->attach_cpus[slot] = slot;
+    } else {
+      measure->tids[slot] = tids[slot];
+      measure->attach_cpus[slot] = -1;
+    }
+  }
+  if (mode == NUMAP_ATTACH_CPUS) {
+    measure->attach_missed = 0;
+  }
+  free(tids);
+  return 0;
+}
+
+/**
+ * Sets the time between two drains of the rings of an attached measure
+ * (100 ms by default). Has to be called before the measure starts.
+ */
+int numap_sampling_set_collector_interval(struct numap_sampling_measure *measure, unsigned int interval_ms) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  if (measure->attach_pid == 0 || interval_ms == 0) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  measure->collector_interval_ms = interval_ms;
+  return 0;
+}
+
+/**
+ * Number of threads of the attached process that were not sampled at
+ * the last scan, because the measure already had MAX_NB_THREADS threads.
+ */
+int numap_sampling_attach_missed(struct numap_sampling_measure *measure) {
+  return measure->attach_missed;
+}
+
+/**
+ * Opens, for the tasks of the attached process other than its main
+ * thread, the event of stream on the cpu of ring thread, and redirects
+ * their samples to that ring (mapped on the event of the main thread).
+ */
+int attach_open_cpu_events(struct numap_sampling_measure *measure, struct perf_event_attr *pe_attr, int stream,
+                           int thread) {
+  pid_t *tids = NULL;
+  size_t capacity = 0;
+  int nb_tids = list_tasks(measure->attach_pid, &tids, &capacity);
+  long ring_fd = *measure_fd(measure, stream, thread);
+  int res = 0;
+  for (int i = 0; i < nb_tids && res == 0; i++) {
+    if (tids[i] == measure->attach_pid) {
+      continue;
+    }
+    long fd = perf_event_open(pe_attr, tids[i], measure->attach_cpus[thread], -1, 0);
+    if (fd == -1) {
+      // Exited since the scan
+      if (errno != ESRCH) {
+        last_sys_errno = errno;
+        res = ERROR_PERF_EVENT_OPEN;
+      }
+      continue;
+    }
+    if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, ring_fd) != 0) {
+      last_sys_errno = errno;
+      close(fd);
+      res = ERROR_PERF_EVENT_OPEN;
+    } else if (array_reserve((void **)&measure->attach_fds, &measure->attach_fds_capacity,
+                             measure->nb_attach_fds + 1, sizeof(long)) != 0) {
+      close(fd);
+      res = ERROR_NUMAP_MALLOC;
+    } else {
+      measure->attach_fds[measure->nb_attach_fds++] = fd;
+    }
+  }
+  free(tids);
+  return res;
+}
+
+/**
+ * Applies request (enable or disable) to the events output to the ring
+ * of another event.
+ */
+void attach_ioctl(struct numap_sampling_measure *measure, unsigned long request) {
+  for (size_t i = 0; i < measure->nb_attach_fds; i++) {
+    ioctl(measure->attach_fds[i], request, 0);
+  }
+}
+
+void attach_close(struct numap_sampling_measure *measure) {
+  for (size_t i = 0; i < measure->nb_attach_fds; i++) {
+    close(measure->attach_fds[i]);
+  }
+  free(measure->attach_fds);
+  measure->attach_fds = NULL;
+  measure->nb_attach_fds = 0;
+  measure->attach_fds_capacity = 0;
+}
+
+/**
+ * Starts sampling the threads of the attached process created since the
+ * last scan.
+ */
+static void attach_scan(struct numap_sampling_measure *measure, pid_t **tids, size_t *capacity) {
+  int nb_tids = list_tasks(measure->attach_pid, tids, capacity);
+  int missed = 0;
+  for (int i = 0; i < nb_tids; i++) {
+    int thread;
+    for (thread = 0; thread < measure->nb_threads && measure->tids[thread] != (*tids)[i]; thread++);
+    if (thread < measure->nb_threads) {
+      continue;
+    }
+    if (numap_sampling_add_thread(measure, (*tids)[i]) == ERROR_NUMAP_TOO_MANY_THREADS) {
+      missed++;
+    }
+  }
+  measure->attach_missed = missed;
+}
+
+/**
+ * Drains the rings that received records since the last drain, as the
+ * refresh handler does.
+ */
+static void collect(struct numap_sampling_measure *measure) {
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+      if (metadata_page == NULL) {
+        continue;
+      }
+      uint64_t head = metadata_page->data_head;
+      rmb();
+      if (head == measure->drained_per_stream[stream][thread]) {
+        continue;
+      }
+      // The measure handler, if any, releases the records
+      stream_drain(measure, stream, thread, measure->handler == NULL);
+      if (measure->handler) {
+        measure->handler(measure, *measure_fd(measure, stream, thread));
+      }
+      measure->drained_per_stream[stream][thread] = head;
+    }
+  }
+}
+
+static void *collector_main(void *arg) {
+  struct numap_sampling_measure *measure = arg;
+  pid_t *tids = NULL;
+  size_t capacity = 0;
+  // The refresh handler of another measure sharing a sketch must not
+  // interrupt a drain of this thread
+  sigio_block(NULL);
+  struct timespec interval;
+  interval.tv_sec = measure->collector_interval_ms / 1000;
+  interval.tv_nsec = (measure->collector_interval_ms % 1000) * 1000000L;
+  while (!__atomic_load_n(&measure->collector_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&interval, NULL);
+    if (measure->attach_mode == NUMAP_ATTACH_THREADS) {
+      attach_scan(measure, &tids, &capacity);
+    }
+    collect(measure);
+  }
+  free(tids);
+  return NULL;
+}
+
+/**
+ * Starts the collector thread of an attached measure that just started
+ * or resumed.
+ */
+int attach_start(struct numap_sampling_measure *measure) {
+  if (measure->attach_pid == 0) {
+    return 0;
+  }
+  measure->collector_stop = 0;
+  int res = pthread_create(&measure->collector, NULL, collector_main, measure);
+  if (res != 0) {
+    errno = res;
+    return ERROR_NUMAP_ATTACH;
+  }
+  measure->collector_running = 1;
+  return 0;
+}
+
+/**
+ * Stops the collector thread. The last records are drained by the stop
+ * of the measure.
+ */
+void attach_stop(struct numap_sampling_measure *measure) {
+  if (!measure->collector_running) {
+    return;
+  }
+  __atomic_store_n(&measure->collector_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(measure->collector, NULL);
+  measure->collector_running = 0;
+}
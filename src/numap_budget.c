@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Locked memory budget of the ring buffers. The kernel lets each user
+ * lock perf_event_mlock_kb per online cpu for perf ring buffers, then
+ * charges the excess against RLIMIT_MEMLOCK (unless the process has
+ * CAP_IPC_LOCK). Rings are sized from the expected sample rate and
+ * shrunk, by powers of two, so that the rings of all the threads fit in
+ * what is left of this budget.
+ */
+
+/**
+ * Kernel default of perf_event_mlock_kb, used when it cannot be read.
+ */
+#define DEFAULT_MLOCK_KB 516
+/**
+ * Seconds of samples a ring holds when nobody drains it during the
+ * measure and the sample rate is known.
+ */
+#define RING_SECONDS 1.0
+#define RING_DEFAULT_PAGES 64
+#define RING_MAX_PAGES 4096
+
+// Bytes of ring buffers currently mapped by the process
+static size_t locked_bytes = 0;
+
+static size_t budget_limit(void) {
+  if (geteuid() == 0) {
+    return SIZE_MAX;
+  }
+  struct rlimit rlimit;
+  if (getrlimit(RLIMIT_MEMLOCK, &rlimit) != 0) {
+    rlimit.rlim_cur = 0;
+  } else if (rlimit.rlim_cur == RLIM_INFINITY) {
+    return SIZE_MAX;
+  }
+  long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t mlock_kb = perf_event_mlock_kb ? perf_event_mlock_kb : DEFAULT_MLOCK_KB;
+  return mlock_kb * 1024 * (nb_cpus > 0 ? nb_cpus : 1) + rlimit.rlim_cur;
+}
+
+/**
+ * Size in bytes of a sample record of sample_type: the header and one
+ * u64 per field, and the frames of a typical call chain.
+ */
+#define CALLCHAIN_TYPICAL_DEPTH 16
+
+static size_t record_size(uint64_t sample_type) {
+  uint64_t fields = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR |
+    PERF_SAMPLE_ID | PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+    PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC | PERF_SAMPLE_TRANSACTION;
+  size_t size = sizeof(struct perf_event_header) + 8 * __builtin_popcountll(sample_type & fields);
+  if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+    // the number of frames and the context marker, then the frames
+    size += 8 * (2 + CALLCHAIN_TYPICAL_DEPTH);
+  }
+  if (sample_type & PERF_SAMPLE_REGS_USER) {
+    // the ABI, then the stack pointer
+    size += 8 * 2;
+  }
+  return size;
+}
+
+static unsigned int floor_power_of_two(unsigned int n) {
+  unsigned int p = 1;
+  while (p * 2 <= n && p * 2 > p) {
+    p *= 2;
+  }
+  return p;
+}
+
+/**
+ * Number of data pages each ring should have, before the budget applies.
+ * An explicit mmap_pages_count is kept (rounded to a power of two).
+ * Otherwise the ring holds twice the samples produced between two
+ * refreshes when a handler drains it, or a second of samples when the
+ * rate is known.
+ */
+static unsigned int wanted_pages(struct numap_sampling_measure *measure) {
+  if (measure->mmap_pages_count > 0) {
+    return floor_power_of_two(measure->mmap_pages_count);
+  }
+  double rate = measure->expected_samples_per_sec;
+  if (rate <= 0 && measure->adaptive) {
+    rate = measure->target_samples_per_sec;
+  }
+  double samples;
+  if (measure->handler != NULL && measure->nb_refresh > 0) {
+    samples = 2.0 * measure->nb_refresh;
+  } else if (rate > 0) {
+    samples = rate * RING_SECONDS;
+  } else {
+    return RING_DEFAULT_PAGES;
+  }
+  double pages = samples * record_size(measure->sample_type) / measure->page_size;
+  unsigned int count = 1;
+  while (count < pages && count < RING_MAX_PAGES) {
+    count *= 2;
+  }
+  return count;
+}
+
+/**
+ * Length of the ring of thread when its numap_thread_config sizes it, 0
+ * when it uses mmap_len.
+ */
+size_t budget_thread_ring_len(struct numap_sampling_measure *measure, int thread) {
+  unsigned int pages = measure->thread_configs[thread].mmap_pages_count;
+  if (pages == 0) {
+    return 0;
+  }
+  return measure->page_size * (1 + floor_power_of_two(pages));
+}
+
+/**
+ * Chooses the data pages count of the nb_rings rings measure is about
+ * to map, besides fixed_bytes of rings sized per thread, and sets
+ * mmap_pages_count and mmap_len accordingly.
+ */
+void budget_size_rings(struct numap_sampling_measure *measure, int nb_rings, size_t fixed_bytes) {
+  unsigned int pages = wanted_pages(measure);
+  measure->wanted_pages_count = pages;
+  size_t limit = budget_limit();
+  if (limit != SIZE_MAX && nb_rings > 0) {
+    size_t locked = __atomic_load_n(&locked_bytes, __ATOMIC_RELAXED);
+    size_t available = limit > locked + fixed_bytes ? limit - locked - fixed_bytes : 0;
+    while (pages > 1 && (1 + pages) * measure->page_size * nb_rings > available) {
+      pages /= 2;
+    }
+  }
+  budget_set_pages(measure, pages);
+}
+
+/**
+ * Sets the data pages count of the rings of measure, reporting it when
+ * it is below the wanted one.
+ */
+void budget_set_pages(struct numap_sampling_measure *measure, unsigned int pages) {
+  measure->mmap_pages_count = pages;
+  measure->mmap_len = measure->page_size * (1 + pages);
+  if (pages < measure->wanted_pages_count) {
+    fprintf(stderr, "libnumap: ring buffers shrunk to %u pages instead of %u to fit in locked memory "
+            "(perf_event_mlock_kb = %u, RLIMIT_MEMLOCK)\n", pages, measure->wanted_pages_count, perf_event_mlock_kb);
+  }
+}
+
+void budget_acquire(size_t len) {
+  __atomic_add_fetch(&locked_bytes, len, __ATOMIC_RELAXED);
+}
+
+void budget_release(size_t len) {
+  __atomic_sub_fetch(&locked_bytes, len, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <numa.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+#define CALIBRATION_DEFAULT_BUFFER_SIZE (256UL * 1024 * 1024)
+// A buffer that fits in the caches measures them, not the memory
+#define CALIBRATION_LLC_MULTIPLE 4
+#define CALIBRATION_FALLBACK_LLC_SIZE (32UL * 1024 * 1024)
+#define CALIBRATION_CACHE_LINE 64
+#define CALIBRATION_CHASE_STEPS (4 * 1024 * 1024)
+#define CALIBRATION_STREAM_PASSES 4
+#define CALIBRATION_MAX_STREAM_THREADS 64
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Pointer chasing through a random cyclic permutation of the cache
+ * lines of the buffer: each load depends on the previous one and
+ * defeats the hardware prefetchers.
+ */
+struct chase_arg {
+  int cpu_node;
+  int mem_node;
+  size_t buffer_size;
+  double latency_ns;
+  int error;
+};
+
+static void *chase_thread(void *p) {
+  struct chase_arg *arg = p;
+  size_t nb_lines = arg->buffer_size / CALIBRATION_CACHE_LINE;
+  arg->error = 0;
+  if (numa_run_on_node(arg->cpu_node) != 0) {
+    arg->error = ERROR_NUMAP_CALIBRATION;
+    return NULL;
+  }
+  char *buffer = numa_alloc_onnode(arg->buffer_size, arg->mem_node);
+  size_t *order = malloc(nb_lines * sizeof(size_t));
+  if (buffer == NULL || order == NULL) {
+    if (buffer) {
+      numa_free(buffer, arg->buffer_size);
+    }
+    free(order);
+    arg->error = ERROR_NUMAP_MALLOC;
+    return NULL;
+  }
+  // Sattolo's algorithm gives a single cycle through all lines
+  unsigned int seed = 42;
+  for (size_t i = 0; i < nb_lines; i++) {
+    order[i] = i;
+  }
+  for (size_t i = nb_lines - 1; i > 0; i--) {
+    size_t j = ((size_t)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % i;
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (size_t i = 0; i < nb_lines; i++) {
+    *(void **)(buffer + order[i] * CALIBRATION_CACHE_LINE) = buffer + order[(i + 1) % nb_lines] * CALIBRATION_CACHE_LINE;
+  }
+  free(order);
+
+  void **p_chase = (void **)buffer;
+  // Warm up TLBs and page tables
+  for (size_t i = 0; i < nb_lines; i++) {
+    p_chase = *p_chase;
+  }
+  double start = now_ns();
+  for (size_t i = 0; i < CALIBRATION_CHASE_STEPS; i++) {
+    p_chase = *p_chase;
+  }
+  double end = now_ns();
+  // Keeps the compiler from removing the loop
+  if (p_chase == NULL) {
+    arg->error = ERROR_NUMAP_CALIBRATION;
+  }
+  arg->latency_ns = (end - start) / CALIBRATION_CHASE_STEPS;
+  numa_free(buffer, arg->buffer_size);
+  return NULL;
+}
+
+/**
+ * Streaming read bandwidth: one thread per cpu of the cpu node reads
+ * its own slice of a buffer allocated on the memory node.
+ */
+struct stream_arg {
+  int cpu_node;
+  uint64_t *slice;
+  size_t slice_len;
+  pthread_barrier_t *barrier;
+  pthread_mutex_t *gate; // held while the threads are created
+  const int *aborted; // set when not all of them could be
+  uint64_t sum;
+  int error;
+};
+
+static void *stream_thread(void *p) {
+  struct stream_arg *arg = p;
+  pthread_mutex_lock(arg->gate);
+  pthread_mutex_unlock(arg->gate);
+  if (*arg->aborted) {
+    return NULL;
+  }
+  arg->error = numa_run_on_node(arg->cpu_node) != 0 ? ERROR_NUMAP_CALIBRATION : 0;
+  // Touch the slice once so that page faults are not measured
+  for (size_t i = 0; i < arg->slice_len; i++) {
+    arg->slice[i] = i;
+  }
+  pthread_barrier_wait(arg->barrier);
+  uint64_t sum = 0;
+  for (int pass = 0; pass < CALIBRATION_STREAM_PASSES; pass++) {
+    for (size_t i = 0; i < arg->slice_len; i += 4) {
+      sum += arg->slice[i] + arg->slice[i + 1] + arg->slice[i + 2] + arg->slice[i + 3];
+    }
+  }
+  arg->sum = sum;
+  pthread_barrier_wait(arg->barrier);
+  return NULL;
+}
+
+static int node_nb_cpus(int node) {
+  struct bitmask *mask = numa_allocate_cpumask();
+  int nb_cpus = 0;
+  if (numa_node_to_cpus(node, mask) == 0) {
+    nb_cpus = numa_bitmask_weight(mask);
+  }
+  numa_bitmask_free(mask);
+  return nb_cpus;
+}
+
+static int measure_bandwidth(int cpu_node, int mem_node, size_t buffer_size, double *bandwidth_mbs) {
+  int nb_threads = node_nb_cpus(cpu_node);
+  if (nb_threads > CALIBRATION_MAX_STREAM_THREADS) {
+    nb_threads = CALIBRATION_MAX_STREAM_THREADS;
+  }
+  if (nb_threads <= 0) {
+    return ERROR_NUMAP_CALIBRATION;
+  }
+  uint64_t *buffer = numa_alloc_onnode(buffer_size, mem_node);
+  if (buffer == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  size_t slice_len = (buffer_size / sizeof(uint64_t) / nb_threads) & ~(size_t)3;
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, nb_threads + 1);
+  // The threads wait for all of them to exist before reaching the barrier
+  pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+  int aborted = 0;
+  struct stream_arg args[CALIBRATION_MAX_STREAM_THREADS];
+  pthread_t threads[CALIBRATION_MAX_STREAM_THREADS];
+  int nb_created;
+  pthread_mutex_lock(&gate);
+  for (nb_created = 0; nb_created < nb_threads; nb_created++) {
+    int t = nb_created;
+    args[t].cpu_node = cpu_node;
+    args[t].slice = buffer + t * slice_len;
+    args[t].slice_len = slice_len;
+    args[t].barrier = &barrier;
+    args[t].gate = &gate;
+    args[t].aborted = &aborted;
+    int err = pthread_create(&threads[t], NULL, stream_thread, &args[t]);
+    if (err != 0) {
+      aborted = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&gate);
+  if (aborted) {
+    for (int t = 0; t < nb_created; t++) {
+      pthread_join(threads[t], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    numa_free(buffer, buffer_size);
+    return ERROR_NUMAP_CALIBRATION;
+  }
+  pthread_barrier_wait(&barrier);
+  double start = now_ns();
+  pthread_barrier_wait(&barrier);
+  double end = now_ns();
+  int res = 0;
+  for (int t = 0; t < nb_threads; t++) {
+    pthread_join(threads[t], NULL);
+    if (args[t].error) {
+      res = args[t].error;
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  numa_free(buffer, buffer_size);
+  double bytes = (double)slice_len * sizeof(uint64_t) * nb_threads * CALIBRATION_STREAM_PASSES;
+  *bandwidth_mbs = bytes / ((end - start) / 1e9) / (1024 * 1024);
+  return res;
+}
+
+/**
+ * Smallest buffer the kernels accept: several times the last level
+ * cache, or a large cache when its size is unknown.
+ */
+static size_t min_buffer_size(void) {
+  long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (llc <= 0) {
+    llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  }
+  if (llc <= 0) {
+    llc = CALIBRATION_FALLBACK_LLC_SIZE;
+  }
+  return CALIBRATION_LLC_MULTIPLE * (size_t)llc;
+}
+
+/**
+ * Measures the latency and bandwidth of every (cpu node, memory node)
+ * pair with buffers of buffer_size bytes, 0 for the default (256 MB, or
+ * more on machines with a larger last level cache). Returns
+ * ERROR_NUMAP_INVALID_ARGUMENT when buffer_size is smaller than
+ * CALIBRATION_LLC_MULTIPLE times the last level cache.
+ */
+int numap_calibration_run(struct numap_calibration *calibration, size_t buffer_size) {
+  if (nb_numa_nodes == (unsigned int)-1) {
+    return ERROR_NUMAP_NOT_NUMA;
+  }
+  size_t min_size = min_buffer_size();
+  if (buffer_size == 0) {
+    buffer_size = CALIBRATION_DEFAULT_BUFFER_SIZE > min_size ? CALIBRATION_DEFAULT_BUFFER_SIZE : min_size;
+  }
+  if (buffer_size < min_size) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  memset(calibration, 0, sizeof(struct numap_calibration));
+  calibration->nb_nodes = nb_numa_nodes < MAX_NB_NUMA_NODES ? nb_numa_nodes : MAX_NB_NUMA_NODES;
+  for (int cpu_node = 0; cpu_node < calibration->nb_nodes; cpu_node++) {
+    if (node_nb_cpus(cpu_node) == 0) {
+      continue;
+    }
+    for (int mem_node = 0; mem_node < calibration->nb_nodes; mem_node++) {
+      if (numa_node_size64(mem_node, NULL) <= 0) {
+        continue;
+      }
+      struct chase_arg chase;
+      chase.cpu_node = cpu_node;
+      chase.mem_node = mem_node;
+      chase.buffer_size = buffer_size;
+      pthread_t thread;
+      int err = pthread_create(&thread, NULL, chase_thread, &chase);
+      if (err != 0) {
+        return ERROR_NUMAP_CALIBRATION;
+      }
+      pthread_join(thread, NULL);
+      if (chase.error) {
+        return chase.error;
+      }
+      calibration->latency_ns[cpu_node][mem_node] = chase.latency_ns;
+      int res = measure_bandwidth(cpu_node, mem_node, buffer_size, &calibration->bandwidth_mbs[cpu_node][mem_node]);
+      if (res != 0) {
+        return res;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Calibration results are cached per user, by default in
+ * $XDG_CACHE_HOME/numap/calibration. NUMAP_CALIBRATION_FILE overrides
+ * this path.
+ */
+const char *numap_calibration_default_path(void) {
+  static char path[1024];
+  const char *env = getenv("NUMAP_CALIBRATION_FILE");
+  if (env != NULL) {
+    return env;
+  }
+  env = getenv("XDG_CACHE_HOME");
+  if (env != NULL) {
+    snprintf(path, sizeof(path), "%s/numap/calibration", env);
+  } else {
+    env = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.cache/numap/calibration", env ? env : "/tmp");
+  }
+  return path;
+}
+
+/**
+ * Calibration file of the last ERROR_NUMAP_CALIBRATION_FILE of the
+ * calling thread, for its error message.
+ */
+__thread char last_calibration_path[1024];
+
+static int calibration_file_error(const char *path, int err) {
+  snprintf(last_calibration_path, sizeof(last_calibration_path), "%s", path);
+  last_sys_errno = err;
+  return ERROR_NUMAP_CALIBRATION_FILE;
+}
+
+static void make_parent_dirs(const char *path) {
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char *p = dir + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(dir, 0755);
+      *p = '/';
+    }
+  }
+}
+
+int numap_calibration_save(struct numap_calibration *calibration, const char *path) {
+  if (path == NULL) {
+    path = numap_calibration_default_path();
+  }
+  make_parent_dirs(path);
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return calibration_file_error(path, errno);
+  }
+  fprintf(f, "# numap calibration: <cpu node> <memory node> <value>\n");
+  fprintf(f, "nodes %d\n", calibration->nb_nodes);
+  for (int cpu_node = 0; cpu_node < calibration->nb_nodes; cpu_node++) {
+    for (int mem_node = 0; mem_node < calibration->nb_nodes; mem_node++) {
+      fprintf(f, "latency_ns %d %d %.3f\n", cpu_node, mem_node, calibration->latency_ns[cpu_node][mem_node]);
+      fprintf(f, "bandwidth_mbs %d %d %.3f\n", cpu_node, mem_node, calibration->bandwidth_mbs[cpu_node][mem_node]);
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+int numap_calibration_load(struct numap_calibration *calibration, const char *path) {
+  if (path == NULL) {
+    path = numap_calibration_default_path();
+  }
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return calibration_file_error(path, errno);
+  }
+  memset(calibration, 0, sizeof(struct numap_calibration));
+  char *line = NULL;
+  size_t size = 0;
+  int res = 0;
+  while (getline(&line, &size, f) != -1) {
+    char key[32];
+    int cpu_node, mem_node;
+    double value;
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (sscanf(line, "nodes %d", &calibration->nb_nodes) == 1) {
+      continue;
+    }
+    if (sscanf(line, "%31s %d %d %lf", key, &cpu_node, &mem_node, &value) != 4 ||
+        cpu_node < 0 || cpu_node >= MAX_NB_NUMA_NODES || mem_node < 0 || mem_node >= MAX_NB_NUMA_NODES) {
+      res = ERROR_NUMAP_CALIBRATION_FILE;
+      break;
+    }
+    if (strcmp(key, "latency_ns") == 0) {
+      calibration->latency_ns[cpu_node][mem_node] = value;
+    } else if (strcmp(key, "bandwidth_mbs") == 0) {
+      calibration->bandwidth_mbs[cpu_node][mem_node] = value;
+    }
+  }
+  free(line);
+  fclose(f);
+  if (res == 0 && (calibration->nb_nodes <= 0 || calibration->nb_nodes > MAX_NB_NUMA_NODES)) {
+    res = ERROR_NUMAP_CALIBRATION_FILE;
+  }
+  if (res != 0) {
+    // Malformed rather than unreadable
+    calibration_file_error(path, 0);
+  }
+  return res;
+}
+
+int numap_calibration_print(struct numap_calibration *calibration) {
+  int cpu_node, mem_node;
+  printf("%-14s", "latency (ns)");
+  for (mem_node = 0; mem_node < calibration->nb_nodes; mem_node++) {
+    printf(" %10d", mem_node);
+  }
+  printf("\n");
+  for (cpu_node = 0; cpu_node < calibration->nb_nodes; cpu_node++) {
+    printf("node %-9d", cpu_node);
+    for (mem_node = 0; mem_node < calibration->nb_nodes; mem_node++) {
+      printf(" %10.1f", calibration->latency_ns[cpu_node][mem_node]);
+    }
+    printf("\n");
+  }
+  printf("\n%-14s", "bandwidth MB/s");
+  for (mem_node = 0; mem_node < calibration->nb_nodes; mem_node++) {
+    printf(" %10d", mem_node);
+  }
+  printf("\n");
+  for (cpu_node = 0; cpu_node < calibration->nb_nodes; cpu_node++) {
+    printf("node %-9d", cpu_node);
+    for (mem_node = 0; mem_node < calibration->nb_nodes; mem_node++) {
+      printf(" %10.0f", calibration->bandwidth_mbs[cpu_node][mem_node]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+/**
+ * Cost of an access from cpu_node to mem_node as a multiple of a local
+ * access of cpu_node. Returns 0 when this pair was not calibrated.
+ */
+double numap_calibration_remote_factor(struct numap_calibration *calibration, int cpu_node, int mem_node) {
+  if (cpu_node < 0 || mem_node < 0 || cpu_node >= calibration->nb_nodes || mem_node >= calibration->nb_nodes) {
+    return 0;
+  }
+  double local = calibration->latency_ns[cpu_node][cpu_node];
+  double remote = calibration->latency_ns[cpu_node][mem_node];
+  if (local <= 0 || remote <= 0) {
+    return 0;
+  }
+  return remote / local;
+}
+
+/**
+ * Percentage of the measured local bandwidth of node used by `bytes`
+ * transferred in `seconds`. Returns 0 when this node was not calibrated.
+ */
+double numap_calibration_utilization(struct numap_calibration *calibration, int node, double bytes, double seconds) {
+  if (node < 0 || node >= calibration->nb_nodes || seconds <= 0) {
+    return 0;
+  }
+  double capacity = calibration->bandwidth_mbs[node][node];
+  if (capacity <= 0) {
+    return 0;
+  }
+  return 100.0 * (bytes / seconds / (1024 * 1024)) / capacity;
+}
+
+/**
+ * Percentage of the measured bandwidth from cpu_node to mem_node used by
+ * `bytes` transferred in `seconds`. Returns 0 when this pair was not
+ * calibrated.
+ */
+double numap_calibration_pair_utilization(struct numap_calibration *calibration, int cpu_node, int mem_node,
+                                          double bytes, double seconds) {
+  if (cpu_node < 0 || mem_node < 0 || cpu_node >= calibration->nb_nodes || mem_node >= calibration->nb_nodes ||
+      seconds <= 0) {
+    return 0;
+  }
+  double capacity = calibration->bandwidth_mbs[cpu_node][mem_node];
+  if (capacity <= 0) {
+    return 0;
+  }
+  return 100.0 * (bytes / seconds / (1024 * 1024)) / capacity;
+}
+
+/**
+ * Calibration used by the analyses: loaded once from the cache file,
+ * NULL when the machine was never calibrated.
+ */
+static pthread_once_t calibration_once = PTHREAD_ONCE_INIT;
+static struct numap_calibration cached_calibration;
+static struct numap_calibration *current_calibration = NULL;
+
+static void load_cached_calibration(void) {
+  if (numap_calibration_load(&cached_calibration, NULL) == 0) {
+    current_calibration = &cached_calibration;
+  }
+}
+
+struct numap_calibration *calibration_get(void) {
+  pthread_once(&calibration_once, load_cached_calibration);
+  return current_calibration;
+}
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <numa.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Aggregation key: the page address with the thread index and the cpu
+ * node stored in the (always zero) low bits of the page address.
+ */
+#define KEY_NODE_BITS   5
+#define KEY_THREAD_BITS 7
+#if MAX_NB_THREADS > (1 << KEY_THREAD_BITS) || MAX_NB_NUMA_NODES >= (1 << KEY_NODE_BITS)
+#error "numap_cost.c: aggregation key too small for MAX_NB_THREADS or MAX_NB_NUMA_NODES"
+#endif
+#define KEY(page, thread, node) ((page) | ((uint64_t)(thread) << KEY_NODE_BITS) | (uint64_t)((node) + 1))
+#define KEY_THREAD(key) ((int)(((key) >> KEY_NODE_BITS) & ((1 << KEY_THREAD_BITS) - 1)))
+#define KEY_NODE(key) ((int)((key) & ((1 << KEY_NODE_BITS) - 1)) - 1)
+
+#define MOVE_PAGES_BATCH 1024
+
+struct cost_entry {
+  uint64_t key;
+  uint32_t page_index;
+  uint64_t samples;
+  uint64_t accesses; // sum of the periods
+  double weighted_latency; // sum of weight * period
+};
+
+struct cost_state {
+  uint64_t page_mask;
+  struct u64_map entries_map;
+  struct cost_entry *entries;
+  size_t entries_capacity;
+  struct u64_map pages_map;
+  struct numap_page_cost *pages;
+  size_t pages_capacity;
+  struct numap_remote_cost *cost;
+  uint64_t first_time;
+  uint64_t last_time;
+};
+
+static int cost_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct cost_state *state = arg;
+  if (!is_served_by_local_memory(sample->data_src) && !is_served_by_remote_memory(sample->data_src)) {
+    return 0;
+  }
+  struct numap_remote_cost *cost = state->cost;
+  if (sample->sample_type & PERF_SAMPLE_TIME) {
+    if (sample->time < state->first_time) {
+      state->first_time = sample->time;
+    }
+    if (sample->time > state->last_time) {
+      state->last_time = sample->time;
+    }
+  }
+  cost->thread_memory_samples[thread]++;
+  if (sample->data_src.mem_lvl & PERF_MEM_LVL_REM_RAM1) {
+    cost->thread_remote_1hop[thread]++;
+  } else if (sample->data_src.mem_lvl & PERF_MEM_LVL_REM_RAM2) {
+    cost->thread_remote_2hops[thread]++;
+  }
+
+  int node = sample_cpu_node(measure, sample);
+  uint64_t page = sample->addr & state->page_mask;
+  int inserted;
+  int64_t page_index = u64_map_get(&state->pages_map, page, &inserted);
+  if (page_index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&state->pages, &state->pages_capacity, page_index + 1, sizeof(struct numap_page_cost)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&state->pages[page_index], 0, sizeof(struct numap_page_cost));
+    state->pages[page_index].page = page;
+    state->pages[page_index].node = -1;
+  }
+  state->pages[page_index].samples++;
+
+  uint64_t key = KEY(page, thread, node);
+  int64_t index = u64_map_get(&state->entries_map, key, &inserted);
+  if (index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&state->entries, &state->entries_capacity, index + 1, sizeof(struct cost_entry)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&state->entries[index], 0, sizeof(struct cost_entry));
+    state->entries[index].key = key;
+    state->entries[index].page_index = page_index;
+  }
+  uint64_t period = sample_period(measure, thread, sample);
+  state->entries[index].samples++;
+  state->entries[index].accesses += period;
+  state->entries[index].weighted_latency += (double)sample->weight * period;
+  return 0;
+}
+
+/**
+ * Finds the node of each of the nb_pages pages, -1 when unknown. Pages
+ * are queried with the tid of the sampled threads so that this also
+ * works for other processes.
+ */
+void pages_resolve_nodes(struct numap_sampling_measure *measure, const uint64_t *pages, int *nodes, size_t nb_pages) {
+  void *batch[MOVE_PAGES_BATCH];
+  int status[MOVE_PAGES_BATCH];
+  for (size_t first = 0; first < nb_pages; first += MOVE_PAGES_BATCH) {
+    size_t count = nb_pages - first < MOVE_PAGES_BATCH ? nb_pages - first : MOVE_PAGES_BATCH;
+    for (size_t i = 0; i < count; i++) {
+      batch[i] = (void *)(uintptr_t)pages[first + i];
+      nodes[first + i] = -1;
+    }
+    int resolved = 0;
+    for (int thread = 0; thread < measure->nb_threads && !resolved; thread++) {
+      resolved = numa_move_pages(measure->tids[thread], count, batch, NULL, status, 0) == 0;
+    }
+    if (!resolved) {
+      continue;
+    }
+    for (size_t i = 0; i < count; i++) {
+      nodes[first + i] = status[i] >= 0 ? status[i] : -1;
+    }
+  }
+}
+
+void entries_resolve_nodes(struct numap_sampling_measure *measure, void *entries, size_t nb_entries,
+                           size_t entry_size, size_t page_offset, size_t node_offset) {
+  uint64_t pages[MOVE_PAGES_BATCH];
+  int nodes[MOVE_PAGES_BATCH];
+  uint64_t page_mask = ~((uint64_t)measure->page_size - 1);
+  struct numap_topology *topology = measure->topology;
+  int nb_nodes = measure_nb_nodes(measure);
+  for (size_t first = 0; first < nb_entries; first += MOVE_PAGES_BATCH) {
+    size_t count = nb_entries - first < MOVE_PAGES_BATCH ? nb_entries - first : MOVE_PAGES_BATCH;
+    for (size_t i = 0; i < count; i++) {
+      uint8_t *entry = (uint8_t *)entries + (first + i) * entry_size;
+      pages[i] = *(uint64_t *)(entry + page_offset) & page_mask;
+      nodes[i] = -1;
+    }
+    // The pages of a replayed measure are not mapped anymore: their
+    // node was resolved when they were recorded
+    if (!measure->replay) {
+      pages_resolve_nodes(measure, pages, nodes, count);
+    } else if (topology != NULL) {
+      for (size_t i = 0; i < count; i++) {
+        int64_t index = u64_map_find(&topology->pages_map, pages[i]);
+        nodes[i] = index >= 0 ? topology->page_nodes[index] : -1;
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      uint8_t *entry = (uint8_t *)entries + (first + i) * entry_size;
+      int node = nodes[i] < nb_nodes ? nodes[i] : -1;
+      *(int *)(entry + node_offset) = node;
+    }
+  }
+}
+
+int sample_cpu_node(struct numap_sampling_measure *measure, struct numap_sample *sample) {
+  if (!(sample->sample_type & PERF_SAMPLE_CPU)) {
+    return -1;
+  }
+  if (measure->topology != NULL) {
+    return sample->cpu < (uint32_t)measure->topology->nb_cpus ? measure->topology->cpu_to_node[sample->cpu] : -1;
+  }
+  return sample->cpu < (uint32_t)nb_cpus ? cpu_to_node[sample->cpu] : -1;
+}
+
+int measure_nb_nodes(struct numap_sampling_measure *measure) {
+  if (measure != NULL && measure->topology != NULL) {
+    return measure->topology->nb_nodes > 0 ? measure->topology->nb_nodes : -1;
+  }
+  if (nb_numa_nodes == (unsigned int)-1) {
+    return -1;
+  }
+  return nb_numa_nodes < MAX_NB_NUMA_NODES ? nb_numa_nodes : MAX_NB_NUMA_NODES;
+}
+
+static int compare_page_cost(const void *a, const void *b) {
+  const struct numap_page_cost *pa = a;
+  const struct numap_page_cost *pb = b;
+  if (pa->lost_cycles != pb->lost_cycles) {
+    return pa->lost_cycles < pb->lost_cycles ? 1 : -1;
+  }
+  return pa->samples < pb->samples ? 1 : (pa->samples > pb->samples ? -1 : 0);
+}
+
+/**
+ * Latency of a remote access relative to a local one, taken from the
+ * calibration of the machine when available and otherwise from the
+ * numa_distance matrix (10 is the distance of a node to itself). The
+ * calibration of the host does not apply to a trace recorded on another
+ * machine: the distances recorded with it are used.
+ */
+double remote_latency_factor(struct numap_sampling_measure *measure, int cpu_node, int mem_node) {
+  if (measure != NULL && measure->topology != NULL) {
+    int local = measure->topology->distances[cpu_node][cpu_node];
+    int remote = measure->topology->distances[cpu_node][mem_node];
+    return local > 0 && remote > 0 ? (double)remote / local : 1.0;
+  }
+  struct numap_calibration *calibration = calibration_get();
+  if (calibration != NULL) {
+    double factor = numap_calibration_remote_factor(calibration, cpu_node, mem_node);
+    if (factor > 0) {
+      return factor;
+    }
+  }
+  int local = numa_distance(cpu_node, cpu_node);
+  int remote = numa_distance(cpu_node, mem_node);
+  if (local <= 0 || remote <= 0) {
+    return 1.0;
+  }
+  return (double)remote / local;
+}
+
+int numap_sampling_remote_cost(struct numap_sampling_measure *measure, struct numap_remote_cost *cost) {
+  struct cost_state state;
+  uint64_t pair_accesses[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  int res;
+
+  int nb_nodes = measure_nb_nodes(measure);
+  if (nb_nodes < 0) {
+    return ERROR_NUMAP_NOT_NUMA;
+  }
+  if (!(measure->sample_type & PERF_SAMPLE_ADDR) || !(measure->sample_type & PERF_SAMPLE_DATA_SRC)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  memset(cost, 0, sizeof(struct numap_remote_cost));
+  cost->nb_nodes = nb_nodes;
+  for (int cpu_node = 0; cpu_node < nb_nodes; cpu_node++) {
+    for (int mem_node = 0; mem_node < nb_nodes; mem_node++) {
+      cost->pair_factor[cpu_node][mem_node] = remote_latency_factor(measure, cpu_node, mem_node);
+    }
+  }
+  cost->nb_threads = measure->nb_threads;
+
+  memset(&state, 0, sizeof(state));
+  memset(pair_accesses, 0, sizeof(pair_accesses));
+  state.cost = cost;
+  state.first_time = UINT64_MAX;
+  state.page_mask = ~((uint64_t)measure->page_size - 1);
+  if (u64_map_init(&state.entries_map, 4096) != 0 || u64_map_init(&state.pages_map, 4096) != 0) {
+    u64_map_free(&state.entries_map);
+    return ERROR_NUMAP_MALLOC;
+  }
+
+  res = numap_sampling_foreach_sample(measure, cost_sample, &state);
+  if (res != 0) {
+    goto out;
+  }
+  entries_resolve_nodes(measure, state.pages, state.pages_map.count, sizeof(struct numap_page_cost),
+                        offsetof(struct numap_page_cost, page), offsetof(struct numap_page_cost, node));
+
+  for (size_t i = 0; i < state.entries_map.count; i++) {
+    struct cost_entry *entry = &state.entries[i];
+    struct numap_page_cost *page = &state.pages[entry->page_index];
+    int thread = KEY_THREAD(entry->key);
+    int cpu_node = KEY_NODE(entry->key);
+    int mem_node = page->node;
+    if (cpu_node < 0 || mem_node < 0 || mem_node >= cost->nb_nodes) {
+      cost->unresolved_samples += entry->samples;
+      continue;
+    }
+    cost->pair_samples[cpu_node][mem_node] += entry->samples;
+    pair_accesses[cpu_node][mem_node] += entry->accesses;
+    if (cpu_node == mem_node) {
+      continue;
+    }
+    // Cycles the access would have saved if the page was local
+    double factor = cost->pair_factor[cpu_node][mem_node];
+    double lost = entry->weighted_latency * (1.0 - 1.0 / factor);
+    cost->pair_lost_cycles[cpu_node][mem_node] += lost;
+    cost->thread_lost_cycles[thread] += lost;
+    page->remote_samples += entry->samples;
+    page->lost_cycles += lost;
+  }
+
+  // Each access served by memory transfers a cache line; the
+  // calibration of the host does not apply to a recorded topology
+  if (state.first_time < state.last_time) {
+    cost->seconds = (state.last_time - state.first_time) / 1e9;
+  }
+  struct numap_calibration *calibration = measure->topology == NULL ? calibration_get() : NULL;
+  for (int cpu_node = 0; cpu_node < nb_nodes; cpu_node++) {
+    for (int mem_node = 0; mem_node < nb_nodes; mem_node++) {
+      double bytes = (double)pair_accesses[cpu_node][mem_node] * NUMAP_CACHE_LINE_SIZE;
+      cost->pair_bandwidth_mbs[cpu_node][mem_node] = cost->seconds > 0 ? bytes / cost->seconds / (1024 * 1024) : 0;
+      if (calibration != NULL) {
+        cost->pair_utilization[cpu_node][mem_node] =
+          numap_calibration_pair_utilization(calibration, cpu_node, mem_node, bytes, cost->seconds);
+      }
+    }
+  }
+
+  qsort(state.pages, state.pages_map.count, sizeof(struct numap_page_cost), compare_page_cost);
+  cost->nb_pages = state.pages_map.count;
+  cost->pages = state.pages;
+  state.pages = NULL;
+
+ out:
+  free(state.pages);
+  free(state.entries);
+  u64_map_free(&state.entries_map);
+  u64_map_free(&state.pages_map);
+  return res;
+}
+
+int numap_remote_cost_print(struct numap_remote_cost *cost, size_t nb_pages) {
+  int cpu_node, mem_node, thread;
+
+  printf("\nRemote memory access cost (estimated cycles lost)\n");
+  printf("%-14s", "cpu\\mem node");
+  for (mem_node = 0; mem_node < cost->nb_nodes; mem_node++) {
+    printf(" %12d", mem_node);
+  }
+  printf("\n");
+  for (cpu_node = 0; cpu_node < cost->nb_nodes; cpu_node++) {
+    printf("node %-9d", cpu_node);
+    for (mem_node = 0; mem_node < cost->nb_nodes; mem_node++) {
+      printf(" %12.4g", cost->pair_lost_cycles[cpu_node][mem_node]);
+    }
+    printf("\n");
+  }
+
+  // Node pairs sorted by cost, most expensive flows first
+  printf("\n");
+  char done[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  memset(done, 0, sizeof(done));
+  for (;;) {
+    int best_cpu = -1, best_mem = -1;
+    for (cpu_node = 0; cpu_node < cost->nb_nodes; cpu_node++) {
+      for (mem_node = 0; mem_node < cost->nb_nodes; mem_node++) {
+        if (done[cpu_node][mem_node] || cost->pair_lost_cycles[cpu_node][mem_node] <= 0) {
+          continue;
+        }
+        if (best_cpu == -1 || cost->pair_lost_cycles[cpu_node][mem_node] > cost->pair_lost_cycles[best_cpu][best_mem]) {
+          best_cpu = cpu_node;
+          best_mem = mem_node;
+        }
+      }
+    }
+    if (best_cpu == -1) {
+      break;
+    }
+    done[best_cpu][best_mem] = 1;
+    printf("Node %d -> node %d: %-8" PRIu64 " samples %0.2fx local latency %.4g cycles lost\n", best_cpu, best_mem,
+           cost->pair_samples[best_cpu][best_mem], cost->pair_factor[best_cpu][best_mem],
+           cost->pair_lost_cycles[best_cpu][best_mem]);
+  }
+
+  printf("\n");
+  for (thread = 0; thread < cost->nb_threads; thread++) {
+    printf("Thread %d: %-8" PRIu64 " memory samples %-8" PRIu64 " remote 1 hop %-8" PRIu64 " remote 2 hops %.4g cycles lost\n",
+           thread, cost->thread_memory_samples[thread], cost->thread_remote_1hop[thread],
+           cost->thread_remote_2hops[thread], cost->thread_lost_cycles[thread]);
+  }
+  if (cost->unresolved_samples) {
+    printf("%" PRIu64 " memory samples with unknown cpu or page node\n", cost->unresolved_samples);
+  }
+
+  if (cost->seconds > 0) {
+    printf("\nSampled memory bandwidth over %0.3fs, MB/s (%% of the calibrated bandwidth)\n", cost->seconds);
+    printf("%-14s", "cpu\\mem node");
+    for (mem_node = 0; mem_node < cost->nb_nodes; mem_node++) {
+      printf(" %18d", mem_node);
+    }
+    printf("\n");
+    for (cpu_node = 0; cpu_node < cost->nb_nodes; cpu_node++) {
+      printf("node %-9d", cpu_node);
+      for (mem_node = 0; mem_node < cost->nb_nodes; mem_node++) {
+        printf(" %10.1f (%4.1f%%)", cost->pair_bandwidth_mbs[cpu_node][mem_node],
+               cost->pair_utilization[cpu_node][mem_node]);
+      }
+      printf("\n");
+    }
+  }
+
+  printf("\n");
+  for (size_t page = 0; page < nb_pages && page < cost->nb_pages; page++) {
+    struct numap_page_cost *pc = &cost->pages[page];
+    if (pc->lost_cycles <= 0) {
+      break;
+    }
+    printf("Page %#" PRIx64 " (node %d): %-8" PRIu64 " samples %-8" PRIu64 " remote %.4g cycles lost\n",
+           pc->page, pc->node, pc->samples, pc->remote_samples, pc->lost_cycles);
+  }
+  return 0;
+}
+
+void numap_remote_cost_free(struct numap_remote_cost *cost) {
+  free(cost->pages);
+  cost->pages = NULL;
+  cost->nb_pages = 0;
+}
@@ -0,0 +1,313 @@
+#ifndef NUMAP_INTERNAL_H
+#define NUMAP_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "numap.h"
+
+#define NOT_SUPPORTED "NOT_SUPPORTED"
+#define ARCHI_MAX_CANDIDATES 8
+#define ARCHI_EVENT_LEN 256
+
+#define CPU_MODEL(family, model) ((family) | (model) <<8)
+
+/**
+ * Candidate events of an architecture, tried in order.
+ */
+struct archi_events {
+  int nb_candidates;
+  char candidates[ARCHI_MAX_CANDIDATES][ARCHI_EVENT_LEN];
+};
+
+/**
+ * Description of a micro architecture, read from numap_archi.conf. The
+ * sampling events are the candidates selected by archi_probe. On hybrid
+ * processors, the main events are opened on the cpu_core PMU and the
+ * atom events on the cpu_atom PMU.
+ */
+struct archi {
+  unsigned int id;
+  char name[256];
+  char sampling_read_event[ARCHI_EVENT_LEN];
+  char sampling_write_event[ARCHI_EVENT_LEN];
+  char sampling_read_atom_event[ARCHI_EVENT_LEN];
+  char sampling_write_atom_event[ARCHI_EVENT_LEN];
+  char counting_read_event[ARCHI_EVENT_LEN];
+  char counting_write_event[ARCHI_EVENT_LEN];
+  int sampling_read_precise_ip;
+  int sampling_write_precise_ip;
+  int sampling_read_atom_precise_ip;
+  int sampling_write_atom_precise_ip;
+  struct archi_events read_candidates;
+  struct archi_events write_candidates;
+  struct archi_events read_atom_candidates;
+  struct archi_events write_atom_candidates;
+  char read_probe_errors[1024];
+  char write_probe_errors[1024];
+  char read_atom_probe_errors[1024];
+  char write_atom_probe_errors[1024];
+  int core_pmu_type; // perf type of the cpu_core PMU, -1 if the processor is not hybrid
+  int atom_pmu_type; // perf type of the cpu_atom PMU, -1 if the processor is not hybrid
+};
+
+int archi_load(unsigned int archi_id, struct archi *arch);
+void archi_probe(struct archi *arch);
+
+/**
+ * Access to the event streams of a sampling measure.
+ */
+static inline long *measure_fd(struct numap_sampling_measure *measure, int stream, int thread) {
+  return stream == 0 ? &measure->fd_per_tid[thread] : &measure->stream_fd_per_tid[stream - 1][thread];
+}
+
+static inline struct perf_event_mmap_page **measure_ring(struct numap_sampling_measure *measure, int stream, int thread) {
+  return stream == 0 ? &measure->metadata_pages_per_tid[thread] : &measure->stream_metadata_pages_per_tid[stream - 1][thread];
+}
+
+/* tid of the slot of a thread removed by numap_sampling_remove_thread, until another one is added */
+#define THREAD_REMOVED ((pid_t)-1)
+
+/* Period sample of thread was taken with: the number of accesses it stands for */
+static inline uint64_t sample_period(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample) {
+  return (sample->sample_type & PERF_SAMPLE_PERIOD) ? sample->period : measure->period_per_tid[thread];
+}
+
+/* Length of the ring of thread, which may be sized by its numap_thread_config */
+static inline size_t measure_ring_len(struct numap_sampling_measure *measure, int thread) {
+  return measure->mmap_len_per_tid[thread] ? measure->mmap_len_per_tid[thread] : measure->mmap_len;
+}
+
+/* Returns the thread sampled by fd and sets its stream, -1 if fd is not part of measure */
+int measure_find_fd(struct numap_sampling_measure *measure, int fd, int *stream);
+
+/**
+ * Sample types providing the access latency (PERF_SAMPLE_WEIGHT_STRUCT
+ * appeared in Linux 5.12).
+ */
+#ifdef PERF_SAMPLE_WEIGHT_TYPE
+#define SAMPLE_WEIGHT_TYPE PERF_SAMPLE_WEIGHT_TYPE
+#else
+#define SAMPLE_WEIGHT_TYPE PERF_SAMPLE_WEIGHT
+#endif
+
+/**
+ * A session owns the links from the file descriptors of its sampling
+ * measures to the measures, used by the SIGIO handler. The details of
+ * the last error are per thread (last_pfm_err, last_sys_errno), not per
+ * session.
+ */
+struct session_link {
+  struct session_link *next;
+  struct session_link *removed_next;
+  int fd;
+  struct numap_sampling_measure *measure;
+};
+
+struct numap_session {
+  struct numap_session *next;
+  pthread_mutex_t lock; // protects links
+  struct session_link *links;
+};
+
+extern struct numap_session default_session;
+extern __thread int last_pfm_err; // last libpfm error of the calling thread
+extern __thread int last_sys_errno; // errno of the last failed system call of the calling thread
+extern __thread char last_calibration_path[1024]; // file of the last calibration file error of the calling thread
+
+const char *error_message(int error, char *buffer, size_t len);
+int session_register_fd(struct numap_session *session, int fd, struct numap_sampling_measure *measure);
+void session_unregister_measure(struct numap_session *session, struct numap_sampling_measure *measure);
+void session_unregister_fd(struct numap_session *session, struct numap_sampling_measure *measure, int fd);
+struct numap_sampling_measure *session_find_fd(int fd);
+void session_handler_enter(void);
+void session_handler_exit(void);
+int session_install_signal_handler(struct numap_session *session, void (*handler)(int, siginfo_t*, void*));
+void sigio_block(sigset_t *old);
+void sigio_restore(const sigset_t *old);
+
+/**
+ * Platform information gathered by numap.c and shared with the
+ * analysis code.
+ */
+extern unsigned int nb_numa_nodes;
+extern int nb_cpus;
+extern int *cpu_to_node; // node of each cpu, -1 when unknown
+
+/**
+ * Node of each page, -1 when unknown.
+ */
+void pages_resolve_nodes(struct numap_sampling_measure *measure, const uint64_t *pages, int *nodes, size_t nb_pages);
+
+/**
+ * Sets the node of nb_entries entries of entry_size bytes, e.g. struct
+ * numap_page_rw, from the address at page_offset (a page or an address
+ * in it) to the int at node_offset: -1 when unknown, as for the pages
+ * of a replayed measure.
+ */
+void entries_resolve_nodes(struct numap_sampling_measure *measure, void *entries, size_t nb_entries,
+                           size_t entry_size, size_t page_offset, size_t node_offset);
+
+/**
+ * Node of the cpu that took sample, -1 when unknown.
+ */
+int sample_cpu_node(struct numap_sampling_measure *measure, struct numap_sample *sample);
+
+/**
+ * Calibration loaded from the cache file, NULL if there is none.
+ */
+struct numap_calibration *calibration_get(void);
+
+/**
+ * Latency of an access from cpu_node to mem_node relative to a local
+ * one, on the machine measure was recorded on (the host when measure is
+ * NULL).
+ */
+double remote_latency_factor(struct numap_sampling_measure *measure, int cpu_node, int mem_node);
+
+/**
+ * Number of nodes of the machine measure was recorded on, -1 when it is
+ * not NUMA.
+ */
+int measure_nb_nodes(struct numap_sampling_measure *measure);
+
+/* Names of the NUMAP_CLASS_* data source classes */
+extern const char *sample_class_names[NUMAP_NB_CLASSES];
+
+/**
+ * Adaptive sampling period controller, driven by the refresh signal
+ * handler.
+ */
+double period_controller_now(void);
+void period_controller_start(struct numap_sampling_measure *measure);
+void period_controller_start_thread(struct numap_sampling_measure *measure, int thread, double now);
+void period_controller_scan(struct numap_sampling_measure *measure, int stream, int thread);
+void period_controller_update(struct numap_sampling_measure *measure, int stream, int thread, uint64_t lost,
+                              double drain_time);
+
+/**
+ * Feeds the sketch, the live statistics and the regions of measure from
+ * a ring, see numap_sampling_set_sketch, numap_sampling_set_live and
+ * numap_sampling_set_regions.
+ */
+void stream_drain(struct numap_sampling_measure *measure, int stream, int thread, int release);
+
+/**
+ * Live statistics: the samples counted between live_begin and live_end
+ * are published at once.
+ */
+void live_begin(struct numap_live *live);
+void live_add(struct numap_live *live, struct numap_sampling_measure *measure, int thread, struct numap_sample *sample);
+void live_lost(struct numap_live *live, int thread, uint64_t lost);
+void live_end(struct numap_live *live, struct numap_sampling_measure *measure);
+
+/**
+ * Buckets of struct numap_latency_histogram: exact values below 16
+ * cycles, then 8 buckets per power of two.
+ */
+static inline int latency_bucket(uint64_t latency) {
+  if (latency < 16) {
+    return latency;
+  }
+  int exponent = 63 - __builtin_clzll(latency);
+  return 16 + (exponent - 4) * 8 + ((latency >> (exponent - 3)) & 7);
+}
+
+/* Lower bound of bucket */
+static inline uint64_t bucket_latency(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+  int exponent = (bucket - 16) / 8 + 4;
+  return (uint64_t)(8 + (bucket - 16) % 8) << (exponent - 3);
+}
+
+/**
+ * Load latency sweeps.
+ */
+int sweep_stream_opened(struct numap_sampling_measure *measure, int stream, int thread);
+int sweep_stream_active(struct numap_sampling_measure *measure, int stream, int thread);
+int sweep_start(struct numap_sampling_measure *measure);
+void sweep_stop(struct numap_sampling_measure *measure);
+
+/**
+ * Attach mode: collector thread and per-cpu events of another process.
+ */
+void event_enable(struct numap_sampling_measure *measure, long fd);
+int attach_open_cpu_events(struct numap_sampling_measure *measure, struct perf_event_attr *pe_attr, int stream,
+                           int thread);
+void attach_ioctl(struct numap_sampling_measure *measure, unsigned long request);
+void attach_close(struct numap_sampling_measure *measure);
+int attach_start(struct numap_sampling_measure *measure);
+void attach_stop(struct numap_sampling_measure *measure);
+
+/**
+ * Per-thread configuration.
+ */
+unsigned int thread_ldlat(struct numap_sampling_measure *measure, int thread);
+int thread_ldlats(struct numap_sampling_measure *measure, unsigned int *ldlats);
+int thread_stream_opened(struct numap_sampling_measure *measure, int stream, int thread);
+int thread_configs_start(struct numap_sampling_measure *measure, uint64_t *sample_type, int *reads, int *writes);
+
+/**
+ * Locked memory budget of the ring buffers.
+ */
+extern unsigned int perf_event_mlock_kb;
+void budget_size_rings(struct numap_sampling_measure *measure, int nb_rings, size_t fixed_bytes);
+size_t budget_thread_ring_len(struct numap_sampling_measure *measure, int thread);
+void budget_set_pages(struct numap_sampling_measure *measure, unsigned int pages);
+void budget_acquire(size_t len);
+void budget_release(size_t len);
+
+/**
+ * Ring buffer walking: calls `record` for each perf record found
+ * between `from` and `to` in the data area of `metadata_page`.
+ * Records wrapping at the end of the data area are copied so that
+ * callers always see them contiguously.
+ */
+typedef int (*ring_record_fn)(struct perf_event_header *header, void *arg);
+int ring_walk(struct perf_event_mmap_page *metadata_page, size_t page_size, size_t mmap_len,
+              uint64_t from, uint64_t to, ring_record_fn record, void *arg);
+
+/**
+ * Open addressing hash map from a 64 bits key to a dense index,
+ * used to aggregate samples per page or per cache line.
+ */
+struct u64_map {
+  uint64_t *keys;
+  uint32_t *values;
+  size_t capacity;
+  size_t count;
+};
+
+int u64_map_init(struct u64_map *map, size_t capacity);
+void u64_map_free(struct u64_map *map);
+/* Returns the index of key, inserting it with index map->count when absent */
+int64_t u64_map_get(struct u64_map *map, uint64_t key, int *inserted);
+/* Returns the index of key or -1 when absent */
+int64_t u64_map_find(struct u64_map *map, uint64_t key);
+
+/**
+ * Grows a dynamic array so that it can hold at least `count` elements.
+ */
+int array_reserve(void **array, size_t *capacity, size_t count, size_t elem_size);
+
+/**
+ * NUMA topology of the machine a numap trace was recorded on, and the
+ * node of its sampled pages resolved while recording: analyses of the
+ * replayed measure use them instead of the topology of the host.
+ */
+struct numap_topology {
+  int nb_nodes; // 0 when the machine was not NUMA
+  int nb_cpus;
+  int *cpu_to_node;
+  int distances[MAX_NB_NUMA_NODES][MAX_NB_NUMA_NODES];
+  struct u64_map pages_map;
+  int *page_nodes;
+  size_t page_nodes_capacity;
+};
+
+void topology_free(struct numap_topology *topology);
+
+#endif
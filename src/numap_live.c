@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <numa.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Live statistics: the refresh handler publishes aggregates of the
+ * samples it drains into a named POSIX shared memory segment, so that
+ * other processes can watch a measure while it runs.
+ *
+ * The segment starts with a sequence count. Each drained batch of
+ * samples makes it odd, updates the stats in place and makes it even
+ * again, so the publishing side never waits for readers. Readers copy
+ * the stats and retry when the count was odd or changed meanwhile.
+ * Publishers of several threads are serialized by a spin lock, as for
+ * sketches.
+ *
+ * The refresh handler runs in a signal handler: remote memory samples
+ * are published with their page, and the readers resolve the node of
+ * the page (move_pages(2)) when they take a snapshot.
+ */
+
+#define LIVE_TOP_K (4 * NUMAP_LIVE_TOP_PAGES)
+#define LIVE_SNAPSHOT_TRIES 1000
+#define LIVE_RESOLVE_BATCH 256
+
+/**
+ * Creates (or reuses) the shared memory segment name (e.g.
+ * "/numap.1234", see shm_open(3)) holding the live statistics of a
+ * measure. Has to be closed with numap_live_close.
+ */
+int numap_live_open(struct numap_live *live, const char *name) {
+  memset(live, 0, sizeof(struct numap_live));
+  if (name == NULL || name[0] != '/' || strlen(name) >= sizeof(live->name)) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  int res = numap_sketch_init(&live->pages, LIVE_TOP_K, 0.01, 0.01);
+  if (res != 0) {
+    return res;
+  }
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    res = ERROR_NUMAP_SHM;
+    goto error;
+  }
+  if (ftruncate(fd, sizeof(struct numap_live_segment)) != 0) {
+    close(fd);
+    res = ERROR_NUMAP_SHM;
+    goto error;
+  }
+  live->segment = mmap(NULL, sizeof(struct numap_live_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (live->segment == MAP_FAILED) {
+    live->segment = NULL;
+    res = ERROR_NUMAP_SHM;
+    goto error;
+  }
+  strcpy(live->name, name);
+
+  struct numap_live_segment *segment = live->segment;
+  __atomic_store_n(&segment->seq, segment->seq | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memset(&segment->stats, 0, sizeof(struct numap_live_stats));
+  segment->stats.magic = NUMAP_LIVE_MAGIC;
+  segment->stats.version = NUMAP_LIVE_VERSION;
+  segment->stats.pid = getpid();
+  segment->stats.page_size = sysconf(_SC_PAGESIZE);
+  segment->stats.nb_nodes = nb_numa_nodes == (unsigned int)-1 ? 1 :
+    (nb_numa_nodes < MAX_NB_NUMA_NODES ? nb_numa_nodes : MAX_NB_NUMA_NODES);
+  for (int node = 0; node < MAX_NB_NUMA_NODES; node++) {
+    numap_latency_histogram_init(&segment->stats.node_latency[node]);
+  }
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELEASE);
+  return 0;
+
+ error:
+  {
+    int err = errno;
+    numap_sketch_free(&live->pages);
+    errno = err;
+  }
+  return res;
+}
+
+/**
+ * Unmaps and removes the segment of live. The measure publishing to it
+ * has to be ended first.
+ */
+void numap_live_close(struct numap_live *live) {
+  if (live->segment != NULL) {
+    munmap(live->segment, sizeof(struct numap_live_segment));
+    shm_unlink(live->name);
+    live->segment = NULL;
+  }
+  numap_sketch_free(&live->pages);
+}
+
+/**
+ * Makes the refresh handler of measure publish its samples to live,
+ * every nb_refresh samples (see numap_sampling_set_measure_handler). As
+ * with sketches, the samples are released to the kernel unless a
+ * measure handler is set, and those since the last refresh stay in the
+ * rings when the measure stops. Has to be called before the measure
+ * starts.
+ */
+int numap_sampling_set_live(struct numap_sampling_measure *measure, struct numap_live *live) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  measure->live = live;
+  return 0;
+}
+
+void live_begin(struct numap_live *live) {
+  while (__atomic_test_and_set(&live->lock, __ATOMIC_ACQUIRE)) {
+  }
+  __atomic_store_n(&live->segment->seq, live->segment->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void live_add(struct numap_live *live, struct numap_sampling_measure *measure, int thread, struct numap_sample *sample) {
+  struct numap_live_stats *stats = &live->segment->stats;
+  stats->thread_samples[thread]++;
+  if (!(sample->sample_type & PERF_SAMPLE_DATA_SRC)) {
+    return;
+  }
+  int class = numap_sample_class(sample->data_src);
+  stats->thread_classes[thread][class]++;
+  if (!(sample->sample_type & PERF_SAMPLE_ADDR)) {
+    return;
+  }
+  // Pages and nodes gather several threads, possibly sampled with different periods
+  uint64_t period = sample_period(measure, thread, sample);
+  numap_sketch_add(&live->pages, sample, period);
+  if (class != NUMAP_CLASS_LOCAL_MEMORY && class != NUMAP_CLASS_REMOTE_MEMORY) {
+    return;
+  }
+  int cpu_node = sample_cpu_node(measure, sample);
+  if (cpu_node < 0) {
+    stats->unresolved += period;
+    return;
+  }
+  // Local memory is the node of the cpu, readers resolve remote pages
+  if (class == NUMAP_CLASS_LOCAL_MEMORY) {
+    stats->node_accesses[cpu_node][cpu_node] += period;
+    if (sample->sample_type & PERF_SAMPLE_WEIGHT) {
+      numap_latency_histogram_add_count(&stats->node_latency[cpu_node], sample->weight, period);
+    }
+    return;
+  }
+  struct numap_live_pending *pending = &stats->pending[stats->nb_pending % NUMAP_LIVE_PENDING];
+  pending->page = sample->addr & ~((uint64_t)stats->page_size - 1);
+  pending->weight = (sample->sample_type & PERF_SAMPLE_WEIGHT) ? sample->weight : 0;
+  pending->period = period;
+  pending->cpu_node = cpu_node;
+  stats->nb_pending++;
+  stats->pending_accesses += period;
+}
+
+void live_lost(struct numap_live *live, int thread, uint64_t lost) {
+  live->segment->stats.thread_lost[thread] += lost;
+}
+
+/**
+ * Keeps the NUMAP_LIVE_TOP_PAGES hottest pages of the sketch of live,
+ * hottest first, without allocating.
+ */
+static void live_top_pages(struct numap_live *live) {
+  struct numap_live_stats *stats = &live->segment->stats;
+  struct numap_space_saving *ss = &live->pages.top[NUMAP_SKETCH_PAGES];
+  int nb = 0;
+  for (int i = 0; i < ss->nb; i++) {
+    struct numap_heavy_hitter *hitter = &ss->entries[i];
+    if (nb == NUMAP_LIVE_TOP_PAGES && hitter->count <= stats->top_pages[nb - 1].count) {
+      continue;
+    }
+    int j = nb < NUMAP_LIVE_TOP_PAGES ? nb++ : nb - 1;
+    while (j > 0 && stats->top_pages[j - 1].count < hitter->count) {
+      stats->top_pages[j] = stats->top_pages[j - 1];
+      j--;
+    }
+    stats->top_pages[j] = *hitter;
+  }
+  stats->nb_top_pages = nb;
+}
+
+void live_end(struct numap_live *live, struct numap_sampling_measure *measure) {
+  struct numap_live_stats *stats = &live->segment->stats;
+  live_top_pages(live);
+  stats->pid = measure->attach_pid != 0 ? measure->attach_pid : getpid();
+  stats->nb_threads = measure->nb_threads;
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    stats->tids[thread] = measure->tids[thread];
+    stats->periods[thread] = measure->period_per_tid[thread];
+  }
+  stats->time = period_controller_now();
+  stats->publications++;
+  __atomic_store_n(&live->segment->seq, live->segment->seq + 1, __ATOMIC_RELEASE);
+  __atomic_clear(&live->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps, read only, the live statistics segment name created by
+ * numap_live_open in the sampled process.
+ */
+int numap_live_attach(struct numap_live_reader *reader, const char *name) {
+  struct stat st;
+  memset(reader, 0, sizeof(struct numap_live_reader));
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return ERROR_NUMAP_SHM;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return ERROR_NUMAP_SHM;
+  }
+  if ((size_t)st.st_size < sizeof(struct numap_live_segment)) {
+    close(fd);
+    errno = EPROTO;
+    return ERROR_NUMAP_SHM;
+  }
+  const struct numap_live_segment *segment = mmap(NULL, sizeof(struct numap_live_segment), PROT_READ, MAP_SHARED,
+                                                  fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    return ERROR_NUMAP_SHM;
+  }
+  if (segment->stats.magic != NUMAP_LIVE_MAGIC || segment->stats.version != NUMAP_LIVE_VERSION) {
+    munmap((void *)segment, sizeof(struct numap_live_segment));
+    errno = EPROTO;
+    return ERROR_NUMAP_SHM;
+  }
+  reader->segment = segment;
+  return 0;
+}
+
+/**
+ * Counts the remote memory samples published since the previous
+ * snapshot of reader, once the nodes of their pages are known (a
+ * move_pages(2) call per batch on the sampled process). Samples
+ * overwritten before any snapshot saw them are unresolved.
+ */
+static void live_resolve(struct numap_live_reader *reader, const struct numap_live_stats *stats) {
+  void *pages[LIVE_RESOLVE_BATCH];
+  int status[LIVE_RESOLVE_BATCH];
+  uint64_t first = reader->nb_resolved;
+  if (stats->nb_pending - first > NUMAP_LIVE_PENDING) {
+    first = stats->nb_pending - NUMAP_LIVE_PENDING;
+  }
+  while (first < stats->nb_pending) {
+    int count = stats->nb_pending - first < LIVE_RESOLVE_BATCH ? stats->nb_pending - first : LIVE_RESOLVE_BATCH;
+    for (int i = 0; i < count; i++) {
+      pages[i] = (void *)(uintptr_t)stats->pending[(first + i) % NUMAP_LIVE_PENDING].page;
+    }
+    int resolved = numa_move_pages(stats->pid, count, pages, NULL, status, 0) == 0;
+    for (int i = 0; i < count; i++) {
+      const struct numap_live_pending *pending = &stats->pending[(first + i) % NUMAP_LIVE_PENDING];
+      reader->resolved_accesses += pending->period;
+      if (!resolved || status[i] < 0 || status[i] >= MAX_NB_NUMA_NODES) {
+        reader->unresolved += pending->period;
+        continue;
+      }
+      reader->node_accesses[pending->cpu_node][status[i]] += pending->period;
+      if (pending->weight > 0) {
+        numap_latency_histogram_add_count(&reader->node_latency[status[i]], pending->weight, pending->period);
+      }
+    }
+    first += count;
+  }
+  reader->nb_resolved = stats->nb_pending;
+  reader->unresolved += stats->pending_accesses - reader->resolved_accesses;
+  reader->resolved_accesses = stats->pending_accesses;
+}
+
+/**
+ * Copies a consistent snapshot of the live statistics into stats, with
+ * the remote memory samples counted in the node matrix. Never blocks
+ * the publishing process: gives up with ERROR_NUMAP_SHM_BUSY if the
+ * stats keep changing during the copy.
+ */
+int numap_live_snapshot(struct numap_live_reader *reader, struct numap_live_stats *stats) {
+  const struct numap_live_segment *segment = reader->segment;
+  for (int tries = 0; tries < LIVE_SNAPSHOT_TRIES; tries++) {
+    uint64_t seq = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(stats, &segment->stats, sizeof(struct numap_live_stats));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&segment->seq, __ATOMIC_RELAXED) != seq) {
+      continue;
+    }
+    live_resolve(reader, stats);
+    for (int cpu_node = 0; cpu_node < MAX_NB_NUMA_NODES; cpu_node++) {
+      for (int node = 0; node < MAX_NB_NUMA_NODES; node++) {
+        stats->node_accesses[cpu_node][node] += reader->node_accesses[cpu_node][node];
+      }
+    }
+    stats->unresolved += reader->unresolved;
+    for (int node = 0; node < MAX_NB_NUMA_NODES; node++) {
+      numap_latency_histogram_merge(&stats->node_latency[node], &reader->node_latency[node]);
+    }
+    return 0;
+  }
+  return ERROR_NUMAP_SHM_BUSY;
+}
+
+void numap_live_detach(struct numap_live_reader *reader) {
+  if (reader->segment != NULL) {
+    munmap((void *)reader->segment, sizeof(struct numap_live_segment));
+    reader->segment = NULL;
+  }
+}
+
+int numap_live_print(struct numap_live_stats *stats, int nb_pages) {
+  printf("\nLive statistics of process %d: %" PRIu64 " publications\n", (int)stats->pid, stats->publications);
+  for (int thread = 0; thread < stats->nb_threads && thread < MAX_NB_THREADS; thread++) {
+    uint64_t samples = stats->thread_samples[thread];
+    uint64_t *classes = stats->thread_classes[thread];
+    uint64_t remote = classes[NUMAP_CLASS_REMOTE_MEMORY] + classes[NUMAP_CLASS_REMOTE_CACHE];
+    uint64_t memory = classes[NUMAP_CLASS_LOCAL_MEMORY] + remote;
+    printf("Thread %-8d period %-8" PRIu64 " %-10" PRIu64 " samples %-8" PRIu64 " lost remote %5.1f%%",
+           (int)stats->tids[thread], stats->periods[thread], samples, stats->thread_lost[thread],
+           memory ? 100.0 * remote / memory : 0.0);
+    for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+      if (classes[c] != 0) {
+        printf(" %s %0.1f%%", sample_class_names[c], 100.0 * classes[c] / samples);
+      }
+    }
+    printf("\n");
+  }
+  printf("Memory accesses per cpu node (rows) and memory node (columns), %" PRIu64 " unresolved\n", stats->unresolved);
+  for (int cpu_node = 0; cpu_node < stats->nb_nodes; cpu_node++) {
+    printf("  node %-2d", cpu_node);
+    for (int mem_node = 0; mem_node < stats->nb_nodes; mem_node++) {
+      printf(" %10" PRIu64, stats->node_accesses[cpu_node][mem_node]);
+    }
+    printf("\n");
+  }
+  for (int node = 0; node < stats->nb_nodes; node++) {
+    struct numap_latency_histogram *histogram = &stats->node_latency[node];
+    if (histogram->count == 0) {
+      continue;
+    }
+    printf("Memory node %-2d latency p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 " cycles\n", node,
+           numap_latency_histogram_percentile(histogram, 50), numap_latency_histogram_percentile(histogram, 90),
+           numap_latency_histogram_percentile(histogram, 99), histogram->max);
+  }
+  for (int i = 0; i < nb_pages && i < stats->nb_top_pages; i++) {
+    printf("Page %#-16" PRIx64 " %-8" PRIu64 " accesses\n", stats->top_pages[i].key, stats->top_pages[i].count);
+  }
+  return 0;
+}
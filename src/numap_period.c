@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Bounds of the period change applied at each refresh, so that a single
+ * burst cannot move the period too far.
+ */
+#define PERIOD_MAX_STEP 4.0
+/**
+ * Relative change under which the period is left untouched, to avoid
+ * an ioctl at every refresh.
+ */
+#define PERIOD_HYSTERESIS 0.125
+
+double period_controller_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Makes numap adjust the sampling period of each thread at every refresh
+ * (each nb_refresh samples) so that the thread produces about
+ * target_samples_per_sec samples per second and that the handler does
+ * not take more than max_overhead (a fraction, e.g. 0.02) of the time.
+ * A zero target disables the corresponding constraint. The period stays
+ * within [min_period, max_period] and is doubled whenever the kernel
+ * loses samples. Has to be called before the measure starts.
+ *
+ * Samples then carry PERF_SAMPLE_PERIOD, so that each drained batch
+ * records the period it was sampled with, and period_per_tid holds the
+ * active period of each thread.
+ */
+int numap_sampling_set_adaptive_period(struct numap_sampling_measure *measure, double target_samples_per_sec,
+                                       double max_overhead, uint64_t min_period, uint64_t max_period) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  if ((target_samples_per_sec <= 0 && max_overhead <= 0) || min_period == 0 || min_period > max_period) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  // The controller runs on refresh signals, which attached measures do without
+  if (measure->attach_pid != 0) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  measure->adaptive = 1;
+  measure->target_samples_per_sec = target_samples_per_sec;
+  measure->max_overhead = max_overhead;
+  measure->min_period = min_period;
+  measure->max_period = max_period;
+  return 0;
+}
+
+void period_controller_start_thread(struct numap_sampling_measure *measure, int thread, double now) {
+  for (int stream = 0; stream < NUMAP_MAX_STREAMS; stream++) {
+    measure->last_refresh_per_stream[stream][thread] = now;
+    measure->rate_per_stream[stream][thread] = 0;
+    measure->overhead_per_stream[stream][thread] = 0;
+  }
+}
+
+void period_controller_start(struct numap_sampling_measure *measure) {
+  double now = period_controller_now();
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+      measure->scanned_per_stream[stream][thread] = metadata_page ? metadata_page->data_head : 0;
+    }
+    period_controller_start_thread(measure, thread, now);
+  }
+}
+
+/**
+ * Counts the samples lost by the kernel in a stream of thread since the
+ * last scan. Must run before the user handler releases the records.
+ */
+void period_controller_scan(struct numap_sampling_measure *measure, int stream, int thread) {
+  struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+  uint8_t *data = (uint8_t *)metadata_page + measure->page_size;
+  uint64_t data_size = measure_ring_len(measure, thread) - measure->page_size;
+  uint64_t head = metadata_page->data_head;
+  rmb();
+  uint64_t pos = measure->scanned_per_stream[stream][thread];
+  if (pos < metadata_page->data_tail) {
+    pos = metadata_page->data_tail;
+  }
+  while (pos < head) {
+    // Records are 8 bytes aligned: neither a header nor a field wraps
+    struct perf_event_header *header = (struct perf_event_header *)(data + pos % data_size);
+    if (header->size == 0) {
+      break;
+    }
+    if (header->type == PERF_RECORD_LOST) {
+      // struct { header; u64 id; u64 lost; }
+      measure->lost_per_tid[thread] += *(uint64_t *)(data + (pos + 16) % data_size);
+    }
+    pos += header->size;
+  }
+  measure->scanned_per_stream[stream][thread] = pos;
+}
+
+/**
+ * Called after each refresh of a stream of thread: the stream produced
+ * nb_refresh samples since its previous refresh, and the handler took
+ * drain_time seconds. The budgets apply to the thread, that is to the
+ * sum of the latest rates and overheads of its streams.
+ */
+void period_controller_update(struct numap_sampling_measure *measure, int stream, int thread, uint64_t lost,
+                              double drain_time) {
+  double now = period_controller_now();
+  double elapsed = now - measure->last_refresh_per_stream[stream][thread];
+  measure->last_refresh_per_stream[stream][thread] = now;
+  if (elapsed <= 0) {
+    return;
+  }
+  measure->rate_per_stream[stream][thread] = measure->nb_refresh / elapsed;
+  measure->overhead_per_stream[stream][thread] = drain_time / elapsed;
+  double rate = 0;
+  double overhead = 0;
+  for (int s = 0; s < measure->nb_streams; s++) {
+    rate += measure->rate_per_stream[s][thread];
+    overhead += measure->overhead_per_stream[s][thread];
+  }
+
+  // factor > 1 lengthens the period: the most constraining budget wins
+  double factor = 0;
+  if (measure->target_samples_per_sec > 0) {
+    factor = rate / measure->target_samples_per_sec;
+  }
+  if (measure->max_overhead > 0) {
+    if (overhead / measure->max_overhead > factor) {
+      factor = overhead / measure->max_overhead;
+    }
+  }
+  if (lost > 0 && factor < 2) {
+    factor = 2;
+  }
+  if (factor > PERIOD_MAX_STEP) {
+    factor = PERIOD_MAX_STEP;
+  } else if (factor < 1 / PERIOD_MAX_STEP) {
+    factor = 1 / PERIOD_MAX_STEP;
+  }
+
+  uint64_t period = measure->period_per_tid[thread];
+  double wanted = period * factor;
+  if (wanted < measure->min_period) {
+    wanted = measure->min_period;
+  } else if (wanted > measure->max_period) {
+    wanted = measure->max_period;
+  }
+  if (wanted > period * (1 - PERIOD_HYSTERESIS) && wanted < period * (1 + PERIOD_HYSTERESIS)) {
+    return;
+  }
+  // The events of all the streams of thread share the period
+  uint64_t new_period = (uint64_t)wanted;
+  for (int s = 0; s < measure->nb_streams; s++) {
+    if (*measure_ring(measure, s, thread) != NULL &&
+        ioctl(*measure_fd(measure, s, thread), PERF_EVENT_IOC_PERIOD, &new_period) == 0) {
+      measure->period_per_tid[thread] = new_period;
+    }
+  }
+  // The rates measured at the old period scale with it until their next refresh
+  double scale = (double)period / measure->period_per_tid[thread];
+  for (int s = 0; s < measure->nb_streams; s++) {
+    measure->rate_per_stream[s][thread] *= scale;
+    measure->overhead_per_stream[s][thread] *= scale;
+  }
+}
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Time windowed analysis: samples are bucketed by timestamp into fixed
+ * windows, each with its data source classes, its hottest pages and its
+ * latency percentiles, every sample counting for the accesses of its
+ * period. Consecutive windows are then grouped into phases:
+ * a phase ends when NUMAP_PHASE_MIN_WINDOWS windows in a row differ
+ * from the phase so far, by their classes or by their median latency,
+ * by more than the threshold. Fewer windows that differ are noise: they
+ * count in the phase, but the next windows are not compared to them.
+ */
+
+#define NUMAP_MAX_WINDOWS 65536
+#define NUMAP_PHASE_MIN_WINDOWS 2
+#define NUMAP_PHASE_THRESHOLD 0.2
+// Page number in the low bits of the key, window index in the high ones
+#define KEY_WINDOW_SHIFT 36
+
+struct phase_page {
+  uint64_t key;
+  uint64_t accesses;
+};
+
+struct phase_state {
+  uint64_t start;
+  uint64_t end;
+  uint64_t window_ns;
+  int page_shift;
+  struct numap_phases *phases;
+  struct numap_latency_histogram *histograms;
+  struct u64_map pages_map;
+  struct phase_page *pages;
+  size_t pages_capacity;
+};
+
+int numap_sample_class(union perf_mem_data_src data_src) {
+  if (is_served_by_local_cache1(data_src)) {
+    return NUMAP_CLASS_L1;
+  }
+  if (is_served_by_local_lfb(data_src)) {
+    return NUMAP_CLASS_LFB;
+  }
+  if (is_served_by_local_cache2(data_src)) {
+    return NUMAP_CLASS_L2;
+  }
+  if (is_served_by_local_cache3(data_src)) {
+    return NUMAP_CLASS_L3;
+  }
+  if (is_served_by_local_memory(data_src)) {
+    return NUMAP_CLASS_LOCAL_MEMORY;
+  }
+  if (is_served_by_remote_memory(data_src)) {
+    return NUMAP_CLASS_REMOTE_MEMORY;
+  }
+  if (data_src.mem_lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2)) {
+    return NUMAP_CLASS_REMOTE_CACHE;
+  }
+  return NUMAP_CLASS_OTHER;
+}
+
+const char *sample_class_names[NUMAP_NB_CLASSES] = {
+  "L1", "LFB", "L2", "L3", "local mem", "remote cache", "remote mem", "other"
+};
+
+static int bounds_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct phase_state *state = arg;
+  if (sample->time < state->start) {
+    state->start = sample->time;
+  }
+  if (sample->time > state->end) {
+    state->end = sample->time;
+  }
+  return 0;
+}
+
+static int phase_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct phase_state *state = arg;
+  uint64_t index = (sample->time - state->start) / state->window_ns;
+  struct numap_window *window = &state->phases->windows[index];
+  uint64_t period = sample_period(measure, thread, sample);
+  window->samples++;
+  window->accesses += period;
+  window->classes[numap_sample_class(sample->data_src)] += period;
+  if (sample->weight > 0) {
+    numap_latency_histogram_add_count(&state->histograms[index], sample->weight, period);
+  }
+
+  uint64_t key = ((sample->addr >> state->page_shift) & ((1ULL << KEY_WINDOW_SHIFT) - 1)) |
+    (index << KEY_WINDOW_SHIFT);
+  int inserted;
+  int64_t page_index = u64_map_get(&state->pages_map, key, &inserted);
+  if (page_index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&state->pages, &state->pages_capacity, page_index + 1, sizeof(struct phase_page)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    state->pages[page_index].key = key;
+    state->pages[page_index].accesses = 0;
+  }
+  state->pages[page_index].accesses += period;
+  return 0;
+}
+
+/**
+ * Keeps the NUMAP_WINDOW_HOT_PAGES pages of window with the most
+ * accesses, hottest first.
+ */
+static void window_add_page(struct numap_window *window, uint64_t page, uint64_t accesses) {
+  window->nb_pages++;
+  int slot = window->nb_hot_pages < NUMAP_WINDOW_HOT_PAGES ? window->nb_hot_pages++ : NUMAP_WINDOW_HOT_PAGES - 1;
+  if (slot == NUMAP_WINDOW_HOT_PAGES - 1 && window->hot_accesses[slot] >= accesses) {
+    return;
+  }
+  while (slot > 0 && window->hot_accesses[slot - 1] < accesses) {
+    window->hot_pages[slot] = window->hot_pages[slot - 1];
+    window->hot_accesses[slot] = window->hot_accesses[slot - 1];
+    slot--;
+  }
+  window->hot_pages[slot] = page;
+  window->hot_accesses[slot] = accesses;
+}
+
+/**
+ * Distance, between 0 and 1, of window to the classes and median
+ * latency of the phase so far.
+ */
+static double phase_distance(struct numap_window *window, uint64_t *classes, uint64_t accesses, double latency) {
+  double distance = 0;
+  for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+    double a = (double)window->classes[c] / window->accesses;
+    double b = (double)classes[c] / accesses;
+    distance += a > b ? a - b : b - a;
+  }
+  distance /= 2;
+  if (window->p50 > 0 && latency > 0) {
+    double max = window->p50 > latency ? window->p50 : latency;
+    double min = window->p50 > latency ? latency : window->p50;
+    double latency_distance = (max - min) / max;
+    if (latency_distance > distance) {
+      distance = latency_distance;
+    }
+  }
+  return distance;
+}
+
+static int phase_add(struct numap_phases *phases, size_t first_window) {
+  struct numap_phase *phase = realloc(phases->phases, (phases->nb_phases + 1) * sizeof(struct numap_phase));
+  if (phase == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  phases->phases = phase;
+  phase = &phases->phases[phases->nb_phases++];
+  memset(phase, 0, sizeof(struct numap_phase));
+  phase->first_window = first_window;
+  return 0;
+}
+
+static void phase_account(struct numap_phase *phase, struct numap_window *window) {
+  phase->samples += window->samples;
+  phase->accesses += window->accesses;
+  for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+    phase->classes[c] += window->classes[c];
+  }
+  // Access weighted mean of the medians of the windows
+  phase->latency_sum += (double)window->p50 * window->accesses;
+}
+
+static int phases_detect(struct numap_phases *phases, double threshold) {
+  size_t candidate = 0;
+  int nb_candidates = 0;
+  // Windows are compared to those of the current phase, without the noise
+  struct numap_phase reference;
+  memset(&reference, 0, sizeof(reference));
+  for (size_t w = 0; w < phases->nb_windows; w++) {
+    struct numap_window *window = &phases->windows[w];
+    if (window->samples == 0) {
+      continue;
+    }
+    if (phases->nb_phases == 0) {
+      if (phase_add(phases, w) != 0) {
+        return ERROR_NUMAP_MALLOC;
+      }
+      phase_account(&phases->phases[0], window);
+      reference = phases->phases[0];
+      continue;
+    }
+    struct numap_phase *phase = &phases->phases[phases->nb_phases - 1];
+    double distance = phase_distance(window, reference.classes, reference.accesses,
+                                     reference.latency_sum / reference.accesses);
+    if (distance <= threshold) {
+      // Windows that looked different were only noise
+      for (; nb_candidates > 0; candidate++) {
+        if (phases->windows[candidate].samples > 0) {
+          phase_account(phase, &phases->windows[candidate]);
+          nb_candidates--;
+        }
+      }
+      phase_account(phase, window);
+      phase_account(&reference, window);
+      continue;
+    }
+    if (nb_candidates++ == 0) {
+      candidate = w;
+    }
+    if (nb_candidates < NUMAP_PHASE_MIN_WINDOWS) {
+      continue;
+    }
+    if (phase_add(phases, candidate) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    phase = &phases->phases[phases->nb_phases - 1];
+    for (; candidate <= w; candidate++) {
+      if (phases->windows[candidate].samples > 0) {
+        phase_account(phase, &phases->windows[candidate]);
+      }
+    }
+    reference = *phase;
+    nb_candidates = 0;
+  }
+  // Trailing windows that did not make a phase stay in the last one
+  for (; nb_candidates > 0; candidate++) {
+    if (phases->windows[candidate].samples > 0) {
+      phase_account(&phases->phases[phases->nb_phases - 1], &phases->windows[candidate]);
+      nb_candidates--;
+    }
+  }
+  for (int p = 0; p < phases->nb_phases; p++) {
+    struct numap_phase *phase = &phases->phases[p];
+    size_t end = p + 1 < phases->nb_phases ? phases->phases[p + 1].first_window : phases->nb_windows;
+    phase->nb_windows = end - phase->first_window;
+    for (size_t w = phase->first_window; w < end; w++) {
+      phases->windows[w].phase = p;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Buckets the samples of measure into windows of window_seconds, using
+ * their timestamps, and splits the measure into phases. The measure has
+ * to sample PERF_SAMPLE_TIME, e.g. with NUMAP_ANALYSIS_SAMPLE_TYPE:
+ * measures started by numap_sampling_read_start or
+ * numap_sampling_write_start give ERROR_NUMAP_SAMPLE_TYPE. threshold is
+ * the distance (between 0 and 1) above which a window does not belong
+ * to the current phase, 0 for the default. phases has to be freed with
+ * numap_phases_free.
+ */
+int numap_sampling_phases(struct numap_sampling_measure *measure, double window_seconds, double threshold,
+                          struct numap_phases *phases) {
+  struct phase_state state;
+  int res;
+
+  if (!(measure->sample_type & PERF_SAMPLE_TIME)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  if (window_seconds <= 0 || threshold < 0 || threshold > 1) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  if (threshold == 0) {
+    threshold = NUMAP_PHASE_THRESHOLD;
+  }
+  memset(phases, 0, sizeof(struct numap_phases));
+  memset(&state, 0, sizeof(state));
+  state.start = UINT64_MAX;
+  state.window_ns = (uint64_t)(window_seconds * 1e9);
+  if (state.window_ns == 0) {
+    state.window_ns = 1;
+  }
+  state.page_shift = __builtin_ctzll(measure->page_size);
+  state.phases = phases;
+  res = numap_sampling_foreach_sample(measure, bounds_sample, &state);
+  if (res != 0 || state.start == UINT64_MAX) {
+    return res;
+  }
+  uint64_t nb_windows = (state.end - state.start) / state.window_ns + 1;
+  if (nb_windows > NUMAP_MAX_WINDOWS) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  phases->start = state.start;
+  phases->window_ns = state.window_ns;
+  phases->nb_windows = nb_windows;
+  phases->windows = calloc(nb_windows, sizeof(struct numap_window));
+  state.histograms = calloc(nb_windows, sizeof(struct numap_latency_histogram));
+  if (phases->windows == NULL || state.histograms == NULL || u64_map_init(&state.pages_map, 4096) != 0) {
+    res = ERROR_NUMAP_MALLOC;
+    goto out;
+  }
+
+  res = numap_sampling_foreach_sample(measure, phase_sample, &state);
+  if (res != 0) {
+    goto out;
+  }
+  for (size_t i = 0; i < state.pages_map.count; i++) {
+    uint64_t key = state.pages[i].key;
+    window_add_page(&phases->windows[key >> KEY_WINDOW_SHIFT],
+                    (key & ((1ULL << KEY_WINDOW_SHIFT) - 1)) << state.page_shift, state.pages[i].accesses);
+  }
+  for (size_t w = 0; w < nb_windows; w++) {
+    struct numap_window *window = &phases->windows[w];
+    window->start = state.start + w * state.window_ns;
+    window->p50 = numap_latency_histogram_percentile(&state.histograms[w], 50);
+    window->p90 = numap_latency_histogram_percentile(&state.histograms[w], 90);
+    window->p99 = numap_latency_histogram_percentile(&state.histograms[w], 99);
+  }
+  res = phases_detect(phases, threshold);
+
+ out:
+  if (res != 0) {
+    numap_phases_free(phases);
+  }
+  free(state.histograms);
+  free(state.pages);
+  u64_map_free(&state.pages_map);
+  return res;
+}
+
+static void print_classes(uint64_t *classes, uint64_t accesses) {
+  for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+    if (classes[c] > 0) {
+      printf(" %s %0.1f%%", sample_class_names[c], 100.0 * classes[c] / accesses);
+    }
+  }
+}
+
+int numap_phases_print(struct numap_phases *phases, char print_windows) {
+  printf("\n%d phases over %zu windows of %0.3fs\n", phases->nb_phases, phases->nb_windows, phases->window_ns / 1e9);
+  for (int p = 0; p < phases->nb_phases; p++) {
+    struct numap_phase *phase = &phases->phases[p];
+    printf("Phase %d: %0.3fs - %0.3fs %-8" PRIu64 " samples p50 %0.0f,", p,
+           phase->first_window * phases->window_ns / 1e9,
+           (phase->first_window + phase->nb_windows) * phases->window_ns / 1e9,
+           phase->samples, phase->accesses ? phase->latency_sum / phase->accesses : 0.0);
+    print_classes(phase->classes, phase->accesses);
+    printf("\n");
+    if (!print_windows) {
+      continue;
+    }
+    for (size_t w = phase->first_window; w < phase->first_window + phase->nb_windows; w++) {
+      struct numap_window *window = &phases->windows[w];
+      if (window->samples == 0) {
+        continue;
+      }
+      printf("  %0.3fs: %-8" PRIu64 " samples %-6" PRIu64 " pages p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 ",",
+             (window->start - phases->start) / 1e9, window->samples, window->nb_pages, window->p50, window->p90,
+             window->p99);
+      print_classes(window->classes, window->accesses);
+      if (window->nb_hot_pages > 0) {
+        printf(", hottest page %#" PRIx64 " (%" PRIu64 " accesses)", window->hot_pages[0], window->hot_accesses[0]);
+      }
+      printf("\n");
+    }
+  }
+  return 0;
+}
+
+void numap_phases_free(struct numap_phases *phases) {
+  free(phases->windows);
+  free(phases->phases);
+  phases->windows = NULL;
+  phases->phases = NULL;
+  phases->nb_windows = 0;
+  phases->nb_phases = 0;
+}
@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <numa.h>
+#include <numaif.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Page placement advisor: the samples served by memory are counted per
+ * page and per accessing cpu node, and each page is proposed the node
+ * where its accesses would be the cheapest. A move is only proposed
+ * when the target node clearly dominates the accesses (hysteresis) and
+ * when the latency it saves over the horizon pays for the migration.
+ */
+
+#define PLACEMENT_BATCH 256
+
+struct placement_state {
+  uint64_t page_mask;
+  int nb_nodes;
+  struct u64_map pages_map;
+  struct numap_page_placement *pages;
+  size_t pages_capacity;
+};
+
+void numap_placement_params_init(struct numap_placement_params *params) {
+  params->min_samples = NUMAP_PLACEMENT_MIN_SAMPLES;
+  params->hysteresis = NUMAP_PLACEMENT_HYSTERESIS;
+  params->migration_cycles = NUMAP_PLACEMENT_MIGRATION_CYCLES;
+  params->horizon = 1.0;
+  params->max_bytes_per_sec = 0;
+}
+
+static int placement_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct placement_state *state = arg;
+  if (!is_served_by_local_memory(sample->data_src) && !is_served_by_remote_memory(sample->data_src)) {
+    return 0;
+  }
+  int node = sample_cpu_node(measure, sample);
+  if (node < 0) {
+    return 0;
+  }
+  uint64_t page = sample->addr & state->page_mask;
+  int inserted;
+  int64_t index = u64_map_get(&state->pages_map, page, &inserted);
+  if (index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&state->pages, &state->pages_capacity, index + 1, sizeof(struct numap_page_placement)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&state->pages[index], 0, sizeof(struct numap_page_placement));
+    state->pages[index].page = page;
+    state->pages[index].node = -1;
+    state->pages[index].target = -1;
+  }
+  struct numap_page_placement *pp = &state->pages[index];
+  uint64_t period = sample_period(measure, thread, sample);
+  pp->samples++;
+  pp->node_samples[node]++;
+  pp->node_cycles[node] += (double)sample->weight * period;
+  return 0;
+}
+
+/**
+ * Estimated cycles spent accessing pp if it was on node mem_node. The
+ * sampled latencies were paid with the page on its current node, so
+ * they are scaled by the latency factor of each node pair.
+ */
+static double placement_cycles(struct numap_sampling_measure *measure, struct numap_page_placement *pp, int nb_nodes,
+                               int mem_node) {
+  double cycles = 0;
+  for (int cpu_node = 0; cpu_node < nb_nodes; cpu_node++) {
+    if (pp->node_samples[cpu_node] == 0) {
+      continue;
+    }
+    cycles += pp->node_cycles[cpu_node] * remote_latency_factor(measure, cpu_node, mem_node) /
+      remote_latency_factor(measure, cpu_node, pp->node);
+  }
+  return cycles;
+}
+
+static void placement_decide(struct numap_sampling_measure *measure, struct numap_page_placement *pp, int nb_nodes,
+                             struct numap_placement_params *params) {
+  if (pp->node < 0 || pp->samples < params->min_samples) {
+    return;
+  }
+  int best = pp->node;
+  double best_cycles = placement_cycles(measure, pp, nb_nodes, pp->node);
+  double current_cycles = best_cycles;
+  for (int node = 0; node < nb_nodes; node++) {
+    if (node == pp->node || pp->node_samples[node] == 0) {
+      continue;
+    }
+    double cycles = placement_cycles(measure, pp, nb_nodes, node);
+    if (cycles < best_cycles) {
+      best = node;
+      best_cycles = cycles;
+    }
+  }
+  if (best == pp->node) {
+    return;
+  }
+  // Hysteresis: pages accessed evenly from several nodes stay where they are
+  if (pp->node_samples[best] < params->hysteresis * pp->node_samples[pp->node]) {
+    return;
+  }
+  double gain = (current_cycles - best_cycles) * params->horizon;
+  if (gain <= params->migration_cycles) {
+    return;
+  }
+  pp->target = best;
+  pp->gain = gain - params->migration_cycles;
+}
+
+static int compare_page_placement(const void *a, const void *b) {
+  const struct numap_page_placement *pa = a;
+  const struct numap_page_placement *pb = b;
+  if (pa->gain != pb->gain) {
+    return pa->gain < pb->gain ? 1 : -1;
+  }
+  return pa->page < pb->page ? -1 : (pa->page > pb->page ? 1 : 0);
+}
+
+/**
+ * Proposes a target node for the hot pages of measure (see struct
+ * numap_placement_params). params can be NULL for the defaults. Pages
+ * to move come first in plan, by decreasing gain. pages has to be freed
+ * with numap_placement_free.
+ */
+int numap_sampling_placement(struct numap_sampling_measure *measure, struct numap_placement_params *params,
+                             struct numap_placement_plan *plan) {
+  struct numap_placement_params defaults;
+  struct placement_state state;
+  int res;
+
+  int nb_nodes = measure_nb_nodes(measure);
+  if (nb_nodes < 0) {
+    return ERROR_NUMAP_NOT_NUMA;
+  }
+  if (!(measure->sample_type & PERF_SAMPLE_ADDR) || !(measure->sample_type & PERF_SAMPLE_DATA_SRC)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  if (params == NULL) {
+    numap_placement_params_init(&defaults);
+    params = &defaults;
+  }
+  if (params->hysteresis < 1.0 || params->horizon <= 0 || params->migration_cycles < 0) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  memset(plan, 0, sizeof(struct numap_placement_plan));
+  plan->nb_nodes = nb_nodes;
+
+  memset(&state, 0, sizeof(state));
+  state.nb_nodes = plan->nb_nodes;
+  state.page_mask = ~((uint64_t)measure->page_size - 1);
+  if (u64_map_init(&state.pages_map, 4096) != 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+
+  res = numap_sampling_foreach_sample(measure, placement_sample, &state);
+  if (res != 0) {
+    goto out;
+  }
+
+  size_t nb_pages = state.pages_map.count;
+  entries_resolve_nodes(measure, state.pages, nb_pages, sizeof(struct numap_page_placement),
+                        offsetof(struct numap_page_placement, page), offsetof(struct numap_page_placement, node));
+
+  for (size_t i = 0; i < nb_pages; i++) {
+    placement_decide(measure, &state.pages[i], plan->nb_nodes, params);
+    if (state.pages[i].target >= 0) {
+      plan->nb_moves++;
+      plan->gain += state.pages[i].gain;
+    }
+  }
+  qsort(state.pages, nb_pages, sizeof(struct numap_page_placement), compare_page_placement);
+  plan->page_size = measure->page_size;
+  plan->max_bytes_per_sec = params->max_bytes_per_sec;
+  plan->nb_pages = nb_pages;
+  plan->pages = state.pages;
+  state.pages = NULL;
+
+ out:
+  free(state.pages);
+  u64_map_free(&state.pages_map);
+  return res;
+}
+
+static void placement_throttle(struct numap_placement_plan *plan, double start, uint64_t bytes) {
+  if (plan->max_bytes_per_sec <= 0) {
+    return;
+  }
+  double wait = bytes / plan->max_bytes_per_sec - (period_controller_now() - start);
+  if (wait > 0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+  }
+}
+
+/**
+ * Moves the pages of plan to their target node with batched
+ * move_pages(2) calls, in the address space of the sampled threads of
+ * measure, at most max_bytes_per_sec of the plan. The status of each
+ * page is set to its new node or to a negative errno.
+ */
+int numap_placement_apply(struct numap_sampling_measure *measure, struct numap_placement_plan *plan) {
+  void *batch[PLACEMENT_BATCH];
+  int nodes[PLACEMENT_BATCH];
+  int status[PLACEMENT_BATCH];
+  size_t indexes[PLACEMENT_BATCH];
+
+  if (measure->replay) {
+    return ERROR_NUMAP_REPLAY;
+  }
+  plan->moved = 0;
+  plan->failed = 0;
+  double start = period_controller_now();
+  uint64_t bytes = 0;
+  size_t i = 0;
+  while (i < plan->nb_pages) {
+    size_t count = 0;
+    for (; i < plan->nb_pages && count < PLACEMENT_BATCH; i++) {
+      struct numap_page_placement *pp = &plan->pages[i];
+      if (pp->target < 0) {
+        continue;
+      }
+      batch[count] = (void *)(uintptr_t)pp->page;
+      nodes[count] = pp->target;
+      indexes[count] = i;
+      count++;
+    }
+    if (count == 0) {
+      break;
+    }
+    long res = -1;
+    for (int thread = 0; thread < measure->nb_threads && res != 0; thread++) {
+      res = move_pages(measure->tids[thread], count, batch, nodes, status, MPOL_MF_MOVE);
+    }
+    if (res < 0) {
+      last_sys_errno = errno;
+      return ERROR_NUMAP_MOVE_PAGES;
+    }
+    for (size_t j = 0; j < count; j++) {
+      struct numap_page_placement *pp = &plan->pages[indexes[j]];
+      pp->status = status[j];
+      if (status[j] == pp->target) {
+        plan->moved++;
+      } else {
+        plan->failed++;
+      }
+    }
+    bytes += count * plan->page_size;
+    placement_throttle(plan, start, bytes);
+  }
+  return 0;
+}
+
+int numap_placement_print(struct numap_placement_plan *plan, size_t nb_pages) {
+  printf("\nPage placement: %zu pages sampled, %zu to move, %.4g cycles saved\n", plan->nb_pages, plan->nb_moves,
+         plan->gain);
+  if (plan->moved || plan->failed) {
+    printf("%zu pages moved, %zu failed\n", plan->moved, plan->failed);
+  }
+  for (size_t page = 0; page < nb_pages && page < plan->nb_moves; page++) {
+    struct numap_page_placement *pp = &plan->pages[page];
+    printf("Page %#" PRIx64 ": node %d -> node %d %-8" PRIu64 " samples %.4g cycles saved, samples per node",
+           pp->page, pp->node, pp->target, pp->samples, pp->gain);
+    for (int node = 0; node < plan->nb_nodes; node++) {
+      printf(" %" PRIu64, pp->node_samples[node]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+void numap_placement_free(struct numap_placement_plan *plan) {
+  free(plan->pages);
+  plan->pages = NULL;
+  plan->nb_pages = 0;
+  plan->nb_moves = 0;
+}
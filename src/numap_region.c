@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Address space regions: an interval index of the mappings of the
+ * sampled processes, sorted by pid then start address, that classifies
+ * the address of each sample as heap, stack (of which thread), private
+ * anonymous memory, file mapping or shared memory. It is read from
+ * /proc/<pid>/maps when a process is first sampled, then kept up to date
+ * by the mmap records of the rings: later mappings replace the parts of
+ * earlier ones they overlap (unmaps are not reported), and an exec
+ * empties the address space of its process. The stack of a thread is
+ * the mapping holding the stack pointer of its samples, taken with
+ * PERF_SAMPLE_REGS_USER (on x86_64 and aarch64), or of the thread
+ * itself while it is blocked in a system call when the mappings are
+ * read.
+ *
+ * The index is updated by the refresh handler, in signal context: it
+ * has a fixed capacity and, like the sketch, updates are serialized by
+ * a spin lock taken with SIGIO blocked, while readers take snapshots
+ * with a sequence count.
+ */
+
+#define REGIONS_DEFAULT_CAPACITY 4096
+
+static const char *region_type_names[NUMAP_NB_REGION_TYPES] = {
+  "unknown", "heap", "stack", "anon", "file", "shm"
+};
+
+static void regions_lock(struct numap_regions *regions) {
+  while (__atomic_test_and_set(&regions->lock, __ATOMIC_ACQUIRE)) {
+  }
+  __atomic_store_n(&regions->seq, regions->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void regions_unlock(struct numap_regions *regions) {
+  __atomic_store_n(&regions->seq, regions->seq + 1, __ATOMIC_RELEASE);
+  __atomic_clear(&regions->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sequence count to read the regions from, once no update is going on.
+ */
+static uint64_t read_begin(struct numap_regions *regions) {
+  uint64_t seq;
+  while ((seq = __atomic_load_n(&regions->seq, __ATOMIC_ACQUIRE)) & 1) {
+  }
+  return seq;
+}
+
+/**
+ * Whether the regions were updated since read_begin returned seq.
+ */
+static int read_retry(struct numap_regions *regions, uint64_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&regions->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * Sets up regions to index at most capacity mappings (0 for a default
+ * of 4096).
+ */
+int numap_regions_init(struct numap_regions *regions, int capacity) {
+  if (capacity < 0) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  memset(regions, 0, sizeof(struct numap_regions));
+  regions->capacity = capacity ? capacity : REGIONS_DEFAULT_CAPACITY;
+  regions->regions = calloc(regions->capacity, sizeof(struct numap_region));
+  if (regions->regions == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  return 0;
+}
+
+void numap_regions_free(struct numap_regions *regions) {
+  free(regions->regions);
+  memset(regions, 0, sizeof(struct numap_regions));
+}
+
+/**
+ * Type of a mapping from its name, as in /proc/<pid>/maps or in mmap
+ * records, and whether it is shared.
+ */
+static int region_type(const char *name, int shared) {
+  if (strcmp(name, "[heap]") == 0) {
+    return NUMAP_REGION_HEAP;
+  }
+  if (strncmp(name, "[stack", 6) == 0) {
+    return NUMAP_REGION_STACK;
+  }
+  if (strncmp(name, "/dev/shm/", 9) == 0 || strncmp(name, "/SYSV", 5) == 0 || strncmp(name, "/memfd:", 7) == 0 ||
+      strncmp(name, "[anon_shmem:", 12) == 0) {
+    return NUMAP_REGION_SHM;
+  }
+  if (name[0] == '\0' || strncmp(name, "/dev/zero", 9) == 0) {
+    return shared ? NUMAP_REGION_SHM : NUMAP_REGION_ANON;
+  }
+  // [vdso], [vvar], named anonymous memory ([anon:...])
+  if (name[0] == '[') {
+    return NUMAP_REGION_ANON;
+  }
+  return NUMAP_REGION_FILE;
+}
+
+/**
+ * Index of the first region after (pid, addr).
+ */
+static int upper_bound(struct numap_regions *regions, uint32_t pid, uint64_t addr) {
+  int low = 0;
+  int high = __atomic_load_n(&regions->nb_regions, __ATOMIC_RELAXED);
+  if (high > regions->capacity) {
+    high = regions->capacity;
+  }
+  while (low < high) {
+    int middle = (low + high) / 2;
+    struct numap_region *region = &regions->regions[middle];
+    if (region->pid < pid || (region->pid == pid && region->start <= addr)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static struct numap_region *find_region(struct numap_regions *regions, uint32_t pid, uint64_t addr) {
+  int i = upper_bound(regions, pid, addr) - 1;
+  if (i >= 0 && regions->regions[i].pid == pid && addr < regions->regions[i].end) {
+    return &regions->regions[i];
+  }
+  return NULL;
+}
+
+static void insert_at(struct numap_regions *regions, int i, struct numap_region *region) {
+  memmove(&regions->regions[i + 1], &regions->regions[i], (regions->nb_regions - i) * sizeof(struct numap_region));
+  regions->regions[i] = *region;
+  regions->nb_regions++;
+}
+
+/**
+ * Indexes region, replacing the parts of the regions of its process that
+ * it overlaps. The statistics of the regions it covers entirely, with
+ * the same type and name (e.g. the heap growing), carry over. Called
+ * with the lock held.
+ */
+static void insert_region(struct numap_regions *regions, struct numap_region *region) {
+  if (region->start >= region->end) {
+    return;
+  }
+  int i = upper_bound(regions, region->pid, region->start);
+  if (i > 0) {
+    struct numap_region *prev = &regions->regions[i - 1];
+    if (prev->pid == region->pid && prev->start == region->start) {
+      i--;
+    } else if (prev->pid == region->pid && prev->end > region->end) {
+      // region splits prev in two
+      if (regions->nb_regions + 2 > regions->capacity) {
+        regions->dropped++;
+        return;
+      }
+      struct numap_region tail = *prev;
+      tail.pgoff += region->end - prev->start;
+      tail.start = region->end;
+      tail.accesses = 0;
+      tail.latency = 0;
+      memset(tail.classes, 0, sizeof(tail.classes));
+      prev->end = region->start;
+      insert_at(regions, i, &tail);
+      insert_at(regions, i, region);
+      return;
+    } else if (prev->pid == region->pid && prev->end > region->start) {
+      prev->end = region->start;
+    }
+  }
+  int covered = 0;
+  while (i + covered < regions->nb_regions) {
+    struct numap_region *next = &regions->regions[i + covered];
+    if (next->pid != region->pid || next->start >= region->end) {
+      break;
+    }
+    if (next->end > region->end) {
+      next->pgoff += region->end - next->start;
+      next->start = region->end;
+      break;
+    }
+    if (next->type == region->type && strcmp(next->name, region->name) == 0) {
+      region->accesses += next->accesses;
+      region->latency += next->latency;
+      for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+        region->classes[c] += next->classes[c];
+      }
+    }
+    covered++;
+  }
+  if (covered == 0 && regions->nb_regions == regions->capacity) {
+    regions->dropped++;
+    return;
+  }
+  if (covered > 0) {
+    memmove(&regions->regions[i + 1], &regions->regions[i + covered],
+            (regions->nb_regions - i - covered) * sizeof(struct numap_region));
+    regions->nb_regions -= covered - 1;
+    regions->regions[i] = *region;
+  } else {
+    insert_at(regions, i, region);
+  }
+}
+
+static void set_region(struct numap_region *region, uint32_t pid, uint64_t start, uint64_t end, uint64_t pgoff,
+                       const char *name, int shared) {
+  memset(region, 0, sizeof(struct numap_region));
+  region->pid = pid;
+  region->start = start;
+  region->end = end;
+  region->pgoff = pgoff;
+  // Anonymous mappings are named //anon in mmap records
+  if (strcmp(name, "//anon") != 0) {
+    snprintf(region->name, NUMAP_REGION_NAME_LEN, "%s", name);
+  }
+  region->type = region_type(region->name, shared);
+  if (region->type == NUMAP_REGION_STACK) {
+    // The stack named by the kernel is the one of the main thread
+    region->tid = pid;
+  }
+}
+
+/**
+ * Removes the regions of process pid, whose address space was replaced
+ * by an exec. Called with the lock held.
+ */
+static void remove_process(struct numap_regions *regions, uint32_t pid) {
+  int first = upper_bound(regions, pid - 1, UINT64_MAX);
+  int last = upper_bound(regions, pid, UINT64_MAX);
+  memmove(&regions->regions[first], &regions->regions[last], (regions->nb_regions - last) * sizeof(struct numap_region));
+  regions->nb_regions -= last - first;
+}
+
+/**
+ * Updates regions from a side-band record of a ring: PERF_RECORD_MMAP,
+ * PERF_RECORD_MMAP2 and the PERF_RECORD_COMM of an exec. Other records
+ * are ignored.
+ */
+void numap_regions_record(struct numap_regions *regions, struct perf_event_header *header) {
+  struct numap_region region;
+  const uint8_t *body = (const uint8_t *)(header + 1);
+  if (header->type == PERF_RECORD_COMM && (header->misc & PERF_RECORD_MISC_COMM_EXEC)) {
+    uint32_t pid;
+    memcpy(&pid, body, sizeof(uint32_t));
+    regions_lock(regions);
+    remove_process(regions, pid);
+    regions_unlock(regions);
+    return;
+  }
+  if (header->type != PERF_RECORD_MMAP && header->type != PERF_RECORD_MMAP2) {
+    return;
+  }
+  struct mmap_sample mmap;
+  memcpy(&mmap, body, offsetof(struct mmap_sample, filename));
+  const char *filename = (const char *)body + offsetof(struct mmap_sample, filename);
+  int shared = 0;
+  if (header->type == PERF_RECORD_MMAP2) {
+    // maj, min, ino and ino_generation (or the build id), then prot and flags
+    uint32_t flags;
+    memcpy(&flags, body + offsetof(struct mmap_sample, filename) + 28, sizeof(uint32_t));
+    shared = (flags & MAP_SHARED) != 0;
+    filename += 32;
+  }
+  set_region(&region, mmap.pid, mmap.addr, mmap.addr + mmap.len, mmap.pgoff, filename, shared);
+  regions_lock(regions);
+  insert_region(regions, &region);
+  regions_unlock(regions);
+}
+
+/**
+ * Process of thread tid, -1 when it does not exist.
+ */
+static pid_t thread_tgid(pid_t tid) {
+  char path[64];
+  char line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)tid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    last_sys_errno = errno;
+    return -1;
+  }
+  pid_t tgid = -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "Tgid: %d", &tgid) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  if (tgid < 0) {
+    last_sys_errno = ESRCH;
+  }
+  return tgid;
+}
+
+/**
+ * Marks region, holding the stack pointer of thread tid, as its stack
+ * unless it is the stack of another thread. Called with the lock held.
+ */
+static void set_stack(struct numap_region *region, uint32_t tid) {
+  if (region->type != NUMAP_REGION_ANON && (region->type != NUMAP_REGION_STACK || region->tid != 0)) {
+    return;
+  }
+  region->type = NUMAP_REGION_STACK;
+  region->tid = tid;
+  if (region->name[0] == '\0') {
+    snprintf(region->name, NUMAP_REGION_NAME_LEN, "[stack:%u]", tid);
+  }
+}
+
+/**
+ * Marks the mapping holding the stack pointer of thread tid as its
+ * stack. /proc/<pid>/task/<tid>/syscall only ends with the stack
+ * pointer and the instruction pointer while the thread is blocked in a
+ * system call: the stacks of running threads are found from their
+ * samples instead, where the stack pointer is sampled.
+ */
+static void mark_stack(struct numap_regions *regions, pid_t pid, pid_t tid) {
+  char path[96];
+  char line[256];
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/syscall", (int)pid, (int)tid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return;
+  }
+  char *fields[9];
+  int nb_fields = 0;
+  if (fgets(line, sizeof(line), f) != NULL) {
+    char *save;
+    for (char *field = strtok_r(line, " \n", &save); field != NULL && nb_fields < 9;
+         field = strtok_r(NULL, " \n", &save)) {
+      fields[nb_fields++] = field;
+    }
+  }
+  fclose(f);
+  if (nb_fields < 3) {
+    // running
+    return;
+  }
+  uint64_t sp = strtoull(fields[nb_fields - 2], NULL, 16);
+  sigset_t old;
+  sigio_block(&old);
+  regions_lock(regions);
+  struct numap_region *region = find_region(regions, pid, sp);
+  if (region != NULL) {
+    set_stack(region, tid);
+  }
+  regions_unlock(regions);
+  sigio_restore(&old);
+}
+
+/**
+ * Reads the mappings of the process of thread tid from /proc the first
+ * time one of its threads is seen, and finds the stack of tid (and, the
+ * first time, of the other threads of the process). Called when the
+ * measure starts and when threads are added, not from signal context:
+ * SIGIO is blocked while the index is updated, so that the refresh
+ * handler does not wait for the lock held by its own thread.
+ */
+int numap_regions_seed(struct numap_regions *regions, pid_t tid) {
+  pid_t pid = thread_tgid(tid);
+  if (pid < 0) {
+    return ERROR_NUMAP_MAPS;
+  }
+  int seeded = 0;
+  for (int i = 0; i < regions->nb_pids && !seeded; i++) {
+    seeded = regions->pids[i] == (uint32_t)pid;
+  }
+  if (seeded || regions->nb_pids == MAX_NB_THREADS) {
+    mark_stack(regions, pid, tid);
+    return 0;
+  }
+  char path[96];
+  snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    last_sys_errno = errno;
+    return ERROR_NUMAP_MAPS;
+  }
+  regions->pids[regions->nb_pids++] = pid;
+  char *line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, f) > 0) {
+    unsigned long start;
+    unsigned long end;
+    unsigned long pgoff;
+    char perms[8];
+    int name_pos = 0;
+    if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &pgoff, &name_pos) < 4 || name_pos == 0) {
+      continue;
+    }
+    char *name = line + name_pos;
+    name[strcspn(name, "\n")] = '\0';
+    struct numap_region region;
+    set_region(&region, pid, start, end, pgoff, name, perms[3] == 's');
+    sigset_t old;
+    sigio_block(&old);
+    regions_lock(regions);
+    insert_region(regions, &region);
+    regions_unlock(regions);
+    sigio_restore(&old);
+  }
+  free(line);
+  fclose(f);
+
+  snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+  DIR *dir = opendir(path);
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9') {
+        mark_stack(regions, pid, atoi(entry->d_name));
+      }
+    }
+    closedir(dir);
+  }
+  return 0;
+}
+
+/**
+ * Counts sample in the region of its address and in the summary of the
+ * type of the region, as count accesses (the period it was taken with),
+ * and returns that type. The mapping holding its stack pointer, when
+ * sampled, becomes the stack of its thread. Safe to call from a signal
+ * handler, with the same restriction as numap_sketch_add.
+ */
+int numap_regions_add(struct numap_regions *regions, struct numap_sample *sample, uint64_t count) {
+  int class = numap_sample_class(sample->data_src);
+  regions_lock(regions);
+  if (sample->sp != 0) {
+    struct numap_region *stack = find_region(regions, sample->pid, sample->sp);
+    if (stack != NULL) {
+      set_stack(stack, sample->tid);
+    }
+  }
+  struct numap_region *region = find_region(regions, sample->pid, sample->addr);
+  int type = region != NULL ? region->type : NUMAP_REGION_UNKNOWN;
+  if (region != NULL) {
+    region->accesses += count;
+    region->classes[class] += count;
+    region->latency += sample->weight * count;
+    if (type == NUMAP_REGION_STACK && region->tid != 0 && region->tid != sample->tid) {
+      regions->foreign_stack += count;
+    }
+  }
+  struct numap_region_summary *summary = &regions->types[type];
+  summary->accesses += count;
+  summary->classes[class] += count;
+  summary->latency += sample->weight * count;
+  regions->total += count;
+  regions_unlock(regions);
+  return type;
+}
+
+/**
+ * Fills region (unless NULL) with the mapping of addr in process pid
+ * and returns its type, NUMAP_REGION_UNKNOWN when none is known. Can be
+ * called while sampling goes on, from any thread.
+ */
+int numap_regions_find(struct numap_regions *regions, pid_t pid, uint64_t addr, struct numap_region *region) {
+  int type;
+  uint64_t seq;
+  do {
+    seq = read_begin(regions);
+    struct numap_region *found = find_region(regions, pid, addr);
+    type = found != NULL ? found->type : NUMAP_REGION_UNKNOWN;
+    if (found != NULL && region != NULL) {
+      *region = *found;
+    }
+  } while (read_retry(regions, seq));
+  return type;
+}
+
+const char *numap_region_type_name(int type) {
+  return type >= 0 && type < NUMAP_NB_REGION_TYPES ? region_type_names[type] : "invalid";
+}
+
+/**
+ * Makes the refresh handler of measure classify its samples into
+ * regions, seeded from /proc when the measure starts and updated from
+ * the mmap records of the rings (the events then report data mappings
+ * and execs too). As with sketches, the samples are released to the
+ * kernel unless a measure handler is set, and those since the last
+ * refresh stay in the rings when the measure stops. Has to be called
+ * before the measure starts.
+ */
+int numap_sampling_set_regions(struct numap_sampling_measure *measure, struct numap_regions *regions) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  if (measure->replay) {
+    return ERROR_NUMAP_REPLAY;
+  }
+  measure->regions = regions;
+  return 0;
+}
+
+static int compare_accesses(const void *a, const void *b) {
+  const struct numap_region *ra = a;
+  const struct numap_region *rb = b;
+  if (ra->accesses != rb->accesses) {
+    return ra->accesses > rb->accesses ? -1 : 1;
+  }
+  return ra->latency > rb->latency ? -1 : ra->latency < rb->latency;
+}
+
+static void print_line(const char *name, uint64_t accesses, uint64_t *classes, uint64_t latency, uint64_t total) {
+  uint64_t remote = classes[NUMAP_CLASS_REMOTE_CACHE] + classes[NUMAP_CLASS_REMOTE_MEMORY];
+  uint64_t memory = classes[NUMAP_CLASS_LOCAL_MEMORY] + remote;
+  printf("%12" PRIu64 " %8.2f %8.2f %8.2f %10.1f  %s\n", accesses, total ? 100.0 * accesses / total : 0.0,
+         accesses ? 100.0 * memory / accesses : 0.0, memory ? 100.0 * remote / memory : 0.0,
+         accesses ? (double)latency / accesses : 0.0, name);
+}
+
+/**
+ * Prints the accesses per region type, then the nb_regions mappings with
+ * the most accesses.
+ */
+int numap_regions_print(struct numap_regions *regions, int nb_regions) {
+  // Snapshot, the refresh handler may update the regions meanwhile
+  struct numap_region *sorted = malloc(regions->capacity * sizeof(struct numap_region));
+  if (sorted == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  int nb;
+  struct numap_region_summary types[NUMAP_NB_REGION_TYPES];
+  uint64_t total;
+  uint64_t foreign_stack;
+  uint64_t dropped;
+  uint64_t seq;
+  do {
+    seq = read_begin(regions);
+    nb = __atomic_load_n(&regions->nb_regions, __ATOMIC_RELAXED);
+    if (nb > regions->capacity) {
+      nb = regions->capacity;
+    }
+    memcpy(sorted, regions->regions, nb * sizeof(struct numap_region));
+    memcpy(types, regions->types, sizeof(types));
+    total = regions->total;
+    foreign_stack = regions->foreign_stack;
+    dropped = regions->dropped;
+  } while (read_retry(regions, seq));
+
+  printf("\nAccesses per region type (%" PRIu64 " accesses, %d mappings", total, nb);
+  if (dropped > 0) {
+    printf(", %" PRIu64 " not indexed", dropped);
+  }
+  printf(")\n");
+  printf("%12s %8s %8s %8s %10s  %s\n", "ACCESSES", "ACC%", "MEM%", "REMOTE%", "AVG_LAT", "TYPE");
+  for (int type = 0; type < NUMAP_NB_REGION_TYPES; type++) {
+    print_line(region_type_names[type], types[type].accesses, types[type].classes, types[type].latency, total);
+  }
+  printf("%" PRIu64 " accesses to the stack of another thread\n", foreign_stack);
+
+  qsort(sorted, nb, sizeof(struct numap_region), compare_accesses);
+  printf("\nMappings with the most accesses\n");
+  printf("%12s %8s %8s %8s %10s  %-5s %-8s %s\n", "ACCESSES", "ACC%", "MEM%", "REMOTE%", "AVG_LAT", "TYPE", "PID",
+         "MAPPING");
+  for (int i = 0; i < nb && i < nb_regions && sorted[i].accesses > 0; i++) {
+    struct numap_region *region = &sorted[i];
+    char name[NUMAP_REGION_NAME_LEN + 64];
+    snprintf(name, sizeof(name), "%-5s %-8u %#" PRIx64 "-%#" PRIx64 " %s", region_type_names[region->type],
+             region->pid, region->start, region->end, region->name);
+    print_line(name, region->accesses, region->classes, region->latency, total);
+  }
+  free(sorted);
+  return 0;
+}
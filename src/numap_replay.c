@@ -0,0 +1,716 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <numa.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Replay of recorded samples: records read from a perf.data file or
+ * from a numap trace are split per thread (and per stream: core type on
+ * hybrid processors, loads or stores) and copied into buffers laid out like perf_event_open ring
+ * buffers, so that every analysis working on a live measure also works
+ * on a replayed one.
+ *
+ * A numap trace also holds the topology of the machine it was recorded
+ * on (nodes, node of each cpu, node distances) and the node of each
+ * sampled page, resolved while recording since the pages are not mapped
+ * anymore when the trace is replayed, possibly on another machine.
+ */
+
+#define PERF_DATA_MAGIC "PERFILE2"
+#define NUMAP_TRACE_MAGIC "NUMAPTR2"
+#define NUMAP_TRACE_MAGIC_V1 "NUMAPTR1" // no topology nor page nodes
+#define NUMAP_TRACE_MAX_CPUS 65536
+
+struct perf_file_section {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct perf_file_header {
+  uint64_t magic;
+  uint64_t size;
+  uint64_t attr_size;
+  struct perf_file_section attrs;
+  struct perf_file_section data;
+  struct perf_file_section event_types;
+  uint64_t features[4];
+};
+
+struct numap_trace_header {
+  char magic[8];
+  uint64_t sample_type;
+  uint64_t sampling_rate;
+  uint64_t reserved;
+};
+
+/**
+ * Follows the header, with nb_cpus int32_t nodes of the cpus and
+ * nb_nodes * nb_nodes int32_t node distances.
+ */
+struct numap_trace_topology {
+  uint32_t nb_nodes; // 0 when the machine was not NUMA
+  uint32_t nb_cpus;
+};
+
+struct numap_trace_chunk {
+  uint32_t tid;
+  uint16_t core_type;
+  uint16_t access; // NUMAP_TRACE_PAGE_NODES for a chunk of struct numap_trace_page_node
+  uint64_t size;
+};
+
+#define NUMAP_TRACE_PAGE_NODES 0xffff
+
+struct numap_trace_page_node {
+  uint64_t page;
+  int32_t node; // -1 when unknown
+  int32_t reserved;
+};
+
+struct replay_thread {
+  uint32_t tid;
+  int core_type;
+  int access;
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+struct replay_state {
+  uint64_t sample_type;
+  struct numap_topology *topology;
+  int nb_threads;
+  struct replay_thread threads[MAX_NB_THREADS * NUMAP_MAX_STREAMS];
+};
+
+/**
+ * Thread of a record: the sampled thread for samples, the thread
+ * described by the record for side-band records.
+ */
+static int record_tid(struct replay_state *state, struct perf_event_header *header, uint32_t *tid) {
+  uint32_t *body = (uint32_t *)(header + 1);
+  switch (header->type) {
+  case PERF_RECORD_SAMPLE: {
+    struct numap_sample sample;
+    if (!(state->sample_type & PERF_SAMPLE_TID) || numap_sample_decode(state->sample_type, header, &sample) != 0) {
+      return -1;
+    }
+    *tid = sample.tid;
+    return 0;
+  }
+  case PERF_RECORD_MMAP:
+  case PERF_RECORD_MMAP2:
+  case PERF_RECORD_COMM:
+    *tid = body[1];
+    return 0;
+  case PERF_RECORD_FORK:
+  case PERF_RECORD_EXIT:
+    *tid = body[2];
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+static int replay_append(struct replay_state *state, uint32_t tid, struct numap_stream *stream,
+                         struct perf_event_header *header) {
+  int thread;
+  for (thread = 0; thread < state->nb_threads; thread++) {
+    if (state->threads[thread].tid == tid && state->threads[thread].core_type == stream->core_type &&
+        state->threads[thread].access == stream->access) {
+      break;
+    }
+  }
+  if (thread == state->nb_threads) {
+    if (state->nb_threads == MAX_NB_THREADS * NUMAP_MAX_STREAMS) {
+      return ERROR_NUMAP_TOO_MANY_THREADS;
+    }
+    memset(&state->threads[thread], 0, sizeof(struct replay_thread));
+    state->threads[thread].tid = tid;
+    state->threads[thread].core_type = stream->core_type;
+    state->threads[thread].access = stream->access;
+    state->nb_threads++;
+  }
+  struct replay_thread *rt = &state->threads[thread];
+  if (array_reserve((void **)&rt->data, &rt->capacity, rt->size + header->size, 1) != 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  memcpy(rt->data + rt->size, header, header->size);
+  rt->size += header->size;
+  return 0;
+}
+
+/**
+ * Splits a buffer of perf records of stream between threads. Records
+ * that do not identify a thread go to default_tid. When the buffer is
+ * the ring of thread default_tid (a numap trace chunk), no record is
+ * split: side-band records stay in the ring they were written to, as in
+ * a live measure, and those describing tasks that were not sampled
+ * (e.g. the creation of a thread past MAX_NB_THREADS) add no thread.
+ */
+static int replay_records(struct replay_state *state, uint8_t *data, size_t size, uint32_t default_tid,
+                          struct numap_stream *stream, int split) {
+  size_t pos = 0;
+  while (pos + sizeof(struct perf_event_header) <= size) {
+    struct perf_event_header *header = (struct perf_event_header *)(data + pos);
+    if (header->size < sizeof(struct perf_event_header) || pos + header->size > size) {
+      return ERROR_NUMAP_REPLAY_FORMAT;
+    }
+    // Types above PERF_RECORD_MAX are perf tool records (rounds, build ids...)
+    if (header->type < PERF_RECORD_MAX) {
+      uint32_t tid;
+      if (!split || record_tid(state, header, &tid) != 0) {
+        tid = default_tid;
+      }
+      int res = replay_append(state, tid, stream, header);
+      if (res != 0) {
+        return res;
+      }
+    }
+    pos += header->size;
+  }
+  return 0;
+}
+
+static int read_at(FILE *f, uint64_t offset, void *buffer, size_t size) {
+  if (fseeko(f, offset, SEEK_SET) != 0 || fread(buffer, 1, size, f) != size) {
+    return ERROR_NUMAP_REPLAY_FORMAT;
+  }
+  return 0;
+}
+
+static int replay_perf_data(FILE *f, struct replay_state *state, uint64_t *sampling_rate) {
+  struct perf_file_header header;
+  if (read_at(f, 0, &header, sizeof(header)) != 0 || header.attr_size <= sizeof(struct perf_file_section) ||
+      header.attrs.size < header.attr_size) {
+    return ERROR_NUMAP_REPLAY_FORMAT;
+  }
+  // All events must share the same sample layout (e.g. perf mem record loads and stores)
+  uint64_t nb_attrs = header.attrs.size / header.attr_size;
+  size_t attr_len = header.attr_size - sizeof(struct perf_file_section);
+  if (attr_len > sizeof(struct perf_event_attr)) {
+    attr_len = sizeof(struct perf_event_attr);
+  }
+  for (uint64_t i = 0; i < nb_attrs; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    if (read_at(f, header.attrs.offset + i * header.attr_size, &attr, attr_len) != 0) {
+      return ERROR_NUMAP_REPLAY_FORMAT;
+    }
+    if (i == 0) {
+      state->sample_type = attr.sample_type;
+      *sampling_rate = attr.freq ? 0 : attr.sample_period;
+    } else if (attr.sample_type != state->sample_type) {
+      return ERROR_NUMAP_SAMPLE_TYPE;
+    }
+    if ((attr.sample_type & PERF_SAMPLE_REGS_USER) && attr.sample_regs_user != NUMAP_SAMPLE_REGS_USER) {
+      // Samples are decoded with the stack pointer as the only register
+      return ERROR_NUMAP_SAMPLE_TYPE;
+    }
+  }
+  uint8_t *data = malloc(header.data.size);
+  if (data == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  int res = read_at(f, header.data.offset, data, header.data.size);
+  if (res == 0) {
+    struct numap_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    res = replay_records(state, data, header.data.size, 0, &stream, 1);
+  }
+  free(data);
+  return res;
+}
+
+void topology_free(struct numap_topology *topology) {
+  if (topology == NULL) {
+    return;
+  }
+  free(topology->cpu_to_node);
+  free(topology->page_nodes);
+  u64_map_free(&topology->pages_map);
+  free(topology);
+}
+
+static int read_topology(FILE *f, struct replay_state *state) {
+  struct numap_trace_topology header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.nb_nodes > MAX_NB_NUMA_NODES ||
+      header.nb_cpus > NUMAP_TRACE_MAX_CPUS) {
+    return ERROR_NUMAP_REPLAY_FORMAT;
+  }
+  struct numap_topology *topology = calloc(1, sizeof(struct numap_topology));
+  if (topology == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  state->topology = topology;
+  topology->nb_nodes = header.nb_nodes;
+  topology->nb_cpus = header.nb_cpus;
+  topology->cpu_to_node = malloc((header.nb_cpus + 1) * sizeof(int));
+  if (topology->cpu_to_node == NULL || u64_map_init(&topology->pages_map, 4096) != 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  for (uint32_t cpu = 0; cpu < header.nb_cpus; cpu++) {
+    int32_t node;
+    if (fread(&node, sizeof(node), 1, f) != 1) {
+      return ERROR_NUMAP_REPLAY_FORMAT;
+    }
+    topology->cpu_to_node[cpu] = node >= 0 && node < topology->nb_nodes ? node : -1;
+  }
+  for (int cpu_node = 0; cpu_node < topology->nb_nodes; cpu_node++) {
+    for (int mem_node = 0; mem_node < topology->nb_nodes; mem_node++) {
+      int32_t distance;
+      if (fread(&distance, sizeof(distance), 1, f) != 1) {
+        return ERROR_NUMAP_REPLAY_FORMAT;
+      }
+      topology->distances[cpu_node][mem_node] = distance;
+    }
+  }
+  return 0;
+}
+
+static int read_page_nodes(struct replay_state *state, uint8_t *data, size_t size) {
+  struct numap_topology *topology = state->topology;
+  if (topology == NULL || size % sizeof(struct numap_trace_page_node) != 0) {
+    return ERROR_NUMAP_REPLAY_FORMAT;
+  }
+  struct numap_trace_page_node *page_nodes = (struct numap_trace_page_node *)data;
+  for (size_t i = 0; i < size / sizeof(struct numap_trace_page_node); i++) {
+    int inserted;
+    int64_t index = u64_map_get(&topology->pages_map, page_nodes[i].page, &inserted);
+    if (index < 0 || array_reserve((void **)&topology->page_nodes, &topology->page_nodes_capacity, index + 1,
+                                   sizeof(int)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    int node = page_nodes[i].node;
+    topology->page_nodes[index] = node >= 0 && node < topology->nb_nodes ? node : -1;
+  }
+  return 0;
+}
+
+static int replay_numap_trace(FILE *f, struct replay_state *state, uint64_t *sampling_rate, int v1) {
+  struct numap_trace_header header;
+  if (read_at(f, 0, &header, sizeof(header)) != 0) {
+    return ERROR_NUMAP_REPLAY_FORMAT;
+  }
+  state->sample_type = header.sample_type;
+  *sampling_rate = header.sampling_rate;
+  if (!v1) {
+    int res = read_topology(f, state);
+    if (res != 0) {
+      return res;
+    }
+  }
+  struct numap_trace_chunk chunk;
+  while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+    uint8_t *data = malloc(chunk.size);
+    if (data == NULL) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    int res = fread(data, 1, chunk.size, f) == chunk.size ? 0 : ERROR_NUMAP_REPLAY_FORMAT;
+    if (res == 0 && chunk.access == NUMAP_TRACE_PAGE_NODES) {
+      res = read_page_nodes(state, data, chunk.size);
+    } else if (res == 0) {
+      struct numap_stream stream;
+      memset(&stream, 0, sizeof(stream));
+      stream.core_type = chunk.core_type;
+      stream.access = chunk.access;
+      res = replay_records(state, data, chunk.size, chunk.tid, &stream, 0);
+    }
+    free(data);
+    if (res != 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Copies size bytes of records into a buffer laid out as the ring of
+ * stream of thread.
+ */
+static int replay_ring(struct numap_sampling_measure *measure, int stream, int thread, void *records, size_t size) {
+  size_t data_size = (size + measure->page_size - 1) / measure->page_size * measure->page_size;
+  if (data_size == 0) {
+    data_size = measure->page_size;
+  }
+  struct perf_event_mmap_page *metadata_page = calloc(1, measure->page_size + data_size);
+  if (metadata_page == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  memcpy((uint8_t *)metadata_page + measure->page_size, records, size);
+  metadata_page->data_offset = measure->page_size;
+  metadata_page->data_size = data_size;
+  metadata_page->data_head = size;
+  metadata_page->data_tail = 0;
+  *measure_fd(measure, stream, thread) = -1;
+  *measure_ring(measure, stream, thread) = metadata_page;
+  if (measure->page_size + data_size > measure->mmap_len) {
+    measure->mmap_len = measure->page_size + data_size;
+  }
+  return 0;
+}
+
+/**
+ * Initializes measure from perf records held in memory: records[thread]
+ * holds sizes[thread] bytes of records of thread tids[thread], laid out
+ * as in a perf_event_open ring buffer.
+ */
+int numap_sampling_replay_init_buffers(struct numap_sampling_measure *measure, uint64_t sample_type,
+                                       unsigned int sampling_rate, int nb_threads, pid_t *tids,
+                                       void **records, size_t *sizes) {
+  if (nb_threads > MAX_NB_THREADS) {
+    return ERROR_NUMAP_TOO_MANY_THREADS;
+  }
+  numap_sampling_init_measure(measure, nb_threads, sampling_rate, 0);
+  measure->replay = 1;
+  measure->sample_type = sample_type;
+  for (int thread = 0; thread < nb_threads; thread++) {
+    measure->tids[thread] = tids[thread];
+    int res = replay_ring(measure, 0, thread, records[thread], sizes[thread]);
+    if (res != 0) {
+      numap_sampling_end(measure);
+      return res;
+    }
+  }
+  return 0;
+}
+
+static int replay_same_stream(struct numap_stream *stream, struct replay_thread *rt) {
+  return stream->core_type == rt->core_type && stream->access == rt->access;
+}
+
+/**
+ * Initializes measure from the records of state, with one stream per
+ * core type and access found.
+ */
+static int replay_state_init(struct numap_sampling_measure *measure, struct replay_state *state,
+                             unsigned int sampling_rate) {
+  pid_t tids[MAX_NB_THREADS];
+  struct numap_stream streams[NUMAP_MAX_STREAMS];
+  int nb_threads = 0;
+  int nb_streams = 0;
+  for (int i = 0; i < state->nb_threads; i++) {
+    struct replay_thread *rt = &state->threads[i];
+    int thread, stream;
+    for (thread = 0; thread < nb_threads && tids[thread] != rt->tid; thread++);
+    if (thread == nb_threads) {
+      if (nb_threads == MAX_NB_THREADS) {
+        return ERROR_NUMAP_TOO_MANY_THREADS;
+      }
+      tids[nb_threads++] = rt->tid;
+    }
+    for (stream = 0; stream < nb_streams && !replay_same_stream(&streams[stream], rt); stream++);
+    if (stream == nb_streams) {
+      if (nb_streams == NUMAP_MAX_STREAMS) {
+        return ERROR_NUMAP_REPLAY_FORMAT;
+      }
+      memset(&streams[nb_streams], 0, sizeof(struct numap_stream));
+      streams[nb_streams].core_type = rt->core_type;
+      streams[nb_streams].access = rt->access;
+      streams[nb_streams++].slot = rt->access == NUMAP_ACCESS_WRITE ? -1 : 0;
+    }
+  }
+
+  numap_sampling_init_measure(measure, nb_threads, sampling_rate, 0);
+  measure->replay = 1;
+  measure->sample_type = state->sample_type;
+  measure->topology = state->topology;
+  state->topology = NULL;
+  if (nb_streams > 0) {
+    measure->nb_streams = nb_streams;
+    memcpy(measure->streams, streams, nb_streams * sizeof(struct numap_stream));
+  }
+  memcpy(measure->tids, tids, nb_threads * sizeof(pid_t));
+  for (int i = 0; i < state->nb_threads; i++) {
+    struct replay_thread *rt = &state->threads[i];
+    int thread, stream;
+    for (thread = 0; tids[thread] != rt->tid; thread++);
+    for (stream = 0; !replay_same_stream(&streams[stream], rt); stream++);
+    int res = replay_ring(measure, stream, thread, rt->data, rt->size);
+    if (res != 0) {
+      numap_sampling_end(measure);
+      return res;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Initializes measure from the samples recorded in path, either a
+ * perf.data file (as written by perf mem record) or a numap trace (as
+ * written by numap_sampling_save). The measure can then be analysed as
+ * if its samples had just been gathered; it cannot be started.
+ */
+int numap_sampling_replay_init(struct numap_sampling_measure *measure, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  char magic[8];
+  uint64_t sampling_rate = 0;
+  struct replay_state *state = calloc(1, sizeof(struct replay_state));
+  int res = state == NULL ? ERROR_NUMAP_MALLOC : 0;
+  if (res == 0 && fread(magic, sizeof(magic), 1, f) != 1) {
+    res = ERROR_NUMAP_REPLAY_FORMAT;
+  }
+  if (res == 0) {
+    if (memcmp(magic, PERF_DATA_MAGIC, sizeof(magic)) == 0) {
+      res = replay_perf_data(f, state, &sampling_rate);
+    } else if (memcmp(magic, NUMAP_TRACE_MAGIC, sizeof(magic)) == 0) {
+      res = replay_numap_trace(f, state, &sampling_rate, 0);
+    } else if (memcmp(magic, NUMAP_TRACE_MAGIC_V1, sizeof(magic)) == 0) {
+      res = replay_numap_trace(f, state, &sampling_rate, 1);
+    } else {
+      res = ERROR_NUMAP_REPLAY_FORMAT;
+    }
+  }
+  fclose(f);
+
+  if (res == 0) {
+    res = replay_state_init(measure, state, sampling_rate);
+  }
+  if (state != NULL) {
+    for (int thread = 0; thread < state->nb_threads; thread++) {
+      free(state->threads[thread].data);
+    }
+    topology_free(state->topology);
+    free(state);
+  }
+  return res;
+}
+
+struct save_arg {
+  FILE *f;
+  struct numap_sampling_measure *measure;
+  struct u64_map *pages; // pages whose node is already in the trace
+  struct numap_trace_page_node *new_pages;
+  size_t nb_new_pages;
+  size_t new_pages_capacity;
+};
+
+static int save_record(struct perf_event_header *header, void *arg) {
+  struct save_arg *sa = arg;
+  if (fwrite(header, header->size, 1, sa->f) != 1) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  struct numap_sample sample;
+  if (header->type != PERF_RECORD_SAMPLE || !(sa->measure->sample_type & PERF_SAMPLE_ADDR) ||
+      numap_sample_decode(sa->measure->sample_type, header, &sample) != 0) {
+    return 0;
+  }
+  int inserted;
+  uint64_t page = sample.addr & ~((uint64_t)sa->measure->page_size - 1);
+  if (u64_map_get(sa->pages, page, &inserted) < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&sa->new_pages, &sa->new_pages_capacity, sa->nb_new_pages + 1,
+                      sizeof(struct numap_trace_page_node)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&sa->new_pages[sa->nb_new_pages], 0, sizeof(struct numap_trace_page_node));
+    sa->new_pages[sa->nb_new_pages++].page = page;
+  }
+  return 0;
+}
+
+/**
+ * Writes the node of the pages sampled for the first time in the last
+ * chunks, as a chunk of struct numap_trace_page_node.
+ */
+static int write_page_nodes(struct save_arg *sa, uint64_t *bytes) {
+  if (sa->nb_new_pages == 0) {
+    return 0;
+  }
+  entries_resolve_nodes(sa->measure, sa->new_pages, sa->nb_new_pages, sizeof(struct numap_trace_page_node),
+                        offsetof(struct numap_trace_page_node, page), offsetof(struct numap_trace_page_node, node));
+  struct numap_trace_chunk chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.access = NUMAP_TRACE_PAGE_NODES;
+  chunk.size = sa->nb_new_pages * sizeof(struct numap_trace_page_node);
+  if (fwrite(&chunk, sizeof(chunk), 1, sa->f) != 1 || fwrite(sa->new_pages, chunk.size, 1, sa->f) != 1) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  if (bytes != NULL) {
+    *bytes += sizeof(chunk) + chunk.size;
+  }
+  sa->nb_new_pages = 0;
+  return 0;
+}
+
+/**
+ * Writes the records of each ring of measure not written yet as one
+ * chunk per stream of a thread, tagged with the core type and the
+ * access of the stream, followed by the node of the pages they sample
+ * for the first time (pages holds the pages already written). The
+ * records are released to the kernel when release is set. Empty chunks
+ * are left out when skip_empty is set.
+ */
+static int write_chunks(FILE *f, struct numap_sampling_measure *measure, struct u64_map *pages, int release,
+                        int skip_empty, uint64_t *bytes) {
+  struct save_arg sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.f = f;
+  sa.measure = measure;
+  sa.pages = pages;
+  int res = 0;
+  for (int thread = 0; thread < measure->nb_threads && res == 0; thread++) {
+    for (int stream = 0; stream < measure->nb_streams && res == 0; stream++) {
+      struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+      if (metadata_page == NULL) {
+        continue;
+      }
+      uint64_t head = metadata_page->data_head;
+      rmb();
+      uint64_t tail = metadata_page->data_tail;
+      if (skip_empty && head == tail) {
+        continue;
+      }
+      struct numap_trace_chunk chunk;
+      chunk.tid = measure->tids[thread];
+      chunk.core_type = measure->streams[stream].core_type;
+      chunk.access = measure->streams[stream].access;
+      chunk.size = head - tail;
+      if (fwrite(&chunk, sizeof(chunk), 1, f) != 1) {
+        res = ERROR_NUMAP_REPLAY_FILE;
+        break;
+      }
+      res = ring_walk(metadata_page, measure->page_size, measure_ring_len(measure, thread), tail, head,
+                      save_record, &sa);
+      if (res != 0) {
+        break;
+      }
+      if (bytes != NULL) {
+        *bytes += sizeof(chunk) + chunk.size;
+      }
+      if (release) {
+        __sync_synchronize();
+        metadata_page->data_tail = head;
+      }
+    }
+  }
+  if (res == 0) {
+    res = write_page_nodes(&sa, bytes);
+  }
+  free(sa.new_pages);
+  return res;
+}
+
+/**
+ * Writes the header of a trace and the topology of the machine measure
+ * runs on (or was recorded on, for a replayed measure).
+ */
+static int write_header(FILE *f, struct numap_sampling_measure *measure) {
+  struct numap_trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NUMAP_TRACE_MAGIC, sizeof(header.magic));
+  header.sample_type = measure->sample_type;
+  header.sampling_rate = measure->sampling_rate;
+  if (fwrite(&header, sizeof(header), 1, f) != 1) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  struct numap_topology *recorded = measure->topology;
+  struct numap_trace_topology topology;
+  int nb_nodes = measure_nb_nodes(measure);
+  topology.nb_nodes = nb_nodes > 0 ? nb_nodes : 0;
+  topology.nb_cpus = recorded != NULL ? recorded->nb_cpus : nb_cpus;
+  if (fwrite(&topology, sizeof(topology), 1, f) != 1) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  for (uint32_t cpu = 0; cpu < topology.nb_cpus; cpu++) {
+    int32_t node = recorded != NULL ? recorded->cpu_to_node[cpu] : cpu_to_node[cpu];
+    if (fwrite(&node, sizeof(node), 1, f) != 1) {
+      return ERROR_NUMAP_REPLAY_FILE;
+    }
+  }
+  for (uint32_t cpu_node = 0; cpu_node < topology.nb_nodes; cpu_node++) {
+    for (uint32_t mem_node = 0; mem_node < topology.nb_nodes; mem_node++) {
+      int32_t distance = recorded != NULL ? recorded->distances[cpu_node][mem_node] : numa_distance(cpu_node, mem_node);
+      if (fwrite(&distance, sizeof(distance), 1, f) != 1) {
+        return ERROR_NUMAP_REPLAY_FILE;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Writes the records available in the ring buffers of measure, without
+ * consuming them, to a numap trace that numap_sampling_replay_init can
+ * read back.
+ */
+int numap_sampling_save(struct numap_sampling_measure *measure, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  struct u64_map pages;
+  int res = u64_map_init(&pages, 4096) == 0 ? write_header(f, measure) : ERROR_NUMAP_MALLOC;
+  if (res == 0) {
+    res = write_chunks(f, measure, &pages, 0, 0, NULL);
+  }
+  u64_map_free(&pages);
+  if (fclose(f) != 0 && res == 0) {
+    res = ERROR_NUMAP_REPLAY_FILE;
+  }
+  return res;
+}
+
+/**
+ * Opens a numap trace in path that the records of the started measure
+ * are streamed to by numap_trace_writer_append, so that recordings are
+ * not bounded by the size of the ring buffers.
+ */
+int numap_trace_writer_open(struct numap_trace_writer *writer, const char *path,
+                            struct numap_sampling_measure *measure) {
+  writer->bytes = 0;
+  writer->pages = calloc(1, sizeof(struct u64_map));
+  if (writer->pages == NULL || u64_map_init(writer->pages, 4096) != 0) {
+    free(writer->pages);
+    writer->pages = NULL;
+    return ERROR_NUMAP_MALLOC;
+  }
+  writer->f = fopen(path, "wb");
+  int res = writer->f != NULL ? write_header(writer->f, measure) : ERROR_NUMAP_REPLAY_FILE;
+  if (res != 0) {
+    if (writer->f != NULL) {
+      fclose(writer->f);
+      writer->f = NULL;
+    }
+    u64_map_free(writer->pages);
+    free(writer->pages);
+    writer->pages = NULL;
+  }
+  return res;
+}
+
+/**
+ * Appends the records gathered by measure since the last append to the
+ * trace of writer, and releases them to the kernel. Has to be called
+ * often enough for the rings not to fill up; threads added to the
+ * measure after the trace was opened are appended too.
+ */
+int numap_trace_writer_append(struct numap_trace_writer *writer, struct numap_sampling_measure *measure) {
+  if (writer->f == NULL) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  return write_chunks(writer->f, measure, writer->pages, 1, 1, &writer->bytes);
+}
+
+int numap_trace_writer_close(struct numap_trace_writer *writer) {
+  if (writer->f == NULL) {
+    return ERROR_NUMAP_REPLAY_FILE;
+  }
+  int res = fclose(writer->f) == 0 ? 0 : ERROR_NUMAP_REPLAY_FILE;
+  writer->f = NULL;
+  u64_map_free(writer->pages);
+  free(writer->pages);
+  writer->pages = NULL;
+  return res;
+}
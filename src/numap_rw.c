@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+#if MAX_NB_THREADS > 64
+#error "numap_rw.c: thread masks too small for MAX_NB_THREADS"
+#endif
+
+struct rw_state {
+  uint64_t page_mask;
+  struct u64_map pages_map;
+  struct numap_page_rw *pages;
+  size_t pages_capacity;
+  struct numap_rw_profile *profile;
+};
+
+static int rw_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct rw_state *state = arg;
+  struct numap_thread_rw *trw = &state->profile->threads[thread];
+  int write = sample->access == NUMAP_ACCESS_WRITE;
+  uint64_t period = sample_period(measure, thread, sample);
+  if (write) {
+    trw->writes += period;
+  } else {
+    trw->reads += period;
+    trw->read_latency += sample->weight * period;
+    if (is_served_by_local_memory(sample->data_src) || is_served_by_remote_memory(sample->data_src)) {
+      trw->memory_reads += period;
+    }
+    if (is_served_by_remote_memory(sample->data_src) ||
+        (sample->data_src.mem_lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2))) {
+      trw->remote_reads += period;
+    }
+  }
+
+  uint64_t page = sample->addr & state->page_mask;
+  int inserted;
+  int64_t index = u64_map_get(&state->pages_map, page, &inserted);
+  if (index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&state->pages, &state->pages_capacity, index + 1, sizeof(struct numap_page_rw)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&state->pages[index], 0, sizeof(struct numap_page_rw));
+    state->pages[index].page = page;
+    state->pages[index].node = -1;
+  }
+  struct numap_page_rw *prw = &state->pages[index];
+  prw->threads |= 1ULL << thread;
+  if (write) {
+    prw->writes += period;
+    prw->writer_threads |= 1ULL << thread;
+  } else {
+    prw->reads += period;
+    prw->read_latency += sample->weight * period;
+  }
+  return 0;
+}
+
+static int compare_page_rw(const void *a, const void *b) {
+  const struct numap_page_rw *pa = a;
+  const struct numap_page_rw *pb = b;
+  uint64_t ca = pa->reads + pa->writes;
+  uint64_t cb = pb->reads + pb->writes;
+  if (ca != cb) {
+    return ca < cb ? 1 : -1;
+  }
+  return pa->page < pb->page ? -1 : (pa->page > pb->page ? 1 : 0);
+}
+
+/**
+ * Builds the read/write profile of measure, per thread and per page,
+ * from the loads and stores it sampled (e.g. with
+ * numap_sampling_read_write_start). pages has to be freed with
+ * numap_rw_profile_free. Reads and writes are counted in accesses:
+ * each sample counts for the period it was taken with.
+ */
+int numap_sampling_rw_profile(struct numap_sampling_measure *measure, struct numap_rw_profile *profile) {
+  struct rw_state state;
+
+  if (!(measure->sample_type & PERF_SAMPLE_ADDR)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  memset(profile, 0, sizeof(struct numap_rw_profile));
+  profile->nb_threads = measure->nb_threads;
+
+  memset(&state, 0, sizeof(state));
+  state.profile = profile;
+  state.page_mask = ~((uint64_t)measure->page_size - 1);
+  if (u64_map_init(&state.pages_map, 4096) != 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  int res = numap_sampling_foreach_sample(measure, rw_sample, &state);
+  if (res != 0) {
+    goto out;
+  }
+
+  size_t nb_pages = state.pages_map.count;
+  entries_resolve_nodes(measure, state.pages, nb_pages, sizeof(struct numap_page_rw),
+                        offsetof(struct numap_page_rw, page), offsetof(struct numap_page_rw, node));
+
+  qsort(state.pages, nb_pages, sizeof(struct numap_page_rw), compare_page_rw);
+  profile->nb_pages = nb_pages;
+  profile->pages = state.pages;
+  state.pages = NULL;
+
+ out:
+  free(state.pages);
+  u64_map_free(&state.pages_map);
+  return res;
+}
+
+int numap_rw_profile_print(struct numap_rw_profile *profile, size_t nb_pages) {
+  printf("\nRead/write profile\n");
+  for (int thread = 0; thread < profile->nb_threads; thread++) {
+    struct numap_thread_rw *trw = &profile->threads[thread];
+    uint64_t total = trw->reads + trw->writes;
+    printf("Thread %d: %-8" PRIu64 " reads %-8" PRIu64 " writes %5.1f%% writes %-8" PRIu64 " memory reads %-8" PRIu64
+           " remote reads mean read latency %0.1f\n",
+           thread, trw->reads, trw->writes, total ? 100.0 * trw->writes / total : 0.0, trw->memory_reads,
+           trw->remote_reads, trw->reads ? (double)trw->read_latency / trw->reads : 0.0);
+  }
+
+  printf("\n");
+  for (size_t page = 0; page < nb_pages && page < profile->nb_pages; page++) {
+    struct numap_page_rw *prw = &profile->pages[page];
+    int nb_threads = __builtin_popcountll(prw->threads);
+    int nb_writers = __builtin_popcountll(prw->writer_threads);
+    printf("Page %#" PRIx64 " (node %d): %-8" PRIu64 " reads %-8" PRIu64 " writes %d threads %d writers%s\n",
+           prw->page, prw->node, prw->reads, prw->writes, nb_threads, nb_writers,
+           nb_threads > 1 && nb_writers > 0 ? " shared written" : "");
+  }
+  return 0;
+}
+
+void numap_rw_profile_free(struct numap_rw_profile *profile) {
+  free(profile->pages);
+  profile->pages = NULL;
+  profile->nb_pages = 0;
+}
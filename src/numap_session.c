@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Sessions are kept in a process wide registry, walked without locks by
+ * the SIGIO handler to find the measure owning a file descriptor.
+ * Modifications are done under registry_lock (or the session lock for
+ * its links) with atomic stores, and memory is only freed once no
+ * handler is running anymore, so that a handler never follows a freed
+ * pointer.
+ */
+struct numap_session default_session = {
+  .next = NULL,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .links = NULL,
+};
+
+/**
+ * Details of the last error, per thread: threads sharing a session do
+ * not overwrite each other's before reading them.
+ */
+__thread int last_pfm_err;
+__thread int last_sys_errno;
+
+static struct numap_session *sessions = &default_session;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int handlers_running = 0;
+
+static pthread_once_t signal_once = PTHREAD_ONCE_INIT;
+static void (*signal_handler)(int, siginfo_t*, void*);
+static int signal_status;
+static int signal_errno;
+
+void session_handler_enter(void) {
+  __atomic_add_fetch(&handlers_running, 1, __ATOMIC_SEQ_CST);
+}
+
+void session_handler_exit(void) {
+  __atomic_sub_fetch(&handlers_running, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Waits until the handlers that may have seen unlinked memory are done.
+ */
+static void session_quiesce(void) {
+  while (__atomic_load_n(&handlers_running, __ATOMIC_SEQ_CST) != 0) {
+    sched_yield();
+  }
+}
+
+int numap_session_create(struct numap_session **session) {
+  int res = numap_init();
+  if (res < 0) {
+    return res;
+  }
+  struct numap_session *s = calloc(1, sizeof(struct numap_session));
+  if (s == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_mutex_lock(&registry_lock);
+  s->next = sessions;
+  __atomic_store_n(&sessions, s, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&registry_lock);
+  *session = s;
+  return 0;
+}
+
+/**
+ * Frees session. All its sampling measures must have been ended.
+ */
+int numap_session_destroy(struct numap_session *session) {
+  if (session == &default_session) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&session->lock);
+  int busy = session->links != NULL;
+  pthread_mutex_unlock(&session->lock);
+  if (busy) {
+    return ERROR_NUMAP_SESSION_BUSY;
+  }
+  pthread_mutex_lock(&registry_lock);
+  struct numap_session **prev = &sessions;
+  while (*prev != NULL && *prev != session) {
+    prev = &(*prev)->next;
+  }
+  if (*prev != NULL) {
+    __atomic_store_n(prev, session->next, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&registry_lock);
+  session_quiesce();
+  pthread_mutex_destroy(&session->lock);
+  free(session);
+  return 0;
+}
+
+/**
+ * Kept for the sessions API: the details of the last error belong to
+ * the calling thread, whatever its session, so session is unused.
+ */
+const char *numap_session_error_message(struct numap_session *session, int error) {
+  static __thread char message[1024];
+  return error_message(error, message, sizeof(message));
+}
+
+int session_register_fd(struct numap_session *session, int fd, struct numap_sampling_measure *measure) {
+  struct session_link *link = malloc(sizeof(struct session_link));
+  if (link == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  link->fd = fd;
+  link->measure = measure;
+  pthread_mutex_lock(&session->lock);
+  link->next = session->links;
+  __atomic_store_n(&session->links, link, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&session->lock);
+  return 0;
+}
+
+/**
+ * Removes the links of measure (of its event fd only, unless fd is -1)
+ * from its session.
+ */
+static void unregister_links(struct numap_session *session, struct numap_sampling_measure *measure, int fd) {
+  struct session_link *removed = NULL;
+  pthread_mutex_lock(&session->lock);
+  struct session_link **prev = &session->links;
+  while (*prev != NULL) {
+    struct session_link *link = *prev;
+    if (link->measure == measure && (fd == -1 || link->fd == fd)) {
+      // link->next is left untouched for handlers still walking it
+      __atomic_store_n(prev, link->next, __ATOMIC_RELEASE);
+      link->removed_next = removed;
+      removed = link;
+    } else {
+      prev = &link->next;
+    }
+  }
+  pthread_mutex_unlock(&session->lock);
+  if (removed == NULL) {
+    return;
+  }
+  session_quiesce();
+  while (removed != NULL) {
+    struct session_link *next = removed->removed_next;
+    free(removed);
+    removed = next;
+  }
+}
+
+/**
+ * Removes the links of measure, and only them, from its session.
+ */
+void session_unregister_measure(struct numap_session *session, struct numap_sampling_measure *measure) {
+  unregister_links(session, measure, -1);
+}
+
+/**
+ * Removes the link of event fd of measure from its session, before the
+ * event is closed and its number reused.
+ */
+void session_unregister_fd(struct numap_session *session, struct numap_sampling_measure *measure, int fd) {
+  unregister_links(session, measure, fd);
+}
+
+/**
+ * Returns the measure owning fd, or NULL if there is none (e.g. late
+ * signal of an ended measure). Async signal safe: must be called
+ * between session_handler_enter and session_handler_exit.
+ */
+struct numap_sampling_measure *session_find_fd(int fd) {
+  for (struct numap_session *s = __atomic_load_n(&sessions, __ATOMIC_ACQUIRE); s != NULL;
+       s = __atomic_load_n(&s->next, __ATOMIC_ACQUIRE)) {
+    for (struct session_link *link = __atomic_load_n(&s->links, __ATOMIC_ACQUIRE); link != NULL;
+         link = __atomic_load_n(&link->next, __ATOMIC_ACQUIRE)) {
+      if (link->fd == fd) {
+        return link->measure;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void install_signal_handler(void) {
+  struct sigaction sigoverflow;
+  memset(&sigoverflow, 0, sizeof(struct sigaction));
+  sigoverflow.sa_sigaction = signal_handler;
+  sigoverflow.sa_flags = SA_SIGINFO;
+  if (sigaction(SIGIO, &sigoverflow, NULL) < 0) {
+    signal_status = ERROR_NUMAP_SIGNAL;
+    signal_errno = errno;
+  }
+}
+
+/**
+ * Blocks SIGIO in the calling thread until sigio_restore. The refresh
+ * handler takes the spin locks of sketches, live statistics and regions:
+ * code taking them outside the handler blocks SIGIO first, or the
+ * handler would spin forever if it interrupted the thread holding one.
+ * The handler itself runs with SIGIO blocked.
+ */
+void sigio_block(sigset_t *old) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGIO);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+void sigio_restore(const sigset_t *old) {
+  pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/**
+ * Installs the SIGIO handler shared by every session, once per process.
+ */
+int session_install_signal_handler(struct numap_session *session, void (*handler)(int, siginfo_t*, void*)) {
+  signal_handler = handler;
+  pthread_once(&signal_once, install_signal_handler);
+  if (signal_status != 0) {
+    last_sys_errno = signal_errno;
+  }
+  return signal_status;
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Cache line contention analysis, in the spirit of perf c2c: load and
+ * store samples are grouped by cache line, and lines whose loads hit a
+ * modified line in another core's cache (HITM snoops) while being
+ * accessed by several threads or nodes are reported. Counts are in
+ * accesses: each sample counts for the period it was taken with.
+ */
+
+#if MAX_NB_THREADS > 64 || MAX_NB_NUMA_NODES > 32
+#error "numap_sharing.c: thread or node masks too small"
+#endif
+
+#define LINE_MASK (~((uint64_t)NUMAP_CACHE_LINE_SIZE - 1))
+#define WORD_SIZE (NUMAP_CACHE_LINE_SIZE / NUMAP_LINE_WORDS)
+
+struct sharing_state {
+  struct u64_map lines_map;
+  struct numap_line_sharing *lines;
+  size_t lines_capacity;
+  struct numap_sharing *sharing;
+};
+
+static int is_remote_hitm(union perf_mem_data_src data_src) {
+  if (data_src.mem_lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2)) {
+    return 1;
+  }
+#ifdef PERF_MEM_REMOTE_REMOTE
+  if (data_src.mem_remote == PERF_MEM_REMOTE_REMOTE) {
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+static int sharing_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct sharing_state *state = arg;
+  struct numap_sharing *sharing = state->sharing;
+  uint64_t line = sample->addr & LINE_MASK;
+  int inserted;
+  int64_t index = u64_map_get(&state->lines_map, line, &inserted);
+  if (index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&state->lines, &state->lines_capacity, index + 1, sizeof(struct numap_line_sharing)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&state->lines[index], 0, sizeof(struct numap_line_sharing));
+    state->lines[index].line = line;
+    state->lines[index].node = -1;
+  }
+  struct numap_line_sharing *ls = &state->lines[index];
+  struct numap_line_word *word = &ls->words[(sample->addr & (NUMAP_CACHE_LINE_SIZE - 1)) / WORD_SIZE];
+  int write = sample->access == NUMAP_ACCESS_WRITE || sample->data_src.mem_op == PERF_MEM_OP_STORE;
+  uint64_t period = sample_period(measure, thread, sample);
+
+  int node = sample_cpu_node(measure, sample);
+  if (node >= 0) {
+    ls->cpu_nodes |= 1U << node;
+  }
+  ls->threads |= 1ULL << thread;
+  word->threads |= 1ULL << thread;
+  if (write) {
+    ls->stores += period;
+    word->stores += period;
+    sharing->stores += period;
+    return 0;
+  }
+  ls->loads += period;
+  word->loads += period;
+  sharing->loads += period;
+  if (sample->data_src.mem_snoop & PERF_MEM_SNOOP_HITM) {
+    word->hitm += period;
+    ls->hitm_threads |= 1ULL << thread;
+    ls->hitm_latency += sample->weight * period;
+    if (is_remote_hitm(sample->data_src)) {
+      ls->remote_hitm += period;
+      sharing->remote_hitm += period;
+    } else {
+      ls->local_hitm += period;
+      sharing->local_hitm += period;
+    }
+  }
+  return 0;
+}
+
+static int compare_line_sharing(const void *a, const void *b) {
+  const struct numap_line_sharing *la = a;
+  const struct numap_line_sharing *lb = b;
+  uint64_t ha = la->local_hitm + la->remote_hitm;
+  uint64_t hb = lb->local_hitm + lb->remote_hitm;
+  if (la->remote_hitm != lb->remote_hitm) {
+    return la->remote_hitm < lb->remote_hitm ? 1 : -1;
+  }
+  if (ha != hb) {
+    return ha < hb ? 1 : -1;
+  }
+  return la->line < lb->line ? -1 : (la->line > lb->line ? 1 : 0);
+}
+
+/**
+ * False sharing: several threads use the line but no word of it is
+ * used by more than one thread.
+ */
+static int is_false_sharing(struct numap_line_sharing *ls) {
+  if (__builtin_popcountll(ls->threads) < 2) {
+    return 0;
+  }
+  for (int w = 0; w < NUMAP_LINE_WORDS; w++) {
+    if (__builtin_popcountll(ls->words[w].threads) > 1) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Finds the cache lines of measure contended between threads: lines
+ * with HITM loads that are accessed by several threads or from several
+ * nodes. Combine with numap_sampling_read_write_start to see the stores
+ * too. lines has to be freed with numap_sharing_free.
+ */
+int numap_sampling_sharing(struct numap_sampling_measure *measure, struct numap_sharing *sharing) {
+  struct sharing_state state;
+  int res;
+
+  if (!(measure->sample_type & PERF_SAMPLE_ADDR) || !(measure->sample_type & PERF_SAMPLE_DATA_SRC)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  memset(sharing, 0, sizeof(struct numap_sharing));
+
+  memset(&state, 0, sizeof(state));
+  state.sharing = sharing;
+  if (u64_map_init(&state.lines_map, 4096) != 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+
+  res = numap_sampling_foreach_sample(measure, sharing_sample, &state);
+  if (res != 0) {
+    goto out;
+  }
+
+  // Keeps the contended lines only
+  size_t nb_lines = 0;
+  for (size_t i = 0; i < state.lines_map.count; i++) {
+    struct numap_line_sharing *ls = &state.lines[i];
+    if (ls->local_hitm + ls->remote_hitm == 0 ||
+        (__builtin_popcountll(ls->threads) < 2 && __builtin_popcount(ls->cpu_nodes) < 2)) {
+      continue;
+    }
+    ls->false_sharing = is_false_sharing(ls);
+    state.lines[nb_lines++] = *ls;
+  }
+
+  entries_resolve_nodes(measure, state.lines, nb_lines, sizeof(struct numap_line_sharing),
+                        offsetof(struct numap_line_sharing, line), offsetof(struct numap_line_sharing, node));
+
+  qsort(state.lines, nb_lines, sizeof(struct numap_line_sharing), compare_line_sharing);
+  sharing->nb_lines = nb_lines;
+  sharing->lines = state.lines;
+  state.lines = NULL;
+
+ out:
+  free(state.lines);
+  u64_map_free(&state.lines_map);
+  return res;
+}
+
+static void print_threads(uint64_t threads) {
+  const char *separator = "";
+  for (int thread = 0; thread < MAX_NB_THREADS; thread++) {
+    if (threads & (1ULL << thread)) {
+      printf("%s%d", separator, thread);
+      separator = ",";
+    }
+  }
+}
+
+int numap_sharing_print(struct numap_sharing *sharing, size_t nb_lines) {
+  printf("\nCache line contention: %-8" PRIu64 " loads %-8" PRIu64 " stores %-8" PRIu64 " local HITM %-8" PRIu64 " remote HITM\n",
+         sharing->loads, sharing->stores, sharing->local_hitm, sharing->remote_hitm);
+  for (size_t i = 0; i < nb_lines && i < sharing->nb_lines; i++) {
+    struct numap_line_sharing *ls = &sharing->lines[i];
+    uint64_t hitm = ls->local_hitm + ls->remote_hitm;
+    printf("\nLine %#" PRIx64 " (node %d): %-6" PRIu64 " local HITM %-6" PRIu64 " remote HITM mean HITM latency %0.1f"
+           " %-6" PRIu64 " loads %-6" PRIu64 " stores %d nodes %s\n",
+           ls->line, ls->node, ls->local_hitm, ls->remote_hitm, hitm ? (double)ls->hitm_latency / hitm : 0.0,
+           ls->loads, ls->stores, __builtin_popcount(ls->cpu_nodes),
+           ls->false_sharing ? "false sharing" : "true sharing");
+    printf("  threads ");
+    print_threads(ls->threads);
+    printf(", HITM threads ");
+    print_threads(ls->hitm_threads);
+    printf("\n");
+    for (int w = 0; w < NUMAP_LINE_WORDS; w++) {
+      struct numap_line_word *word = &ls->words[w];
+      if (word->threads == 0) {
+        continue;
+      }
+      printf("  offset %-3d %-6" PRIu64 " loads %-6" PRIu64 " stores %-6" PRIu64 " HITM, threads ",
+             w * WORD_SIZE, word->loads, word->stores, word->hitm);
+      print_threads(word->threads);
+      printf("\n");
+    }
+  }
+  return 0;
+}
+
+void numap_sharing_free(struct numap_sharing *sharing) {
+  free(sharing->lines);
+  sharing->lines = NULL;
+  sharing->nb_lines = 0;
+}
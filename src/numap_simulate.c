@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Memory placement policy simulator. The samples served by memory are
+ * aggregated once per (page, thread); each policy then only walks these
+ * entries, placing every page on a node and charging each access the
+ * latency factor between the node of the thread and the node of the
+ * page. Sampled latencies are first brought back to local latencies,
+ * as the page was local or remote when they were measured.
+ */
+
+#define KEY_THREAD_BITS 7
+#if MAX_NB_THREADS > (1 << KEY_THREAD_BITS)
+#error "numap_simulate.c: aggregation key too small for MAX_NB_THREADS"
+#endif
+#define KEY(page, thread) ((page) | (uint64_t)(thread))
+
+struct simulate_state {
+  uint64_t page_mask;
+  const struct numap_machine *machine; // NULL for the topology of the measure
+  double remote_factor[MAX_NB_NUMA_NODES]; // mean factor of the remote nodes of each cpu node
+  uint64_t thread_node_samples[MAX_NB_THREADS][MAX_NB_NUMA_NODES];
+  struct u64_map pages_map;
+  size_t pages_capacity;
+  struct u64_map entries_map;
+  size_t entries_capacity;
+  struct numap_simulation *simulation;
+};
+
+static int simulate_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct simulate_state *state = arg;
+  struct numap_simulation *simulation = state->simulation;
+  int remote = is_served_by_remote_memory(sample->data_src);
+  if (!remote && !is_served_by_local_memory(sample->data_src)) {
+    return 0;
+  }
+  int node;
+  if (state->machine == NULL) {
+    node = sample_cpu_node(measure, sample);
+  } else if ((sample->sample_type & PERF_SAMPLE_CPU) && sample->cpu < (uint32_t)state->machine->nb_cpus) {
+    node = state->machine->cpu_to_node[sample->cpu];
+    node = node < simulation->nb_nodes ? node : -1;
+  } else {
+    node = -1;
+  }
+  if (node >= 0) {
+    state->thread_node_samples[thread][node]++;
+  }
+  uint64_t page = sample->addr & state->page_mask;
+  uint64_t period = sample_period(measure, thread, sample);
+  uint64_t time = (sample->sample_type & PERF_SAMPLE_TIME) ? sample->time : 0;
+  int inserted;
+  int64_t page_index = u64_map_get(&state->pages_map, page, &inserted);
+  if (page_index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&simulation->pages, &state->pages_capacity, page_index + 1,
+                      sizeof(struct numap_simulated_page)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&simulation->pages[page_index], 0, sizeof(struct numap_simulated_page));
+    simulation->pages[page_index].page = page;
+    simulation->pages[page_index].first_time = time;
+    simulation->pages[page_index].first_thread = thread;
+  } else if (time < simulation->pages[page_index].first_time) {
+    simulation->pages[page_index].first_time = time;
+    simulation->pages[page_index].first_thread = thread;
+  }
+
+  uint64_t key = KEY(page, thread);
+  int64_t index = u64_map_get(&state->entries_map, key, &inserted);
+  if (index < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  if (inserted) {
+    if (array_reserve((void **)&simulation->entries, &state->entries_capacity, index + 1,
+                      sizeof(struct numap_simulated_access)) != 0) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    memset(&simulation->entries[index], 0, sizeof(struct numap_simulated_access));
+    simulation->entries[index].thread = thread;
+    simulation->entries[index].page_index = page_index;
+  }
+  struct numap_simulated_access *entry = &simulation->entries[index];
+  double cycles = (double)sample->weight * period;
+  if (remote && node >= 0) {
+    cycles /= state->remote_factor[node];
+  }
+  entry->samples++;
+  entry->accesses += period;
+  entry->local_cycles += cycles;
+  return 0;
+}
+
+/**
+ * Without sample times, the first touch of a page is attributed to the
+ * thread accessing it the most.
+ */
+static void simulate_first_touch_by_count(struct numap_simulation *simulation) {
+  uint64_t *best = calloc(simulation->nb_pages, sizeof(uint64_t));
+  if (best == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < simulation->nb_entries; i++) {
+    struct numap_simulated_access *entry = &simulation->entries[i];
+    if (entry->accesses > best[entry->page_index]) {
+      best[entry->page_index] = entry->accesses;
+      simulation->pages[entry->page_index].first_thread = entry->thread;
+    }
+  }
+  free(best);
+}
+
+/**
+ * Aggregates the samples of measure, typically replayed from a
+ * recording, for numap_simulation_run, on the machine the samples were
+ * taken on: the one recorded in the trace of a replayed measure, the
+ * host otherwise. thread_nodes gives the node each thread runs on; when
+ * NULL, each thread gets the node it was sampled on the most. The
+ * simulation has to be freed with numap_simulation_free.
+ */
+int numap_simulation_init(struct numap_simulation *simulation, struct numap_sampling_measure *measure,
+                          const int *thread_nodes) {
+  return numap_simulation_init_machine(simulation, measure, thread_nodes, NULL);
+}
+
+/**
+ * Same as numap_simulation_init on the given machine (when not NULL),
+ * e.g. for a perf.data recording, which has no topology.
+ */
+int numap_simulation_init_machine(struct numap_simulation *simulation, struct numap_sampling_measure *measure,
+                                  const int *thread_nodes, const struct numap_machine *machine) {
+  struct simulate_state *state;
+  int res;
+
+  int nb_nodes = machine != NULL ? machine->nb_nodes : measure_nb_nodes(measure);
+  if (machine != NULL && (nb_nodes < 1 || nb_nodes > MAX_NB_NUMA_NODES || machine->nb_cpus < 0 ||
+                          (machine->nb_cpus > 0 && machine->cpu_to_node == NULL))) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  if (nb_nodes < 0) {
+    return ERROR_NUMAP_NOT_NUMA;
+  }
+  if (!(measure->sample_type & PERF_SAMPLE_ADDR) || !(measure->sample_type & PERF_SAMPLE_DATA_SRC)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  memset(simulation, 0, sizeof(struct numap_simulation));
+  simulation->nb_nodes = nb_nodes;
+  simulation->nb_threads = measure->nb_threads;
+  simulation->page_size = measure->page_size;
+  for (int cpu_node = 0; cpu_node < nb_nodes; cpu_node++) {
+    for (int mem_node = 0; mem_node < nb_nodes; mem_node++) {
+      if (machine == NULL) {
+        simulation->factors[cpu_node][mem_node] = remote_latency_factor(measure, cpu_node, mem_node);
+        continue;
+      }
+      int local = machine->distances[cpu_node][cpu_node];
+      int remote = machine->distances[cpu_node][mem_node];
+      simulation->factors[cpu_node][mem_node] = local > 0 && remote > 0 ? (double)remote / local : 1.0;
+    }
+  }
+
+  state = calloc(1, sizeof(struct simulate_state));
+  if (state == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  state->simulation = simulation;
+  state->machine = machine;
+  state->page_mask = ~((uint64_t)measure->page_size - 1);
+  for (int cpu_node = 0; cpu_node < simulation->nb_nodes; cpu_node++) {
+    double sum = 0;
+    for (int mem_node = 0; mem_node < simulation->nb_nodes; mem_node++) {
+      if (mem_node != cpu_node) {
+        sum += simulation->factors[cpu_node][mem_node];
+      }
+    }
+    state->remote_factor[cpu_node] = simulation->nb_nodes > 1 ? sum / (simulation->nb_nodes - 1) : 1.0;
+  }
+  if (u64_map_init(&state->pages_map, 4096) != 0 || u64_map_init(&state->entries_map, 4096) != 0) {
+    res = ERROR_NUMAP_MALLOC;
+    goto out;
+  }
+
+  res = numap_sampling_foreach_sample(measure, simulate_sample, state);
+  simulation->nb_pages = state->pages_map.count;
+  simulation->nb_entries = state->entries_map.count;
+  if (res != 0) {
+    numap_simulation_free(simulation);
+    goto out;
+  }
+  if (!(measure->sample_type & PERF_SAMPLE_TIME)) {
+    simulate_first_touch_by_count(simulation);
+  }
+
+  for (int thread = 0; thread < simulation->nb_threads; thread++) {
+    int node = thread_nodes != NULL ? thread_nodes[thread] : -1;
+    if (thread_nodes == NULL) {
+      uint64_t best = 0;
+      for (int n = 0; n < simulation->nb_nodes; n++) {
+        if (state->thread_node_samples[thread][n] > best) {
+          best = state->thread_node_samples[thread][n];
+          node = n;
+        }
+      }
+    }
+    simulation->thread_nodes[thread] = node >= 0 && node < simulation->nb_nodes ? node : -1;
+  }
+
+ out:
+  u64_map_free(&state->pages_map);
+  u64_map_free(&state->entries_map);
+  free(state);
+  return res;
+}
+
+/**
+ * Node of page under policy, -1 when unknown.
+ */
+static int policy_node(struct numap_simulation *simulation, struct numap_policy *policy, int *interleave,
+                       int nb_interleave, struct numap_simulated_page *page) {
+  switch (policy->type) {
+  case NUMAP_POLICY_INTERLEAVE:
+    return interleave[(page->page / simulation->page_size) % nb_interleave];
+  case NUMAP_POLICY_PREFERRED:
+    return policy->node;
+  case NUMAP_POLICY_BIND:
+    for (size_t i = 0; i < policy->nb_ranges; i++) {
+      if (page->page >= policy->ranges[i].start && page->page < policy->ranges[i].end) {
+        return policy->ranges[i].node;
+      }
+    }
+    // Fall through - allocations outside the ranges are placed by first touch
+  case NUMAP_POLICY_FIRST_TOUCH:
+  default:
+    return simulation->thread_nodes[page->first_thread];
+  }
+}
+
+/**
+ * Estimates the remote accesses, the bytes served by each node and the
+ * latency cost of the simulated accesses under policy. The interleave
+ * policy uses the nodes of policy->nodes (all the nodes when 0), and
+ * the bind policy places the pages of each range on its node and the
+ * others by first touch.
+ */
+int numap_simulation_run(struct numap_simulation *simulation, struct numap_policy *policy,
+                         struct numap_policy_result *result) {
+  int interleave[MAX_NB_NUMA_NODES];
+  int nb_interleave = 0;
+
+  for (int node = 0; node < simulation->nb_nodes; node++) {
+    if (policy->nodes == 0 || (policy->nodes & (1U << node))) {
+      interleave[nb_interleave++] = node;
+    }
+  }
+  if (policy->type < NUMAP_POLICY_FIRST_TOUCH || policy->type > NUMAP_POLICY_BIND || nb_interleave == 0 ||
+      (policy->type == NUMAP_POLICY_PREFERRED && (policy->node < 0 || policy->node >= simulation->nb_nodes))) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  for (size_t i = 0; i < policy->nb_ranges; i++) {
+    if (policy->ranges[i].node < 0 || policy->ranges[i].node >= simulation->nb_nodes) {
+      return ERROR_NUMAP_INVALID_ARGUMENT;
+    }
+  }
+
+  memset(result, 0, sizeof(struct numap_policy_result));
+  result->policy = policy->type;
+  result->nb_nodes = simulation->nb_nodes;
+  int *page_nodes = malloc(simulation->nb_pages * sizeof(int));
+  if (page_nodes == NULL && simulation->nb_pages > 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  for (size_t i = 0; i < simulation->nb_pages; i++) {
+    page_nodes[i] = policy_node(simulation, policy, interleave, nb_interleave, &simulation->pages[i]);
+  }
+
+  for (size_t i = 0; i < simulation->nb_entries; i++) {
+    struct numap_simulated_access *entry = &simulation->entries[i];
+    int cpu_node = simulation->thread_nodes[entry->thread];
+    int mem_node = page_nodes[entry->page_index];
+    if (cpu_node < 0 || mem_node < 0) {
+      result->unresolved_samples += entry->samples;
+      continue;
+    }
+    result->samples += entry->samples;
+    result->node_bytes[mem_node] += (double)entry->accesses * NUMAP_CACHE_LINE_SIZE;
+    result->local_cycles += entry->local_cycles;
+    result->cycles += entry->local_cycles * simulation->factors[cpu_node][mem_node];
+    if (cpu_node != mem_node) {
+      result->remote_samples += entry->samples;
+    }
+  }
+  result->remote_fraction = result->samples ? (double)result->remote_samples / result->samples : 0;
+  free(page_nodes);
+  return 0;
+}
+
+static const char *policy_name(int type) {
+  switch (type) {
+  case NUMAP_POLICY_FIRST_TOUCH:
+    return "first touch";
+  case NUMAP_POLICY_INTERLEAVE:
+    return "interleave";
+  case NUMAP_POLICY_PREFERRED:
+    return "preferred";
+  case NUMAP_POLICY_BIND:
+    return "bind";
+  }
+  return "unknown";
+}
+
+/**
+ * Prints result; per node bandwidth demands are given when the
+ * duration of the recording (seconds) is known, bytes otherwise.
+ */
+int numap_policy_result_print(struct numap_policy_result *result, double seconds) {
+  printf("Policy %-12s %5.1f%% remote accesses, %.4g cycles (%.2fx local)",
+         policy_name(result->policy), 100.0 * result->remote_fraction, result->cycles,
+         result->local_cycles > 0 ? result->cycles / result->local_cycles : 0.0);
+  for (int node = 0; node < result->nb_nodes; node++) {
+    if (seconds > 0) {
+      printf(", node %d %.1f MB/s", node, result->node_bytes[node] / seconds / 1e6);
+    } else {
+      printf(", node %d %.4g MB", node, result->node_bytes[node] / 1e6);
+    }
+  }
+  printf("\n");
+  if (result->unresolved_samples) {
+    printf("%" PRIu64 " memory samples of threads with an unknown node\n", result->unresolved_samples);
+  }
+  return 0;
+}
+
+void numap_simulation_free(struct numap_simulation *simulation) {
+  free(simulation->pages);
+  free(simulation->entries);
+  simulation->pages = NULL;
+  simulation->entries = NULL;
+  simulation->nb_pages = 0;
+  simulation->nb_entries = 0;
+}
@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Streaming sketches of the hottest pages and cache lines, in fixed
+ * memory. Each one has:
+ *
+ * - a space-saving top-k: k counters, the least counted one being given
+ *   to a new key. The count of a key overestimates its accesses by at
+ *   most its error, itself below total / k, and every key with more
+ *   than total / k accesses is monitored.
+ * - a count-min sketch of depth rows of width counters: the estimate of
+ *   any key overestimates its accesses by less than epsilon * total
+ *   with probability 1 - delta.
+ *
+ * Each sample counts for the accesses it stands for, the period it was
+ * taken with, so that threads sampled with different periods compare.
+ *
+ * Sketches are updated from the refresh signal handler, so nothing is
+ * allocated after numap_sketch_init. Updates are serialized by a spin
+ * lock. The handler runs with SIGIO blocked and updates done outside of
+ * it (the drains of numap_sampling_read_stop and of the collector of
+ * attached measures) block SIGIO too, so that the handler never
+ * interrupts the thread holding the lock. Readers use a sequence count
+ * to take consistent snapshots while sampling goes on.
+ */
+
+static const uint64_t row_seeds[] = {
+  0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+  0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL, 0x94d049bb133111ebULL, 0xbf58476d1ce4e5b9ULL,
+};
+#define NUMAP_SKETCH_MAX_DEPTH (sizeof(row_seeds) / sizeof(row_seeds[0]))
+
+static inline uint64_t sketch_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static int space_saving_init(struct numap_space_saving *ss, int k) {
+  uint32_t index_size = 4;
+  while (index_size < 2 * (uint32_t)k) {
+    index_size *= 2;
+  }
+  ss->k = k;
+  ss->nb = 0;
+  ss->index_mask = index_size - 1;
+  ss->entries = calloc(k, sizeof(struct numap_heavy_hitter));
+  ss->heap = calloc(k, sizeof(uint32_t));
+  ss->heap_pos = calloc(k, sizeof(uint32_t));
+  ss->index = calloc(index_size, sizeof(uint32_t));
+  if (ss->entries == NULL || ss->heap == NULL || ss->heap_pos == NULL || ss->index == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  return 0;
+}
+
+static void space_saving_free(struct numap_space_saving *ss) {
+  free(ss->entries);
+  free(ss->heap);
+  free(ss->heap_pos);
+  free(ss->index);
+  memset(ss, 0, sizeof(struct numap_space_saving));
+}
+
+/**
+ * Index slot holding key, or the empty slot where it would go.
+ */
+static uint32_t index_slot(struct numap_space_saving *ss, uint64_t key) {
+  uint32_t slot = sketch_hash(key) & ss->index_mask;
+  while (ss->index[slot] != 0 && ss->entries[ss->index[slot] - 1].key != key) {
+    slot = (slot + 1) & ss->index_mask;
+  }
+  return slot;
+}
+
+/**
+ * Removes the index slot of a key, moving back the keys that probed
+ * past it (no tombstones, so lookups stay short).
+ */
+static void index_remove(struct numap_space_saving *ss, uint32_t slot) {
+  uint32_t next = slot;
+  for (;;) {
+    next = (next + 1) & ss->index_mask;
+    if (ss->index[next] == 0) {
+      break;
+    }
+    uint32_t home = sketch_hash(ss->entries[ss->index[next] - 1].key) & ss->index_mask;
+    // The key at next can fill slot when its home is not in (slot, next]
+    int stays = slot <= next ? (home > slot && home <= next) : (home > slot || home <= next);
+    if (!stays) {
+      ss->index[slot] = ss->index[next];
+      slot = next;
+    }
+  }
+  ss->index[slot] = 0;
+}
+
+static void heap_swap(struct numap_space_saving *ss, uint32_t a, uint32_t b) {
+  uint32_t entry = ss->heap[a];
+  ss->heap[a] = ss->heap[b];
+  ss->heap[b] = entry;
+  ss->heap_pos[ss->heap[a]] = a;
+  ss->heap_pos[ss->heap[b]] = b;
+}
+
+static void heap_down(struct numap_space_saving *ss, uint32_t pos) {
+  for (;;) {
+    uint32_t smallest = pos;
+    uint32_t left = 2 * pos + 1;
+    uint32_t right = left + 1;
+    if (left < (uint32_t)ss->nb && ss->entries[ss->heap[left]].count < ss->entries[ss->heap[smallest]].count) {
+      smallest = left;
+    }
+    if (right < (uint32_t)ss->nb && ss->entries[ss->heap[right]].count < ss->entries[ss->heap[smallest]].count) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      return;
+    }
+    heap_swap(ss, pos, smallest);
+    pos = smallest;
+  }
+}
+
+static void heap_up(struct numap_space_saving *ss, uint32_t pos) {
+  while (pos > 0) {
+    uint32_t parent = (pos - 1) / 2;
+    if (ss->entries[ss->heap[parent]].count <= ss->entries[ss->heap[pos]].count) {
+      return;
+    }
+    heap_swap(ss, pos, parent);
+    pos = parent;
+  }
+}
+
+static void space_saving_add(struct numap_space_saving *ss, uint64_t key, uint64_t count) {
+  uint32_t slot = index_slot(ss, key);
+  if (ss->index[slot] != 0) {
+    uint32_t entry = ss->index[slot] - 1;
+    ss->entries[entry].count += count;
+    heap_down(ss, ss->heap_pos[entry]);
+    return;
+  }
+  if (ss->nb < ss->k) {
+    uint32_t entry = ss->nb++;
+    ss->entries[entry].key = key;
+    ss->entries[entry].count = count;
+    ss->entries[entry].error = 0;
+    ss->index[slot] = entry + 1;
+    ss->heap[entry] = entry;
+    ss->heap_pos[entry] = entry;
+    heap_up(ss, entry);
+    return;
+  }
+  // The least counted key makes room for the new one, which inherits its count
+  uint32_t entry = ss->heap[0];
+  index_remove(ss, index_slot(ss, ss->entries[entry].key));
+  ss->entries[entry].key = key;
+  ss->entries[entry].error = ss->entries[entry].count;
+  ss->entries[entry].count += count;
+  ss->index[index_slot(ss, key)] = entry + 1;
+  heap_down(ss, 0);
+}
+
+static void count_min_add(struct numap_count_min *cm, uint64_t key, uint64_t count) {
+  for (uint32_t row = 0; row < cm->depth; row++) {
+    cm->counts[row * cm->width + sketch_hash(key ^ row_seeds[row]) % cm->width] += count;
+  }
+}
+
+static uint64_t count_min_estimate(struct numap_count_min *cm, uint64_t key) {
+  uint64_t estimate = UINT64_MAX;
+  for (uint32_t row = 0; row < cm->depth; row++) {
+    uint64_t counter = __atomic_load_n(&cm->counts[row * cm->width + sketch_hash(key ^ row_seeds[row]) % cm->width],
+                                       __ATOMIC_RELAXED);
+    if (counter < estimate) {
+      estimate = counter;
+    }
+  }
+  return estimate;
+}
+
+/**
+ * Sets up sketch to track the k hottest pages and cache lines, with
+ * count-min estimates within epsilon * total accesses with probability
+ * 1 - delta. All the memory is allocated here: at most
+ * 2 * (48 * k + 8 * e / epsilon * ln(1 / delta)) bytes. delta has to be
+ * at least exp(-NUMAP_SKETCH_MAX_DEPTH), one row of counters per seed.
+ */
+int numap_sketch_init(struct numap_sketch *sketch, int k, double epsilon, double delta) {
+  if (k < 1 || epsilon <= 0 || epsilon >= 1 || delta <= 0 || delta >= 1) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  memset(sketch, 0, sizeof(struct numap_sketch));
+  uint32_t width = (uint32_t)(M_E / epsilon) + 1;
+  // Smallest depth with exp(-depth) <= delta
+  uint32_t depth = 1;
+  for (double p = 1 / M_E; p > delta; p /= M_E) {
+    depth++;
+  }
+  if (depth > NUMAP_SKETCH_MAX_DEPTH) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  sketch->epsilon = epsilon;
+  sketch->delta = delta;
+  sketch->page_shift = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+  for (int what = 0; what < NUMAP_SKETCH_KINDS; what++) {
+    sketch->counts[what].width = width;
+    sketch->counts[what].depth = depth;
+    sketch->counts[what].counts = calloc((size_t)width * depth, sizeof(uint64_t));
+    if (sketch->counts[what].counts == NULL || space_saving_init(&sketch->top[what], k) != 0) {
+      numap_sketch_free(sketch);
+      return ERROR_NUMAP_MALLOC;
+    }
+  }
+  return 0;
+}
+
+void numap_sketch_free(struct numap_sketch *sketch) {
+  for (int what = 0; what < NUMAP_SKETCH_KINDS; what++) {
+    space_saving_free(&sketch->top[what]);
+    free(sketch->counts[what].counts);
+    sketch->counts[what].counts = NULL;
+  }
+}
+
+/**
+ * Counts a sample standing for count accesses (the period it was taken
+ * with) in sketch. Safe to call from a signal handler. A thread whose
+ * samples are drained into the same sketch by numap_sampling_set_sketch
+ * has to block SIGIO around the call.
+ */
+void numap_sketch_add(struct numap_sketch *sketch, struct numap_sample *sample, uint64_t count) {
+  uint64_t keys[NUMAP_SKETCH_KINDS];
+  keys[NUMAP_SKETCH_PAGES] = sample->addr >> sketch->page_shift << sketch->page_shift;
+  keys[NUMAP_SKETCH_LINES] = sample->addr & ~((uint64_t)NUMAP_CACHE_LINE_SIZE - 1);
+  while (__atomic_test_and_set(&sketch->lock, __ATOMIC_ACQUIRE)) {
+  }
+  __atomic_store_n(&sketch->seq, sketch->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (int what = 0; what < NUMAP_SKETCH_KINDS; what++) {
+    count_min_add(&sketch->counts[what], keys[what], count);
+    space_saving_add(&sketch->top[what], keys[what], count);
+  }
+  sketch->total += count;
+  __atomic_store_n(&sketch->seq, sketch->seq + 1, __ATOMIC_RELEASE);
+  __atomic_clear(&sketch->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Upper bound of the accesses to the page or cache line (what is
+ * NUMAP_SKETCH_PAGES or NUMAP_SKETCH_LINES) holding addr.
+ */
+uint64_t numap_sketch_estimate(struct numap_sketch *sketch, int what, uint64_t addr) {
+  uint64_t key = what == NUMAP_SKETCH_PAGES ? addr >> sketch->page_shift << sketch->page_shift :
+    addr & ~((uint64_t)NUMAP_CACHE_LINE_SIZE - 1);
+  return count_min_estimate(&sketch->counts[what], key);
+}
+
+static int compare_heavy_hitter(const void *a, const void *b) {
+  const struct numap_heavy_hitter *ha = a;
+  const struct numap_heavy_hitter *hb = b;
+  if (ha->count != hb->count) {
+    return ha->count < hb->count ? 1 : -1;
+  }
+  return ha->key < hb->key ? -1 : (ha->key > hb->key ? 1 : 0);
+}
+
+/**
+ * Copies the (at most k) hottest pages or cache lines (what is
+ * NUMAP_SKETCH_PAGES or NUMAP_SKETCH_LINES) into hitters, hottest
+ * first, and returns their number. total, when not NULL, gets the
+ * accesses counted so far. Can be called while sampling goes on.
+ */
+int numap_sketch_top(struct numap_sketch *sketch, int what, struct numap_heavy_hitter *hitters, int k,
+                     uint64_t *total) {
+  struct numap_space_saving *ss = &sketch->top[what];
+  struct numap_heavy_hitter *snapshot = malloc(ss->k * sizeof(struct numap_heavy_hitter));
+  if (snapshot == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  int nb;
+  uint64_t seq;
+  do {
+    while ((seq = __atomic_load_n(&sketch->seq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    nb = __atomic_load_n(&ss->nb, __ATOMIC_RELAXED);
+    memcpy(snapshot, ss->entries, nb * sizeof(struct numap_heavy_hitter));
+    if (total != NULL) {
+      *total = sketch->total;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&sketch->seq, __ATOMIC_RELAXED) != seq);
+  qsort(snapshot, nb, sizeof(struct numap_heavy_hitter), compare_heavy_hitter);
+  if (nb > k) {
+    nb = k;
+  }
+  memcpy(hitters, snapshot, nb * sizeof(struct numap_heavy_hitter));
+  free(snapshot);
+  return nb;
+}
+
+struct drain_arg {
+  struct numap_sampling_measure *measure;
+  int thread;
+};
+
+static int drain_record(struct perf_event_header *header, void *arg) {
+  struct drain_arg *da = arg;
+  struct numap_sampling_measure *measure = da->measure;
+  struct numap_sample sample;
+  if (header->type == PERF_RECORD_LOST && measure->live != NULL) {
+    // struct { header; u64 id; u64 lost; }
+    live_lost(measure->live, da->thread, ((uint64_t *)(header + 1))[1]);
+    return 0;
+  }
+  if (header->type != PERF_RECORD_SAMPLE && measure->regions != NULL) {
+    numap_regions_record(measure->regions, header);
+    return 0;
+  }
+  if (header->type != PERF_RECORD_SAMPLE || numap_sample_decode(measure->sample_type, header, &sample) != 0) {
+    return 0;
+  }
+  uint64_t period = sample_period(measure, da->thread, &sample);
+  if (measure->sketch != NULL) {
+    numap_sketch_add(measure->sketch, &sample, period);
+  }
+  if (measure->regions != NULL) {
+    numap_regions_add(measure->regions, &sample, period);
+  }
+  if (measure->live != NULL) {
+    live_add(measure->live, measure, da->thread, &sample);
+  }
+  return 0;
+}
+
+/**
+ * Counts the records of a ring not seen yet into the sketch, the live
+ * statistics and the regions of measure, and releases them to the kernel when
+ * release is set. Called by the refresh handler, which releases them to
+ * bound memory, and when the measure stops, which keeps them.
+ */
+void stream_drain(struct numap_sampling_measure *measure, int stream, int thread, int release) {
+  struct perf_event_mmap_page *metadata_page = *measure_ring(measure, stream, thread);
+  if ((measure->sketch == NULL && measure->live == NULL && measure->regions == NULL) || metadata_page == NULL) {
+    return;
+  }
+  uint64_t head = metadata_page->data_head;
+  rmb();
+  uint64_t pos = measure->drained_per_stream[stream][thread];
+  if (pos < metadata_page->data_tail) {
+    pos = metadata_page->data_tail;
+  }
+  struct drain_arg da = { measure, thread };
+  if (measure->live != NULL) {
+    live_begin(measure->live);
+  }
+  ring_walk(metadata_page, measure->page_size, measure_ring_len(measure, thread), pos, head, drain_record, &da);
+  if (measure->live != NULL) {
+    live_end(measure->live, measure);
+  }
+  measure->drained_per_stream[stream][thread] = head;
+  if (release) {
+    __sync_synchronize();
+    metadata_page->data_tail = head;
+  }
+}
+
+/**
+ * Makes the refresh handler of measure count its samples into sketch,
+ * every nb_refresh samples (see numap_sampling_set_measure_handler). The
+ * samples are released to the kernel unless a measure handler is set,
+ * so that rings never fill up and memory stays bounded: the rings then
+ * only keep the samples since the last refresh, which stopping the
+ * measure counts without releasing them. Has to be called before the
+ * measure starts.
+ */
+int numap_sampling_set_sketch(struct numap_sampling_measure *measure, struct numap_sketch *sketch) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  measure->sketch = sketch;
+  return 0;
+}
+
+int numap_sketch_print(struct numap_sketch *sketch, int k) {
+  static const char *names[NUMAP_SKETCH_KINDS] = { "pages", "cache lines" };
+  struct numap_heavy_hitter *hitters = malloc(k * sizeof(struct numap_heavy_hitter));
+  if (hitters == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  for (int what = 0; what < NUMAP_SKETCH_KINDS; what++) {
+    uint64_t total;
+    int nb = numap_sketch_top(sketch, what, hitters, k, &total);
+    if (nb < 0) {
+      free(hitters);
+      return nb;
+    }
+    printf("\nHottest %s of %" PRIu64 " accesses (counts within %" PRIu64 ")\n", names[what], total,
+           total / sketch->top[what].k);
+    for (int i = 0; i < nb; i++) {
+      printf("%#-16" PRIx64 " %-8" PRIu64 " accesses (at least %" PRIu64 ") %0.2f%%\n", hitters[i].key,
+             hitters[i].count, hitters[i].count - hitters[i].error, total ? 100.0 * hitters[i].count / total : 0.0);
+    }
+  }
+  free(hitters);
+  return 0;
+}
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Call stacks of samples taken with PERF_SAMPLE_CALLCHAIN, kept in a
+ * trie: each node is a frame whose parent is its caller, so that stacks
+ * sharing their outer frames share their nodes, and a sample is
+ * identified by the node of its innermost frame. Statistics are kept in
+ * that node, hence the memory used grows with the number of distinct
+ * stacks, not with the number of samples. Children are found through an
+ * open addressing index of (parent, ip) pairs.
+ */
+
+#define STACK_INITIAL_NODES 1024
+
+static inline uint64_t stack_hash(uint32_t parent, uint64_t ip) {
+  uint64_t key = ip ^ ((uint64_t)parent * 0x9e3779b97f4a7c15ULL);
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+int numap_stacks_init(struct numap_stacks *stacks) {
+  memset(stacks, 0, sizeof(struct numap_stacks));
+  stacks->capacity = STACK_INITIAL_NODES;
+  stacks->nodes = calloc(stacks->capacity, sizeof(struct numap_stack_node));
+  stacks->index_mask = 2 * STACK_INITIAL_NODES - 1;
+  stacks->index = calloc(stacks->index_mask + 1, sizeof(uint32_t));
+  if (stacks->nodes == NULL || stacks->index == NULL) {
+    numap_stacks_free(stacks);
+    return ERROR_NUMAP_MALLOC;
+  }
+  // The root stands for the empty stack, the parent of outermost frames
+  stacks->nb_nodes = 1;
+  return 0;
+}
+
+void numap_stacks_free(struct numap_stacks *stacks) {
+  free(stacks->nodes);
+  free(stacks->index);
+  memset(stacks, 0, sizeof(struct numap_stacks));
+}
+
+/**
+ * Index slot holding the child of parent at ip, or the empty slot where
+ * it would go.
+ */
+static uint32_t index_slot(struct numap_stacks *stacks, uint32_t parent, uint64_t ip) {
+  uint32_t slot = stack_hash(parent, ip) & stacks->index_mask;
+  for (;;) {
+    uint32_t node = stacks->index[slot];
+    if (node == 0 || (stacks->nodes[node].parent == parent && stacks->nodes[node].ip == ip)) {
+      return slot;
+    }
+    slot = (slot + 1) & stacks->index_mask;
+  }
+}
+
+/**
+ * Doubles the nodes and the index, keeping the index at most half full.
+ */
+static int stacks_grow(struct numap_stacks *stacks) {
+  uint32_t capacity = 2 * stacks->capacity;
+  struct numap_stack_node *nodes = realloc(stacks->nodes, capacity * sizeof(struct numap_stack_node));
+  if (nodes == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  stacks->nodes = nodes;
+  stacks->capacity = capacity;
+  uint32_t *index = calloc(2 * capacity, sizeof(uint32_t));
+  if (index == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  free(stacks->index);
+  stacks->index = index;
+  stacks->index_mask = 2 * capacity - 1;
+  for (uint32_t node = 1; node < stacks->nb_nodes; node++) {
+    stacks->index[index_slot(stacks, stacks->nodes[node].parent, stacks->nodes[node].ip)] = node;
+  }
+  return 0;
+}
+
+/**
+ * Node of the frame at ip called from parent, created if needed.
+ */
+static int64_t stacks_child(struct numap_stacks *stacks, uint32_t parent, uint64_t ip) {
+  uint32_t slot = index_slot(stacks, parent, ip);
+  if (stacks->index[slot] != 0) {
+    return stacks->index[slot];
+  }
+  if (stacks->nb_nodes == stacks->capacity) {
+    int res = stacks_grow(stacks);
+    if (res != 0) {
+      return res;
+    }
+    slot = index_slot(stacks, parent, ip);
+  }
+  uint32_t node = stacks->nb_nodes++;
+  memset(&stacks->nodes[node], 0, sizeof(struct numap_stack_node));
+  stacks->nodes[node].ip = ip;
+  stacks->nodes[node].parent = parent;
+  stacks->nodes[node].depth = stacks->nodes[parent].depth + 1;
+  stacks->index[slot] = node;
+  return node;
+}
+
+/**
+ * Adds the stack of sample to stacks, with its data source and latency,
+ * and returns the node identifying the stack (its innermost frame). A
+ * sample without call chain is identified by its instruction pointer.
+ */
+int64_t numap_stacks_add(struct numap_stacks *stacks, struct numap_sample *sample) {
+  int64_t node = 0;
+  // Call chains start with the innermost frame, the trie with the outermost
+  for (int64_t i = (int64_t)sample->nb_callchain - 1; i >= 0 && node >= 0; i--) {
+    uint64_t ip;
+    memcpy(&ip, &sample->callchain[i], sizeof(uint64_t));
+    // Context markers (PERF_CONTEXT_USER...) are not frames
+    if (ip >= (uint64_t)PERF_CONTEXT_MAX) {
+      continue;
+    }
+    node = stacks_child(stacks, node, ip);
+  }
+  if (node == 0) {
+    node = stacks_child(stacks, 0, sample->ip);
+  }
+  if (node < 0) {
+    return node;
+  }
+  struct numap_stack_node *n = &stacks->nodes[node];
+  n->samples++;
+  n->classes[numap_sample_class(sample->data_src)]++;
+  n->latency += sample->weight;
+  if (sample->weight > n->max_latency) {
+    n->max_latency = sample->weight;
+  }
+  stacks->total++;
+  return node;
+}
+
+/**
+ * Fills ips with the frames of the stack of node, innermost first, and
+ * returns their number (at most max).
+ */
+int numap_stacks_frames(struct numap_stacks *stacks, uint32_t node, uint64_t *ips, int max) {
+  int nb = 0;
+  while (node != 0 && node < stacks->nb_nodes && nb < max) {
+    ips[nb++] = stacks->nodes[node].ip;
+    node = stacks->nodes[node].parent;
+  }
+  return nb;
+}
+
+static int stacks_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  int64_t node = numap_stacks_add(arg, sample);
+  return node < 0 ? (int)node : 0;
+}
+
+/**
+ * Builds the stack trie of the samples of measure, which has to sample
+ * with PERF_SAMPLE_CALLCHAIN (e.g. started by numap_sampling_read_start_generic
+ * with NUMAP_CALLCHAIN_SAMPLE_TYPE).
+ */
+int numap_sampling_stacks(struct numap_sampling_measure *measure, struct numap_stacks *stacks) {
+  int res = numap_stacks_init(stacks);
+  if (res != 0) {
+    return res;
+  }
+  res = numap_sampling_foreach_sample(measure, stacks_sample, stacks);
+  if (res != 0) {
+    numap_stacks_free(stacks);
+  }
+  return res;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  const struct numap_stack_node *na = *(const struct numap_stack_node **)a;
+  const struct numap_stack_node *nb = *(const struct numap_stack_node **)b;
+  if (na->latency != nb->latency) {
+    return na->latency > nb->latency ? -1 : 1;
+  }
+  return na->samples > nb->samples ? -1 : na->samples < nb->samples;
+}
+
+/**
+ * Prints the nb_stacks stacks whose samples have the highest total
+ * latency, with their data sources.
+ */
+int numap_stacks_print(struct numap_stacks *stacks, size_t nb_stacks) {
+  struct numap_stack_node **sorted = malloc(stacks->nb_nodes * sizeof(struct numap_stack_node *));
+  if (sorted == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  size_t nb_sampled = 0;
+  for (uint32_t node = 1; node < stacks->nb_nodes; node++) {
+    if (stacks->nodes[node].samples > 0) {
+      sorted[nb_sampled++] = &stacks->nodes[node];
+    }
+  }
+  qsort(sorted, nb_sampled, sizeof(struct numap_stack_node *), compare_latency);
+  printf("\n%zu distinct stacks in %" PRIu32 " nodes for %" PRIu64 " samples\n", nb_sampled, stacks->nb_nodes - 1,
+         stacks->total);
+  for (size_t i = 0; i < nb_sampled && i < nb_stacks; i++) {
+    struct numap_stack_node *n = sorted[i];
+    uint64_t remote = n->classes[NUMAP_CLASS_REMOTE_CACHE] + n->classes[NUMAP_CLASS_REMOTE_MEMORY];
+    uint64_t memory = n->classes[NUMAP_CLASS_LOCAL_MEMORY] + remote;
+    printf("\nStack %u: %" PRIu64 " samples %0.2f%%, mean latency %0.1f max %" PRIu64 ", %0.1f%% memory, "
+           "%0.1f%% of it remote\n", (unsigned int)(n - stacks->nodes), n->samples,
+           stacks->total ? 100.0 * n->samples / stacks->total : 0.0, (double)n->latency / n->samples,
+           n->max_latency, 100.0 * memory / n->samples, memory ? 100.0 * remote / memory : 0.0);
+    printf("  ");
+    for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+      if (n->classes[c] > 0) {
+        printf(" %s %" PRIu64, sample_class_names[c], n->classes[c]);
+      }
+    }
+    printf("\n");
+    for (uint32_t node = n - stacks->nodes; node != 0; node = stacks->nodes[node].parent) {
+      printf("  %#" PRIx64 "\n", stacks->nodes[node].ip);
+    }
+  }
+  free(sorted);
+  return 0;
+}
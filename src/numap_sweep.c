@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Load latency sweeps: read sampling opens one stream per threshold of
+ * the sweep. In NUMAP_SWEEP_TIME mode, every thread opens all the
+ * streams and a timer enables one slot at a time; in
+ * NUMAP_SWEEP_THREADS mode, each thread only opens the streams of its
+ * slot. The samples of each slot are then combined, weighted by how
+ * long (or by how many threads) each slot was sampled.
+ */
+
+/**
+ * Makes read sampling rotate through the nb_ldlats load latency
+ * thresholds (in cycles) of ldlats: over time, each one during interval
+ * seconds (NUMAP_SWEEP_TIME), or across threads (NUMAP_SWEEP_THREADS).
+ * High thresholds only sample expensive loads, at a much lower
+ * overhead. Has to be called before the measure starts.
+ */
+int numap_sampling_set_ldlat_sweep(struct numap_sampling_measure *measure, const unsigned int *ldlats, int nb_ldlats,
+                                   int mode, double interval) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  if (nb_ldlats < 1 || nb_ldlats > NUMAP_MAX_SWEEP ||
+      (mode != NUMAP_SWEEP_TIME && mode != NUMAP_SWEEP_THREADS) ||
+      (mode == NUMAP_SWEEP_TIME && interval <= 0)) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  // The events of the other tasks of a per-cpu attach are not rotated
+  if (measure->attach_pid != 0 && measure->attach_mode == NUMAP_ATTACH_CPUS) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  for (int slot = 0; slot < nb_ldlats; slot++) {
+    // The threshold is a 16 bits field of the PMU
+    if (ldlats[slot] == 0 || ldlats[slot] > 0xffff) {
+      return ERROR_NUMAP_INVALID_ARGUMENT;
+    }
+    measure->sweep_ldlat[slot] = ldlats[slot];
+    measure->sweep_time[slot] = 0;
+  }
+  measure->nb_sweep = nb_ldlats;
+  measure->sweep_mode = mode;
+  measure->sweep_interval = interval;
+  measure->sweep_slot = 0;
+  return 0;
+}
+
+/**
+ * Whether thread has an event for stream.
+ */
+int sweep_stream_opened(struct numap_sampling_measure *measure, int stream, int thread) {
+  if (measure->nb_sweep == 0 || measure->sweep_mode != NUMAP_SWEEP_THREADS || measure->streams[stream].slot < 0) {
+    return 1;
+  }
+  return measure->streams[stream].slot == thread % measure->nb_sweep;
+}
+
+/**
+ * Whether the event of thread for stream currently samples.
+ */
+int sweep_stream_active(struct numap_sampling_measure *measure, int stream, int thread) {
+  if (measure->nb_sweep == 0 || measure->sweep_mode != NUMAP_SWEEP_TIME || measure->streams[stream].slot < 0) {
+    return sweep_stream_opened(measure, stream, thread);
+  }
+  return measure->streams[stream].slot == __atomic_load_n(&measure->sweep_slot, __ATOMIC_ACQUIRE);
+}
+
+static void sweep_rotate(union sigval value) {
+  struct numap_sampling_measure *measure = value.sival_ptr;
+  if (!measure->started) {
+    return;
+  }
+  double now = period_controller_now();
+  int slot = measure->sweep_slot;
+  int next = (slot + 1) % measure->nb_sweep;
+  measure->sweep_time[slot] += now - measure->sweep_slot_start;
+  measure->sweep_slot_start = now;
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      if (measure->streams[stream].slot == slot && *measure_ring(measure, stream, thread) != NULL) {
+        ioctl(*measure_fd(measure, stream, thread), PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+  }
+  // From now on, the signal handler does not refresh the events of slot
+  __atomic_store_n(&measure->sweep_slot, next, __ATOMIC_RELEASE);
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    for (int stream = 0; stream < measure->nb_streams; stream++) {
+      if (measure->streams[stream].slot == next && *measure_ring(measure, stream, thread) != NULL) {
+        // Refreshing enables the event
+        event_enable(measure, *measure_fd(measure, stream, thread));
+      }
+    }
+  }
+}
+
+/**
+ * Arms the rotation timer of a NUMAP_SWEEP_TIME measure that just
+ * started or resumed.
+ */
+int sweep_start(struct numap_sampling_measure *measure) {
+  if (measure->nb_sweep == 0 || measure->sweep_mode != NUMAP_SWEEP_TIME) {
+    return 0;
+  }
+  measure->sweep_slot_start = period_controller_now();
+  if (measure->nb_sweep == 1) {
+    return 0;
+  }
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD;
+  sev.sigev_notify_function = sweep_rotate;
+  sev.sigev_value.sival_ptr = measure;
+  if (timer_create(CLOCK_MONOTONIC, &sev, &measure->sweep_timer) != 0) {
+    last_sys_errno = errno;
+    return ERROR_NUMAP_SIGNAL;
+  }
+  struct itimerspec its;
+  its.it_value.tv_sec = (time_t)measure->sweep_interval;
+  its.it_value.tv_nsec = (long)((measure->sweep_interval - its.it_value.tv_sec) * 1e9);
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+    its.it_value.tv_nsec = 1;
+  }
+  its.it_interval = its.it_value;
+  timer_settime(measure->sweep_timer, 0, &its, NULL);
+  measure->sweep_timer_armed = 1;
+  return 0;
+}
+
+/**
+ * Disarms the rotation timer and accounts for the time of the active
+ * slot. Called when the measure stops.
+ */
+void sweep_stop(struct numap_sampling_measure *measure) {
+  if (measure->nb_sweep == 0 || measure->sweep_mode != NUMAP_SWEEP_TIME) {
+    return;
+  }
+  if (measure->sweep_timer_armed) {
+    timer_delete(measure->sweep_timer);
+    measure->sweep_timer_armed = 0;
+  }
+  measure->sweep_time[measure->sweep_slot] += period_controller_now() - measure->sweep_slot_start;
+}
+
+struct sweep_counts {
+  uint64_t counts[NUMAP_MAX_SWEEP][NUMAP_LATENCY_BUCKETS];
+  double sums[NUMAP_MAX_SWEEP][NUMAP_LATENCY_BUCKETS];
+  uint64_t max;
+};
+
+static int sweep_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct sweep_counts *sc = arg;
+  int slot = measure->streams[sample->stream].slot;
+  if (sample->weight == 0 || slot < 0) {
+    return 0;
+  }
+  int bucket = latency_bucket(sample->weight);
+  sc->counts[slot][bucket]++;
+  sc->sums[slot][bucket] += sample->weight;
+  if (sample->weight > sc->max) {
+    sc->max = sample->weight;
+  }
+  return 0;
+}
+
+/**
+ * Builds the latency distribution of the loads of a sweep. A slot with
+ * threshold t only sees the loads above t, so each bucket combines the
+ * slots whose threshold is below the bucket, and scales their samples
+ * by the share of the measure these slots were sampled (time in
+ * NUMAP_SWEEP_TIME mode, threads in NUMAP_SWEEP_THREADS mode). Counts
+ * are estimates of what a single stream at the lowest threshold would
+ * have sampled during the whole measure. Without a sweep, this is
+ * numap_sampling_latency_histogram.
+ */
+int numap_sampling_sweep_histogram(struct numap_sampling_measure *measure, struct numap_latency_histogram *histogram) {
+  if (measure->nb_sweep == 0) {
+    return numap_sampling_latency_histogram(measure, histogram);
+  }
+  if (!(measure->sample_type & SAMPLE_WEIGHT_TYPE)) {
+    return ERROR_NUMAP_SAMPLE_TYPE;
+  }
+  struct sweep_counts *sc = calloc(1, sizeof(struct sweep_counts));
+  if (sc == NULL) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  int res = numap_sampling_foreach_sample(measure, sweep_sample, sc);
+  if (res != 0) {
+    free(sc);
+    return res;
+  }
+
+  double exposure[NUMAP_MAX_SWEEP];
+  double total = 0;
+  for (int slot = 0; slot < measure->nb_sweep; slot++) {
+    if (measure->sweep_mode == NUMAP_SWEEP_TIME) {
+      exposure[slot] = measure->sweep_time[slot];
+    } else {
+      exposure[slot] = 0;
+      for (int thread = slot; thread < measure->nb_threads; thread += measure->nb_sweep) {
+        exposure[slot]++;
+      }
+    }
+    total += exposure[slot];
+  }
+
+  numap_latency_histogram_init(histogram);
+  double sum = 0;
+  for (int bucket = 0; bucket < NUMAP_LATENCY_BUCKETS; bucket++) {
+    double eligible = 0;
+    uint64_t count = 0;
+    double bucket_sum = 0;
+    for (int slot = 0; slot < measure->nb_sweep; slot++) {
+      if (measure->sweep_ldlat[slot] <= bucket_latency(bucket)) {
+        eligible += exposure[slot];
+        count += sc->counts[slot][bucket];
+        bucket_sum += sc->sums[slot][bucket];
+      }
+    }
+    if (eligible <= 0 || count == 0) {
+      continue;
+    }
+    double scale = total / eligible;
+    histogram->buckets[bucket] = (uint64_t)(count * scale + 0.5);
+    histogram->count += histogram->buckets[bucket];
+    sum += bucket_sum * scale;
+  }
+  histogram->sum = (uint64_t)sum;
+  histogram->max = sc->max;
+  free(sc);
+  return 0;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Per-thread configuration: each thread of a measure can sample with
+ * its own period, access kinds, load latency threshold and ring size.
+ * Loads are opened once per threshold used by the threads, each thread
+ * only opening the streams of its own threshold. When the periods
+ * differ, samples carry PERF_SAMPLE_PERIOD so that the analyses weight
+ * each sample by the period of the thread that took it.
+ */
+
+/**
+ * Overrides the sampling parameters of thread in measure (see struct
+ * numap_thread_config), or restores those of the measure when config
+ * is NULL. Has to be called before the measure starts.
+ */
+int numap_sampling_set_thread_config(struct numap_sampling_measure *measure, int thread,
+                                     const struct numap_thread_config *config) {
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  if (thread < 0 || thread >= (int)measure->nb_threads) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  if (config == NULL) {
+    memset(&measure->thread_configs[thread], 0, sizeof(struct numap_thread_config));
+    return 0;
+  }
+  // The threshold is a 16 bits field of the PMU
+  if ((config->accesses & ~(NUMAP_THREAD_READS | NUMAP_THREAD_WRITES)) != 0 || config->ldlat > 0xffff) {
+    return ERROR_NUMAP_INVALID_ARGUMENT;
+  }
+  measure->thread_configs[thread] = *config;
+  return 0;
+}
+
+/**
+ * Load latency threshold of the loads sampled by thread.
+ */
+unsigned int thread_ldlat(struct numap_sampling_measure *measure, int thread) {
+  unsigned int ldlat = measure->thread_configs[thread].ldlat;
+  return ldlat != 0 ? ldlat : measure->ldlat;
+}
+
+/**
+ * Fills ldlats with the distinct load latency thresholds of the threads
+ * sampling loads, and returns their number (at least 1), or
+ * ERROR_NUMAP_INVALID_ARGUMENT when they are more than NUMAP_MAX_STREAMS.
+ */
+int thread_ldlats(struct numap_sampling_measure *measure, unsigned int *ldlats) {
+  int nb_ldlats = 0;
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    if (!(measure->thread_accesses[thread] & NUMAP_THREAD_READS)) {
+      continue;
+    }
+    unsigned int ldlat = thread_ldlat(measure, thread);
+    int i = 0;
+    while (i < nb_ldlats && ldlats[i] != ldlat) {
+      i++;
+    }
+    if (i == nb_ldlats) {
+      if (nb_ldlats == NUMAP_MAX_STREAMS) {
+        // A stream per threshold
+        return ERROR_NUMAP_INVALID_ARGUMENT;
+      }
+      ldlats[nb_ldlats++] = ldlat;
+    }
+  }
+  if (nb_ldlats == 0) {
+    ldlats[nb_ldlats++] = measure->ldlat;
+  }
+  return nb_ldlats;
+}
+
+/**
+ * Whether thread has an event for stream: the stream samples an access
+ * kind of the thread, with the threshold of the thread or of its sweep
+ * slot.
+ */
+int thread_stream_opened(struct numap_sampling_measure *measure, int stream, int thread) {
+  struct numap_stream *s = &measure->streams[stream];
+  if (!(measure->thread_accesses[thread] & (1 << s->access))) {
+    return 0;
+  }
+  if (s->access == NUMAP_ACCESS_READ && measure->nb_sweep == 0 && s->ldlat != thread_ldlat(measure, thread)) {
+    return 0;
+  }
+  return sweep_stream_opened(measure, stream, thread);
+}
+
+/**
+ * Resolves the access kinds of each thread for a sampling start of
+ * reads and/or writes, and widens reads, writes and sample_type to what
+ * the threads need.
+ */
+int thread_configs_start(struct numap_sampling_measure *measure, uint64_t *sample_type, int *reads, int *writes) {
+  int defaults = (*reads ? NUMAP_THREAD_READS : 0) | (*writes ? NUMAP_THREAD_WRITES : 0);
+  int accesses = 0;
+  int periods_differ = 0;
+
+  if (measure->started != 0) {
+    return ERROR_NUMAP_ALREADY_STARTED;
+  }
+  for (int thread = 0; thread < measure->nb_threads; thread++) {
+    struct numap_thread_config *config = &measure->thread_configs[thread];
+    // Sweeps choose the thresholds themselves
+    if (config->ldlat != 0 && measure->nb_sweep > 0) {
+      return ERROR_NUMAP_INVALID_ARGUMENT;
+    }
+    measure->thread_accesses[thread] = config->accesses != 0 ? config->accesses : defaults;
+    accesses |= measure->thread_accesses[thread];
+    if (config->sampling_rate != 0 && config->sampling_rate != measure->sampling_rate) {
+      periods_differ = 1;
+    }
+  }
+  if ((accesses & NUMAP_THREAD_READS) && !*reads && !numap_sampling_read_supported()) {
+    return ERROR_NUMAP_READ_SAMPLING_ARCH_NOT_SUPPORTED;
+  }
+  if ((accesses & NUMAP_THREAD_WRITES) && !*writes && !numap_sampling_write_supported()) {
+    return ERROR_NUMAP_WRITE_SAMPLING_ARCH_NOT_SUPPORTED;
+  }
+  *reads = (accesses & NUMAP_THREAD_READS) != 0;
+  *writes = (accesses & NUMAP_THREAD_WRITES) != 0;
+  if (periods_differ) {
+    // Samples are weighted by the period of their own thread
+    *sample_type |= PERF_SAMPLE_PERIOD;
+  }
+  return 0;
+}
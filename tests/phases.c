@@ -0,0 +1,108 @@
+#include <unistd.h>
+
+#include "synthetic.h"
+
+/**
+ * Replays a thread sampled at a period of 1000 over 20 windows of 1ms,
+ * 100 samples each, in two phases:
+ * - windows 0-9 load from local memory (70 samples of 128 cycles, 25
+ *   of 256) and from remote memory (5 samples of 512 cycles),
+ * - windows 10-19 load from local memory (40 samples of 128 cycles) and
+ *   from remote memory (50 samples of 512 cycles, 10 of 1024),
+ * except window 4, which looks like the second phase. The per window
+ * classes count accesses, the percentiles are those of each window, and
+ * a single phase change is detected at window 10: window 4 alone is
+ * noise.
+ */
+
+#define NB_WINDOWS 20
+#define WINDOW_NS 1000000ULL
+#define PERIOD 1000
+#define START 1000000000ULL
+#define BASE 0x7f0000000000ULL
+
+static int second_phase(int window) {
+  return window >= NB_WINDOWS / 2 || window == 4;
+}
+
+int main(void) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  union perf_mem_data_src local = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_LOC_RAM, PERF_MEM_SNOOP_NA);
+  union perf_mem_data_src remote = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_REM_RAM1, PERF_MEM_SNOOP_NA);
+  struct synthetic_ring ring;
+  memset(&ring, 0, sizeof(ring));
+  for (int w = 0; w < NB_WINDOWS; w++) {
+    for (int i = 0; i < 100; i++) {
+      uint64_t time = START + w * WINDOW_NS + i * 5000;
+      // Page 0 gets 40 samples, pages 1-6 10 each
+      uint64_t addr = BASE + (i < 40 ? 0 : 1 + i % 6) * page_size + 64 * (i % 64);
+      if (!second_phase(w)) {
+        ring_sample(&ring, 100, 100, time, addr, 0, i < 70 ? 128 : (i < 95 ? 256 : 512), i < 95 ? local : remote);
+      } else {
+        ring_sample(&ring, 100, 100, time, addr, 0, i < 40 ? 128 : (i < 90 ? 512 : 1024), i < 40 ? local : remote);
+      }
+    }
+  }
+
+  struct numap_sampling_measure measure;
+  struct numap_phases phases;
+  int res = replay_rings(&measure, &ring, 1, PERIOD);
+  if (res != 0) {
+    fprintf(stderr, "numap_sampling_replay_init_buffers: %s\n", numap_error_message(res));
+    return 1;
+  }
+  CHECK(numap_sampling_phases(&measure, 0, 0, &phases) == ERROR_NUMAP_INVALID_ARGUMENT);
+  res = numap_sampling_phases(&measure, WINDOW_NS / 1e9, 0, &phases);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(phases.start == START);
+    CHECK(phases.window_ns == WINDOW_NS);
+    CHECK(phases.nb_windows == NB_WINDOWS);
+    for (size_t w = 0; w < phases.nb_windows; w++) {
+      struct numap_window *window = &phases.windows[w];
+      CHECK(window->start == START + w * WINDOW_NS);
+      CHECK(window->samples == 100);
+      CHECK(window->accesses == 100 * PERIOD);
+      CHECK(window->nb_pages == 7);
+      CHECK(window->nb_hot_pages == 7);
+      CHECK(window->hot_pages[0] == BASE && window->hot_accesses[0] == 40 * PERIOD);
+      if (!second_phase(w)) {
+        CHECK(window->classes[NUMAP_CLASS_LOCAL_MEMORY] == 95 * PERIOD);
+        CHECK(window->classes[NUMAP_CLASS_REMOTE_MEMORY] == 5 * PERIOD);
+        CHECK(window->p50 == 128 && window->p90 == 256 && window->p99 == 512);
+      } else {
+        CHECK(window->classes[NUMAP_CLASS_LOCAL_MEMORY] == 40 * PERIOD);
+        CHECK(window->classes[NUMAP_CLASS_REMOTE_MEMORY] == 60 * PERIOD);
+        CHECK(window->p50 == 512 && window->p90 == 1024 && window->p99 == 1024);
+      }
+      CHECK(window->phase == (w < NB_WINDOWS / 2 ? 0 : 1));
+    }
+    CHECK(phases.nb_phases == 2);
+    if (phases.nb_phases == 2) {
+      CHECK(phases.phases[0].first_window == 0 && phases.phases[0].nb_windows == NB_WINDOWS / 2);
+      CHECK(phases.phases[1].first_window == NB_WINDOWS / 2 && phases.phases[1].nb_windows == NB_WINDOWS / 2);
+      CHECK(phases.phases[0].accesses == NB_WINDOWS / 2 * 100 * PERIOD);
+      CHECK(phases.phases[0].classes[NUMAP_CLASS_REMOTE_MEMORY] == (9 * 5 + 60) * PERIOD);
+      CHECK(phases.phases[1].classes[NUMAP_CLASS_REMOTE_MEMORY] == 10 * 60 * PERIOD);
+      CHECK(phases.phases[1].latency_sum == 512.0 * 10 * 100 * PERIOD);
+    }
+    numap_phases_free(&phases);
+  }
+  numap_sampling_end(&measure);
+  ring_free(&ring);
+
+  // Without timestamps there are no windows
+  uint64_t none = 0;
+  void *records = &none;
+  size_t size = 0;
+  pid_t tid = 100;
+  res = numap_sampling_replay_init_buffers(&measure, NUMAP_ANALYSIS_SAMPLE_TYPE & ~PERF_SAMPLE_TIME, PERIOD, 1,
+                                           &tid, &records, &size);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(numap_sampling_phases(&measure, WINDOW_NS / 1e9, 0, &phases) == ERROR_NUMAP_SAMPLE_TYPE);
+    numap_sampling_end(&measure);
+  }
+
+  return report("phases");
+}
@@ -0,0 +1,190 @@
+#include <sys/mman.h>
+
+#include "synthetic.h"
+
+/**
+ * Runs synthetic MMAP, MMAP2 and COMM records of process 1000 through
+ * numap_regions_record and checks the resulting intervals: later
+ * mappings split, truncate or replace the ones they overlap, the
+ * statistics of the regions a mapping of the same type and name covers
+ * carry over, an exec empties the address space, the mapping holding the
+ * stack pointer of a sample becomes the stack of its thread, and
+ * mappings are dropped at capacity.
+ */
+
+#define PID 1000
+
+/**
+ * Builds a PERF_RECORD_MMAP (flags < 0) or PERF_RECORD_MMAP2 record of
+ * a mapping of process pid into record.
+ */
+static struct perf_event_header *mmap_record(uint64_t *record, uint32_t pid, uint64_t start, uint64_t end,
+                                             uint64_t pgoff, int flags, const char *name) {
+  struct perf_event_header *header = (struct perf_event_header *)record;
+  uint8_t *body = (uint8_t *)(header + 1);
+  struct mmap_sample mmap;
+  mmap.pid = pid;
+  mmap.tid = pid;
+  mmap.addr = start;
+  mmap.len = end - start;
+  mmap.pgoff = pgoff;
+  memcpy(body, &mmap, offsetof(struct mmap_sample, filename));
+  char *filename = (char *)body + offsetof(struct mmap_sample, filename);
+  header->type = PERF_RECORD_MMAP;
+  if (flags >= 0) {
+    // maj, min, ino, ino_generation and prot are not used
+    header->type = PERF_RECORD_MMAP2;
+    memset(filename, 0, 28);
+    memcpy(filename + 28, &flags, sizeof(uint32_t));
+    filename += 32;
+  }
+  strcpy(filename, name);
+  header->misc = PERF_RECORD_MISC_USER;
+  header->size = (filename + strlen(name) + 1 - (char *)record + 7) & ~7;
+  return header;
+}
+
+static void record_mmap(struct numap_regions *regions, uint32_t pid, uint64_t start, uint64_t end, uint64_t pgoff,
+                        int flags, const char *name) {
+  uint64_t record[64];
+  numap_regions_record(regions, mmap_record(record, pid, start, end, pgoff, flags, name));
+}
+
+static void record_exec(struct numap_regions *regions, uint32_t pid) {
+  uint64_t record[8];
+  struct perf_event_header *header = (struct perf_event_header *)record;
+  header->type = PERF_RECORD_COMM;
+  header->misc = PERF_RECORD_MISC_USER | PERF_RECORD_MISC_COMM_EXEC;
+  header->size = sizeof(struct perf_event_header) + 2 * sizeof(uint32_t) + 8;
+  uint32_t ids[2] = { pid, pid };
+  memcpy(header + 1, ids, sizeof(ids));
+  strcpy((char *)(header + 1) + sizeof(ids), "a.out");
+  numap_regions_record(regions, header);
+}
+
+static int add(struct numap_regions *regions, uint32_t tid, uint64_t addr, uint64_t sp, uint64_t count) {
+  struct numap_sample sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.pid = PID;
+  sample.tid = tid;
+  sample.addr = addr;
+  sample.sp = sp;
+  sample.weight = 100;
+  sample.data_src = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_LOC_RAM, PERF_MEM_SNOOP_NA);
+  return numap_regions_add(regions, &sample, count);
+}
+
+/* Whether addr is in the region [start, end) of type, which has a region pgoff at start */
+static int region_is(struct numap_regions *regions, uint64_t addr, int type, uint64_t start, uint64_t end,
+                     uint64_t pgoff) {
+  struct numap_region region;
+  if (numap_regions_find(regions, PID, addr, &region) != type) {
+    return 0;
+  }
+  return type == NUMAP_REGION_UNKNOWN || (region.start == start && region.end == end && region.pgoff == pgoff);
+}
+
+int main(void) {
+  struct numap_regions regions;
+  struct numap_region region;
+  CHECK(numap_regions_init(&regions, -1) == ERROR_NUMAP_INVALID_ARGUMENT);
+  if (numap_regions_init(&regions, 0) != 0) {
+    fprintf(stderr, "numap_regions_init failed\n");
+    return 1;
+  }
+
+  // Types from the names and the MAP_SHARED flag of MMAP2 records
+  record_mmap(&regions, PID, 0x1000000, 0x1100000, 0, -1, "[heap]");
+  record_mmap(&regions, PID, 0x2000000, 0x2100000, 0, MAP_PRIVATE, "//anon");
+  record_mmap(&regions, PID, 0x3000000, 0x3010000, 0, MAP_SHARED, "//anon");
+  record_mmap(&regions, PID, 0x4000000, 0x4100000, 0, MAP_PRIVATE, "/usr/lib/libc.so.6");
+  record_mmap(&regions, PID, 0x5000000, 0x5800000, 0, MAP_PRIVATE, "//anon");
+  record_mmap(&regions, PID, 0x7ff000000, 0x7ff100000, 0, -1, "[stack]");
+  record_mmap(&regions, 2000, 0x1000000, 0x1100000, 0, -1, "[heap]");
+  CHECK(regions.nb_regions == 7);
+  CHECK(region_is(&regions, 0x1000000, NUMAP_REGION_HEAP, 0x1000000, 0x1100000, 0));
+  CHECK(region_is(&regions, 0x20fffff, NUMAP_REGION_ANON, 0x2000000, 0x2100000, 0));
+  CHECK(region_is(&regions, 0x3000040, NUMAP_REGION_SHM, 0x3000000, 0x3010000, 0));
+  CHECK(region_is(&regions, 0x4000000, NUMAP_REGION_FILE, 0x4000000, 0x4100000, 0));
+  CHECK(region_is(&regions, 0x7ff000000, NUMAP_REGION_STACK, 0x7ff000000, 0x7ff100000, 0));
+  CHECK(region_is(&regions, 0x1100000, NUMAP_REGION_UNKNOWN, 0, 0, 0));
+  CHECK(numap_regions_find(&regions, PID, 0x7ff000000, &region) == NUMAP_REGION_STACK && region.tid == PID);
+  CHECK(numap_regions_find(&regions, PID, 0x2000000, &region) == NUMAP_REGION_ANON && region.name[0] == '\0');
+
+  // A mapping inside another one splits it in two
+  record_mmap(&regions, PID, 0x4040000, 0x4050000, 0, MAP_PRIVATE, "/tmp/data");
+  CHECK(regions.nb_regions == 9);
+  CHECK(region_is(&regions, 0x403ffff, NUMAP_REGION_FILE, 0x4000000, 0x4040000, 0));
+  CHECK(region_is(&regions, 0x4040000, NUMAP_REGION_FILE, 0x4040000, 0x4050000, 0));
+  CHECK(region_is(&regions, 0x4050000, NUMAP_REGION_FILE, 0x4050000, 0x4100000, 0x50000));
+  CHECK(numap_regions_find(&regions, PID, 0x4048000, &region) == NUMAP_REGION_FILE &&
+        strcmp(region.name, "/tmp/data") == 0);
+
+  // Partial overlaps truncate the end, then the start, of the anonymous mapping
+  record_mmap(&regions, PID, 0x2080000, 0x2180000, 0, MAP_PRIVATE, "/tmp/other");
+  CHECK(region_is(&regions, 0x2000000, NUMAP_REGION_ANON, 0x2000000, 0x2080000, 0));
+  CHECK(region_is(&regions, 0x2080000, NUMAP_REGION_FILE, 0x2080000, 0x2180000, 0));
+  record_mmap(&regions, PID, 0x1ff0000, 0x2010000, 0, MAP_PRIVATE, "/tmp/first");
+  CHECK(region_is(&regions, 0x2000000, NUMAP_REGION_FILE, 0x1ff0000, 0x2010000, 0));
+  CHECK(region_is(&regions, 0x2010000, NUMAP_REGION_ANON, 0x2010000, 0x2080000, 0x10000));
+  CHECK(regions.nb_regions == 11);
+
+  // The heap growing keeps its statistics, a different mapping does not
+  CHECK(add(&regions, PID, 0x1000040, 0, 5) == NUMAP_REGION_HEAP);
+  CHECK(add(&regions, PID, 0x4048000, 0, 3) == NUMAP_REGION_FILE);
+  record_mmap(&regions, PID, 0x1000000, 0x1200000, 0, -1, "[heap]");
+  CHECK(numap_regions_find(&regions, PID, 0x11fffff, &region) == NUMAP_REGION_HEAP);
+  CHECK(region.start == 0x1000000 && region.end == 0x1200000);
+  CHECK(region.accesses == 5 && region.latency == 500 && region.classes[NUMAP_CLASS_LOCAL_MEMORY] == 5);
+  record_mmap(&regions, PID, 0x4040000, 0x4050000, 0, MAP_PRIVATE, "//anon");
+  CHECK(numap_regions_find(&regions, PID, 0x4048000, &region) == NUMAP_REGION_ANON && region.accesses == 0);
+  // A mapping covering several regions replaces them all
+  record_mmap(&regions, PID, 0x1ff0000, 0x2200000, 0, MAP_PRIVATE, "/tmp/big");
+  CHECK(region_is(&regions, 0x2100000, NUMAP_REGION_FILE, 0x1ff0000, 0x2200000, 0));
+  CHECK(regions.nb_regions == 9);
+
+  // The stack pointer of thread 1001 tags its anonymous mapping
+  CHECK(add(&regions, 1001, 0x1000000, 0x57ff000, 1) == NUMAP_REGION_HEAP);
+  CHECK(numap_regions_find(&regions, PID, 0x5000000, &region) == NUMAP_REGION_STACK);
+  CHECK(region.tid == 1001 && strcmp(region.name, "[stack:1001]") == 0);
+  CHECK(add(&regions, 1001, 0x57fe000, 0x57ff000, 2) == NUMAP_REGION_STACK);
+  CHECK(regions.foreign_stack == 0);
+  // Neither the stack of another thread nor a file mapping become the stack of thread 1002
+  CHECK(add(&regions, 1002, 0x57fe000, 0x57fe000, 4) == NUMAP_REGION_STACK);
+  CHECK(add(&regions, 1002, 0x57fe000, 0x4000000, 4) == NUMAP_REGION_STACK);
+  CHECK(numap_regions_find(&regions, PID, 0x5000000, &region) == NUMAP_REGION_STACK && region.tid == 1001);
+  CHECK(numap_regions_find(&regions, PID, 0x4000000, &region) == NUMAP_REGION_FILE);
+  CHECK(regions.foreign_stack == 8);
+  CHECK(add(&regions, PID, 0x7ff000100, 0, 1) == NUMAP_REGION_STACK);
+  CHECK(regions.foreign_stack == 8);
+  CHECK(add(&regions, PID, 0x9000000, 0, 7) == NUMAP_REGION_UNKNOWN);
+  CHECK(regions.types[NUMAP_REGION_UNKNOWN].accesses == 7);
+  CHECK(regions.types[NUMAP_REGION_STACK].accesses == 11);
+  CHECK(regions.total == 5 + 3 + 1 + 2 + 4 + 4 + 1 + 7);
+
+  // An exec empties the address space of its process only
+  record_exec(&regions, PID);
+  CHECK(regions.nb_regions == 1);
+  CHECK(region_is(&regions, 0x1000000, NUMAP_REGION_UNKNOWN, 0, 0, 0));
+  CHECK(numap_regions_find(&regions, 2000, 0x1000000, NULL) == NUMAP_REGION_HEAP);
+  numap_regions_free(&regions);
+
+  // Mappings are dropped at capacity, replacements still fit
+  CHECK(numap_regions_init(&regions, 3) == 0);
+  record_mmap(&regions, PID, 0x1000000, 0x1100000, 0, -1, "[heap]");
+  record_mmap(&regions, PID, 0x2000000, 0x2100000, 0, MAP_PRIVATE, "//anon");
+  record_mmap(&regions, PID, 0x3000000, 0x3100000, 0, MAP_PRIVATE, "/tmp/data");
+  CHECK(regions.nb_regions == 3 && regions.dropped == 0);
+  record_mmap(&regions, PID, 0x4000000, 0x4100000, 0, MAP_PRIVATE, "//anon");
+  CHECK(regions.nb_regions == 3 && regions.dropped == 1);
+  CHECK(region_is(&regions, 0x4000000, NUMAP_REGION_UNKNOWN, 0, 0, 0));
+  record_mmap(&regions, PID, 0x2040000, 0x2050000, 0, MAP_PRIVATE, "/tmp/other");
+  CHECK(regions.nb_regions == 3 && regions.dropped == 2);
+  CHECK(region_is(&regions, 0x2040000, NUMAP_REGION_ANON, 0x2000000, 0x2100000, 0));
+  record_mmap(&regions, PID, 0x1000000, 0x1200000, 0, -1, "[heap]");
+  CHECK(regions.nb_regions == 3 && regions.dropped == 2);
+  CHECK(region_is(&regions, 0x1100000, NUMAP_REGION_HEAP, 0x1000000, 0x1200000, 0));
+  numap_regions_free(&regions);
+
+  return report("regions");
+}
@@ -0,0 +1,148 @@
+#include <math.h>
+#include <unistd.h>
+
+#include "synthetic.h"
+
+/**
+ * Remote access cost on a machine with 3 nodes, cpus 2n and 2n + 1 on
+ * node n, nodes 0 and 2 two hops away:
+ *
+ *        0   1   2
+ *   0   10  21  31
+ *   1   21  10  21
+ *   2   31  21  10
+ *
+ * Three threads sampled at a period of 1000 access 3 adjacent pages, one
+ * on each node, and a page of unknown node. A remote access of latency
+ * 10 * d at distance d would have taken 100 cycles locally: it loses
+ * 10 * (d - 10) cycles, 110 at one hop and 210 at two, times the period.
+ * Thread 1 also runs once on node 2: its accesses to page 0 from nodes
+ * 1 and 2 share the page and the thread but not the node of the
+ * aggregation key.
+ */
+
+#define PERIOD 1000
+#define BASE 0x7f0000000000ULL
+#define ONE_HOP_LOST (110.0 * PERIOD)
+#define TWO_HOPS_LOST (210.0 * PERIOD)
+
+static const int distances[3][MAX_NB_NUMA_NODES] = {
+  { 10, 21, 31 },
+  { 21, 10, 21 },
+  { 31, 21, 10 },
+};
+
+static int close_to(double value, double expected) {
+  return fabs(value - expected) <= 1e-9 * fabs(expected);
+}
+
+int main(void) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  union perf_mem_data_src local = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_LOC_RAM, PERF_MEM_SNOOP_NA);
+  union perf_mem_data_src one_hop = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_REM_RAM1, PERF_MEM_SNOOP_NA);
+  union perf_mem_data_src two_hops = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_REM_RAM2, PERF_MEM_SNOOP_NA);
+  union perf_mem_data_src cache = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_L1, PERF_MEM_SNOOP_NA);
+  uint64_t pages[4] = { BASE, BASE + page_size, BASE + 2 * page_size, BASE + 3 * page_size };
+  struct synthetic_ring rings[3];
+  memset(rings, 0, sizeof(rings));
+
+  // Memory samples from 1s to 2s
+  uint64_t time = 1000000000;
+  for (int i = 0; i < 4; i++) {
+    ring_sample(&rings[0], 100, 100, time++, pages[0] + 64 * i, 0, 100, local);
+  }
+  for (int i = 0; i < 2; i++) {
+    ring_sample(&rings[0], 100, 100, time++, pages[1] + 64 * i, 1, 210, one_hop);
+  }
+  for (int i = 0; i < 3; i++) {
+    ring_sample(&rings[0], 100, 100, time++, pages[2] + 64 * i, 0, 310, two_hops);
+  }
+  ring_sample(&rings[0], 100, 100, time++, pages[3], 0, 100, local);
+  for (int i = 0; i < 5; i++) {
+    ring_sample(&rings[1], 100, 101, time++, pages[0] + 64 * i, 2, 210, one_hop);
+  }
+  ring_sample(&rings[1], 100, 101, time++, pages[0], 4, 310, two_hops);
+  for (int i = 0; i < 2; i++) {
+    ring_sample(&rings[1], 100, 101, time++, pages[1] + 64 * i, 3, 100, local);
+  }
+  for (int i = 0; i < 3; i++) {
+    ring_sample(&rings[2], 100, 102, time++, pages[2] + 64 * i, 5, 100, local);
+  }
+  ring_sample(&rings[2], 100, 102, 2000000000, pages[1], 4, 210, one_hop);
+  // Not served by memory: neither cost nor time
+  ring_sample(&rings[2], 100, 102, 5000000000, pages[1], 4, 4, cache);
+
+  struct numap_sampling_measure measure;
+  int res = replay_rings(&measure, rings, 3, PERIOD);
+  if (res != 0) {
+    fprintf(stderr, "numap_sampling_replay_init_buffers: %s\n", numap_error_message(res));
+    return 1;
+  }
+  measure.topology = synthetic_topology(3, distances);
+  for (int node = 0; node < 3; node++) {
+    topology_page_node(measure.topology, pages[node], node);
+  }
+
+  struct numap_remote_cost cost;
+  res = numap_sampling_remote_cost(&measure, &cost);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(cost.nb_nodes == 3 && cost.nb_threads == 3);
+    CHECK(close_to(cost.pair_factor[0][1], 2.1) && close_to(cost.pair_factor[0][2], 3.1));
+    CHECK(close_to(cost.pair_factor[1][1], 1.0));
+
+    uint64_t pair_samples[3][3] = {
+      { 4, 2, 3 },
+      { 5, 2, 0 },
+      { 1, 1, 3 },
+    };
+    double pair_lost[3][3] = {
+      { 0, 2 * ONE_HOP_LOST, 3 * TWO_HOPS_LOST },
+      { 5 * ONE_HOP_LOST, 0, 0 },
+      { TWO_HOPS_LOST, ONE_HOP_LOST, 0 },
+    };
+    for (int cpu_node = 0; cpu_node < 3; cpu_node++) {
+      for (int mem_node = 0; mem_node < 3; mem_node++) {
+        CHECK(cost.pair_samples[cpu_node][mem_node] == pair_samples[cpu_node][mem_node]);
+        CHECK(close_to(cost.pair_lost_cycles[cpu_node][mem_node], pair_lost[cpu_node][mem_node]));
+        // A cache line per access over 1s
+        CHECK(close_to(cost.pair_bandwidth_mbs[cpu_node][mem_node],
+                       pair_samples[cpu_node][mem_node] * PERIOD * 64.0 / (1024 * 1024)));
+        CHECK(cost.pair_utilization[cpu_node][mem_node] == 0);
+      }
+    }
+    CHECK(cost.unresolved_samples == 1);
+    CHECK(close_to(cost.seconds, 1.0));
+
+    CHECK(cost.thread_memory_samples[0] == 10 && cost.thread_memory_samples[1] == 8 &&
+          cost.thread_memory_samples[2] == 4);
+    CHECK(cost.thread_remote_1hop[0] == 2 && cost.thread_remote_2hops[0] == 3);
+    CHECK(cost.thread_remote_1hop[1] == 5 && cost.thread_remote_2hops[1] == 1);
+    CHECK(cost.thread_remote_1hop[2] == 1 && cost.thread_remote_2hops[2] == 0);
+    CHECK(close_to(cost.thread_lost_cycles[0], 2 * ONE_HOP_LOST + 3 * TWO_HOPS_LOST));
+    CHECK(close_to(cost.thread_lost_cycles[1], 5 * ONE_HOP_LOST + TWO_HOPS_LOST));
+    CHECK(close_to(cost.thread_lost_cycles[2], ONE_HOP_LOST));
+
+    // Sorted by lost cycles: pages 0, 2, 1, then the page of unknown node
+    CHECK(cost.nb_pages == 4);
+    if (cost.nb_pages == 4) {
+      CHECK(cost.pages[0].page == pages[0] && cost.pages[0].node == 0);
+      CHECK(cost.pages[0].samples == 10 && cost.pages[0].remote_samples == 6);
+      CHECK(close_to(cost.pages[0].lost_cycles, 5 * ONE_HOP_LOST + TWO_HOPS_LOST));
+      CHECK(cost.pages[1].page == pages[2] && cost.pages[1].node == 2);
+      CHECK(cost.pages[1].samples == 6 && cost.pages[1].remote_samples == 3);
+      CHECK(close_to(cost.pages[1].lost_cycles, 3 * TWO_HOPS_LOST));
+      CHECK(cost.pages[2].page == pages[1] && cost.pages[2].node == 1);
+      CHECK(cost.pages[2].samples == 5 && cost.pages[2].remote_samples == 3);
+      CHECK(close_to(cost.pages[2].lost_cycles, 3 * ONE_HOP_LOST));
+      CHECK(cost.pages[3].page == pages[3] && cost.pages[3].node == -1);
+      CHECK(cost.pages[3].samples == 1 && cost.pages[3].lost_cycles == 0);
+    }
+    numap_remote_cost_free(&cost);
+  }
+  numap_sampling_end(&measure);
+  for (int thread = 0; thread < 3; thread++) {
+    ring_free(&rings[thread]);
+  }
+  return report("remote cost");
+}
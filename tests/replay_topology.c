@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "numap.h"
+
+/**
+ * Replays data/topology.numap, recorded on a machine with 2 nodes (cpus
+ * 0-1 on node 0, cpus 2-3 on node 1, distances 10 and 21) at a period
+ * of 1000:
+ * - thread 100 loads page 0x7f0000001000 (node 0) 4 times from cpu 0
+ *   with 100 cycles, and page 0x7f0000002000 (node 1) twice from cpu 1
+ *   with 210 cycles,
+ * - thread 101 loads page 0x7f0000001000 3 times from cpu 2 with 210
+ *   cycles, and stores once to page 0x7f0000002000.
+ * The analyses have to use the recorded topology and page nodes, and
+ * give the same results on any host, NUMA or not.
+ */
+
+#define PAGE_0 0x7f0000001000ULL
+#define PAGE_1 0x7f0000002000ULL
+
+static int failures = 0;
+
+#define CHECK(cond)                                             \
+  do {                                                          \
+    if (!(cond)) {                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+static int page_node(struct numap_rw_profile *profile, uint64_t page) {
+  for (size_t i = 0; i < profile->nb_pages; i++) {
+    if (profile->pages[i].page == page) {
+      return profile->pages[i].node;
+    }
+  }
+  return -2;
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "data/topology.numap";
+  struct numap_sampling_measure measure;
+  int res = numap_sampling_replay_init(&measure, path);
+  if (res != 0) {
+    fprintf(stderr, "numap_sampling_replay_init %s: %s\n", path, numap_error_message(res));
+    return 1;
+  }
+  CHECK(measure.nb_threads == 2);
+
+  struct numap_remote_cost cost;
+  res = numap_sampling_remote_cost(&measure, &cost);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(cost.nb_nodes == 2);
+    CHECK(cost.unresolved_samples == 0);
+    CHECK(cost.pair_samples[0][0] == 4);
+    CHECK(cost.pair_samples[0][1] == 2);
+    CHECK(cost.pair_samples[1][0] == 3);
+    CHECK(cost.pair_samples[1][1] == 0);
+    CHECK(fabs(cost.pair_factor[0][1] - 2.1) < 1e-9);
+    CHECK(fabs(cost.thread_lost_cycles[0] - 2 * 210 * 1000 * (1 - 1 / 2.1)) < 1e-3);
+    CHECK(fabs(cost.thread_lost_cycles[1] - 3 * 210 * 1000 * (1 - 1 / 2.1)) < 1e-3);
+    numap_remote_cost_free(&cost);
+  }
+
+  struct numap_rw_profile profile;
+  res = numap_sampling_rw_profile(&measure, &profile);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(profile.nb_pages == 2);
+    CHECK(page_node(&profile, PAGE_0) == 0);
+    CHECK(page_node(&profile, PAGE_1) == 1);
+    numap_rw_profile_free(&profile);
+  }
+
+  struct numap_placement_plan plan;
+  res = numap_sampling_placement(&measure, NULL, &plan);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(plan.nb_nodes == 2);
+    for (size_t i = 0; i < plan.nb_pages; i++) {
+      CHECK(plan.pages[i].node == (plan.pages[i].page == PAGE_0 ? 0 : 1));
+    }
+    numap_placement_free(&plan);
+  }
+
+  numap_sampling_end(&measure);
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("replay topology: ok\n");
+  return 0;
+}
@@ -0,0 +1,124 @@
+#include <unistd.h>
+
+#include "synthetic.h"
+
+/**
+ * Replays two threads sampled at a period of 1000 on a machine with 2
+ * nodes: thread 0 (tid 100) runs on cpu 0 (node 0), thread 1 (tid 101)
+ * on cpu 2 (node 1). The lines of a page of node 1 are accessed as
+ * follows:
+ * - line 0: thread 0 loads word 0 with 3 remote HITM and stores it
+ *   twice, thread 1 loads word 3 with 4 local HITM: false sharing,
+ * - line 1: both threads load word 5 with a local HITM: true sharing,
+ * - line 2: thread 0 alone loads it with HITM,
+ * - line 3: both threads load it without HITM.
+ * Only lines 0 and 1 are contended.
+ */
+
+#define PERIOD 1000
+#define BASE 0x7f0000000000ULL
+#define LINE(n) (BASE + (n) * NUMAP_CACHE_LINE_SIZE)
+#define WORD(n) ((n) * (NUMAP_CACHE_LINE_SIZE / NUMAP_LINE_WORDS))
+
+static const int distances[2][MAX_NB_NUMA_NODES] = {
+  { 10, 21 },
+  { 21, 10 },
+};
+
+static struct numap_line_sharing *find_line(struct numap_sharing *sharing, uint64_t line) {
+  for (size_t i = 0; i < sharing->nb_lines; i++) {
+    if (sharing->lines[i].line == line) {
+      return &sharing->lines[i];
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+  union perf_mem_data_src local_hitm = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_L3, PERF_MEM_SNOOP_HITM);
+  union perf_mem_data_src remote_hitm = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_REM_CCE1, PERF_MEM_SNOOP_HITM);
+  union perf_mem_data_src load = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_L1, PERF_MEM_SNOOP_NONE);
+  union perf_mem_data_src store = data_src_of(PERF_MEM_OP_STORE, PERF_MEM_LVL_L1, PERF_MEM_SNOOP_NA);
+  struct synthetic_ring rings[2];
+  memset(rings, 0, sizeof(rings));
+  uint64_t time = 1000;
+  for (int i = 0; i < 3; i++) {
+    ring_sample(&rings[0], 100, 100, time++, LINE(0) + WORD(0), 0, 300, remote_hitm);
+  }
+  for (int i = 0; i < 2; i++) {
+    ring_sample(&rings[0], 100, 100, time++, LINE(0) + WORD(0) + 4, 0, 0, store);
+  }
+  for (int i = 0; i < 4; i++) {
+    ring_sample(&rings[1], 100, 101, time++, LINE(0) + WORD(3), 2, 100, local_hitm);
+  }
+  ring_sample(&rings[0], 100, 100, time++, LINE(1) + WORD(5), 1, 100, local_hitm);
+  ring_sample(&rings[1], 100, 101, time++, LINE(1) + WORD(5), 3, 100, local_hitm);
+  ring_sample(&rings[0], 100, 100, time++, LINE(2), 0, 100, local_hitm);
+  ring_sample(&rings[0], 100, 100, time++, LINE(2) + WORD(7), 0, 100, local_hitm);
+  ring_sample(&rings[0], 100, 100, time++, LINE(3), 0, 4, load);
+  ring_sample(&rings[1], 100, 101, time++, LINE(3) + WORD(1), 2, 4, load);
+
+  struct numap_sampling_measure measure;
+  int res = replay_rings(&measure, rings, 2, PERIOD);
+  if (res != 0) {
+    fprintf(stderr, "numap_sampling_replay_init_buffers: %s\n", numap_error_message(res));
+    return 1;
+  }
+  measure.topology = synthetic_topology(2, distances);
+  topology_page_node(measure.topology, BASE & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1), 1);
+
+  struct numap_sharing sharing;
+  res = numap_sampling_sharing(&measure, &sharing);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(sharing.loads == 13 * PERIOD);
+    CHECK(sharing.stores == 2 * PERIOD);
+    CHECK(sharing.remote_hitm == 3 * PERIOD);
+    CHECK(sharing.local_hitm == 8 * PERIOD);
+    CHECK(sharing.nb_lines == 2);
+    // Remote HITM first
+    CHECK(sharing.nb_lines > 0 && sharing.lines[0].line == LINE(0));
+
+    struct numap_line_sharing *ls = find_line(&sharing, LINE(0));
+    CHECK(ls != NULL);
+    if (ls != NULL) {
+      CHECK(ls->node == 1);
+      CHECK(ls->false_sharing);
+      CHECK(ls->loads == 7 * PERIOD && ls->stores == 2 * PERIOD);
+      CHECK(ls->remote_hitm == 3 * PERIOD && ls->local_hitm == 4 * PERIOD);
+      CHECK(ls->hitm_latency == (3 * 300 + 4 * 100) * PERIOD);
+      CHECK(ls->threads == 3 && ls->hitm_threads == 3);
+      CHECK(ls->cpu_nodes == 3);
+      for (int w = 0; w < NUMAP_LINE_WORDS; w++) {
+        struct numap_line_word *word = &ls->words[w];
+        if (w == 0) {
+          CHECK(word->threads == 1);
+          CHECK(word->loads == 3 * PERIOD && word->stores == 2 * PERIOD && word->hitm == 3 * PERIOD);
+        } else if (w == 3) {
+          CHECK(word->threads == 2);
+          CHECK(word->loads == 4 * PERIOD && word->stores == 0 && word->hitm == 4 * PERIOD);
+        } else {
+          CHECK(word->threads == 0 && word->loads == 0 && word->stores == 0);
+        }
+      }
+    }
+
+    ls = find_line(&sharing, LINE(1));
+    CHECK(ls != NULL);
+    if (ls != NULL) {
+      CHECK(!ls->false_sharing);
+      CHECK(ls->threads == 3 && ls->words[5].threads == 3);
+      CHECK(ls->local_hitm == 2 * PERIOD && ls->remote_hitm == 0);
+      CHECK(ls->cpu_nodes == 3);
+    }
+    // A single thread, or no HITM, is no contention
+    CHECK(find_line(&sharing, LINE(2)) == NULL);
+    CHECK(find_line(&sharing, LINE(3)) == NULL);
+    numap_sharing_free(&sharing);
+  }
+  numap_sampling_end(&measure);
+  ring_free(&rings[0]);
+  ring_free(&rings[1]);
+
+  return report("sharing");
+}
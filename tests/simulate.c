@@ -0,0 +1,127 @@
+#include <math.h>
+#include <unistd.h>
+
+#include "synthetic.h"
+
+/**
+ * Simulates placement policies for two threads sampled at a period of
+ * 1000 on a machine with 2 nodes at a distance of 20 (remote accesses
+ * are twice as slow): thread 0 runs on cpu 0 (node 0), thread 1 on cpu
+ * 2 (node 1). Thread 0 first touches pages 0 and 1, thread 1 pages 2
+ * and 3. Each thread loads each of its pages 10 times from local memory
+ * with 100 cycles, and thread 0 also loads page 2 10 times from remote
+ * memory with 200 cycles: 100 cycles once local. Every (thread, page)
+ * then costs 10 * 1000 * 100 cycles when local, twice as much when
+ * remote.
+ */
+
+#define PERIOD 1000
+#define BASE 0x7f0000000000ULL // even page number: interleaving places the even pages on node 0
+#define LOCAL_CYCLES (10.0 * PERIOD * 100)
+
+static const int machine_cpu_nodes[4] = { 0, 0, 1, 1 };
+
+static int close_to(double value, double expected) {
+  return fabs(value - expected) <= 1e-9 * fabs(expected);
+}
+
+static int run(struct numap_simulation *simulation, int type, int node, uint32_t nodes,
+               struct numap_policy_result *result) {
+  struct numap_policy policy;
+  memset(&policy, 0, sizeof(policy));
+  policy.type = type;
+  policy.node = node;
+  policy.nodes = nodes;
+  return numap_simulation_run(simulation, &policy, result);
+}
+
+int main(void) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  union perf_mem_data_src local = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_LOC_RAM, PERF_MEM_SNOOP_NA);
+  union perf_mem_data_src remote = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_REM_RAM1, PERF_MEM_SNOOP_NA);
+  union perf_mem_data_src cache = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_L1, PERF_MEM_SNOOP_NA);
+  struct synthetic_ring rings[2];
+  memset(rings, 0, sizeof(rings));
+  for (int i = 0; i < 10; i++) {
+    for (int page = 0; page < 2; page++) {
+      ring_sample(&rings[0], 100, 100, 1000 + i, BASE + page * page_size + 64 * i, 0, 100, local);
+      ring_sample(&rings[1], 100, 101, 1000 + i, BASE + (2 + page) * page_size + 64 * i, 2, 100, local);
+    }
+    ring_sample(&rings[0], 100, 100, 2000 + i, BASE + 2 * page_size + 64 * i, 1, 200, remote);
+    // Not served by memory: not simulated
+    ring_sample(&rings[0], 100, 100, 2000 + i, BASE + 3 * page_size, 1, 4, cache);
+  }
+
+  struct numap_sampling_measure measure;
+  int res = replay_rings(&measure, rings, 2, PERIOD);
+  if (res != 0) {
+    fprintf(stderr, "numap_sampling_replay_init_buffers: %s\n", numap_error_message(res));
+    return 1;
+  }
+  struct numap_machine machine;
+  memset(&machine, 0, sizeof(machine));
+  machine.nb_nodes = 2;
+  machine.nb_cpus = 4;
+  machine.cpu_to_node = machine_cpu_nodes;
+  machine.distances[0][0] = machine.distances[1][1] = 10;
+  machine.distances[0][1] = machine.distances[1][0] = 20;
+
+  struct numap_simulation simulation;
+  struct numap_policy_result result;
+  struct numap_machine invalid = machine;
+  invalid.nb_nodes = 0;
+  CHECK(numap_simulation_init_machine(&simulation, &measure, NULL, &invalid) == ERROR_NUMAP_INVALID_ARGUMENT);
+
+  // Thread nodes from the cpus of the samples
+  res = numap_simulation_init_machine(&simulation, &measure, NULL, &machine);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(simulation.nb_nodes == 2 && simulation.nb_pages == 4 && simulation.nb_entries == 5);
+    CHECK(simulation.thread_nodes[0] == 0 && simulation.thread_nodes[1] == 1);
+    CHECK(close_to(simulation.factors[0][1], 2.0) && close_to(simulation.factors[1][1], 1.0));
+
+    CHECK(run(&simulation, NUMAP_POLICY_FIRST_TOUCH, 0, 0, &result) == 0);
+    CHECK(result.samples == 50 && result.remote_samples == 10 && result.unresolved_samples == 0);
+    CHECK(close_to(result.remote_fraction, 0.2));
+    CHECK(close_to(result.local_cycles, 5 * LOCAL_CYCLES));
+    CHECK(close_to(result.cycles, 4 * LOCAL_CYCLES + 2 * LOCAL_CYCLES));
+    CHECK(close_to(result.node_bytes[0], 20.0 * PERIOD * NUMAP_CACHE_LINE_SIZE));
+    CHECK(close_to(result.node_bytes[1], 30.0 * PERIOD * NUMAP_CACHE_LINE_SIZE));
+
+    // Pages 0 and 2 on node 0, pages 1 and 3 on node 1
+    CHECK(run(&simulation, NUMAP_POLICY_INTERLEAVE, 0, 0, &result) == 0);
+    CHECK(result.samples == 50 && result.remote_samples == 20);
+    CHECK(close_to(result.remote_fraction, 0.4));
+    CHECK(close_to(result.cycles, 3 * LOCAL_CYCLES + 2 * 2 * LOCAL_CYCLES));
+    CHECK(close_to(result.node_bytes[0], 30.0 * PERIOD * NUMAP_CACHE_LINE_SIZE));
+
+    // Interleaving on node 1 only is binding everything to it
+    CHECK(run(&simulation, NUMAP_POLICY_INTERLEAVE, 0, 1U << 1, &result) == 0);
+    CHECK(result.remote_samples == 30 && close_to(result.remote_fraction, 0.6));
+    CHECK(close_to(result.cycles, 2 * LOCAL_CYCLES + 3 * 2 * LOCAL_CYCLES));
+    CHECK(result.node_bytes[0] == 0);
+
+    CHECK(run(&simulation, NUMAP_POLICY_PREFERRED, 0, 0, &result) == 0);
+    CHECK(result.remote_samples == 20 && close_to(result.remote_fraction, 0.4));
+
+    CHECK(run(&simulation, NUMAP_POLICY_INTERLEAVE, 0, 1U << 2, &result) == ERROR_NUMAP_INVALID_ARGUMENT);
+    CHECK(run(&simulation, NUMAP_POLICY_PREFERRED, 2, 0, &result) == ERROR_NUMAP_INVALID_ARGUMENT);
+    numap_simulation_free(&simulation);
+  }
+
+  // Threads of an unknown node are not simulated
+  int thread_nodes[2] = { 0, -1 };
+  res = numap_simulation_init_machine(&simulation, &measure, thread_nodes, &machine);
+  CHECK(res == 0);
+  if (res == 0) {
+    CHECK(run(&simulation, NUMAP_POLICY_FIRST_TOUCH, 0, 0, &result) == 0);
+    CHECK(result.samples == 20 && result.unresolved_samples == 30);
+    CHECK(result.remote_samples == 0);
+    numap_simulation_free(&simulation);
+  }
+
+  numap_sampling_end(&measure);
+  ring_free(&rings[0]);
+  ring_free(&rings[1]);
+  return report("simulate");
+}
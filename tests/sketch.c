@@ -0,0 +1,86 @@
+#include <math.h>
+#include <unistd.h>
+
+#include "synthetic.h"
+
+/**
+ * Feeds a skewed stream of accesses through numap_sketch_add: 8 hot
+ * pages get 60% of the accesses, 1000 cold pages the rest, each sample
+ * standing for 1 or 3 accesses. The space-saving summary has to return
+ * the hot pages as the top ones, and the count-min estimates have to
+ * stay between the exact counts and the exact counts plus epsilon times
+ * the accesses.
+ */
+
+#define NB_HOT 8
+#define NB_COLD 1000
+#define NB_SAMPLES 100000
+#define BASE 0x7f0000000000ULL
+
+static uint64_t xorshift(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+int main(void) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  struct numap_sketch sketch;
+
+  // Depth is limited to the number of row seeds: delta below exp(-8) is rejected
+  CHECK(numap_sketch_init(&sketch, 16, 0.01, 0.5 * exp(-8)) == ERROR_NUMAP_INVALID_ARGUMENT);
+  CHECK(numap_sketch_init(&sketch, 16, 0.01, 0) == ERROR_NUMAP_INVALID_ARGUMENT);
+  CHECK(numap_sketch_init(&sketch, 0, 0.01, 0.001) == ERROR_NUMAP_INVALID_ARGUMENT);
+  int res = numap_sketch_init(&sketch, 16, 0.01, 0.001);
+  CHECK(res == 0);
+  if (res != 0) {
+    return report("sketch");
+  }
+
+  uint64_t exact[NB_HOT + NB_COLD];
+  memset(exact, 0, sizeof(exact));
+  uint64_t total = 0;
+  uint64_t rng = 88172645463325252ULL;
+  struct numap_sample sample;
+  memset(&sample, 0, sizeof(sample));
+  for (int i = 0; i < NB_SAMPLES; i++) {
+    uint64_t r = xorshift(&rng);
+    int page = r % 10 < 6 ? (r >> 8) % NB_HOT : NB_HOT + (r >> 8) % NB_COLD;
+    uint64_t count = (r >> 32) & 1 ? 3 : 1;
+    // Any address in the page and cache line counts for them
+    sample.addr = BASE + page * page_size + ((r >> 40) % page_size);
+    numap_sketch_add(&sketch, &sample, count);
+    exact[page] += count;
+    total += count;
+  }
+
+  struct numap_heavy_hitter hitters[NB_HOT];
+  uint64_t sketch_total;
+  int nb = numap_sketch_top(&sketch, NUMAP_SKETCH_PAGES, hitters, NB_HOT, &sketch_total);
+  CHECK(nb == NB_HOT);
+  CHECK(sketch_total == total);
+  for (int i = 0; i < nb; i++) {
+    uint64_t page = (hitters[i].key - BASE) / page_size;
+    CHECK(hitters[i].key % page_size == 0);
+    CHECK(page < NB_HOT);
+    if (page < NB_HOT) {
+      CHECK(hitters[i].count >= exact[page]);
+      CHECK(hitters[i].count - hitters[i].error <= exact[page]);
+    }
+  }
+
+  uint64_t bound = (uint64_t)(sketch.epsilon * total);
+  for (int page = 0; page < NB_HOT + NB_COLD; page++) {
+    uint64_t estimate = numap_sketch_estimate(&sketch, NUMAP_SKETCH_PAGES, BASE + page * page_size + 64);
+    CHECK(estimate >= exact[page]);
+    CHECK(estimate <= exact[page] + bound);
+  }
+  // Pages never accessed
+  CHECK(numap_sketch_estimate(&sketch, NUMAP_SKETCH_PAGES, BASE - page_size) <= bound);
+
+  numap_sketch_free(&sketch);
+  return report("sketch");
+}
@@ -0,0 +1,116 @@
+#include "synthetic.h"
+
+/**
+ * Adds samples over distinct call chains sharing their outer frames to
+ * a stack trie: main calls 8 functions, each calling 16 functions, each
+ * calling 20 leaves (the same 20 ips everywhere), plus the chains
+ * stopping at the middle functions. The trie has to hold one node per
+ * distinct prefix, give back each chain from its node, and keep the node
+ * of a chain when it grows past its initial capacity.
+ */
+
+#define NB_OUTER 8
+#define NB_MIDDLE 16
+#define NB_LEAVES 20
+#define DEPTH 4
+
+#define MAIN_IP 0x401000ULL
+
+/* Call chain of a leaf (leaf < NB_LEAVES) or of a middle function (leaf == NB_LEAVES), innermost first */
+static int chain_of(int outer, int middle, int leaf, uint64_t *callchain) {
+  int nb = 0;
+  callchain[nb++] = PERF_CONTEXT_USER;
+  if (leaf < NB_LEAVES) {
+    callchain[nb++] = 0x404000 + leaf * 0x10;
+  }
+  callchain[nb++] = 0x403000 + (outer * NB_MIDDLE + middle) * 0x10;
+  callchain[nb++] = 0x402000 + outer * 0x10;
+  callchain[nb++] = MAIN_IP;
+  return nb;
+}
+
+/* Samples of each chain: 1 to 3, with latencies 10, 20 and 30 */
+static int chain_samples(int outer, int middle, int leaf) {
+  return 1 + (outer + middle + leaf) % 3;
+}
+
+static int64_t add(struct numap_stacks *stacks, uint64_t *callchain, int nb_callchain, uint64_t weight) {
+  struct numap_sample sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.ip = callchain[1];
+  sample.nb_callchain = nb_callchain;
+  sample.callchain = callchain;
+  sample.weight = weight;
+  sample.data_src = data_src_of(PERF_MEM_OP_LOAD, PERF_MEM_LVL_L1, PERF_MEM_SNOOP_NA);
+  return numap_stacks_add(stacks, &sample);
+}
+
+int main(void) {
+  static uint32_t nodes[NB_OUTER][NB_MIDDLE][NB_LEAVES + 1];
+  uint64_t callchain[DEPTH + 1];
+  struct numap_stacks stacks;
+  if (numap_stacks_init(&stacks) != 0) {
+    fprintf(stderr, "numap_stacks_init failed\n");
+    return 1;
+  }
+  uint32_t initial_capacity = stacks.capacity;
+
+  uint64_t nb_samples = 0;
+  for (int round = 0; round < 3; round++) {
+    for (int outer = 0; outer < NB_OUTER; outer++) {
+      for (int middle = 0; middle < NB_MIDDLE; middle++) {
+        for (int leaf = 0; leaf <= NB_LEAVES; leaf++) {
+          if (round >= chain_samples(outer, middle, leaf)) {
+            continue;
+          }
+          int nb = chain_of(outer, middle, leaf, callchain);
+          int64_t node = add(&stacks, callchain, nb, 10 * (round + 1));
+          CHECK(node > 0);
+          if (round == 0) {
+            nodes[outer][middle][leaf] = node;
+          } else {
+            // Node ids are stable, whether the trie grew in between or not
+            CHECK(node == nodes[outer][middle][leaf]);
+          }
+          nb_samples++;
+        }
+      }
+    }
+  }
+  CHECK(stacks.capacity > initial_capacity);
+  // The root, main, then one node per distinct prefix
+  CHECK(stacks.nb_nodes == 1 + 1 + NB_OUTER + NB_OUTER * NB_MIDDLE + NB_OUTER * NB_MIDDLE * NB_LEAVES);
+  CHECK(stacks.total == nb_samples);
+
+  uint64_t ips[DEPTH + 1];
+  for (int outer = 0; outer < NB_OUTER; outer++) {
+    for (int middle = 0; middle < NB_MIDDLE; middle++) {
+      for (int leaf = 0; leaf <= NB_LEAVES; leaf++) {
+        uint32_t node = nodes[outer][middle][leaf];
+        int nb = chain_of(outer, middle, leaf, callchain);
+        // Context markers are not frames
+        CHECK(numap_stacks_frames(&stacks, node, ips, DEPTH + 1) == nb - 1);
+        CHECK(memcmp(ips, callchain + 1, (nb - 1) * sizeof(uint64_t)) == 0);
+        CHECK(numap_stacks_frames(&stacks, node, ips, 2) == 2 && ips[0] == callchain[1]);
+        struct numap_stack_node *n = &stacks.nodes[node];
+        int samples = chain_samples(outer, middle, leaf);
+        CHECK(n->depth == (uint32_t)nb - 1);
+        CHECK(n->samples == (uint64_t)samples);
+        CHECK(n->classes[NUMAP_CLASS_L1] == (uint64_t)samples);
+        CHECK(n->latency == 10ULL * samples * (samples + 1) / 2);
+        CHECK(n->max_latency == 10ULL * samples);
+      }
+    }
+  }
+  // Frames shared by the chains hold no samples
+  CHECK(numap_stacks_frames(&stacks, stacks.nodes[nodes[0][0][0]].parent, ips, DEPTH + 1) == 3);
+  CHECK(stacks.nodes[stacks.nodes[nodes[0][0][NB_LEAVES]].parent].samples == 0);
+
+  // A sample without call chain is identified by its instruction pointer, under the root
+  int64_t node = add(&stacks, callchain, 0, 5);
+  CHECK(node > 0 && stacks.nodes[node].parent == 0 && stacks.nodes[node].ip == callchain[1]);
+  CHECK(numap_stacks_frames(&stacks, 0, ips, DEPTH + 1) == 0);
+
+  numap_stacks_free(&stacks);
+  return report("stacks");
+}
@@ -0,0 +1,166 @@
+#ifndef NUMAP_TESTS_SYNTHETIC_H
+#define NUMAP_TESTS_SYNTHETIC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numap.h"
+#include "numap_internal.h"
+
+/**
+ * Helpers of the tests: synthetic perf records, replayed with
+ * numap_sampling_replay_init_buffers, and a fixed machine topology so
+ * that the analyses give the same results on any host.
+ */
+
+static int failures = 0;
+
+#define CHECK(cond)                                             \
+  do {                                                          \
+    if (!(cond)) {                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+static inline int report(const char *name) {
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
+
+/**
+ * Records of one thread, laid out as in its ring buffer.
+ */
+struct synthetic_ring {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+static inline void ring_append(struct synthetic_ring *ring, const void *record, size_t size) {
+  if (ring->size + size > ring->capacity) {
+    ring->capacity = ring->capacity ? 2 * ring->capacity : 4096;
+    if (ring->capacity < ring->size + size) {
+      ring->capacity = ring->size + size;
+    }
+    ring->data = realloc(ring->data, ring->capacity);
+    if (ring->data == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  memcpy(ring->data + ring->size, record, size);
+  ring->size += size;
+}
+
+/**
+ * Sample laid out as NUMAP_ANALYSIS_SAMPLE_TYPE.
+ */
+struct __attribute__ ((__packed__)) synthetic_sample {
+  struct perf_event_header header;
+  uint64_t ip;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time;
+  uint64_t addr;
+  uint32_t cpu;
+  uint32_t reserved;
+  uint64_t weight;
+  uint64_t data_src;
+};
+
+static inline union perf_mem_data_src data_src_of(uint64_t mem_op, uint64_t mem_lvl, uint64_t mem_snoop) {
+  union perf_mem_data_src data_src;
+  data_src.val = 0;
+  data_src.mem_op = mem_op;
+  data_src.mem_lvl = PERF_MEM_LVL_HIT | mem_lvl;
+  data_src.mem_snoop = mem_snoop;
+  return data_src;
+}
+
+static inline void ring_sample(struct synthetic_ring *ring, uint32_t pid, uint32_t tid, uint64_t time, uint64_t addr,
+                               uint32_t cpu, uint64_t weight, union perf_mem_data_src data_src) {
+  struct synthetic_sample sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.header.type = PERF_RECORD_SAMPLE;
+  sample.header.misc = PERF_RECORD_MISC_USER;
+  sample.header.size = sizeof(sample);
+  sample.ip = 0x400000;
+  sample.pid = pid;
+  sample.tid = tid;
+  sample.time = time;
+  sample.addr = addr;
+  sample.cpu = cpu;
+  sample.weight = weight;
+  sample.data_src = data_src.val;
+  ring_append(ring, &sample, sizeof(sample));
+}
+
+static inline void ring_free(struct synthetic_ring *ring) {
+  free(ring->data);
+  memset(ring, 0, sizeof(struct synthetic_ring));
+}
+
+/**
+ * Replays the rings of nb_threads threads, tids 100, 101..., sampled
+ * with NUMAP_ANALYSIS_SAMPLE_TYPE at period.
+ */
+static inline int replay_rings(struct numap_sampling_measure *measure, struct synthetic_ring *rings, int nb_threads,
+                               unsigned int period) {
+  pid_t tids[MAX_NB_THREADS];
+  void *records[MAX_NB_THREADS];
+  size_t sizes[MAX_NB_THREADS];
+  for (int thread = 0; thread < nb_threads; thread++) {
+    tids[thread] = 100 + thread;
+    records[thread] = rings[thread].data;
+    sizes[thread] = rings[thread].size;
+  }
+  return numap_sampling_replay_init_buffers(measure, NUMAP_ANALYSIS_SAMPLE_TYPE, period, nb_threads, tids,
+                                            records, sizes);
+}
+
+/**
+ * Machine of nb_nodes nodes with 2 cpus each (cpus 2n and 2n + 1 on node
+ * n). distances[i][j] is 10 for i == j. Freed by numap_sampling_end once
+ * given to a measure.
+ */
+static inline struct numap_topology *synthetic_topology(int nb_nodes, const int distances[][MAX_NB_NUMA_NODES]) {
+  struct numap_topology *topology = calloc(1, sizeof(struct numap_topology));
+  if (topology == NULL || u64_map_init(&topology->pages_map, 64) != 0 ||
+      (topology->cpu_to_node = malloc(2 * nb_nodes * sizeof(int))) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  topology->nb_nodes = nb_nodes;
+  topology->nb_cpus = 2 * nb_nodes;
+  for (int cpu = 0; cpu < topology->nb_cpus; cpu++) {
+    topology->cpu_to_node[cpu] = cpu / 2;
+  }
+  for (int cpu_node = 0; cpu_node < nb_nodes; cpu_node++) {
+    for (int mem_node = 0; mem_node < nb_nodes; mem_node++) {
+      topology->distances[cpu_node][mem_node] = distances[cpu_node][mem_node];
+    }
+  }
+  return topology;
+}
+
+/**
+ * Records that page was on node, as the page nodes of a numap trace.
+ */
+static inline void topology_page_node(struct numap_topology *topology, uint64_t page, int node) {
+  int inserted;
+  int64_t index = u64_map_get(&topology->pages_map, page, &inserted);
+  if (index < 0 || array_reserve((void **)&topology->page_nodes, &topology->page_nodes_capacity, index + 1,
+                                 sizeof(int)) != 0) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  topology->page_nodes[index] = node;
+}
+
+#endif
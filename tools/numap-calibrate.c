@@ -0,0 +1,75 @@
+#include "numap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Measures memory latency and bandwidth for each (cpu node, memory
+ * node) pair and stores them in numap's calibration cache file.
+ */
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-s buffer_size_mb] [-o calibration_file] [-p]\n", name);
+  fprintf(stderr, "  -s  size of the buffer used by each kernel (default 256 MB, at least 4 times the last level cache)\n");
+  fprintf(stderr, "  -o  output file (default %s)\n", numap_calibration_default_path());
+  fprintf(stderr, "  -p  print the cached calibration and exit\n");
+}
+
+int main(int argc, char **argv) {
+  size_t buffer_size = 0;
+  const char *path = NULL;
+  int print_only = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:o:ph")) != -1) {
+    switch (opt) {
+    case 's':
+      buffer_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'o':
+      path = optarg;
+      break;
+    case 'p':
+      print_only = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  struct numap_calibration calibration;
+  if (print_only) {
+    res = numap_calibration_load(&calibration, path);
+    if(res < 0) {
+      fprintf(stderr, "numap_calibration_load : %s\n", numap_error_message(res));
+      return -1;
+    }
+    numap_calibration_print(&calibration);
+    return 0;
+  }
+
+  printf("Calibrating memory latency and bandwidth for each node pair\n");
+  fflush(stdout);
+  res = numap_calibration_run(&calibration, buffer_size);
+  if(res < 0) {
+    fprintf(stderr, "numap_calibration_run : %s\n", numap_error_message(res));
+    return -1;
+  }
+  numap_calibration_print(&calibration);
+
+  res = numap_calibration_save(&calibration, path);
+  if(res < 0) {
+    fprintf(stderr, "numap_calibration_save : %s\n", numap_error_message(res));
+    return -1;
+  }
+  printf("\nCalibration saved to %s\n", path ? path : numap_calibration_default_path());
+  return 0;
+}
@@ -0,0 +1,336 @@
+#include "numap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/**
+ * Records the memory accesses of a command: runs the command, samples
+ * its loads (and optionally its stores) in all of its threads and
+ * child processes for their whole lifetime, and streams the samples
+ * and the mmap, fork and exit records to a numap trace that numap-report
+ * (or numap_sampling_replay_init) reads back.
+ *
+ * The command is traced with ptrace so that each new thread or process
+ * is stopped until its events are opened: every task has its own
+ * events and ring, so that samples and records keep their thread (events
+ * inherited by children can only be mapped per cpu). When the measure
+ * has no slot left, the last records of the exited tasks are written and
+ * their slots are given to the new ones.
+ */
+
+static volatile sig_atomic_t drain_due;
+
+static void on_alarm(int signum) {
+  drain_due = 1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-o file] [-p period] [-m pages] [-i interval] [-w] [-g] -- command [args...]\n", name);
+  fprintf(stderr, "  -o  trace file (default numap.trace)\n");
+  fprintf(stderr, "  -p  sampling period (default 2000)\n");
+  fprintf(stderr, "  -m  pages of the ring buffer of each thread (default: sized by the library)\n");
+  fprintf(stderr, "  -i  milliseconds between two writes of the ring buffers (default 100)\n");
+  fprintf(stderr, "  -w  sample stores as well as loads\n");
+  fprintf(stderr, "  -g  record the call stack of each sample\n");
+  fprintf(stderr, "At most %d threads are recorded at the same time.\n", MAX_NB_THREADS);
+}
+
+struct tid_set {
+  pid_t *tids;
+  int nb_tids;
+  int capacity;
+};
+
+static int tid_set_contains(struct tid_set *set, pid_t tid) {
+  for (int i = 0; i < set->nb_tids; i++) {
+    if (set->tids[i] == tid) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void tid_set_add(struct tid_set *set, pid_t tid) {
+  if (set->nb_tids == set->capacity) {
+    int capacity = set->capacity ? 2 * set->capacity : 64;
+    pid_t *tids = realloc(set->tids, capacity * sizeof(pid_t));
+    if (tids == NULL) {
+      return;
+    }
+    set->tids = tids;
+    set->capacity = capacity;
+  }
+  set->tids[set->nb_tids++] = tid;
+}
+
+static int tid_set_remove(struct tid_set *set, pid_t tid) {
+  for (int i = 0; i < set->nb_tids; i++) {
+    if (set->tids[i] == tid) {
+      set->tids[i] = set->tids[--set->nb_tids];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Writes the last records of the exited tasks and frees their slots in
+ * measure.
+ */
+static int recycle_exited(struct numap_sampling_measure *measure, struct numap_trace_writer *writer,
+                          struct tid_set *exited) {
+  int res = numap_trace_writer_append(writer, measure);
+  if (res != 0) {
+    return res;
+  }
+  for (int i = 0; i < exited->nb_tids; i++) {
+    // Tasks that were not recorded are not in the measure
+    numap_sampling_remove_thread(measure, exited->tids[i]);
+  }
+  exited->nb_tids = 0;
+  return 0;
+}
+
+/**
+ * Starts sampling tid, created by the command. Returns whether it is
+ * recorded.
+ */
+static int record_task(struct numap_sampling_measure *measure, struct numap_trace_writer *writer,
+                       struct tid_set *exited, pid_t tid) {
+  static int warned;
+  int res = 0;
+  if (tid_set_contains(exited, tid)) {
+    // The tid of an exited task was reused: its slot has to go first
+    res = recycle_exited(measure, writer, exited);
+  }
+  if (res == 0) {
+    res = numap_sampling_add_thread(measure, tid);
+  }
+  if (res == ERROR_NUMAP_TOO_MANY_THREADS && exited->nb_tids > 0) {
+    res = recycle_exited(measure, writer, exited);
+    if (res == 0) {
+      res = numap_sampling_add_thread(measure, tid);
+    }
+  }
+  if (res == ERROR_NUMAP_TOO_MANY_THREADS) {
+    if (!warned) {
+      fprintf(stderr, "numap-record: at most %d threads are recorded at the same time\n", MAX_NB_THREADS);
+      warned = 1;
+    }
+  } else if (res != 0) {
+    fprintf(stderr, "numap-record: thread %d : %s\n", (int)tid, numap_error_message(res));
+  }
+  return res == 0;
+}
+
+/**
+ * Runs command stopped before its exec, so that its events are opened
+ * before it runs.
+ */
+static pid_t spawn(char **command) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+      perror("numap-record: ptrace");
+      _exit(127);
+    }
+    raise(SIGSTOP);
+    execvp(command[0], command);
+    fprintf(stderr, "numap-record: %s: %s\n", command[0], strerror(errno));
+    _exit(127);
+  }
+  return pid;
+}
+
+int main(int argc, char **argv) {
+  const char *output = "numap.trace";
+  int period = 2000;
+  int mmap_pages = 0;
+  int interval_ms = 100;
+  int writes = 0;
+  uint64_t sample_type = NUMAP_ANALYSIS_SAMPLE_TYPE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "+o:p:m:i:wgh")) != -1) {
+    switch (opt) {
+    case 'o':
+      output = optarg;
+      break;
+    case 'p':
+      period = atoi(optarg);
+      break;
+    case 'm':
+      mmap_pages = atoi(optarg);
+      break;
+    case 'i':
+      interval_ms = atoi(optarg);
+      break;
+    case 'w':
+      writes = 1;
+      break;
+    case 'g':
+      sample_type = NUMAP_CALLCHAIN_SAMPLE_TYPE;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (optind >= argc || period <= 0 || mmap_pages < 0 || interval_ms <= 0) {
+    usage(argv[0]);
+    return -1;
+  }
+  char **command = &argv[optind];
+
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  pid_t child = spawn(command);
+  if (child < 0) {
+    perror("numap-record: fork");
+    return -1;
+  }
+  int status;
+  if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+    fprintf(stderr, "numap-record: %s did not start\n", command[0]);
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+         PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+
+  struct numap_sampling_measure measure;
+  res = numap_sampling_init_measure(&measure, 1, period, mmap_pages);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_init_measure : %s\n", numap_error_message(res));
+    kill(child, SIGKILL);
+    return -1;
+  }
+  measure.tids[0] = child;
+  res = writes ? numap_sampling_read_write_start_generic(&measure, sample_type) :
+                 numap_sampling_read_start_generic(&measure, sample_type);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_start : %s\n", numap_error_message(res));
+    kill(child, SIGKILL);
+    return -1;
+  }
+  struct numap_trace_writer writer;
+  res = numap_trace_writer_open(&writer, output, &measure);
+  if(res < 0) {
+    fprintf(stderr, "numap_trace_writer_open : %s\n", numap_error_message(res));
+    kill(child, SIGKILL);
+    return -1;
+  }
+
+  // Alarms interrupt waitpid so that the rings are written while the command runs
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_alarm;
+  sigaction(SIGALRM, &sa, NULL);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval_ms / 1000;
+  timer.it_interval.tv_usec = (interval_ms % 1000) * 1000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_REAL, &timer, NULL);
+  // The command gets the terminal signals, we wait for it to exit
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+
+  // New tasks start with a SIGSTOP, reported before or after the event
+  // of their creation
+  struct tid_set known = { NULL, 0, 0 };
+  struct tid_set stop_pending = { NULL, 0, 0 };
+  struct tid_set stopped_early = { NULL, 0, 0 };
+  struct tid_set exited = { NULL, 0, 0 };
+  tid_set_add(&known, child);
+  int nb_recorded = 1;
+  int exit_code = 0;
+  ptrace(PTRACE_CONT, child, NULL, NULL);
+  for (;;) {
+    if (drain_due) {
+      drain_due = 0;
+      res = numap_trace_writer_append(&writer, &measure);
+      if (res != 0) {
+        fprintf(stderr, "numap_trace_writer_append : %s\n", numap_error_message(res));
+        break;
+      }
+    }
+    pid_t tid = waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // ECHILD: the command and all of its children are gone
+      break;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      tid_set_remove(&known, tid);
+      tid_set_add(&exited, tid);
+      if (tid == child) {
+        exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      }
+      continue;
+    }
+    if (!WIFSTOPPED(status)) {
+      continue;
+    }
+    int signum = WSTOPSIG(status);
+    int event = status >> 16;
+    if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK) {
+      // The new task does not run until it is continued after its first stop
+      unsigned long new_tid;
+      ptrace(PTRACE_GETEVENTMSG, tid, NULL, &new_tid);
+      if (!tid_set_remove(&stopped_early, new_tid)) {
+        tid_set_add(&known, new_tid);
+        tid_set_add(&stop_pending, new_tid);
+        nb_recorded += record_task(&measure, &writer, &exited, new_tid);
+      }
+      signum = 0;
+    } else if (event != 0) {
+      signum = 0;
+    } else if (signum == SIGSTOP && tid_set_remove(&stop_pending, tid)) {
+      signum = 0;
+    } else if (signum == SIGSTOP && !tid_set_contains(&known, tid)) {
+      tid_set_add(&known, tid);
+      tid_set_add(&stopped_early, tid);
+      nb_recorded += record_task(&measure, &writer, &exited, tid);
+      signum = 0;
+    }
+    ptrace(PTRACE_CONT, tid, NULL, (void *)(long)signum);
+  }
+
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_REAL, &off, NULL);
+  if (writes) {
+    numap_sampling_write_stop(&measure);
+  } else {
+    numap_sampling_read_stop(&measure);
+  }
+  res = numap_trace_writer_append(&writer, &measure);
+  if (res == 0) {
+    res = numap_trace_writer_close(&writer);
+  } else {
+    numap_trace_writer_close(&writer);
+  }
+  if(res < 0) {
+    fprintf(stderr, "numap-record : %s\n", numap_error_message(res));
+  } else {
+    fprintf(stderr, "numap-record: %d threads, %.1f MB written to %s\n", nb_recorded,
+            writer.bytes / (1024.0 * 1024.0), output);
+  }
+  numap_sampling_end(&measure);
+  free(known.tids);
+  free(stop_pending.tids);
+  free(stopped_early.tids);
+  free(exited.tids);
+  return exit_code;
+}
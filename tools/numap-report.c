@@ -0,0 +1,627 @@
+#include "numap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include <unistd.h>
+
+/**
+ * Reports on a numap trace written by numap-record (or by
+ * numap_sampling_save): samples and data sources per thread, the most
+ * accessed pages, the load latency distribution, the functions whose
+ * accesses cost the most latency and, for traces recorded with call
+ * chains, the call stacks that do.
+ *
+ * Functions are found from the mmap records of the trace and the symbol
+ * tables of the mapped ELF files, read when the report runs: files
+ * rebuilt since the recording give wrong names.
+ */
+
+#define REPORT_THREADS (1 << 0)
+#define REPORT_PAGES   (1 << 1)
+#define REPORT_LATENCY (1 << 2)
+#define REPORT_SYMBOLS (1 << 3)
+#define REPORT_STACKS  (1 << 4)
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-t] [-g] [-l] [-s] [-k] [-n nb_entries] [file]\n", name);
+  fprintf(stderr, "  -t  per-thread report\n");
+  fprintf(stderr, "  -g  per-page report\n");
+  fprintf(stderr, "  -l  latency report\n");
+  fprintf(stderr, "  -s  per-symbol report\n");
+  fprintf(stderr, "  -k  per-call stack report (traces recorded with numap-record -g)\n");
+  fprintf(stderr, "  -n  number of pages, symbols and stacks shown (default 20)\n");
+  fprintf(stderr, "All reports but -k are printed when none is selected. The default file is numap.trace.\n");
+}
+
+struct symbol {
+  uint64_t addr;
+  uint64_t size;
+  const char *name;
+  const char *object;
+  uint64_t samples;
+  uint64_t memory;
+  uint64_t remote;
+  uint64_t latency;
+};
+
+struct load_segment {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t vaddr;
+};
+
+/**
+ * An ELF file mapped by the command, with its functions sorted by
+ * address. The last symbol gathers the samples found in no function.
+ */
+struct object {
+  char *path;
+  char *strtab;
+  int nb_segments;
+  struct load_segment *segments;
+  int nb_symbols;
+  struct symbol *symbols;
+};
+
+struct mapping {
+  uint32_t pid;
+  uint64_t start;
+  uint64_t end;
+  uint64_t pgoff;
+  int object;
+  int order; // of its record: later mappings replace earlier ones
+  uint64_t max_end; // largest end of the mappings of pid up to this one, once sorted
+};
+
+struct report {
+  int nb_objects;
+  struct object *objects;
+  int nb_mappings;
+  struct mapping *mappings; // sorted by pid then start address once loaded
+  int nb_forks;
+  uint32_t (*forks)[2]; // pid, parent pid, sorted by pid once loaded
+  struct symbol unknown;
+  uint64_t total_samples;
+  uint64_t total_latency;
+};
+
+static void *grow(void *array, int count, size_t size) {
+  // Capacities are the powers of two
+  if (count == 0 || (count & (count - 1)) == 0) {
+    void *grown = realloc(array, (count ? 2 * count : 16) * size);
+    if (grown == NULL) {
+      fprintf(stderr, "numap-report: %s\n", numap_error_message(ERROR_NUMAP_MALLOC));
+      exit(EXIT_FAILURE);
+    }
+    return grown;
+  }
+  return array;
+}
+
+static int compare_addr(const void *a, const void *b) {
+  const struct symbol *sa = a;
+  const struct symbol *sb = b;
+  return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+/**
+ * Reads the functions of the ELF file of object from its symbol table,
+ * or its dynamic symbol table when stripped.
+ */
+static void load_symbols(struct object *object) {
+  FILE *f = fopen(object->path, "rb");
+  if (f == NULL) {
+    return;
+  }
+  uint8_t *data = NULL;
+  long size = 0;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > (long)sizeof(Elf64_Ehdr) && fseek(f, 0, SEEK_SET) == 0) {
+    data = malloc(size);
+    if (data != NULL && fread(data, 1, size, f) != (size_t)size) {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(f);
+  if (data == NULL) {
+    return;
+  }
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)data;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > (uint64_t)size ||
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > (uint64_t)size) {
+    free(data);
+    return;
+  }
+  Elf64_Phdr *phdrs = (Elf64_Phdr *)(data + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD) {
+      object->segments = grow(object->segments, object->nb_segments, sizeof(struct load_segment));
+      struct load_segment *segment = &object->segments[object->nb_segments++];
+      segment->offset = phdrs[i].p_offset;
+      segment->size = phdrs[i].p_filesz;
+      segment->vaddr = phdrs[i].p_vaddr;
+    }
+  }
+  Elf64_Shdr *shdrs = (Elf64_Shdr *)(data + ehdr->e_shoff);
+  Elf64_Shdr *symtab = NULL;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type == SHT_SYMTAB || (shdrs[i].sh_type == SHT_DYNSYM && symtab == NULL)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (symtab != NULL && symtab->sh_link < ehdr->e_shnum && symtab->sh_offset + symtab->sh_size <= (uint64_t)size) {
+    Elf64_Shdr *strtab = &shdrs[symtab->sh_link];
+    if (strtab->sh_offset + strtab->sh_size <= (uint64_t)size && strtab->sh_size > 0) {
+      object->strtab = malloc(strtab->sh_size);
+    }
+    if (object->strtab != NULL) {
+      memcpy(object->strtab, data + strtab->sh_offset, strtab->sh_size);
+      object->strtab[strtab->sh_size - 1] = '\0';
+      Elf64_Sym *syms = (Elf64_Sym *)(data + symtab->sh_offset);
+      size_t nb_syms = symtab->sh_size / sizeof(Elf64_Sym);
+      for (size_t i = 0; i < nb_syms; i++) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_value == 0 ||
+            syms[i].st_name >= strtab->sh_size) {
+          continue;
+        }
+        object->symbols = grow(object->symbols, object->nb_symbols, sizeof(struct symbol));
+        struct symbol *symbol = &object->symbols[object->nb_symbols++];
+        memset(symbol, 0, sizeof(struct symbol));
+        symbol->addr = syms[i].st_value;
+        symbol->size = syms[i].st_size;
+        symbol->name = object->strtab + syms[i].st_name;
+        symbol->object = object->path;
+      }
+      qsort(object->symbols, object->nb_symbols, sizeof(struct symbol), compare_addr);
+    }
+  }
+  free(data);
+}
+
+static int find_object(struct report *report, const char *path) {
+  for (int i = 0; i < report->nb_objects; i++) {
+    if (strcmp(report->objects[i].path, path) == 0) {
+      return i;
+    }
+  }
+  report->objects = grow(report->objects, report->nb_objects, sizeof(struct object));
+  struct object *object = &report->objects[report->nb_objects];
+  memset(object, 0, sizeof(struct object));
+  object->path = strdup(path);
+  if (object->path == NULL) {
+    return -1;
+  }
+  if (path[0] == '/') {
+    load_symbols(object);
+  }
+  // Samples of the object outside of its functions
+  object->symbols = grow(object->symbols, object->nb_symbols, sizeof(struct symbol));
+  struct symbol *other = &object->symbols[object->nb_symbols];
+  memset(other, 0, sizeof(struct symbol));
+  other->name = "[unknown]";
+  other->object = object->path;
+  return report->nb_objects++;
+}
+
+static int collect_record(struct numap_sampling_measure *measure, int thread, struct perf_event_header *header,
+                          void *arg) {
+  struct report *report = arg;
+  uint8_t *body = (uint8_t *)(header + 1);
+  const char *filename;
+  if (header->type == PERF_RECORD_MMAP) {
+    filename = ((struct mmap_sample *)body)->filename;
+  } else if (header->type == PERF_RECORD_MMAP2) {
+    // major, minor, inode, inode generation, protection and flags follow the offset
+    filename = (const char *)body + sizeof(uint32_t) * 2 + sizeof(uint64_t) * 3 + 32;
+  } else if (header->type == PERF_RECORD_FORK) {
+    uint32_t *ids = (uint32_t *)body;
+    if (ids[0] != ids[1]) {
+      report->forks = grow(report->forks, report->nb_forks, sizeof(report->forks[0]));
+      report->forks[report->nb_forks][0] = ids[0];
+      report->forks[report->nb_forks++][1] = ids[1];
+    }
+    return 0;
+  } else {
+    return 0;
+  }
+  struct mmap_sample *mmap = (struct mmap_sample *)body;
+  if ((uint8_t *)filename >= (uint8_t *)header + header->size) {
+    return 0;
+  }
+  int object = find_object(report, filename);
+  if (object < 0) {
+    return ERROR_NUMAP_MALLOC;
+  }
+  report->mappings = grow(report->mappings, report->nb_mappings, sizeof(struct mapping));
+  struct mapping *mapping = &report->mappings[report->nb_mappings++];
+  mapping->pid = mmap->pid;
+  mapping->start = mmap->addr;
+  mapping->end = mmap->addr + mmap->len;
+  mapping->pgoff = mmap->pgoff;
+  mapping->object = object;
+  mapping->order = report->nb_mappings - 1;
+  return 0;
+}
+
+static int compare_mapping(const void *a, const void *b) {
+  const struct mapping *ma = a;
+  const struct mapping *mb = b;
+  if (ma->pid != mb->pid) {
+    return ma->pid < mb->pid ? -1 : 1;
+  }
+  if (ma->start != mb->start) {
+    return ma->start < mb->start ? -1 : 1;
+  }
+  return ma->order - mb->order;
+}
+
+static int compare_fork(const void *a, const void *b) {
+  const uint32_t *fa = a;
+  const uint32_t *fb = b;
+  return fa[0] < fb[0] ? -1 : fa[0] > fb[0];
+}
+
+/**
+ * Latest mapping of ip in process pid or, for children that did not
+ * map it themselves, in their parents.
+ */
+static struct mapping *find_mapping(struct report *report, uint32_t pid, uint64_t ip) {
+  for (int depth = 0; depth < 64; depth++) {
+    // First mapping after (pid, ip)
+    int low = 0;
+    int high = report->nb_mappings;
+    while (low < high) {
+      int middle = (low + high) / 2;
+      struct mapping *mapping = &report->mappings[middle];
+      if (mapping->pid < pid || (mapping->pid == pid && mapping->start <= ip)) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    // The mappings holding ip are before it, as long as one of them ends after ip
+    struct mapping *latest = NULL;
+    for (int i = low - 1; i >= 0 && report->mappings[i].pid == pid && report->mappings[i].max_end > ip; i--) {
+      struct mapping *mapping = &report->mappings[i];
+      if (ip < mapping->end && (latest == NULL || mapping->order > latest->order)) {
+        latest = mapping;
+      }
+    }
+    if (latest != NULL) {
+      return latest;
+    }
+    uint32_t key[2] = { pid, 0 };
+    uint32_t *fork = bsearch(key, report->forks, report->nb_forks, sizeof(report->forks[0]), compare_fork);
+    if (fork == NULL) {
+      return NULL;
+    }
+    pid = fork[1];
+  }
+  return NULL;
+}
+
+static struct symbol *find_symbol(struct report *report, uint32_t pid, uint64_t ip) {
+  struct mapping *mapping = find_mapping(report, pid, ip);
+  if (mapping == NULL) {
+    return &report->unknown;
+  }
+  struct object *object = &report->objects[mapping->object];
+  struct symbol *other = &object->symbols[object->nb_symbols];
+  uint64_t offset = ip - mapping->start + mapping->pgoff;
+  int i;
+  for (i = 0; i < object->nb_segments; i++) {
+    struct load_segment *segment = &object->segments[i];
+    if (offset >= segment->offset && offset < segment->offset + segment->size) {
+      break;
+    }
+  }
+  if (i == object->nb_segments) {
+    return other;
+  }
+  uint64_t vaddr = offset - object->segments[i].offset + object->segments[i].vaddr;
+  // Last function starting at or before vaddr
+  int low = 0;
+  int high = object->nb_symbols;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (object->symbols[middle].addr <= vaddr) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == 0) {
+    return other;
+  }
+  struct symbol *symbol = &object->symbols[low - 1];
+  uint64_t size = symbol->size ? symbol->size : 1;
+  return vaddr < symbol->addr + size ? symbol : other;
+}
+
+static int count_sample(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct report *report = arg;
+  struct symbol *symbol = find_symbol(report, sample->pid, sample->ip);
+  int class = numap_sample_class(sample->data_src);
+  symbol->samples++;
+  if (class == NUMAP_CLASS_LOCAL_MEMORY || class == NUMAP_CLASS_REMOTE_CACHE || class == NUMAP_CLASS_REMOTE_MEMORY) {
+    symbol->memory++;
+  }
+  if (class == NUMAP_CLASS_REMOTE_CACHE || class == NUMAP_CLASS_REMOTE_MEMORY) {
+    symbol->remote++;
+  }
+  symbol->latency += sample->weight;
+  report->total_samples++;
+  report->total_latency += sample->weight;
+  return 0;
+}
+
+static int compare_latency(const void *a, const void *b) {
+  const struct symbol *sa = *(const struct symbol **)a;
+  const struct symbol *sb = *(const struct symbol **)b;
+  if (sa->latency != sb->latency) {
+    return sa->latency > sb->latency ? -1 : 1;
+  }
+  return sa->samples > sb->samples ? -1 : sa->samples < sb->samples;
+}
+
+static int report_load(struct numap_sampling_measure *measure, struct report *report) {
+  memset(report, 0, sizeof(struct report));
+  report->unknown.name = "[unknown]";
+  int res = numap_sampling_foreach_record(measure, collect_record, report);
+  if (res != 0) {
+    return res;
+  }
+  // Sorted for the binary searches of find_mapping
+  qsort(report->mappings, report->nb_mappings, sizeof(struct mapping), compare_mapping);
+  for (int i = 0; i < report->nb_mappings; i++) {
+    struct mapping *mapping = &report->mappings[i];
+    mapping->max_end = mapping->end;
+    if (i > 0 && mapping[-1].pid == mapping->pid && mapping[-1].max_end > mapping->end) {
+      mapping->max_end = mapping[-1].max_end;
+    }
+  }
+  qsort(report->forks, report->nb_forks, sizeof(report->forks[0]), compare_fork);
+  return 0;
+}
+
+static void report_free(struct report *report) {
+  for (int i = 0; i < report->nb_objects; i++) {
+    free(report->objects[i].path);
+    free(report->objects[i].strtab);
+    free(report->objects[i].segments);
+    free(report->objects[i].symbols);
+  }
+  free(report->objects);
+  free(report->mappings);
+  free(report->forks);
+}
+
+static void print_symbol_name(struct symbol *symbol) {
+  printf("%s", symbol->name);
+  if (symbol->object != NULL) {
+    const char *object = strrchr(symbol->object, '/');
+    printf(" [%s]", object != NULL ? object + 1 : symbol->object);
+  }
+}
+
+static int print_symbols(struct numap_sampling_measure *measure, int nb_entries) {
+  struct report report;
+  int res = report_load(measure, &report);
+  if (res == 0) {
+    res = numap_sampling_foreach_sample(measure, count_sample, &report);
+  }
+  int nb_symbols = 1;
+  for (int i = 0; i < report.nb_objects; i++) {
+    nb_symbols += report.objects[i].nb_symbols + 1;
+  }
+  struct symbol **symbols = res == 0 ? malloc(nb_symbols * sizeof(struct symbol *)) : NULL;
+  if (res == 0 && symbols == NULL) {
+    res = ERROR_NUMAP_MALLOC;
+  }
+  if (res == 0) {
+    int n = 0;
+    symbols[n++] = &report.unknown;
+    for (int i = 0; i < report.nb_objects; i++) {
+      for (int j = 0; j <= report.objects[i].nb_symbols; j++) {
+        symbols[n++] = &report.objects[i].symbols[j];
+      }
+    }
+    qsort(symbols, nb_symbols, sizeof(struct symbol *), compare_latency);
+    printf("\nSymbols by total latency (%" PRIu64 " samples, %d mappings)\n", report.total_samples,
+           report.nb_mappings);
+    printf("%10s %8s %8s %8s %10s %8s  %s\n", "SAMPLES", "SAMP%", "MEM%", "REMOTE%", "AVG_LAT", "LAT%", "SYMBOL");
+    for (int i = 0; i < nb_symbols && i < nb_entries && symbols[i]->samples > 0; i++) {
+      struct symbol *symbol = symbols[i];
+      printf("%10" PRIu64 " %8.2f %8.2f %8.2f %10.1f %8.2f  ", symbol->samples,
+             100.0 * symbol->samples / report.total_samples, 100.0 * symbol->memory / symbol->samples,
+             symbol->memory ? 100.0 * symbol->remote / symbol->memory : 0.0,
+             (double)symbol->latency / symbol->samples,
+             report.total_latency ? 100.0 * symbol->latency / report.total_latency : 0.0);
+      print_symbol_name(symbol);
+      printf("\n");
+    }
+  }
+  free(symbols);
+  report_free(&report);
+  return res;
+}
+
+/**
+ * Stacks of the samples, with the process of each node to symbolize its
+ * frames in.
+ */
+struct stack_report {
+  struct numap_stacks stacks;
+  uint32_t *pids;
+  uint32_t pids_capacity;
+};
+
+static int add_stack(struct numap_sampling_measure *measure, int thread, struct numap_sample *sample, void *arg) {
+  struct stack_report *stack_report = arg;
+  uint32_t first = stack_report->stacks.nb_nodes;
+  int64_t node = numap_stacks_add(&stack_report->stacks, sample);
+  if (node < 0) {
+    return (int)node;
+  }
+  if (stack_report->stacks.capacity > stack_report->pids_capacity) {
+    uint32_t *pids = realloc(stack_report->pids, stack_report->stacks.capacity * sizeof(uint32_t));
+    if (pids == NULL) {
+      return ERROR_NUMAP_MALLOC;
+    }
+    stack_report->pids = pids;
+    stack_report->pids_capacity = stack_report->stacks.capacity;
+  }
+  for (uint32_t i = first; i < stack_report->stacks.nb_nodes; i++) {
+    stack_report->pids[i] = sample->pid;
+  }
+  return 0;
+}
+
+static int compare_stack_latency(const void *a, const void *b) {
+  const struct numap_stack_node *na = *(const struct numap_stack_node **)a;
+  const struct numap_stack_node *nb = *(const struct numap_stack_node **)b;
+  if (na->latency != nb->latency) {
+    return na->latency > nb->latency ? -1 : 1;
+  }
+  return na->samples > nb->samples ? -1 : na->samples < nb->samples;
+}
+
+static int print_stacks(struct numap_sampling_measure *measure, int nb_entries) {
+  struct report report;
+  struct stack_report stack_report;
+  memset(&stack_report, 0, sizeof(stack_report));
+  struct numap_stack_node **sorted = NULL;
+  int res = report_load(measure, &report);
+  if (res == 0) {
+    res = numap_stacks_init(&stack_report.stacks);
+  }
+  if (res == 0) {
+    res = numap_sampling_foreach_sample(measure, add_stack, &stack_report);
+  }
+  struct numap_stacks *stacks = &stack_report.stacks;
+  if (res == 0) {
+    sorted = malloc(stacks->nb_nodes * sizeof(struct numap_stack_node *));
+    if (sorted == NULL) {
+      res = ERROR_NUMAP_MALLOC;
+    }
+  }
+  if (res == 0) {
+    int nb_sampled = 0;
+    for (uint32_t node = 1; node < stacks->nb_nodes; node++) {
+      if (stacks->nodes[node].samples > 0) {
+        sorted[nb_sampled++] = &stacks->nodes[node];
+      }
+    }
+    qsort(sorted, nb_sampled, sizeof(struct numap_stack_node *), compare_stack_latency);
+    uint64_t total_latency = 0;
+    for (int i = 0; i < nb_sampled; i++) {
+      total_latency += sorted[i]->latency;
+    }
+    printf("\nCall stacks by total latency (%" PRIu64 " samples, %d stacks in %" PRIu32 " frames)\n", stacks->total,
+           nb_sampled, stacks->nb_nodes - 1);
+    for (int i = 0; i < nb_sampled && i < nb_entries; i++) {
+      struct numap_stack_node *n = sorted[i];
+      uint64_t remote = n->classes[NUMAP_CLASS_REMOTE_CACHE] + n->classes[NUMAP_CLASS_REMOTE_MEMORY];
+      uint64_t memory = n->classes[NUMAP_CLASS_LOCAL_MEMORY] + remote;
+      printf("\n%10" PRIu64 " samples %6.2f%%, mem %6.2f%%, remote %6.2f%%, avg lat %.1f, lat %6.2f%%\n", n->samples,
+             100.0 * n->samples / stacks->total, 100.0 * memory / n->samples,
+             memory ? 100.0 * remote / memory : 0.0, (double)n->latency / n->samples,
+             total_latency ? 100.0 * n->latency / total_latency : 0.0);
+      for (uint32_t node = n - stacks->nodes; node != 0; node = stacks->nodes[node].parent) {
+        printf("    %#18" PRIx64 "  ", stacks->nodes[node].ip);
+        print_symbol_name(find_symbol(&report, stack_report.pids[node], stacks->nodes[node].ip));
+        printf("\n");
+      }
+    }
+  }
+  free(sorted);
+  free(stack_report.pids);
+  numap_stacks_free(&stack_report.stacks);
+  report_free(&report);
+  return res;
+}
+
+int main(int argc, char **argv) {
+  int reports = 0;
+  int nb_entries = 20;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "tglskn:h")) != -1) {
+    switch (opt) {
+    case 't':
+      reports |= REPORT_THREADS;
+      break;
+    case 'g':
+      reports |= REPORT_PAGES;
+      break;
+    case 'l':
+      reports |= REPORT_LATENCY;
+      break;
+    case 's':
+      reports |= REPORT_SYMBOLS;
+      break;
+    case 'k':
+      reports |= REPORT_STACKS;
+      break;
+    case 'n':
+      nb_entries = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (optind < argc - 1 || nb_entries <= 0) {
+    usage(argv[0]);
+    return -1;
+  }
+  const char *path = optind < argc ? argv[optind] : "numap.trace";
+  if (reports == 0) {
+    reports = REPORT_THREADS | REPORT_PAGES | REPORT_LATENCY | REPORT_SYMBOLS;
+  }
+
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+  struct numap_sampling_measure measure;
+  res = numap_sampling_replay_init(&measure, path);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_replay_init %s : %s\n", path, numap_error_message(res));
+    return -1;
+  }
+
+  if (res == 0 && (reports & REPORT_THREADS)) {
+    res = numap_sampling_print(&measure, 0);
+  }
+  if (res == 0 && (reports & REPORT_PAGES)) {
+    struct numap_rw_profile profile;
+    res = numap_sampling_rw_profile(&measure, &profile);
+    if (res == 0) {
+      res = numap_rw_profile_print(&profile, nb_entries);
+      numap_rw_profile_free(&profile);
+    }
+  }
+  if (res == 0 && (reports & REPORT_LATENCY)) {
+    struct numap_latency_histogram histogram;
+    res = numap_sampling_latency_histogram(&measure, &histogram);
+    if (res == 0) {
+      printf("\nLoad latency\n");
+      res = numap_latency_histogram_print(&histogram);
+    }
+  }
+  if (res == 0 && (reports & REPORT_SYMBOLS)) {
+    res = print_symbols(&measure, nb_entries);
+  }
+  if (res == 0 && (reports & REPORT_STACKS)) {
+    res = print_stacks(&measure, nb_entries);
+  }
+  if(res < 0) {
+    fprintf(stderr, "numap-report : %s\n", numap_error_message(res));
+  }
+  numap_sampling_end(&measure);
+  return res < 0 ? -1 : 0;
+}
@@ -0,0 +1,248 @@
+#include "numap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Live NUMA monitor of a running process: samples the loads (and
+ * optionally the stores) of all its threads and refreshes, every
+ * interval, the sample rate, local vs remote ratio and data sources of
+ * each thread, the memory samples, DRAM latency percentiles and
+ * bandwidth of each node, and the hottest pages.
+ *
+ * The measure is attached to the process (see numap_sampling_init_attach):
+ * its collector thread aggregates the samples into the live statistics
+ * of the measure (see numap_live_open) and samples the threads created
+ * since the start. The statistics are read back each interval, so that
+ * other processes can watch the same segment.
+ */
+
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int signum) {
+  interrupted = 1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-p period] [-i interval] [-n nb_pages] [-c] [-w] pid\n", name);
+  fprintf(stderr, "  -p  sampling period (default 2000)\n");
+  fprintf(stderr, "  -i  refresh interval in seconds (default 1)\n");
+  fprintf(stderr, "  -n  number of hottest pages shown (default 10)\n");
+  fprintf(stderr, "  -c  one ring per cpu instead of one per thread (rows are cpus)\n");
+  fprintf(stderr, "  -w  sample stores as well as loads\n");
+  fprintf(stderr, "At most %d threads are sampled without -c.\n", MAX_NB_THREADS);
+}
+
+static void wait_interval(double seconds) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+  // Refresh signals interrupt the sleep
+  while (!interrupted && nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+static void print_threads(struct numap_live_stats *prev, struct numap_live_stats *cur, double seconds, int per_cpu) {
+  printf("\n%-8s %10s %8s %8s %6s %6s %6s %6s %6s %6s\n", per_cpu ? "CPU" : "TID", "SAMPLES/s", "LOST", "REMOTE%", "L1%", "L2%", "L3%",
+         "LMEM%", "RCACHE%", "RMEM%");
+  for (int thread = 0; thread < cur->nb_threads; thread++) {
+    uint64_t classes[NUMAP_NB_CLASSES];
+    for (int c = 0; c < NUMAP_NB_CLASSES; c++) {
+      classes[c] = cur->thread_classes[thread][c] - prev->thread_classes[thread][c];
+    }
+    uint64_t samples = cur->thread_samples[thread] - prev->thread_samples[thread];
+    uint64_t remote = classes[NUMAP_CLASS_REMOTE_MEMORY] + classes[NUMAP_CLASS_REMOTE_CACHE];
+    uint64_t memory = classes[NUMAP_CLASS_LOCAL_MEMORY] + remote;
+    double total = samples ? samples : 1;
+    printf("%-8d %10.0f %8" PRIu64 " %8.1f %6.1f %6.1f %6.1f %6.1f %6.1f %6.1f\n", per_cpu ? thread : (int)cur->tids[thread],
+           samples / seconds, cur->thread_lost[thread] - prev->thread_lost[thread],
+           memory ? 100.0 * remote / memory : 0.0, 100.0 * (classes[NUMAP_CLASS_L1] + classes[NUMAP_CLASS_LFB]) / total,
+           100.0 * classes[NUMAP_CLASS_L2] / total, 100.0 * classes[NUMAP_CLASS_L3] / total,
+           100.0 * classes[NUMAP_CLASS_LOCAL_MEMORY] / total, 100.0 * classes[NUMAP_CLASS_REMOTE_CACHE] / total,
+           100.0 * classes[NUMAP_CLASS_REMOTE_MEMORY] / total);
+  }
+}
+
+static void print_nodes(struct numap_live_stats *prev, struct numap_live_stats *cur, double seconds,
+                        struct numap_counting_measure *counting) {
+  struct numap_latency_histogram histogram;
+  printf("\n%-6s %12s %12s %12s %8s %8s %8s %12s\n", "NODE", "LOCAL/s", "REMOTE_IN/s", "REMOTE_OUT/s", "P50", "P90",
+         "P99", "MB/s");
+  for (int node = 0; node < cur->nb_nodes; node++) {
+    uint64_t local = cur->node_accesses[node][node] - prev->node_accesses[node][node];
+    uint64_t remote_in = 0;
+    uint64_t remote_out = 0;
+    for (int other = 0; other < cur->nb_nodes; other++) {
+      if (other != node) {
+        remote_in += cur->node_accesses[other][node] - prev->node_accesses[other][node];
+        remote_out += cur->node_accesses[node][other] - prev->node_accesses[node][other];
+      }
+    }
+    // Latency of the memory accesses served by node during the interval
+    struct numap_latency_histogram *c = &cur->node_latency[node];
+    struct numap_latency_histogram *p = &prev->node_latency[node];
+    histogram.count = c->count - p->count;
+    histogram.sum = c->sum - p->sum;
+    histogram.max = c->max;
+    for (int bucket = 0; bucket < NUMAP_LATENCY_BUCKETS; bucket++) {
+      histogram.buckets[bucket] = c->buckets[bucket] - p->buckets[bucket];
+    }
+    printf("%-6d %12.0f %12.0f %12.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64, node, local / seconds,
+           remote_in / seconds, remote_out / seconds, numap_latency_histogram_percentile(&histogram, 50),
+           numap_latency_histogram_percentile(&histogram, 90), numap_latency_histogram_percentile(&histogram, 99));
+    if (counting != NULL && node < counting->nb_nodes && counting->is_valid[node]) {
+      // Each memory controller request transfers one cache line
+      double bytes = 64.0 * (counting->reads_count[node] + counting->writes_count[node]);
+      printf(" %12.1f", bytes / seconds / (1024 * 1024));
+    } else {
+      printf(" %12s", "-");
+    }
+    printf("\n");
+  }
+  printf("%" PRIu64 " memory accesses with an unknown node\n", cur->unresolved - prev->unresolved);
+}
+
+static void print_pages(struct numap_live_stats *cur, int nb_pages) {
+  printf("\nHottest pages since the start\n");
+  for (int i = 0; i < nb_pages && i < cur->nb_top_pages; i++) {
+    printf("%#-18" PRIx64 " %10" PRIu64 " accesses\n", cur->top_pages[i].key, cur->top_pages[i].count);
+  }
+}
+
+int main(int argc, char **argv) {
+  int period = 2000;
+  double interval = 1;
+  int nb_pages = 10;
+  int mode = NUMAP_ATTACH_THREADS;
+  int writes = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:i:n:cwh")) != -1) {
+    switch (opt) {
+    case 'p':
+      period = atoi(optarg);
+      break;
+    case 'i':
+      interval = atof(optarg);
+      break;
+    case 'n':
+      nb_pages = atoi(optarg);
+      break;
+    case 'c':
+      mode = NUMAP_ATTACH_CPUS;
+      break;
+    case 'w':
+      writes = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (optind != argc - 1 || period <= 0 || interval <= 0) {
+    usage(argv[0]);
+    return -1;
+  }
+  pid_t pid = atoi(argv[optind]);
+
+  int res = numap_init();
+  if(res < 0) {
+    fprintf(stderr, "numap_init : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  struct numap_sampling_measure measure;
+  res = numap_sampling_init_attach(&measure, pid, mode, period, 0);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_init_attach : %s\n", numap_error_message(res));
+    return -1;
+  }
+
+  struct numap_live live;
+  struct numap_live_reader reader;
+  char name[64];
+  snprintf(name, sizeof(name), "/numap-top.%d", (int)getpid());
+  res = numap_live_open(&live, name);
+  if(res < 0) {
+    fprintf(stderr, "numap_live_open : %s\n", numap_error_message(res));
+    return -1;
+  }
+  numap_sampling_set_live(&measure, &live);
+  res = numap_live_attach(&reader, name);
+  if(res < 0) {
+    fprintf(stderr, "numap_live_attach : %s\n", numap_error_message(res));
+    numap_live_close(&live);
+    return -1;
+  }
+
+  struct numap_live_stats *prev = calloc(1, sizeof(struct numap_live_stats));
+  struct numap_live_stats *cur = calloc(1, sizeof(struct numap_live_stats));
+  if (prev == NULL || cur == NULL) {
+    fprintf(stderr, "numap-top: %s\n", numap_error_message(ERROR_NUMAP_MALLOC));
+    return -1;
+  }
+
+  res = writes ? numap_sampling_read_write_start(&measure) : numap_sampling_read_start_generic(&measure, NUMAP_ANALYSIS_SAMPLE_TYPE);
+  if(res < 0) {
+    fprintf(stderr, "numap_sampling_start : %s\n", numap_error_message(res));
+    numap_live_detach(&reader);
+    numap_live_close(&live);
+    return -1;
+  }
+
+  // Bandwidth is left out on machines without memory controller events
+  struct numap_counting_measure counting;
+  int bandwidth = numap_counting_init_measure(&counting) == 0 && numap_counting_start(&counting) == 0;
+
+  signal(SIGINT, on_interrupt);
+  signal(SIGTERM, on_interrupt);
+  while (!interrupted && kill(pid, 0) == 0) {
+    wait_interval(interval);
+    if (bandwidth) {
+      bandwidth = numap_counting_stop(&counting) == 0;
+    }
+    res = numap_live_snapshot(&reader, cur);
+    if (bandwidth) {
+      bandwidth = numap_counting_start(&counting) == 0;
+    }
+    if (res != 0) {
+      continue;
+    }
+    double seconds = cur->time > prev->time && prev->time > 0 ? cur->time - prev->time : interval;
+    uint64_t samples = 0;
+    uint64_t lost = 0;
+    for (int thread = 0; thread < cur->nb_threads; thread++) {
+      samples += cur->thread_samples[thread] - prev->thread_samples[thread];
+      lost += cur->thread_lost[thread] - prev->thread_lost[thread];
+    }
+    printf("\033[H\033[2J");
+    printf("numap-top - pid %d, %d %s, period %d, %.0f samples/s, %" PRIu64 " lost", (int)pid, cur->nb_threads,
+           mode == NUMAP_ATTACH_CPUS ? "cpus" : "threads", period, samples / seconds, lost);
+    if (numap_sampling_attach_missed(&measure) > 0) {
+      printf(", %d threads not sampled", numap_sampling_attach_missed(&measure));
+    }
+    printf("\n");
+    print_threads(prev, cur, seconds, mode == NUMAP_ATTACH_CPUS);
+    print_nodes(prev, cur, seconds, bandwidth ? &counting : NULL);
+    print_pages(cur, nb_pages);
+    fflush(stdout);
+    struct numap_live_stats *tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  if (bandwidth) {
+    numap_counting_stop(&counting);
+  }
+  numap_sampling_read_stop(&measure);
+  numap_sampling_end(&measure);
+  numap_live_detach(&reader);
+  numap_live_close(&live);
+  free(prev);
+  free(cur);
+  return 0;
+}